@@ -0,0 +1,27 @@
+#include "shell_port_host.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Runs the shell on a pseudo-terminal. Connect with e.g.
+//   $ screen /dev/pts/3
+// or point a script at the printed path as if it were the board's serial port.
+
+int main(int argc, char *argv[]) {
+  const bool buffered = !(argc > 1 && strcmp(argv[1], "--per-char") == 0);
+
+  char slave_path[64];
+  const int fd = shell_port_host_open_pty(slave_path, sizeof(slave_path));
+  if (fd < 0) {
+    perror("Couldn't open a pseudo-terminal");
+    return 1;
+  }
+  printf("Shell on %s\n", slave_path);
+  fflush(stdout);
+
+  shell_port_host_boot(fd, buffered);
+  while (shell_port_host_poll(-1)) {
+  }
+  return 0;
+}
@@ -0,0 +1,108 @@
+// posix_openpt() and friends
+#define _GNU_SOURCE
+
+#include "shell_port_host.h"
+
+#include "shell/shell.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+static int s_fd = -1;
+//! Held open so the master doesn't report a hang up while no terminal has the
+//! slave side open
+static int s_pty_slave_fd = -1;
+
+static int prv_write_all(const char *buf, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    const ssize_t rv = write(s_fd, &buf[written], len - written);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      // The other side is gone, drop the output
+      return (int)len;
+    }
+    written += (size_t)rv;
+  }
+  return (int)len;
+}
+
+static int prv_send_char(char c) {
+  return prv_write_all(&c, 1);
+}
+
+static int prv_send_buf(const char *buf, size_t len) {
+  return prv_write_all(buf, len);
+}
+
+int shell_port_host_open_pty(char *slave_path, size_t slave_path_len) {
+  const int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    return -1;
+  }
+  const char *name = NULL;
+  if (grantpt(fd) != 0 || unlockpt(fd) != 0 || (name = ptsname(fd)) == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  // The line discipline sits on the slave side. Raw mode stops it from
+  // echoing and line buffering the input itself, since the shell does both,
+  // and from rewriting the shell's "\r\n"
+  const int slave_fd = open(name, O_RDWR | O_NOCTTY);
+  if (slave_fd < 0) {
+    close(fd);
+    return -1;
+  }
+  struct termios tio;
+  tcgetattr(slave_fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave_fd, TCSANOW, &tio);
+  if (s_pty_slave_fd >= 0) {
+    close(s_pty_slave_fd);
+  }
+  s_pty_slave_fd = slave_fd;
+
+  strncpy(slave_path, name, slave_path_len - 1);
+  slave_path[slave_path_len - 1] = '\0';
+  return fd;
+}
+
+void shell_port_host_boot(int fd, bool buffered) {
+  s_fd = fd;
+  sShellImpl impl = {
+    .send_char = prv_send_char,
+    .send_buf = buffered ? prv_send_buf : NULL,
+  };
+  shell_boot(&impl);
+}
+
+bool shell_port_host_poll(int timeout_ms) {
+  struct pollfd pfd = { .fd = s_fd, .events = POLLIN };
+  const int rv = poll(&pfd, 1, timeout_ms);
+  if (rv <= 0) {
+    return rv == 0 || errno == EINTR;
+  }
+  if ((pfd.revents & POLLIN) == 0) {
+    // POLLHUP without data left to read
+    return false;
+  }
+
+  char buf[256];
+  const ssize_t len = read(s_fd, buf, sizeof(buf));
+  if (len <= 0) {
+    // A pty master reads EIO once the slave side is closed
+    return len < 0 && (errno == EINTR || errno == EAGAIN);
+  }
+  for (ssize_t i = 0; i < len; i++) {
+    shell_receive_char(buf[i]);
+  }
+  return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//! Linux port of the shell. Instead of a UART, the shell reads and writes a
+//! file descriptor: the master side of a pseudo-terminal, so a terminal
+//! program or script can open the slave side like a serial port, or one end
+//! of a socketpair().
+
+//! Opens a pseudo-terminal in raw mode. Returns the master side for
+//! shell_port_host_boot(), or -1 on error. The path of the slave side, e.g.
+//! /dev/pts/3, is copied to `slave_path`.
+int shell_port_host_open_pty(char *slave_path, size_t slave_path_len);
+
+//! Connects the shell to `fd` and boots it. With `buffered` output goes
+//! through send_buf and the shell's TX buffer, otherwise a write() per char.
+void shell_port_host_boot(int fd, bool buffered);
+
+//! Waits up to `timeout_ms` for input (-1 waits forever) and feeds all of it
+//! to shell_receive_char(). Returns false once the other side has hung up,
+//! which a pseudo-terminal never does: the port keeps its slave side open.
+bool shell_port_host_poll(int timeout_ms);
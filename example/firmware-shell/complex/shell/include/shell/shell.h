@@ -1,25 +1,99 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
+//! Longest command line, including its newline
+#ifndef SHELL_RX_BUFFER_SIZE
+#define SHELL_RX_BUFFER_SIZE (256)
+#endif
+
+//! Most arguments a command line is split into, the command name included
+#ifndef SHELL_MAX_ARGS
+#define SHELL_MAX_ARGS (16)
+#endif
+
+//! Bytes of output held back for `send_buf`, see sShellImpl
+#ifndef SHELL_TX_BUFFER_SIZE
+#define SHELL_TX_BUFFER_SIZE (128)
+#endif
+
 typedef struct ShellCommand {
   const char *command;
   int (*handler)(int argc, char *argv[]);
   const char *help;
 } sShellCommand;
 
+//! The command table. Keep it sorted by name (as strcmp() orders them) so
+//! commands are found by binary search, can be abbreviated to any unique
+//! prefix and tab completed. An unsorted table falls back to a linear search
+//! for exact names only.
 extern const sShellCommand *const g_shell_commands;
 extern const size_t g_num_shell_commands;
 
 typedef struct ShellImpl {
   //! Function to call whenever a character needs to be sent out.
   int (*send_char)(char c);
+  //! Optional. Sends up to `len` bytes and returns how many were taken. When
+  //! set, output is collected in a SHELL_TX_BUFFER_SIZE ring buffer and handed
+  //! over at every newline, when the buffer is full, at the end of
+  //! shell_receive_char() and on shell_flush(). `send_char` is then only used
+  //! when the buffer is full and `send_buf` takes nothing: the oldest byte goes
+  //! out through it to make room. Without `send_char` that byte is dropped
+  //! instead and counted, see shell_tx_dropped().
+  int (*send_buf)(const char *buf, size_t len);
 } sShellImpl;
 
+//! Largest output payload of a machine mode response frame
+#ifndef SHELL_FRAME_MAX_OUTPUT_LEN
+#define SHELL_FRAME_MAX_OUTPUT_LEN (128)
+#endif
+
+//! In machine mode the shell neither echoes nor prompts. Instead it reads
+//! request frames and answers each with response frames. All integers are
+//! little endian:
+//!   request:  SHELL_FRAME_SYNC | seq (2) | len (2) | command line (len)
+//!   response: SHELL_FRAME_SYNC | seq (2) | status (1) | len (2) | output (len)
+//! The command line has no trailing newline and is at most
+//! SHELL_RX_BUFFER_SIZE - 1 bytes. Output longer than SHELL_FRAME_MAX_OUTPUT_LEN
+//! comes in several frames, all but the last with kShellStatus_More. Requests
+//! are run in the order they arrive, so a client can send the next ones before
+//! the first is answered and match the responses by `seq`. Bytes outside a
+//! frame are skipped until the next SHELL_FRAME_SYNC.
+#define SHELL_FRAME_SYNC (0xA5)
+#define SHELL_FRAME_REQUEST_HEADER_LEN (5)
+#define SHELL_FRAME_RESPONSE_HEADER_LEN (6)
+
+typedef enum {
+  kShellMode_Interactive = 0,
+  kShellMode_Machine,
+} eShellMode;
+
+typedef enum {
+  kShellStatus_Ok = 0,
+  //! The command's handler returned non-zero
+  kShellStatus_CommandFailed = 1,
+  kShellStatus_UnknownCommand = 2,
+  kShellStatus_AmbiguousCommand = 3,
+  //! The command line doesn't fit the RX buffer and wasn't run
+  kShellStatus_TooLong = 4,
+  //! The command's output continues in the next frame
+  kShellStatus_More = 0x80,
+} eShellStatus;
+
 //! Initializes the demo shell. To be called early at boot.
 void shell_boot(const sShellImpl *impl);
 
+//! Switches between interactive and machine mode. Called from a command
+//! handler, it takes effect once the command is done, so its response is
+//! still sent the way the command was received.
+void shell_set_mode(eShellMode mode);
+
+//! Command to switch modes: `mode machine` or `mode interactive`
+int shell_mode_handler(int argc, char *argv[]);
+
 //! Call this when a character is received. The character is processed synchronously.
+//! In machine mode, pass every byte of the frames as received.
 void shell_receive_char(char c);
 
 //! Print help command
@@ -27,3 +101,58 @@ int shell_help_handler(int argc, char *argv[]);
 
 //! Prints a line then a newline
 void shell_put_line(const char *str);
+
+//! Hands any buffered output to `send_buf`. Output which doesn't end in a
+//! newline, such as a progress indicator, sits in the buffer until then.
+void shell_flush(void);
+
+//! Bytes of output lost since shell_boot() because the TX buffer was full,
+//! `send_buf` took nothing and there's no `send_char` to fall back on
+size_t shell_tx_dropped(void);
+
+//! Finds the commands whose name starts with the first `len` chars of
+//! `prefix`, in a table sorted by name, in O(log n) compares. They are
+//! consecutive: returns how many there are and sets `first` to the index of
+//! the first one.
+size_t shell_find_prefix(const sShellCommand *commands, size_t num_commands,
+                         const char *prefix, size_t len, size_t *first);
+
+//! Looks up `name` in a table sorted by name. Matches the command of that
+//! name, or else the only command `name` is a prefix of. Returns NULL if there
+//! is no such command; `num_matches` then tells unknown (0) from ambiguous.
+//! An empty name, a prefix of everything, is unknown.
+const sShellCommand *shell_find_command(const sShellCommand *commands, size_t num_commands,
+                                        const char *name, size_t *num_matches);
+
+//! Splits a command line into arguments one character at a time, as it
+//! arrives. Arguments are separated by spaces, tabs or newlines. Quotes, single
+//! or double, keep spaces in an argument; a backslash escapes the next
+//! character except inside single quotes. The arguments are written unquoted
+//! and NUL terminated to the start of `buf` as the characters come in, so
+//! `argv` points straight into it and nothing is copied or scanned again when
+//! the line ends.
+typedef struct ShellTokenizer {
+  char *buf;
+  size_t size;
+  size_t len;
+  int argc;
+  //! Valid after shell_tokenizer_finish(), with argv[argc] NULL
+  char *argv[SHELL_MAX_ARGS + 1];
+  bool in_arg;
+  bool escaped;
+  //! The quote character while inside quotes, otherwise '\0'
+  char quote;
+} sShellTokenizer;
+
+//! Sets up `tokenizer` to write into `buf`. A line of n characters needs at
+//! most n + 1 bytes; characters that don't fit are dropped, as are arguments
+//! past SHELL_MAX_ARGS or starting once the buffer is full.
+void shell_tokenizer_init(sShellTokenizer *tokenizer, char *buf, size_t size);
+
+//! Starts a new line in O(1), without clearing the buffer
+void shell_tokenizer_reset(sShellTokenizer *tokenizer);
+
+void shell_tokenizer_feed(sShellTokenizer *tokenizer, char c);
+
+//! Ends the line, closing any open quote, and returns argc
+int shell_tokenizer_finish(sShellTokenizer *tokenizer);
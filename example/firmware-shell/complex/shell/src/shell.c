@@ -3,10 +3,9 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
-#define SHELL_RX_BUFFER_SIZE (256)
-#define SHELL_MAX_ARGS (16)
 #define SHELL_PROMPT "shell> "
 
 #define SHELL_FOR_EACH_COMMAND(command) \
@@ -16,23 +15,118 @@
 
 static struct ShellContext {
   int (*send_char)(char c);
+  int (*send_buf)(const char *buf, size_t len);
+  //! Set by shell_boot() when g_shell_commands is sorted and can be searched
+  bool commands_sorted;
+  //! Output waiting for send_buf: `tx_len` bytes starting at `tx_head`,
+  //! wrapping around the end of the buffer
+  size_t tx_head;
+  size_t tx_len;
+  char tx_buffer[SHELL_TX_BUFFER_SIZE];
+  //! Bytes lost because the buffer was full and there's no send_char
+  size_t tx_dropped;
+  //! Interactive mode: the line as typed, for backspace and tab completion
   size_t rx_size;
   char rx_buffer[SHELL_RX_BUFFER_SIZE];
+  //! The arguments of the line so far. One byte more than rx_buffer, for the
+  //! terminator when a line fills it.
+  sShellTokenizer tokenizer;
+  char arg_buffer[SHELL_RX_BUFFER_SIZE + 1];
+  eShellMode mode;
+  //! Mode to switch to once the current command is done
+  eShellMode next_mode;
+  bool in_command;
+  //! Machine mode: the request header as it comes in, then the command line
+  //! goes to the tokenizer until `frame_received` reaches `frame_len`
+  uint8_t frame_header[SHELL_FRAME_REQUEST_HEADER_LEN];
+  size_t frame_header_len;
+  uint16_t frame_seq;
+  size_t frame_len;
+  size_t frame_received;
+  //! Machine mode: output of the running command, sent as a frame when full
+  //! or when the command is done
+  size_t frame_output_len;
+  char frame_output[SHELL_FRAME_MAX_OUTPUT_LEN];
 } s_shell;
 
 static bool prv_booted(void) {
-  return s_shell.send_char != NULL;
+  return s_shell.send_char != NULL || s_shell.send_buf != NULL;
+}
+
+void shell_flush(void) {
+  while (s_shell.send_buf != NULL && s_shell.tx_len > 0) {
+    const size_t to_end = SHELL_TX_BUFFER_SIZE - s_shell.tx_head;
+    const size_t len = s_shell.tx_len < to_end ? s_shell.tx_len : to_end;
+    const int sent = s_shell.send_buf(&s_shell.tx_buffer[s_shell.tx_head], len);
+    if (sent <= 0 || (size_t)sent > len) {
+      // The transport is busy, the rest goes out on the next flush
+      return;
+    }
+    s_shell.tx_head = (s_shell.tx_head + (size_t)sent) % SHELL_TX_BUFFER_SIZE;
+    s_shell.tx_len -= (size_t)sent;
+  }
+}
+
+size_t shell_tx_dropped(void) {
+  return s_shell.tx_dropped;
 }
 
 static void prv_send_char(char c) {
   if (!prv_booted()) {
     return;
   }
-  s_shell.send_char(c);
+  if (s_shell.send_buf == NULL) {
+    s_shell.send_char(c);
+    return;
+  }
+
+  if (s_shell.tx_len == SHELL_TX_BUFFER_SIZE) {
+    shell_flush();
+  }
+  if (s_shell.tx_len == SHELL_TX_BUFFER_SIZE) {
+    // send_buf took nothing. Dropping a byte would corrupt a machine mode
+    // frame, so make room by sending the oldest one with send_char, which
+    // keeps the output in order.
+    if (s_shell.send_char == NULL) {
+      s_shell.tx_dropped++;
+      return;
+    }
+    s_shell.send_char(s_shell.tx_buffer[s_shell.tx_head]);
+    s_shell.tx_head = (s_shell.tx_head + 1) % SHELL_TX_BUFFER_SIZE;
+    s_shell.tx_len--;
+  }
+  s_shell.tx_buffer[(s_shell.tx_head + s_shell.tx_len) % SHELL_TX_BUFFER_SIZE] = c;
+  s_shell.tx_len++;
+  if (c == '\n' && s_shell.mode == kShellMode_Interactive) {
+    shell_flush();
+  }
+}
+
+static void prv_send_frame(eShellStatus status) {
+  const uint8_t header[SHELL_FRAME_RESPONSE_HEADER_LEN] = {
+    SHELL_FRAME_SYNC,
+    (uint8_t)(s_shell.frame_seq & 0xff),
+    (uint8_t)(s_shell.frame_seq >> 8),
+    (uint8_t)status,
+    (uint8_t)(s_shell.frame_output_len & 0xff),
+    (uint8_t)(s_shell.frame_output_len >> 8),
+  };
+  for (size_t i = 0; i < sizeof(header); ++i) {
+    prv_send_char((char)header[i]);
+  }
+  for (size_t i = 0; i < s_shell.frame_output_len; ++i) {
+    prv_send_char(s_shell.frame_output[i]);
+  }
+  s_shell.frame_output_len = 0;
 }
 
 static void prv_echo(char c) {
-  if ('\n' == c) {
+  if (s_shell.mode == kShellMode_Machine) {
+    if (s_shell.frame_output_len == SHELL_FRAME_MAX_OUTPUT_LEN) {
+      prv_send_frame(kShellStatus_More);
+    }
+    s_shell.frame_output[s_shell.frame_output_len++] = c;
+  } else if ('\n' == c) {
     prv_send_char('\r');
     prv_send_char('\n');
   } else if ('\b' == c) {
@@ -44,17 +138,19 @@ static void prv_echo(char c) {
   }
 }
 
-static char prv_last_char(void) {
-  return s_shell.rx_buffer[s_shell.rx_size - 1];
-}
-
 static bool prv_is_rx_buffer_full(void) {
   return s_shell.rx_size >= SHELL_RX_BUFFER_SIZE;
 }
 
 static void prv_reset_rx_buffer(void) {
-  memset(s_shell.rx_buffer, 0, sizeof(s_shell.rx_buffer));
   s_shell.rx_size = 0;
+  shell_tokenizer_reset(&s_shell.tokenizer);
+}
+
+//! Adds a typed character to the line
+static void prv_append_char(char c) {
+  s_shell.rx_buffer[s_shell.rx_size++] = c;
+  shell_tokenizer_feed(&s_shell.tokenizer, c);
 }
 
 static void prv_echo_str(const char *str) {
@@ -67,78 +163,382 @@ static void prv_send_prompt(void) {
   prv_echo_str(SHELL_PROMPT);
 }
 
-static const sShellCommand *prv_find_command(const char *name) {
+void shell_tokenizer_init(sShellTokenizer *tokenizer, char *buf, size_t size) {
+  tokenizer->buf = buf;
+  tokenizer->size = size;
+  shell_tokenizer_reset(tokenizer);
+}
+
+void shell_tokenizer_reset(sShellTokenizer *tokenizer) {
+  tokenizer->len = 0;
+  tokenizer->argc = 0;
+  tokenizer->in_arg = false;
+  tokenizer->escaped = false;
+  tokenizer->quote = '\0';
+}
+
+static void prv_tokenizer_start_arg(sShellTokenizer *tokenizer) {
+  if (tokenizer->in_arg) {
+    return;
+  }
+  tokenizer->in_arg = true;
+  // Once the buffer is down to the last byte, which is kept for the
+  // terminator, further arguments are dropped like the chars that don't fit
+  if (tokenizer->argc < SHELL_MAX_ARGS && tokenizer->len + 1 < tokenizer->size) {
+    tokenizer->argv[tokenizer->argc++] = &tokenizer->buf[tokenizer->len];
+  }
+}
+
+static void prv_tokenizer_put(sShellTokenizer *tokenizer, char c) {
+  prv_tokenizer_start_arg(tokenizer);
+  // The last byte is kept for the terminator
+  if (tokenizer->len + 1 < tokenizer->size) {
+    tokenizer->buf[tokenizer->len++] = c;
+  }
+}
+
+static void prv_tokenizer_end_arg(sShellTokenizer *tokenizer) {
+  if (!tokenizer->in_arg) {
+    return;
+  }
+  tokenizer->in_arg = false;
+  // len never passes size - 1, so the terminator always fits. An argument
+  // cut short by a full buffer ends in that last byte, without moving len.
+  tokenizer->buf[tokenizer->len] = '\0';
+  if (tokenizer->len + 1 < tokenizer->size) {
+    tokenizer->len++;
+  }
+}
+
+void shell_tokenizer_feed(sShellTokenizer *tokenizer, char c) {
+  // Most chars are neither whitespace nor quotes nor backslashes, all of which
+  // are '\'' or below except '\\'
+  if ((unsigned char)c > '\'' && c != '\\' && tokenizer->in_arg && !tokenizer->escaped &&
+      tokenizer->quote == '\0') {
+    if (tokenizer->len + 1 < tokenizer->size) {
+      tokenizer->buf[tokenizer->len++] = c;
+    }
+    return;
+  }
+
+  if (tokenizer->escaped) {
+    tokenizer->escaped = false;
+    prv_tokenizer_put(tokenizer, c);
+  } else if (tokenizer->quote == '\'') {
+    if (c == '\'') {
+      tokenizer->quote = '\0';
+    } else {
+      prv_tokenizer_put(tokenizer, c);
+    }
+  } else if (c == '\\') {
+    prv_tokenizer_start_arg(tokenizer);
+    tokenizer->escaped = true;
+  } else if (tokenizer->quote == '"') {
+    if (c == '"') {
+      tokenizer->quote = '\0';
+    } else {
+      prv_tokenizer_put(tokenizer, c);
+    }
+  } else if (c == '"' || c == '\'') {
+    // Starts an argument even if nothing follows, so "" is an empty one
+    prv_tokenizer_start_arg(tokenizer);
+    tokenizer->quote = c;
+  } else if (c == ' ' || c == '\t' || c == '\n') {
+    prv_tokenizer_end_arg(tokenizer);
+  } else {
+    prv_tokenizer_put(tokenizer, c);
+  }
+}
+
+int shell_tokenizer_finish(sShellTokenizer *tokenizer) {
+  prv_tokenizer_end_arg(tokenizer);
+  tokenizer->quote = '\0';
+  tokenizer->escaped = false;
+  tokenizer->argv[tokenizer->argc] = NULL;
+  return tokenizer->argc;
+}
+
+size_t shell_find_prefix(const sShellCommand *commands, size_t num_commands,
+                         const char *prefix, size_t len, size_t *first) {
+  // Names starting with `prefix` compare equal over `len` chars, so they sit
+  // together from the first entry which doesn't compare below it
+  size_t lo = 0;
+  size_t hi = num_commands;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (strncmp(commands[mid].command, prefix, len) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *first = lo;
+
+  size_t end = lo;
+  while (end < num_commands && strncmp(commands[end].command, prefix, len) == 0) {
+    ++end;
+  }
+  return end - lo;
+}
+
+const sShellCommand *shell_find_command(const sShellCommand *commands, size_t num_commands,
+                                        const char *name, size_t *num_matches) {
+  const size_t len = strlen(name);
+  if (len == 0) {
+    // A quoted "" as the command name, not a prefix of every command
+    *num_matches = 0;
+    return NULL;
+  }
+  size_t first;
+  *num_matches = shell_find_prefix(commands, num_commands, name, len, &first);
+  if (*num_matches == 0) {
+    return NULL;
+  }
+  // An exact match sorts ahead of the longer names it's a prefix of
+  if (*num_matches == 1 || commands[first].command[len] == '\0') {
+    return &commands[first];
+  }
+  return NULL;
+}
+
+static const sShellCommand *prv_find_command(const char *name, size_t *num_matches) {
+  if (s_shell.commands_sorted) {
+    return shell_find_command(g_shell_commands, g_num_shell_commands, name, num_matches);
+  }
+  *num_matches = 0;
   SHELL_FOR_EACH_COMMAND(command) {
     if (strcmp(command->command, name) == 0) {
+      *num_matches = 1;
       return command;
     }
   }
   return NULL;
 }
 
-static void prv_process(void) {
-  if (prv_last_char() != '\n' && !prv_is_rx_buffer_full()) {
-    return;
+static bool prv_commands_sorted(void) {
+  for (size_t i = 1; i < g_num_shell_commands; ++i) {
+    if (strcmp(g_shell_commands[i - 1].command, g_shell_commands[i].command) >= 0) {
+      return false;
+    }
   }
+  return true;
+}
 
-  char *argv[SHELL_MAX_ARGS] = {0};
-  int argc = 0;
+//! Prints the names of `num` commands starting at `first` on one line
+static void prv_list_commands(size_t first, size_t num) {
+  for (size_t i = first; i < first + num; ++i) {
+    prv_echo_str(g_shell_commands[i].command);
+    prv_echo(i + 1 < first + num ? ' ' : '\n');
+  }
+}
 
-  char *next_arg = NULL;
-  for (size_t i = 0; i < s_shell.rx_size && argc < SHELL_MAX_ARGS; ++i) {
-    char *const c = &s_shell.rx_buffer[i];
-    if (*c == ' ' || *c == '\n' || i == s_shell.rx_size - 1) {
-      *c = '\0';
-      if (next_arg) {
-        argv[argc++] = next_arg;
-        next_arg = NULL;
-      }
-    } else if (!next_arg) {
-      next_arg = c;
-    }
+//! Runs the command of the line the tokenizer has split
+static eShellStatus prv_run_line(void) {
+  const int argc = shell_tokenizer_finish(&s_shell.tokenizer);
+  char **argv = s_shell.tokenizer.argv;
+  if (argc < 1) {
+    return kShellStatus_Ok;
+  }
+  size_t num_matches;
+  const sShellCommand *command = prv_find_command(argv[0], &num_matches);
+  if (!command && num_matches > 1) {
+    prv_echo_str("Ambiguous command: ");
+    prv_echo_str(argv[0]);
+    prv_echo('\n');
+    size_t first;
+    shell_find_prefix(g_shell_commands, g_num_shell_commands, argv[0], strlen(argv[0]), &first);
+    prv_list_commands(first, num_matches);
+    return kShellStatus_AmbiguousCommand;
   }
+  if (!command) {
+    prv_echo_str("Unknown command: ");
+    prv_echo_str(argv[0]);
+    prv_echo('\n');
+    prv_echo_str("Type 'help' to list all commands\n");
+    return kShellStatus_UnknownCommand;
+  }
+  s_shell.in_command = true;
+  const int rv = command->handler(argc, argv);
+  s_shell.in_command = false;
+  return rv == 0 ? kShellStatus_Ok : kShellStatus_CommandFailed;
+}
+
+static void prv_apply_mode(void) {
+  if (s_shell.next_mode == s_shell.mode) {
+    return;
+  }
+  s_shell.mode = s_shell.next_mode;
+  s_shell.frame_header_len = 0;
+  s_shell.frame_output_len = 0;
+  if (s_shell.mode == kShellMode_Interactive) {
+    prv_echo('\n');
+    prv_send_prompt();
+  }
+}
 
+static void prv_process(void) {
   if (s_shell.rx_size == SHELL_RX_BUFFER_SIZE) {
     prv_echo('\n');
   }
+  prv_run_line();
+  prv_reset_rx_buffer();
+  if (s_shell.next_mode == kShellMode_Interactive) {
+    prv_send_prompt();
+  }
+  prv_apply_mode();
+}
 
-  if (argc >= 1) {
-    const sShellCommand *command = prv_find_command(argv[0]);
-    if (!command) {
-      prv_echo_str("Unknown command: ");
-      prv_echo_str(argv[0]);
-      prv_echo('\n');
-      prv_echo_str("Type 'help' to list all commands\n");
-    } else {
-      command->handler(argc, argv);
-    }
+//! Runs the command line of the request frame just received and sends the
+//! response
+static void prv_process_frame(void) {
+  eShellStatus status = kShellStatus_TooLong;
+  if (s_shell.frame_len < SHELL_RX_BUFFER_SIZE) {
+    status = prv_run_line();
   }
+  prv_send_frame(status);
   prv_reset_rx_buffer();
-  prv_send_prompt();
+  s_shell.frame_header_len = 0;
+  prv_apply_mode();
+}
+
+static void prv_receive_frame_char(char c) {
+  if (s_shell.frame_header_len < SHELL_FRAME_REQUEST_HEADER_LEN) {
+    if (s_shell.frame_header_len == 0 && (uint8_t)c != SHELL_FRAME_SYNC) {
+      return;
+    }
+    s_shell.frame_header[s_shell.frame_header_len++] = (uint8_t)c;
+    if (s_shell.frame_header_len < SHELL_FRAME_REQUEST_HEADER_LEN) {
+      return;
+    }
+    s_shell.frame_seq = (uint16_t)(s_shell.frame_header[1] | (s_shell.frame_header[2] << 8));
+    s_shell.frame_len = (size_t)(s_shell.frame_header[3] | (s_shell.frame_header[4] << 8));
+    s_shell.frame_received = 0;
+  } else {
+    // A command line too long to run is still read to its end
+    if (s_shell.frame_len < SHELL_RX_BUFFER_SIZE) {
+      shell_tokenizer_feed(&s_shell.tokenizer, c);
+    }
+    s_shell.frame_received++;
+  }
+
+  if (s_shell.frame_received == s_shell.frame_len) {
+    prv_process_frame();
+  }
+}
+
+//! Tab completes the command name being typed: a unique match is filled in
+//! along with a space, otherwise the part every match shares. If that adds
+//! nothing, the matches are listed and the line is printed again.
+static void prv_complete(void) {
+  // Only while every char typed is part of the command name, not past a
+  // space, quote or backslash
+  if (!s_shell.commands_sorted || s_shell.tokenizer.len != s_shell.rx_size) {
+    return;
+  }
+  size_t first;
+  const size_t num = shell_find_prefix(g_shell_commands, g_num_shell_commands,
+                                       s_shell.rx_buffer, s_shell.rx_size, &first);
+  if (num == 0) {
+    return;
+  }
+
+  // The matches are sorted, so the first and last share the least
+  const char *name = g_shell_commands[first].command;
+  const char *last = g_shell_commands[first + num - 1].command;
+  const size_t typed = s_shell.rx_size;
+  size_t common = typed;
+  while (name[common] != '\0' && name[common] == last[common]) {
+    ++common;
+  }
+  for (size_t i = typed; i < common && !prv_is_rx_buffer_full(); ++i) {
+    prv_append_char(name[i]);
+    prv_echo(name[i]);
+  }
+
+  if (num == 1) {
+    if (!prv_is_rx_buffer_full()) {
+      prv_append_char(' ');
+      prv_echo(' ');
+    }
+  } else if (common == typed) {
+    prv_echo('\n');
+    prv_list_commands(first, num);
+    prv_send_prompt();
+    for (size_t i = 0; i < s_shell.rx_size; ++i) {
+      prv_echo(s_shell.rx_buffer[i]);
+    }
+  }
 }
 
 void shell_boot(const sShellImpl *impl) {
   s_shell.send_char = impl->send_char;
+  s_shell.send_buf = impl->send_buf;
+  s_shell.tx_head = 0;
+  s_shell.tx_len = 0;
+  s_shell.tx_dropped = 0;
+  s_shell.commands_sorted = prv_commands_sorted();
+  s_shell.mode = kShellMode_Interactive;
+  s_shell.next_mode = kShellMode_Interactive;
+  s_shell.in_command = false;
+  s_shell.frame_header_len = 0;
+  s_shell.frame_output_len = 0;
+  shell_tokenizer_init(&s_shell.tokenizer, s_shell.arg_buffer, sizeof(s_shell.arg_buffer));
   prv_reset_rx_buffer();
   prv_echo_str("\n" SHELL_PROMPT);
+  shell_flush();
 }
 
-void shell_receive_char(char c) {
-  if (c == '\r' || prv_is_rx_buffer_full() || !prv_booted()) {
+void shell_set_mode(eShellMode mode) {
+  s_shell.next_mode = mode;
+  if (!s_shell.in_command) {
+    prv_apply_mode();
+    shell_flush();
+  }
+}
+
+static void prv_receive_char(char c) {
+  if (!prv_booted()) {
+    return;
+  }
+  if (s_shell.mode == kShellMode_Machine) {
+    prv_receive_frame_char(c);
+    return;
+  }
+  if (c == '\r' || prv_is_rx_buffer_full()) {
+    return;
+  }
+  if (c == '\t') {
+    prv_complete();
     return;
   }
   prv_echo(c);
 
   if (c == '\b') {
     if (s_shell.rx_size > 0) {
-      s_shell.rx_buffer[--s_shell.rx_size] = '\0';
+      // Rare enough to split the line again rather than track how to undo
+      // each char
+      const size_t len = s_shell.rx_size - 1;
+      prv_reset_rx_buffer();
+      for (size_t i = 0; i < len; ++i) {
+        prv_append_char(s_shell.rx_buffer[i]);
+      }
     }
     return;
   }
 
-  s_shell.rx_buffer[s_shell.rx_size++] = c;
+  // Enter ends the line even after a backslash or inside quotes
+  if (c != '\n') {
+    prv_append_char(c);
+  }
+  if (c == '\n' || prv_is_rx_buffer_full()) {
+    prv_process();
+  }
+}
 
-  prv_process();
+void shell_receive_char(char c) {
+  prv_receive_char(c);
+  // The echo, prompt or response goes out straight away
+  shell_flush();
 }
 
 void shell_put_line(const char *str) {
@@ -156,3 +556,15 @@ int shell_help_handler(int argc, char *argv[]) {
   }
   return 0;
 }
+
+int shell_mode_handler(int argc, char *argv[]) {
+  if (argc == 2 && strcmp(argv[1], "machine") == 0) {
+    shell_set_mode(kShellMode_Machine);
+  } else if (argc == 2 && strcmp(argv[1], "interactive") == 0) {
+    shell_set_mode(kShellMode_Interactive);
+  } else {
+    shell_put_line("Usage: mode machine|interactive");
+    return -1;
+  }
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
@@ -19,7 +20,7 @@ int cli_cmd_kv_write(int argc, char *argv[]) {
   // 3. Value
   if (argc != 3) {
     shell_put_line("> FAIL,1");
-    return;
+    return -1;
   }
 
   const char *key = argv[1];
@@ -28,7 +29,7 @@ int cli_cmd_kv_write(int argc, char *argv[]) {
   bool result = kv_store_write(key, value, strlen(value));
   if (!result) {
     shell_put_line("> FAIL,2");
-    return;
+    return -1;
   }
   shell_put_line("> OK");
   return 0;
@@ -39,10 +40,12 @@ int cli_cmd_hello(int argc, char *argv[]) {
   return 0;
 }
 
+// Keep sorted by name, the shell binary searches this table
 static const sShellCommand s_shell_commands[] = {
-  {"kv_write", cli_cmd_kv_write, "Write a Key/Value pair"},
   {"hello", cli_cmd_hello, "Say hello"},
   {"help", shell_help_handler, "Lists all commands"},
+  {"kv_write", cli_cmd_kv_write, "Write a Key/Value pair"},
+  {"mode", shell_mode_handler, "Switch to machine or interactive mode"},
 };
 
 const sShellCommand *const g_shell_commands = s_shell_commands;
@@ -0,0 +1,13 @@
+COMPONENT_NAME=bench_shell_host
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/shell/src/shell.c \
+  $(PROJECT_SRC_DIR)/shell_commands.c \
+  $(PROJECT_SRC_DIR)/host/shell_port_host.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/bench_shell_host.cpp
+
+CPPUTEST_LDFLAGS += -lpthread
+
+include $(CPPUTEST_MAKFILE_INFRA)
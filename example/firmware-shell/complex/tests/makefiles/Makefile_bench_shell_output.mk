@@ -0,0 +1,11 @@
+COMPONENT_NAME=bench_shell_output
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/shell/src/shell.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/bench_shell_output.cpp
+
+CPPUTEST_LDFLAGS += -lpthread
+
+include $(CPPUTEST_MAKFILE_INFRA)
@@ -0,0 +1,9 @@
+COMPONENT_NAME=bench_shell_tokenizer
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/shell/src/shell.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/bench_shell_tokenizer.cpp
+
+include $(CPPUTEST_MAKFILE_INFRA)
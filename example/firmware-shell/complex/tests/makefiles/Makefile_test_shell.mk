@@ -0,0 +1,12 @@
+COMPONENT_NAME=test_shell
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/shell/src/shell.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/test_shell.cpp
+
+# Small enough for help to need several response frames
+CPPUTEST_CPPFLAGS += -DSHELL_FRAME_MAX_OUTPUT_LEN=32
+
+include $(CPPUTEST_MAKFILE_INFRA)
@@ -0,0 +1,309 @@
+#include "CppUTest/TestHarness.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+  #include "host/shell_port_host.h"
+  #include "shell/shell.h"
+}
+
+// Replays a script of command lines against the whole shell, the real command
+// table included, running on the host port. A thread plays the device, polling
+// the pty master as main.c does, while the test types each line into the slave
+// side like a script driving the board's serial port, and waits for the next
+// prompt before sending the following line. Per line it records the latency
+// from the first byte sent to the prompt coming back and the bytes that came
+// back (echo, command output and prompt). Runs once with per-char output and
+// once with the buffered send_buf path.
+//
+// Then the same lines go through machine mode: switched on with
+// `mode machine`, every line is a request frame and the client keeps up to
+// BENCH_MACHINE_DEPTH of them in flight, timing each from its frame being sent
+// to its final response frame arriving.
+//
+// The script is generated, or read from the file named by the SHELL_SCRIPT
+// environment variable, one command line per line.
+
+#define BENCH_MAX_LINES 5000
+#define BENCH_MAX_LINE_LEN 128
+#define BENCH_MACHINE_DEPTH 8
+#define BENCH_MACHINE_DEPTH_STR "8"
+#define BENCH_NUM_STATUS (kShellStatus_TooLong + 1)
+
+static const char *s_prompt = "\r\nshell> ";
+
+static char s_script[BENCH_MAX_LINES][BENCH_MAX_LINE_LEN];
+static size_t s_num_lines;
+static uint64_t s_latency_ns[BENCH_MAX_LINES];
+
+static volatile bool s_stop;
+
+typedef struct {
+  double lines_per_sec;
+  uint64_t p50_us;
+  uint64_t p99_us;
+  uint64_t max_us;
+  size_t bytes_back;
+  //! Machine mode: how many lines got each status
+  size_t num_status[BENCH_NUM_STATUS];
+} sScriptResult;
+
+static uint64_t prv_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void prv_build_script(void) {
+  const char *path = getenv("SHELL_SCRIPT");
+  if (path != NULL) {
+    FILE *f = fopen(path, "r");
+    CHECK_TEXT(f != NULL, path);
+    s_num_lines = 0;
+    while (s_num_lines < BENCH_MAX_LINES &&
+           fgets(s_script[s_num_lines], BENCH_MAX_LINE_LEN, f) != NULL) {
+      if (strchr(s_script[s_num_lines], '\n') == NULL) {
+        strcat(s_script[s_num_lines], "\n");
+      }
+      s_num_lines++;
+    }
+    fclose(f);
+    return;
+  }
+
+  // Mostly short commands, now and then a help listing or a failure
+  for (size_t i = 0; i < BENCH_MAX_LINES; i++) {
+    char *line = s_script[i];
+    switch (i % 10) {
+      case 0:
+        snprintf(line, BENCH_MAX_LINE_LEN, "help\n");
+        break;
+      case 1:
+        snprintf(line, BENCH_MAX_LINE_LEN, "kv_write only_a_key\n");
+        break;
+      case 2:
+        snprintf(line, BENCH_MAX_LINE_LEN, "nope\n");
+        break;
+      case 3:
+      case 4:
+      case 5:
+        snprintf(line, BENCH_MAX_LINE_LEN, "hello\n");
+        break;
+      default:
+        snprintf(line, BENCH_MAX_LINE_LEN, "kv_write key%u value%u\n", (unsigned)(i % 64),
+                 (unsigned)i);
+        break;
+    }
+  }
+  s_num_lines = BENCH_MAX_LINES;
+}
+
+static void *prv_device(void *arg) {
+  while (!s_stop && shell_port_host_poll(10)) {
+  }
+  return NULL;
+}
+
+//! Reads until the output ends with `tail` and returns how many bytes that
+//! took
+static size_t prv_read_until(int fd, const char *tail) {
+  static char s_tail[32];
+  const size_t want_len = strlen(tail);
+  size_t tail_len = 0;
+  size_t total = 0;
+  while (true) {
+    char buf[4096];
+    const ssize_t rv = read(fd, buf, sizeof(buf));
+    CHECK(rv > 0);
+    total += (size_t)rv;
+
+    // Only the last few bytes matter to spot the end
+    for (ssize_t i = 0; i < rv; i++) {
+      if (tail_len == want_len) {
+        memmove(s_tail, &s_tail[1], want_len - 1);
+        tail_len--;
+      }
+      s_tail[tail_len++] = buf[i];
+    }
+    if (tail_len == want_len && memcmp(s_tail, tail, want_len) == 0) {
+      return total;
+    }
+  }
+}
+
+static int prv_cmp_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a;
+  const uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static pthread_t s_device_thread;
+static int s_master_fd;
+
+//! Boots the shell on a new pty and returns the slave side for the client
+static int prv_start(bool buffered) {
+  char slave_path[64];
+  s_master_fd = shell_port_host_open_pty(slave_path, sizeof(slave_path));
+  CHECK(s_master_fd >= 0);
+  const int fd = open(slave_path, O_RDWR | O_NOCTTY);
+  CHECK(fd >= 0);
+
+  shell_port_host_boot(s_master_fd, buffered);
+  s_stop = false;
+  pthread_create(&s_device_thread, NULL, prv_device, NULL);
+  prv_read_until(fd, s_prompt);
+  return fd;
+}
+
+static void prv_stop(int fd, uint64_t elapsed_ns, sScriptResult *result) {
+  s_stop = true;
+  pthread_join(s_device_thread, NULL);
+  close(fd);
+  close(s_master_fd);
+
+  qsort(s_latency_ns, s_num_lines, sizeof(s_latency_ns[0]), prv_cmp_u64);
+  result->lines_per_sec = s_num_lines * 1e9 / (double)elapsed_ns;
+  result->p50_us = s_latency_ns[s_num_lines * 50 / 100] / 1000;
+  result->p99_us = s_latency_ns[s_num_lines * 99 / 100] / 1000;
+  result->max_us = s_latency_ns[s_num_lines - 1] / 1000;
+}
+
+//! Types each line and waits for the prompt before the next one
+static void prv_run_interactive(bool buffered, sScriptResult *result) {
+  const int fd = prv_start(buffered);
+
+  result->bytes_back = 0;
+  const uint64_t start = prv_now_ns();
+  for (size_t i = 0; i < s_num_lines; i++) {
+    const uint64_t line_start = prv_now_ns();
+    const size_t len = strlen(s_script[i]);
+    CHECK(write(fd, s_script[i], len) == (ssize_t)len);
+    result->bytes_back += prv_read_until(fd, s_prompt);
+    s_latency_ns[i] = prv_now_ns() - line_start;
+  }
+  prv_stop(fd, prv_now_ns() - start, result);
+}
+
+//! Sends each line as a machine mode frame, keeping up to `depth` in flight
+static void prv_run_machine(size_t depth, sScriptResult *result) {
+  const int fd = prv_start(true);
+  const char *enter = "mode machine\n";
+  CHECK(write(fd, enter, strlen(enter)) == (ssize_t)strlen(enter));
+  prv_read_until(fd, "mode machine\r\n");
+
+  static uint64_t s_sent_ns[BENCH_MAX_LINES];
+  static uint8_t s_rx[8192];
+  size_t rx_len = 0;
+  size_t num_sent = 0;
+  size_t num_done = 0;
+  memset(result->num_status, 0, sizeof(result->num_status));
+  result->bytes_back = 0;
+  const uint64_t start = prv_now_ns();
+  while (num_done < s_num_lines) {
+    while (num_sent < s_num_lines && num_sent - num_done < depth) {
+      // Frames carry the line without its newline
+      uint8_t frame[SHELL_FRAME_REQUEST_HEADER_LEN + BENCH_MAX_LINE_LEN];
+      const size_t len = strcspn(s_script[num_sent], "\n");
+      frame[0] = SHELL_FRAME_SYNC;
+      frame[1] = (uint8_t)(num_sent & 0xff);
+      frame[2] = (uint8_t)(num_sent >> 8);
+      frame[3] = (uint8_t)len;
+      frame[4] = 0;
+      memcpy(&frame[SHELL_FRAME_REQUEST_HEADER_LEN], s_script[num_sent], len);
+      s_sent_ns[num_sent] = prv_now_ns();
+      const size_t frame_len = SHELL_FRAME_REQUEST_HEADER_LEN + len;
+      CHECK(write(fd, frame, frame_len) == (ssize_t)frame_len);
+      num_sent++;
+    }
+
+    const ssize_t rv = read(fd, &s_rx[rx_len], sizeof(s_rx) - rx_len);
+    CHECK(rv > 0);
+    const uint64_t now = prv_now_ns();
+    rx_len += (size_t)rv;
+    result->bytes_back += (size_t)rv;
+
+    size_t off = 0;
+    while (rx_len - off >= SHELL_FRAME_RESPONSE_HEADER_LEN) {
+      const uint8_t *resp = &s_rx[off];
+      const size_t len = resp[4] | (resp[5] << 8);
+      if (rx_len - off < SHELL_FRAME_RESPONSE_HEADER_LEN + len) {
+        break;
+      }
+      LONGS_EQUAL(SHELL_FRAME_SYNC, resp[0]);
+      const uint8_t status = resp[3];
+      if (status != kShellStatus_More) {
+        // Answered in the order they were sent
+        LONGS_EQUAL(num_done & 0xffff, resp[1] | (resp[2] << 8));
+        CHECK(status < BENCH_NUM_STATUS);
+        result->num_status[status]++;
+        s_latency_ns[num_done] = now - s_sent_ns[num_done];
+        num_done++;
+      }
+      off += SHELL_FRAME_RESPONSE_HEADER_LEN + len;
+    }
+    memmove(s_rx, &s_rx[off], rx_len - off);
+    rx_len -= off;
+  }
+  prv_stop(fd, prv_now_ns() - start, result);
+}
+
+TEST_GROUP(BenchShellHost) {
+  void setup() {
+    prv_build_script();
+  }
+  void teardown() {}
+};
+
+TEST(BenchShellHost, ReplayScript) {
+  sScriptResult per_char;
+  sScriptResult buffered;
+  sScriptResult machine;
+  sScriptResult machine_pipelined;
+  prv_run_interactive(false, &per_char);
+  prv_run_interactive(true, &buffered);
+  prv_run_machine(1, &machine);
+  prv_run_machine(BENCH_MACHINE_DEPTH, &machine_pipelined);
+
+  printf("\nshell on the host pty port: %u scripted lines\n", (unsigned)s_num_lines);
+  printf("  %-24s %9s %8s %8s %8s %11s %10s\n", "mode", "lines/s", "p50 us", "p99 us",
+         "max us", "bytes back", "bytes/line");
+  const struct {
+    const char *name;
+    const sScriptResult *result;
+  } rows[] = {
+    { "interactive, per char", &per_char },
+    { "interactive, buffered", &buffered },
+    { "machine, 1 in flight", &machine },
+    { "machine, " BENCH_MACHINE_DEPTH_STR " in flight", &machine_pipelined },
+  };
+  for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+    const sScriptResult *r = rows[i].result;
+    printf("  %-24s %9.0f %8llu %8llu %8llu %11u %10.1f\n", rows[i].name, r->lines_per_sec,
+           (unsigned long long)r->p50_us, (unsigned long long)r->p99_us,
+           (unsigned long long)r->max_us, (unsigned)r->bytes_back,
+           (double)r->bytes_back / (double)s_num_lines);
+  }
+  printf("  machine mode speedup over interactive: %.1fx (1 in flight), %.1fx (%d in flight)\n",
+         machine.lines_per_sec / buffered.lines_per_sec,
+         machine_pipelined.lines_per_sec / buffered.lines_per_sec, BENCH_MACHINE_DEPTH);
+
+  // How the output is sent mustn't change what is sent
+  LONGS_EQUAL(per_char.bytes_back, buffered.bytes_back);
+  // Every line of the generated script gets the status it should
+  if (getenv("SHELL_SCRIPT") == NULL) {
+    LONGS_EQUAL(s_num_lines * 8 / 10, machine.num_status[kShellStatus_Ok]);
+    LONGS_EQUAL(s_num_lines / 10, machine.num_status[kShellStatus_CommandFailed]);
+    LONGS_EQUAL(s_num_lines / 10, machine.num_status[kShellStatus_UnknownCommand]);
+  }
+  // No echo and no prompt. Not waiting for each answer shows in lines/s,
+  // which is wall clock and left to the printout.
+  CHECK(machine_pipelined.bytes_back < buffered.bytes_back);
+}
@@ -0,0 +1,156 @@
+#include "CppUTest/TestHarness.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern "C" {
+  #include "shell/shell.h"
+}
+
+// Command lookup as the table grows from 8 to 1024 commands, comparing the
+// strcmp() over every entry the shell used to do with the binary search over
+// the sorted table. Names look like a production shell's: groups of commands
+// sharing a prefix (fwup-*, diag-*, ...), so neighbours in the table share
+// most of their leading characters.
+
+#define BENCH_MAX_COMMANDS 1024
+#define BENCH_NUM_LOOKUPS 200000
+#define BENCH_NUM_LINES 100000
+
+static const char *s_groups[] = {
+  "fwup-", "diag-", "net-", "kv_", "log-", "pwr-", "sensor-", "ble-",
+};
+#define BENCH_NUM_GROUPS (sizeof(s_groups) / sizeof(s_groups[0]))
+
+static char s_names[BENCH_MAX_COMMANDS][24];
+static sShellCommand s_commands[BENCH_MAX_COMMANDS];
+static sShellCommand s_subset[BENCH_MAX_COMMANDS];
+static const char *s_queries[BENCH_MAX_COMMANDS];
+
+const sShellCommand *const g_shell_commands = s_commands;
+const size_t g_num_shell_commands = BENCH_MAX_COMMANDS;
+
+static const size_t s_table_sizes[] = { 8, 32, 128, 512, 1024 };
+#define BENCH_NUM_TABLE_SIZES (sizeof(s_table_sizes) / sizeof(s_table_sizes[0]))
+
+static uint32_t s_rand_state = 1;
+static uint32_t prv_rand(void) {
+  s_rand_state = s_rand_state * 1103515245 + 12345;
+  return s_rand_state >> 8;
+}
+
+static uint64_t prv_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t s_num_calls;
+static int prv_cmd(int argc, char *argv[]) {
+  s_num_calls++;
+  return 0;
+}
+
+static int prv_send_char(char c) {
+  return 1;
+}
+
+static int prv_command_cmp(const void *a, const void *b) {
+  return strcmp(((const sShellCommand *)a)->command, ((const sShellCommand *)b)->command);
+}
+
+static void prv_build_commands(void) {
+  for (size_t i = 0; i < BENCH_MAX_COMMANDS; i++) {
+    snprintf(s_names[i], sizeof(s_names[i]), "%scommand-%04u", s_groups[i % BENCH_NUM_GROUPS],
+             (unsigned)(i / BENCH_NUM_GROUPS));
+    s_commands[i].command = s_names[i];
+    s_commands[i].handler = prv_cmd;
+    s_commands[i].help = "";
+  }
+  qsort(s_commands, BENCH_MAX_COMMANDS, sizeof(s_commands[0]), prv_command_cmp);
+}
+
+//! The lookup the shell did before the table was sorted
+static const sShellCommand *prv_find_linear(const sShellCommand *commands, size_t num_commands,
+                                            const char *name) {
+  for (size_t i = 0; i < num_commands; i++) {
+    if (strcmp(commands[i].command, name) == 0) {
+      return &commands[i];
+    }
+  }
+  return NULL;
+}
+
+//! Every n-th command of the full table, which is still sorted
+static void prv_build_subset(size_t num_commands) {
+  const size_t stride = BENCH_MAX_COMMANDS / num_commands;
+  for (size_t i = 0; i < num_commands; i++) {
+    s_subset[i] = s_commands[i * stride];
+    s_queries[i] = s_subset[i].command;
+  }
+}
+
+TEST_GROUP(BenchShellLookup) {
+  void setup() {
+    prv_build_commands();
+  }
+  void teardown() {}
+};
+
+TEST(BenchShellLookup, LinearVsSorted) {
+  printf("\nshell command lookup: %d lookups of random names\n", BENCH_NUM_LOOKUPS);
+  for (size_t t = 0; t < BENCH_NUM_TABLE_SIZES; t++) {
+    const size_t n = s_table_sizes[t];
+    prv_build_subset(n);
+
+    size_t found = 0;
+    s_rand_state = 1;
+    uint64_t start = prv_now_ns();
+    for (size_t i = 0; i < BENCH_NUM_LOOKUPS; i++) {
+      found += prv_find_linear(s_subset, n, s_queries[prv_rand() % n]) != NULL;
+    }
+    const double linear_ns = (double)(prv_now_ns() - start) / BENCH_NUM_LOOKUPS;
+    LONGS_EQUAL(BENCH_NUM_LOOKUPS, found);
+
+    found = 0;
+    s_rand_state = 1;
+    start = prv_now_ns();
+    for (size_t i = 0; i < BENCH_NUM_LOOKUPS; i++) {
+      size_t num_matches;
+      found += shell_find_command(s_subset, n, s_queries[prv_rand() % n], &num_matches) != NULL;
+    }
+    const double sorted_ns = (double)(prv_now_ns() - start) / BENCH_NUM_LOOKUPS;
+    LONGS_EQUAL(BENCH_NUM_LOOKUPS, found);
+
+    printf("  %4u commands: linear %7.1f ns %9.0f lookups/s  sorted %6.1f ns %9.0f lookups/s\n",
+           (unsigned)n, linear_ns, 1e9 / linear_ns, sorted_ns, 1e9 / sorted_ns);
+  }
+  // Only the lookups finding every name are checked; which search is faster
+  // is for the printout, as it depends on the host
+}
+
+TEST(BenchShellLookup, LinesThroughShell) {
+  sShellImpl impl = { prv_send_char };
+  shell_boot(&impl);
+
+  static char s_lines[BENCH_NUM_LINES / 10][48];
+  for (size_t i = 0; i < BENCH_NUM_LINES / 10; i++) {
+    snprintf(s_lines[i], sizeof(s_lines[i]), "%s arg1 arg2\n",
+             s_commands[prv_rand() % BENCH_MAX_COMMANDS].command);
+  }
+
+  s_num_calls = 0;
+  const uint64_t start = prv_now_ns();
+  for (size_t i = 0; i < BENCH_NUM_LINES; i++) {
+    for (const char *c = s_lines[i % (BENCH_NUM_LINES / 10)]; *c != '\0'; ++c) {
+      shell_receive_char(*c);
+    }
+  }
+  const uint64_t elapsed = prv_now_ns() - start;
+  printf("\nshell_receive_char(): %d lines against %d commands: %.0f lines/s\n", BENCH_NUM_LINES,
+         BENCH_MAX_COMMANDS, BENCH_NUM_LINES * 1e9 / (double)elapsed);
+  LONGS_EQUAL(BENCH_NUM_LINES, s_num_calls);
+}
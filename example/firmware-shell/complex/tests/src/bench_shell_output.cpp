@@ -0,0 +1,169 @@
+#include "CppUTest/TestHarness.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+  #include "shell/shell.h"
+}
+
+// Shell output throughput over a pseudo-terminal, the closest the host has to
+// a UART: the shell writes to the pty's slave side, as firmware would to the
+// UART driver, and a thread drains the master side like the terminal on the
+// other end of the cable. `help` over a table of BENCH_NUM_COMMANDS commands
+// is the output, sent once a char at a time through send_char (one write()
+// per byte) and once through send_buf and the TX buffer (one write() per line).
+
+#define BENCH_NUM_COMMANDS 256
+#define BENCH_NUM_RUNS 40
+
+static char s_names[BENCH_NUM_COMMANDS][24];
+static sShellCommand s_commands[BENCH_NUM_COMMANDS];
+
+const sShellCommand *const g_shell_commands = s_commands;
+const size_t g_num_shell_commands = BENCH_NUM_COMMANDS;
+
+static int s_master_fd = -1;
+static int s_slave_fd = -1;
+static size_t s_bytes_sent;
+static size_t s_num_writes;
+static volatile size_t s_bytes_received;
+static volatile bool s_stop;
+
+static uint64_t prv_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int prv_send_char(char c) {
+  s_num_writes++;
+  const ssize_t rv = write(s_slave_fd, &c, 1);
+  s_bytes_sent += rv > 0 ? (size_t)rv : 0;
+  return (int)rv;
+}
+
+static int prv_send_buf(const char *buf, size_t len) {
+  s_num_writes++;
+  const ssize_t rv = write(s_slave_fd, buf, len);
+  s_bytes_sent += rv > 0 ? (size_t)rv : 0;
+  return (int)rv;
+}
+
+static void *prv_drain(void *arg) {
+  char buf[4096];
+  while (!s_stop) {
+    struct pollfd pfd = { s_master_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 10) <= 0) {
+      continue;
+    }
+    const ssize_t rv = read(s_master_fd, buf, sizeof(buf));
+    if (rv > 0) {
+      s_bytes_received += (size_t)rv;
+    }
+  }
+  return NULL;
+}
+
+static void prv_open_pty(void) {
+  s_master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+  CHECK(s_master_fd >= 0);
+  CHECK(grantpt(s_master_fd) == 0);
+  CHECK(unlockpt(s_master_fd) == 0);
+  s_slave_fd = open(ptsname(s_master_fd), O_RDWR | O_NOCTTY);
+  CHECK(s_slave_fd >= 0);
+
+  // Raw, so bytes arrive as the shell sent them, "\r\n" included
+  struct termios tio;
+  tcgetattr(s_slave_fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(s_slave_fd, TCSANOW, &tio);
+}
+
+static void prv_build_commands(void) {
+  // "help" sorts after every "command-*"
+  for (size_t i = 0; i < BENCH_NUM_COMMANDS - 1; i++) {
+    snprintf(s_names[i], sizeof(s_names[i]), "command-%04u", (unsigned)i);
+    s_commands[i].command = s_names[i];
+    s_commands[i].handler = NULL;
+    s_commands[i].help = "Does the thing the command is named after";
+  }
+  s_commands[BENCH_NUM_COMMANDS - 1].command = "help";
+  s_commands[BENCH_NUM_COMMANDS - 1].handler = shell_help_handler;
+  s_commands[BENCH_NUM_COMMANDS - 1].help = "Lists all commands";
+}
+
+typedef struct {
+  double mb_per_sec;
+  double bytes_per_write;
+} sOutputResult;
+
+static void prv_run(const sShellImpl *impl, sOutputResult *result) {
+  pthread_t drain_thread;
+  s_stop = false;
+  s_bytes_received = 0;
+  s_bytes_sent = 0;
+  s_num_writes = 0;
+  pthread_create(&drain_thread, NULL, prv_drain, NULL);
+
+  const uint64_t start = prv_now_ns();
+  shell_boot(impl);
+  for (size_t run = 0; run < BENCH_NUM_RUNS; run++) {
+    for (const char *c = "help\n"; *c != '\0'; ++c) {
+      shell_receive_char(*c);
+    }
+  }
+  // Done once everything the shell wrote has made it through the pty
+  while (s_bytes_received < s_bytes_sent) {
+  }
+  const uint64_t elapsed = prv_now_ns() - start;
+
+  s_stop = true;
+  pthread_join(drain_thread, NULL);
+
+  result->mb_per_sec = (double)s_bytes_sent * 1e3 / (double)elapsed;
+  result->bytes_per_write = (double)s_bytes_sent / (double)s_num_writes;
+}
+
+TEST_GROUP(BenchShellOutput) {
+  void setup() {
+    prv_build_commands();
+    prv_open_pty();
+  }
+  void teardown() {
+    close(s_slave_fd);
+    close(s_master_fd);
+  }
+};
+
+TEST(BenchShellOutput, PerCharVsBuffered) {
+  sShellImpl per_char = { prv_send_char, NULL };
+  sShellImpl buffered = { prv_send_char, prv_send_buf };
+  sOutputResult per_char_result;
+  sOutputResult buffered_result;
+
+  // The first run only warms up the pty
+  prv_run(&per_char, &per_char_result);
+  prv_run(&buffered, &buffered_result);
+  prv_run(&per_char, &per_char_result);
+
+  printf("\nshell output over a pty: 'help' with %d commands, %d times\n", BENCH_NUM_COMMANDS,
+         BENCH_NUM_RUNS);
+  printf("  per char (send_char): %7.2f MB/s %6.1f bytes/write\n", per_char_result.mb_per_sec,
+         per_char_result.bytes_per_write);
+  printf("  buffered (send_buf):  %7.2f MB/s %6.1f bytes/write\n", buffered_result.mb_per_sec,
+         buffered_result.bytes_per_write);
+
+  // Every char is a syscall on its own without the TX buffer. That's what the
+  // bench asserts; MB/s depends on the host and is only printed.
+  DOUBLES_EQUAL(1.0, per_char_result.bytes_per_write, 0.001);
+  CHECK(buffered_result.bytes_per_write > 10.0);
+}
@@ -0,0 +1,212 @@
+#include "CppUTest/TestHarness.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+extern "C" {
+  #include "shell/shell.h"
+}
+
+// Cost per received character of splitting command lines into arguments.
+// The incremental tokenizer is compared with what prv_process() did before:
+// store the line, walk all of it when the newline arrives, then memset() the
+// whole RX buffer. Besides the average, the cost of the newline on its own is
+// reported: that's where the old tokenizer did all its work, and the time
+// the receive path is blocked. Then the whole path, shell_receive_char() with
+// echo and dispatch to a no-op command, in interactive and in machine mode.
+// The old tokenizer knows nothing of quotes and splits the quoted line at
+// every space; it's only there for its cost.
+//
+// On x86 the unit is TSC ticks, which run at a fixed rate close to the
+// nominal clock rather than the core's actual cycles. Elsewhere it's ns.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycles"
+static uint64_t prv_cycles(void) {
+  return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static uint64_t prv_cycles(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+#define BENCH_NUM_LINES 200000
+#define BENCH_OLD_RX_BUFFER_SIZE 256
+
+static volatile int s_sink;
+
+static int prv_cmd(int argc, char *argv[]) {
+  s_sink += argc;
+  return 0;
+}
+
+static const sShellCommand s_shell_commands[] = {
+  {"hello", prv_cmd, ""},
+  {"kv_write", prv_cmd, ""},
+};
+
+const sShellCommand *const g_shell_commands = s_shell_commands;
+const size_t g_num_shell_commands = sizeof(s_shell_commands) / sizeof(s_shell_commands[0]);
+
+static int prv_send_char(char c) {
+  return 1;
+}
+
+typedef struct {
+  const char *name;
+  const char *line;
+} sBenchLine;
+
+static const sBenchLine s_lines[] = {
+  { "short", "hello\n" },
+  { "args", "kv_write wifi_ssid my_network\n" },
+  { "quoted", "kv_write greeting \"hello there, \\\"friend\\\"\"\n" },
+  { "long", "kv_write cert "
+            "MIIBszCCAVmgAwIBAgIUQm9vdHN0cmFwIGNlcnRpZmljYXRlIGZvciB0aGUgZGV2aWNlMAoGCCqGSM49"
+            "BAMCMC8xLTArBgNVBAMMJGJvb3RzdHJhcC5leGFtcGxlLmNvbSBkZXZpY2UgdGVzdCBDQTAeFw0yMDAx\n" },
+};
+#define BENCH_NUM_LINE_KINDS (sizeof(s_lines) / sizeof(s_lines[0]))
+
+//! The tokenizer prv_process() used to run, kept to compare against
+static char s_old_rx_buffer[BENCH_OLD_RX_BUFFER_SIZE];
+static size_t s_old_rx_size;
+
+static void prv_old_receive_char(char c) {
+  s_old_rx_buffer[s_old_rx_size++] = c;
+  if (c != '\n' && s_old_rx_size < BENCH_OLD_RX_BUFFER_SIZE) {
+    return;
+  }
+
+  char *argv[16] = {0};
+  int argc = 0;
+  char *next_arg = NULL;
+  for (size_t i = 0; i < s_old_rx_size && argc < 16; ++i) {
+    char *const p = &s_old_rx_buffer[i];
+    if (*p == ' ' || *p == '\n' || i == s_old_rx_size - 1) {
+      *p = '\0';
+      if (next_arg) {
+        argv[argc++] = next_arg;
+        next_arg = NULL;
+      }
+    } else if (!next_arg) {
+      next_arg = p;
+    }
+  }
+  s_sink += argc + (argv[0] != NULL);
+  memset(s_old_rx_buffer, 0, sizeof(s_old_rx_buffer));
+  s_old_rx_size = 0;
+}
+
+static char s_arg_buffer[SHELL_RX_BUFFER_SIZE + 1];
+static sShellTokenizer s_tokenizer;
+
+static void prv_new_receive_char(char c) {
+  if (c != '\n') {
+    shell_tokenizer_feed(&s_tokenizer, c);
+    return;
+  }
+  s_sink += shell_tokenizer_finish(&s_tokenizer);
+  shell_tokenizer_reset(&s_tokenizer);
+}
+
+//! Feeds `data` to `receive` BENCH_NUM_LINES / 10 times over and returns the
+//! cost per char
+static double prv_per_char(void (*receive)(char c), const char *data, size_t len) {
+  const size_t reps = BENCH_NUM_LINES / 10;
+  const uint64_t start = prv_cycles();
+  for (size_t r = 0; r < reps; r++) {
+    for (size_t i = 0; i < len; i++) {
+      receive(data[i]);
+    }
+  }
+  return (double)(prv_cycles() - start) / (double)(reps * len);
+}
+
+//! Median cost of the newline, with the rest of the line fed untimed
+static double prv_newline_cost(void (*receive)(char c), const char *line, size_t len) {
+  static uint64_t s_costs[BENCH_NUM_LINES / 10];
+  const size_t reps = BENCH_NUM_LINES / 10;
+  for (size_t r = 0; r < reps; r++) {
+    for (size_t i = 0; i + 1 < len; i++) {
+      receive(line[i]);
+    }
+    const uint64_t start = prv_cycles();
+    receive(line[len - 1]);
+    s_costs[r] = prv_cycles() - start;
+  }
+  // Partial selection sort is plenty for the median
+  for (size_t i = 0; i <= reps / 2; i++) {
+    size_t min = i;
+    for (size_t j = i + 1; j < reps; j++) {
+      if (s_costs[j] < s_costs[min]) {
+        min = j;
+      }
+    }
+    const uint64_t tmp = s_costs[i];
+    s_costs[i] = s_costs[min];
+    s_costs[min] = tmp;
+  }
+  return (double)s_costs[reps / 2];
+}
+
+static void prv_shell_receive_char(char c) {
+  shell_receive_char(c);
+}
+
+TEST_GROUP(BenchShellTokenizer) {
+  void setup() {
+    shell_tokenizer_init(&s_tokenizer, s_arg_buffer, sizeof(s_arg_buffer));
+    s_old_rx_size = 0;
+  }
+  void teardown() {}
+};
+
+TEST(BenchShellTokenizer, PerChar) {
+  printf("\nshell tokenizer, " BENCH_UNIT " per received char\n");
+  printf("  %-7s %5s %7s %7s %11s %11s %12s %8s\n", "line", "chars", "old", "new",
+         "old at \\n", "new at \\n", "interactive", "machine");
+  for (size_t k = 0; k < BENCH_NUM_LINE_KINDS; k++) {
+    // Ten copies at a time, so the loop overhead is small
+    static char s_data[10 * 256];
+    static char s_frames[10 * 256];
+    const char *line = s_lines[k].line;
+    const size_t line_len = strlen(line);
+    size_t data_len = 0;
+    size_t frames_len = 0;
+    for (size_t i = 0; i < 10; i++) {
+      memcpy(&s_data[data_len], line, line_len);
+      data_len += line_len;
+
+      const size_t cmd_len = line_len - 1;
+      const char header[SHELL_FRAME_REQUEST_HEADER_LEN] = {
+        (char)SHELL_FRAME_SYNC, (char)i, 0, (char)cmd_len, 0,
+      };
+      memcpy(&s_frames[frames_len], header, sizeof(header));
+      memcpy(&s_frames[frames_len + sizeof(header)], line, cmd_len);
+      frames_len += sizeof(header) + cmd_len;
+    }
+
+    const double old_cost = prv_per_char(prv_old_receive_char, s_data, data_len);
+    const double new_cost = prv_per_char(prv_new_receive_char, s_data, data_len);
+    const double old_newline = prv_newline_cost(prv_old_receive_char, line, line_len);
+    const double new_newline = prv_newline_cost(prv_new_receive_char, line, line_len);
+
+    sShellImpl impl = { prv_send_char };
+    shell_boot(&impl);
+    const double interactive = prv_per_char(prv_shell_receive_char, s_data, data_len);
+    shell_set_mode(kShellMode_Machine);
+    const double machine = prv_per_char(prv_shell_receive_char, s_frames, frames_len);
+
+    printf("  %-7s %5u %7.1f %7.1f %11.0f %11.0f %12.1f %8.1f\n", s_lines[k].name,
+           (unsigned)line_len, old_cost, new_cost, old_newline, new_newline, interactive,
+           machine);
+  }
+  // Nothing is asserted: the costs are timings, which vary from host to host
+}
@@ -0,0 +1,560 @@
+#include "CppUTest/TestHarness.h"
+#include "CppUTestExt/MockSupport.h"
+
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+  #include "shell/shell.h"
+}
+
+static char s_output[1024];
+static size_t s_output_len;
+
+static int prv_send_char(char c) {
+  if (s_output_len < sizeof(s_output) - 1) {
+    s_output[s_output_len++] = c;
+  }
+  return 1;
+}
+
+static void prv_clear_output(void) {
+  memset(s_output, 0, sizeof(s_output));
+  s_output_len = 0;
+}
+
+static void prv_receive_str(const char *str) {
+  for (const char *c = str; *c != '\0'; ++c) {
+    shell_receive_char(*c);
+  }
+}
+
+static int prv_cmd(int argc, char *argv[]) {
+  mock().actualCall(__func__).withStringParameter("argv0", argv[0]).withIntParameter("argc", argc);
+  return 0;
+}
+
+static const sShellCommand s_shell_commands[] = {
+  {"fwup-abort", prv_cmd, ""},
+  {"fwup-finish", prv_cmd, ""},
+  {"fwup-start", prv_cmd, ""},
+  {"hello", prv_cmd, ""},
+  {"help", shell_help_handler, ""},
+  {"kv_write", prv_cmd, ""},
+  {"mode", shell_mode_handler, ""},
+};
+
+const sShellCommand *const g_shell_commands = s_shell_commands;
+const size_t g_num_shell_commands = sizeof(s_shell_commands) / sizeof(s_shell_commands[0]);
+
+TEST_GROUP(TestShell) {
+  void setup() {
+    sShellImpl impl = { prv_send_char };
+    shell_boot(&impl);
+    prv_clear_output();
+  }
+
+  void teardown() {
+    mock().checkExpectations();
+    mock().clear();
+  }
+};
+
+TEST(TestShell, FindPrefix) {
+  size_t first;
+  LONGS_EQUAL(3, shell_find_prefix(s_shell_commands, g_num_shell_commands, "fwup-", 5, &first));
+  LONGS_EQUAL(0, first);
+  LONGS_EQUAL(2, shell_find_prefix(s_shell_commands, g_num_shell_commands, "hel", 3, &first));
+  LONGS_EQUAL(3, first);
+  LONGS_EQUAL(1, shell_find_prefix(s_shell_commands, g_num_shell_commands, "kv_write", 8, &first));
+  LONGS_EQUAL(5, first);
+  LONGS_EQUAL(0, shell_find_prefix(s_shell_commands, g_num_shell_commands, "hex", 3, &first));
+  LONGS_EQUAL(0, shell_find_prefix(s_shell_commands, g_num_shell_commands, "zzz", 3, &first));
+  LONGS_EQUAL(0, shell_find_prefix(s_shell_commands, 0, "h", 1, &first));
+}
+
+TEST(TestShell, FindCommand) {
+  size_t num_matches;
+  POINTERS_EQUAL(&s_shell_commands[4],
+                 shell_find_command(s_shell_commands, g_num_shell_commands, "help", &num_matches));
+  // Unique prefixes
+  POINTERS_EQUAL(&s_shell_commands[5],
+                 shell_find_command(s_shell_commands, g_num_shell_commands, "kv", &num_matches));
+  POINTERS_EQUAL(&s_shell_commands[2], shell_find_command(s_shell_commands, g_num_shell_commands,
+                                                          "fwup-s", &num_matches));
+  // Ambiguous and unknown
+  POINTERS_EQUAL(NULL,
+                 shell_find_command(s_shell_commands, g_num_shell_commands, "fwup", &num_matches));
+  LONGS_EQUAL(3, num_matches);
+  POINTERS_EQUAL(NULL,
+                 shell_find_command(s_shell_commands, g_num_shell_commands, "nope", &num_matches));
+  LONGS_EQUAL(0, num_matches);
+  POINTERS_EQUAL(NULL,
+                 shell_find_command(s_shell_commands, g_num_shell_commands, "", &num_matches));
+  LONGS_EQUAL(0, num_matches);
+}
+
+TEST(TestShell, RunsCommand) {
+  mock().expectOneCall("prv_cmd")
+      .withStringParameter("argv0", "hello")
+      .withIntParameter("argc", 3);
+  prv_receive_str("hello a b\n");
+}
+
+TEST(TestShell, RunsUniquePrefix) {
+  mock().expectOneCall("prv_cmd")
+      .withStringParameter("argv0", "kv")
+      .withIntParameter("argc", 3);
+  prv_receive_str("kv key val\n");
+}
+
+TEST(TestShell, AmbiguousPrefix) {
+  prv_receive_str("fwup\n");
+  STRCMP_EQUAL("fwup\r\nAmbiguous command: fwup\r\nfwup-abort fwup-finish fwup-start\r\nshell> ",
+               s_output);
+}
+
+TEST(TestShell, UnknownCommand) {
+  prv_receive_str("nope\n");
+  STRCMP_EQUAL("nope\r\nUnknown command: nope\r\nType 'help' to list all commands\r\nshell> ",
+               s_output);
+}
+
+TEST(TestShell, EmptyCommandName) {
+  prv_receive_str("\"\" a\n");
+  STRCMP_EQUAL("\"\" a\r\nUnknown command: \r\nType 'help' to list all commands\r\nshell> ",
+               s_output);
+}
+
+TEST(TestShell, TabCompletesUniqueMatch) {
+  prv_receive_str("kv\t");
+  STRCMP_EQUAL("kv_write ", s_output);
+
+  mock().expectOneCall("prv_cmd")
+      .withStringParameter("argv0", "kv_write")
+      .withIntParameter("argc", 2);
+  prv_receive_str("k\n");
+}
+
+TEST(TestShell, TabExtendsCommonPrefix) {
+  prv_receive_str("fw\t");
+  STRCMP_EQUAL("fwup-", s_output);
+
+  // Nothing more to add, so the matches are listed and the line redrawn
+  prv_clear_output();
+  prv_receive_str("\t");
+  STRCMP_EQUAL("\r\nfwup-abort fwup-finish fwup-start\r\nshell> fwup-", s_output);
+
+  mock().expectOneCall("prv_cmd")
+      .withStringParameter("argv0", "fwup-start")
+      .withIntParameter("argc", 1);
+  prv_receive_str("s\t\n");
+}
+
+TEST(TestShell, TabOnlyCompletesCommandName) {
+  prv_receive_str("kv_write fw\t");
+  STRCMP_EQUAL("kv_write fw", s_output);
+}
+
+//! What each send_buf call handed over, one entry per call
+static char s_sends[16][256];
+static size_t s_num_sends;
+//! How many bytes the next send_buf call takes, 0 for all of them
+static size_t s_send_limit;
+//! Set while the transport takes nothing at all
+static bool s_send_busy;
+
+static int prv_send_buf(const char *buf, size_t len) {
+  if (s_send_busy) {
+    return 0;
+  }
+  if (s_send_limit != 0 && len > s_send_limit) {
+    len = s_send_limit;
+  }
+  if (s_num_sends < sizeof(s_sends) / sizeof(s_sends[0])) {
+    memcpy(s_sends[s_num_sends], buf, len);
+    s_sends[s_num_sends][len] = '\0';
+    s_num_sends++;
+  }
+  for (size_t i = 0; i < len; i++) {
+    prv_send_char(buf[i]);
+  }
+  return (int)len;
+}
+
+TEST_GROUP(TestShellBuffered) {
+  void setup() {
+    sShellImpl impl = { prv_send_char, prv_send_buf };
+    shell_boot(&impl);
+    prv_clear_output();
+    memset(s_sends, 0, sizeof(s_sends));
+    s_num_sends = 0;
+    s_send_limit = 0;
+    s_send_busy = false;
+  }
+
+  void teardown() {
+    mock().checkExpectations();
+    mock().clear();
+  }
+};
+
+TEST(TestShellBuffered, EchoGoesOutPerChar) {
+  prv_receive_str("he");
+  LONGS_EQUAL(2, s_num_sends);
+  STRCMP_EQUAL("h", s_sends[0]);
+  STRCMP_EQUAL("e", s_sends[1]);
+}
+
+TEST(TestShellBuffered, OutputIsSentALineAtATime) {
+  prv_receive_str("help\n");
+  STRCMP_EQUAL("help\r\nfwup-abort: \r\nfwup-finish: \r\nfwup-start: \r\nhello: \r\n"
+               "help: \r\nkv_write: \r\nmode: \r\nshell> ", s_output);
+  // One call per echoed char, then one per line and the prompt
+  LONGS_EQUAL(4 + 8 + 1, s_num_sends);
+  STRCMP_EQUAL("\r\n", s_sends[4]);
+  STRCMP_EQUAL("fwup-abort: \r\n", s_sends[5]);
+  STRCMP_EQUAL("shell> ", s_sends[12]);
+}
+
+TEST(TestShellBuffered, FlushOnDemand) {
+  shell_put_line("done");
+  LONGS_EQUAL(1, s_num_sends);
+  STRCMP_EQUAL("done\r\n", s_sends[0]);
+
+  // No newline, so it waits for shell_flush()
+  prv_clear_output();
+  mock().expectOneCall("prv_cmd").withStringParameter("argv0", "hello").withIntParameter("argc", 1);
+  prv_receive_str("hello\n");
+  LONGS_EQUAL(1 + 5 + 2, s_num_sends);
+  STRCMP_EQUAL("shell> ", s_sends[7]);
+  shell_flush();
+  LONGS_EQUAL(1 + 5 + 2, s_num_sends);
+}
+
+TEST(TestShellBuffered, PartialSendsKeepTheRest) {
+  s_send_limit = 3;
+  shell_put_line("0123456789");
+  STRCMP_EQUAL("0123456789\r\n", s_output);
+  LONGS_EQUAL(4, s_num_sends);
+  STRCMP_EQUAL("012", s_sends[0]);
+  STRCMP_EQUAL("9\r\n", s_sends[3]);
+}
+
+TEST(TestShellBuffered, LongLinesFlushWhenFull) {
+  char line[SHELL_TX_BUFFER_SIZE + 20];
+  memset(line, 'x', sizeof(line) - 1);
+  line[sizeof(line) - 1] = '\0';
+  shell_put_line(line);
+  // The boot prompt left the ring's head part way along, so the full buffer
+  // goes out as the pieces before and after the wrap, then the rest of the line
+  LONGS_EQUAL(3, s_num_sends);
+  LONGS_EQUAL(SHELL_TX_BUFFER_SIZE, strlen(s_sends[0]) + strlen(s_sends[1]));
+  STRCMP_EQUAL("xxxxxxxxxxxxxxxxxxx\r\n", s_sends[2]);
+  LONGS_EQUAL(sizeof(line) + 1, s_output_len);
+}
+
+TEST(TestShellBuffered, FullBufferFallsBackToSendChar) {
+  shell_flush();
+  prv_clear_output();
+  char line[SHELL_TX_BUFFER_SIZE + 20];
+  memset(line, 'x', sizeof(line) - 1);
+  line[sizeof(line) - 1] = '\0';
+  line[0] = 'a';
+  line[sizeof(line) - 2] = 'z';
+
+  // What doesn't fit goes out through send_char, oldest first, and the rest
+  // follows once send_buf takes it, so nothing is lost or reordered
+  s_send_busy = true;
+  shell_put_line(line);
+  LONGS_EQUAL(0, s_num_sends);
+  LONGS_EQUAL(sizeof(line) + 1 - SHELL_TX_BUFFER_SIZE, s_output_len);
+  s_send_busy = false;
+  shell_flush();
+
+  char expected[sizeof(line) + 2];
+  snprintf(expected, sizeof(expected), "%s\r\n", line);
+  STRCMP_EQUAL(expected, s_output);
+  LONGS_EQUAL(0, shell_tx_dropped());
+}
+
+TEST(TestShellBuffered, FullBufferCountsDropsWithoutSendChar) {
+  sShellImpl impl = { NULL, prv_send_buf };
+  shell_boot(&impl);
+  shell_flush();
+  prv_clear_output();
+
+  s_send_busy = true;
+  char line[SHELL_TX_BUFFER_SIZE + 20];
+  memset(line, 'x', sizeof(line) - 1);
+  line[sizeof(line) - 1] = '\0';
+  shell_put_line(line);
+  LONGS_EQUAL(sizeof(line) + 1 - SHELL_TX_BUFFER_SIZE, shell_tx_dropped());
+}
+
+static void prv_receive_frame(uint16_t seq, const char *line) {
+  const size_t len = strlen(line);
+  const char header[SHELL_FRAME_REQUEST_HEADER_LEN] = {
+    (char)SHELL_FRAME_SYNC, (char)(seq & 0xff), (char)(seq >> 8),
+    (char)(len & 0xff), (char)(len >> 8),
+  };
+  for (size_t i = 0; i < sizeof(header); i++) {
+    shell_receive_char(header[i]);
+  }
+  prv_receive_str(line);
+}
+
+//! Checks the response frame at `*off` in the output and moves past it
+static void prv_check_response(size_t *off, uint16_t seq, eShellStatus status,
+                               const char *output) {
+  const uint8_t *frame = (const uint8_t *)&s_output[*off];
+  CHECK(*off + SHELL_FRAME_RESPONSE_HEADER_LEN <= s_output_len);
+  LONGS_EQUAL(SHELL_FRAME_SYNC, frame[0]);
+  LONGS_EQUAL(seq, frame[1] | (frame[2] << 8));
+  LONGS_EQUAL(status, frame[3]);
+  const size_t len = frame[4] | (frame[5] << 8);
+  LONGS_EQUAL(strlen(output), len);
+  MEMCMP_EQUAL(output, &frame[SHELL_FRAME_RESPONSE_HEADER_LEN], len);
+  *off += SHELL_FRAME_RESPONSE_HEADER_LEN + len;
+}
+
+TEST_GROUP(TestShellMachine) {
+  void setup() {
+    sShellImpl impl = { prv_send_char };
+    shell_boot(&impl);
+    shell_set_mode(kShellMode_Machine);
+    prv_clear_output();
+  }
+
+  void teardown() {
+    mock().checkExpectations();
+    mock().clear();
+  }
+};
+
+TEST(TestShellMachine, SwitchesWithModeCommand) {
+  shell_set_mode(kShellMode_Interactive);
+  STRCMP_EQUAL("\r\nshell> ", s_output);
+
+  // No prompt once in machine mode
+  prv_clear_output();
+  prv_receive_str("mode machine\n");
+  STRCMP_EQUAL("mode machine\r\n", s_output);
+
+  // The response is framed, then the prompt is back
+  prv_clear_output();
+  prv_receive_frame(1, "mode interactive");
+  size_t off = 0;
+  prv_check_response(&off, 1, kShellStatus_Ok, "");
+  STRCMP_EQUAL("\r\nshell> ", &s_output[off]);
+}
+
+TEST(TestShellMachine, RunsFramesWithoutEcho) {
+  mock().expectOneCall("prv_cmd")
+      .withStringParameter("argv0", "hello")
+      .withIntParameter("argc", 3);
+  prv_receive_frame(0x1234, "hello a b");
+  size_t off = 0;
+  prv_check_response(&off, 0x1234, kShellStatus_Ok, "");
+  LONGS_EQUAL(off, s_output_len);
+}
+
+TEST(TestShellMachine, StatusCodes) {
+  prv_receive_frame(1, "nope");
+  prv_receive_frame(2, "fwup");
+  prv_receive_frame(3, "mode");
+  prv_receive_frame(4, "");
+  // SHELL_FRAME_MAX_OUTPUT_LEN is 32 in this build, so the messages are split
+  size_t off = 0;
+  prv_check_response(&off, 1, kShellStatus_More, "Unknown command: nope\nType 'help");
+  prv_check_response(&off, 1, kShellStatus_UnknownCommand, "' to list all commands\n");
+  prv_check_response(&off, 2, kShellStatus_More, "Ambiguous command: fwup\nfwup-abo");
+  prv_check_response(&off, 2, kShellStatus_AmbiguousCommand, "rt fwup-finish fwup-start\n");
+  prv_check_response(&off, 3, kShellStatus_CommandFailed, "Usage: mode machine|interactive\n");
+  prv_check_response(&off, 4, kShellStatus_Ok, "");
+  LONGS_EQUAL(off, s_output_len);
+}
+
+TEST(TestShellMachine, PipelinedFramesAnsweredInOrder) {
+  mock().expectNCalls(3, "prv_cmd").ignoreOtherParameters();
+  // All three arrive before the shell answers any of them
+  char frames[64];
+  size_t len = 0;
+  for (uint16_t seq = 10; seq < 13; seq++) {
+    const char header[] = { (char)SHELL_FRAME_SYNC, (char)seq, 0, 5, 0 };
+    memcpy(&frames[len], header, sizeof(header));
+    memcpy(&frames[len + sizeof(header)], "hello", 5);
+    len += sizeof(header) + 5;
+  }
+  for (size_t i = 0; i < len; i++) {
+    shell_receive_char(frames[i]);
+  }
+  size_t off = 0;
+  prv_check_response(&off, 10, kShellStatus_Ok, "");
+  prv_check_response(&off, 11, kShellStatus_Ok, "");
+  prv_check_response(&off, 12, kShellStatus_Ok, "");
+}
+
+TEST(TestShellMachine, LongOutputIsSplit) {
+  prv_receive_frame(5, "help");
+  size_t off = 0;
+  prv_check_response(&off, 5, kShellStatus_More, "fwup-abort: \nfwup-finish: \nfwup-");
+  prv_check_response(&off, 5, kShellStatus_More, "start: \nhello: \nhelp: \nkv_write:");
+  prv_check_response(&off, 5, kShellStatus_Ok, " \nmode: \n");
+  LONGS_EQUAL(off, s_output_len);
+}
+
+TEST(TestShellMachine, SkipsGarbageAndTooLongLines) {
+  prv_receive_str("junk\n");
+  LONGS_EQUAL(0, s_output_len);
+
+  static char line[SHELL_RX_BUFFER_SIZE + 10];
+  memset(line, 'x', sizeof(line) - 1);
+  prv_receive_frame(6, line);
+  mock().expectOneCall("prv_cmd").ignoreOtherParameters();
+  prv_receive_frame(7, "hello");
+  size_t off = 0;
+  prv_check_response(&off, 6, kShellStatus_TooLong, "");
+  prv_check_response(&off, 7, kShellStatus_Ok, "");
+}
+
+static char s_arg_buffer[64];
+static sShellTokenizer s_tokenizer;
+
+static int prv_tokenize(const char *line) {
+  shell_tokenizer_reset(&s_tokenizer);
+  for (const char *c = line; *c != '\0'; ++c) {
+    shell_tokenizer_feed(&s_tokenizer, *c);
+  }
+  return shell_tokenizer_finish(&s_tokenizer);
+}
+
+TEST_GROUP(TestShellTokenizer) {
+  void setup() {
+    memset(s_arg_buffer, 'x', sizeof(s_arg_buffer));
+    shell_tokenizer_init(&s_tokenizer, s_arg_buffer, sizeof(s_arg_buffer));
+  }
+
+  void teardown() {
+    mock().checkExpectations();
+    mock().clear();
+  }
+};
+
+TEST(TestShellTokenizer, SplitsOnWhitespace) {
+  LONGS_EQUAL(3, prv_tokenize("  kv_write \t key  val "));
+  STRCMP_EQUAL("kv_write", s_tokenizer.argv[0]);
+  STRCMP_EQUAL("key", s_tokenizer.argv[1]);
+  STRCMP_EQUAL("val", s_tokenizer.argv[2]);
+  POINTERS_EQUAL(NULL, s_tokenizer.argv[3]);
+  // Written in place, one argument after the other
+  POINTERS_EQUAL(s_arg_buffer, s_tokenizer.argv[0]);
+  POINTERS_EQUAL(&s_arg_buffer[9], s_tokenizer.argv[1]);
+
+  LONGS_EQUAL(0, prv_tokenize(""));
+  LONGS_EQUAL(0, prv_tokenize("   "));
+}
+
+TEST(TestShellTokenizer, Quotes) {
+  LONGS_EQUAL(4, prv_tokenize("kv_write \"my key\" 'a \"b\" c' \"\""));
+  STRCMP_EQUAL("my key", s_tokenizer.argv[1]);
+  STRCMP_EQUAL("a \"b\" c", s_tokenizer.argv[2]);
+  STRCMP_EQUAL("", s_tokenizer.argv[3]);
+
+  // Quotes can open part way through an argument, and are closed at the end
+  LONGS_EQUAL(2, prv_tokenize("key=\"a b\"c 'open"));
+  STRCMP_EQUAL("key=a bc", s_tokenizer.argv[0]);
+  STRCMP_EQUAL("open", s_tokenizer.argv[1]);
+}
+
+TEST(TestShellTokenizer, Escapes) {
+  LONGS_EQUAL(3, prv_tokenize("a\\ b \"say \\\"hi\\\"\" 'c:\\dir'"));
+  STRCMP_EQUAL("a b", s_tokenizer.argv[0]);
+  STRCMP_EQUAL("say \"hi\"", s_tokenizer.argv[1]);
+  // Single quotes keep backslashes
+  STRCMP_EQUAL("c:\\dir", s_tokenizer.argv[2]);
+
+  LONGS_EQUAL(1, prv_tokenize("\\"));
+  STRCMP_EQUAL("", s_tokenizer.argv[0]);
+}
+
+TEST(TestShellTokenizer, Limits) {
+  // Arguments past SHELL_MAX_ARGS are dropped
+  char line[SHELL_MAX_ARGS * 2 + 8] = "";
+  for (int i = 0; i < SHELL_MAX_ARGS + 2; i++) {
+    strcat(line, "a ");
+  }
+  LONGS_EQUAL(SHELL_MAX_ARGS, prv_tokenize(line));
+  POINTERS_EQUAL(NULL, s_tokenizer.argv[SHELL_MAX_ARGS]);
+
+  // As are chars that don't fit, leaving room for the terminator
+  char long_arg[sizeof(s_arg_buffer) + 8];
+  memset(long_arg, 'y', sizeof(long_arg) - 1);
+  long_arg[sizeof(long_arg) - 1] = '\0';
+  LONGS_EQUAL(1, prv_tokenize(long_arg));
+  LONGS_EQUAL(sizeof(s_arg_buffer) - 1, strlen(s_tokenizer.argv[0]));
+}
+
+TEST(TestShellTokenizer, SmallBuffer) {
+  // Only the first 4 bytes are the tokenizer's, the rest show any overrun
+  shell_tokenizer_init(&s_tokenizer, s_arg_buffer, 4);
+  LONGS_EQUAL(1, prv_tokenize("abcdef g h"));
+  STRCMP_EQUAL("abc", s_tokenizer.argv[0]);
+  POINTERS_EQUAL(NULL, s_tokenizer.argv[1]);
+  BYTES_EQUAL('x', s_arg_buffer[4]);
+
+  // An argument which fills the buffer exactly is still terminated
+  LONGS_EQUAL(2, prv_tokenize("a b c"));
+  STRCMP_EQUAL("a", s_tokenizer.argv[0]);
+  STRCMP_EQUAL("b", s_tokenizer.argv[1]);
+  POINTERS_EQUAL(NULL, s_tokenizer.argv[2]);
+  BYTES_EQUAL('x', s_arg_buffer[4]);
+
+  // No argument at all fits in a single byte
+  memset(s_arg_buffer, 'x', sizeof(s_arg_buffer));
+  shell_tokenizer_init(&s_tokenizer, s_arg_buffer, 1);
+  LONGS_EQUAL(0, prv_tokenize("a b"));
+  BYTES_EQUAL('\0', s_arg_buffer[0]);
+  BYTES_EQUAL('x', s_arg_buffer[1]);
+}
+
+TEST_GROUP(TestShellQuoting) {
+  void setup() {
+    sShellImpl impl = { prv_send_char };
+    shell_boot(&impl);
+    prv_clear_output();
+  }
+
+  void teardown() {
+    mock().checkExpectations();
+    mock().clear();
+  }
+};
+
+TEST(TestShellQuoting, QuotedArguments) {
+  mock().expectOneCall("prv_cmd")
+      .withStringParameter("argv0", "kv_write")
+      .withIntParameter("argc", 3);
+  prv_receive_str("kv_write key \"a value with spaces\"\n");
+}
+
+TEST(TestShellQuoting, NewlineEndsOpenQuote) {
+  mock().expectOneCall("prv_cmd")
+      .withStringParameter("argv0", "hello")
+      .withIntParameter("argc", 2);
+  prv_receive_str("hello \"a b\n");
+}
+
+TEST(TestShellQuoting, BackspaceAcrossQuotes) {
+  mock().expectOneCall("prv_cmd")
+      .withStringParameter("argv0", "hello")
+      .withIntParameter("argc", 2);
+  // The closing quote, the space and the 'c' are taken back, so the quote
+  // runs on over " b"
+  prv_receive_str("hellp\bo \"a\" c\b\b\b b\"\n");
+}
+
+TEST(TestShellQuoting, NoCompletionInsideQuotes) {
+  prv_receive_str("\"he\t");
+  STRCMP_EQUAL("\"he", s_output);
+}
@@ -1,8 +1,24 @@
+#include <stdint.h>
+
 typedef enum {
   kSettingsFileRead,
   kSettingsFileWrite,
   kSettingsFileDelete,
+  kSettingsCacheHit,
+  kSettingsCacheMiss,
+  kSettingsFilterNegative,
+  kSettingsFilterFalsePositive,
+  kSettingsFileWriteSkipped,
+  kSettingsWriteQueued,
+  kSettingsWriteCoalesced,
+  kSettingsWriteQueueFull,
+  //! Gauges, reported with analytics_set()
+  kSettingsWriteQueueDepth,
+  kSettingsWriteQueueFlushLatencyUs,
   // Other items to instrument
 } eAnalyticsKey;
 
 void analytics_inc(eAnalyticsKey key);
+
+//! Records the latest value of a gauge
+void analytics_set(eAnalyticsKey key, uint32_t value);
@@ -0,0 +1,230 @@
+#include "kv_compress.h"
+
+#include <string.h>
+
+#define KV_COMPRESS_EMPTY UINT32_MAX
+
+#define KV_COMPRESS_TOKEN_MATCH (0x80)
+
+typedef enum {
+  kDecodeState_Token,
+  kDecodeState_Literals,
+  kDecodeState_MatchOffset,
+} eDecodeState;
+
+//
+// Encoder
+//
+// Greedy: every position is hashed on its first KV_COMPRESS_MIN_MATCH bytes
+// and only the most recent position with the same hash is tried. That misses
+// some matches a chained search would find, but needs no more RAM than the
+// table and runs in linear time.
+//
+
+static uint32_t prv_hash(const uint8_t *p) {
+  const uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+  return (v * 2654435761u) >> (32 - KV_COMPRESS_HASH_BITS);
+}
+
+static void prv_flush(sKvCompressor *c) {
+  if (c->ok && c->cb && c->out_len > 0) {
+    c->ok = c->cb(c->out, c->out_len, c->ctx);
+  }
+  c->out_len = 0;
+}
+
+static void prv_put(sKvCompressor *c, const void *data, uint32_t len) {
+  if (!c->ok) {
+    return;
+  }
+  if (c->total + len > c->max_len) {
+    c->ok = false;
+    return;
+  }
+  c->total += len;
+  if (!c->cb) {
+    return;
+  }
+
+  const uint8_t *p = data;
+  while (len > 0) {
+    const uint32_t space = sizeof(c->out) - c->out_len;
+    const uint32_t n = len < space ? len : space;
+    memcpy(&c->out[c->out_len], p, n);
+    c->out_len += n;
+    p += n;
+    len -= n;
+    if (c->out_len == sizeof(c->out)) {
+      prv_flush(c);
+    }
+  }
+}
+
+static void prv_put_literals(sKvCompressor *c, const uint8_t *p, uint32_t len) {
+  while (len > 0) {
+    const uint32_t n = len < KV_COMPRESS_MAX_LITERALS ? len : KV_COMPRESS_MAX_LITERALS;
+    const uint8_t token = (uint8_t)(n - 1);
+    prv_put(c, &token, 1);
+    prv_put(c, p, n);
+    p += n;
+    len -= n;
+  }
+}
+
+static void prv_put_match(sKvCompressor *c, uint32_t dist, uint32_t len) {
+  const uint32_t off = dist - 1;
+  const uint8_t token[2] = {
+    (uint8_t)(KV_COMPRESS_TOKEN_MATCH | ((len - KV_COMPRESS_MIN_MATCH) << 1) | (off >> 8)),
+    (uint8_t)(off & 0xff),
+  };
+  prv_put(c, token, sizeof(token));
+}
+
+uint32_t kv_compress(sKvCompressor *compressor, const void *in, uint32_t len, uint32_t max_len,
+                     KvCompressOutputCallback cb, void *ctx) {
+  sKvCompressor *c = compressor;
+  const uint8_t *src = in;
+
+  memset(c->head, 0xff, sizeof(c->head));
+  c->out_len = 0;
+  c->total = 0;
+  c->max_len = max_len;
+  c->cb = cb;
+  c->ctx = ctx;
+  c->ok = true;
+
+  uint32_t lit_start = 0;
+  uint32_t i = 0;
+  while (c->ok && i + KV_COMPRESS_MIN_MATCH <= len) {
+    const uint32_t h = prv_hash(&src[i]);
+    const uint32_t cand = c->head[h];
+    c->head[h] = i;
+    if (cand == KV_COMPRESS_EMPTY || i - cand > KV_COMPRESS_WINDOW_SIZE ||
+        memcmp(&src[cand], &src[i], KV_COMPRESS_MIN_MATCH) != 0) {
+      i++;
+      continue;
+    }
+
+    uint32_t match_len = KV_COMPRESS_MIN_MATCH;
+    while (i + match_len < len && match_len < KV_COMPRESS_MAX_MATCH &&
+           src[cand + match_len] == src[i + match_len]) {
+      match_len++;
+    }
+    prv_put_literals(c, &src[lit_start], i - lit_start);
+    prv_put_match(c, i - cand, match_len);
+
+    // Index the positions inside the match too, so later repeats find them
+    for (uint32_t j = i + 1; j < i + match_len && j + KV_COMPRESS_MIN_MATCH <= len; j++) {
+      c->head[prv_hash(&src[j])] = j;
+    }
+    i += match_len;
+    lit_start = i;
+  }
+  prv_put_literals(c, &src[lit_start], len - lit_start);
+  prv_flush(c);
+
+  return c->ok ? c->total : 0;
+}
+
+//
+// Decoder
+//
+// Output is written straight into the window, which doubles as the output
+// buffer: decoded bytes are handed to the callback once the window is full
+// and at the end of every kv_decompress_feed().
+//
+
+void kv_decompress_init(sKvDecompressor *decompressor) {
+  memset(decompressor, 0, sizeof(*decompressor));
+}
+
+static bool prv_emit(sKvDecompressor *d, KvCompressOutputCallback cb, void *ctx) {
+  while (d->emitted < d->total) {
+    const uint32_t start = d->emitted % KV_COMPRESS_WINDOW_SIZE;
+    const uint32_t pending = d->total - d->emitted;
+    const uint32_t to_wrap = KV_COMPRESS_WINDOW_SIZE - start;
+    const uint32_t n = pending < to_wrap ? pending : to_wrap;
+    d->emitted += n;
+    if (!cb(&d->window[start], n, ctx)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool prv_out_byte(sKvDecompressor *d, uint8_t b, KvCompressOutputCallback cb, void *ctx) {
+  // The slot about to be reused hasn't been handed out yet
+  if (d->total - d->emitted == KV_COMPRESS_WINDOW_SIZE && !prv_emit(d, cb, ctx)) {
+    return false;
+  }
+  d->window[d->total % KV_COMPRESS_WINDOW_SIZE] = b;
+  d->total++;
+  return true;
+}
+
+static bool prv_copy_match(sKvDecompressor *d, uint32_t dist, uint32_t len,
+                           KvCompressOutputCallback cb, void *ctx) {
+  if (dist > d->total) {
+    d->corrupt = true;
+    return false;
+  }
+  // Byte by byte, as a match may overlap the bytes it produces
+  for (uint32_t i = 0; i < len; i++) {
+    const uint8_t b = d->window[(d->total - dist) % KV_COMPRESS_WINDOW_SIZE];
+    if (!prv_out_byte(d, b, cb, ctx)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool kv_decompress_feed(sKvDecompressor *decompressor, const void *in, uint32_t len,
+                        KvCompressOutputCallback cb, void *ctx) {
+  sKvDecompressor *d = decompressor;
+  const uint8_t *src = in;
+  if (d->corrupt) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < len; i++) {
+    const uint8_t b = src[i];
+    bool ok = true;
+    switch (d->state) {
+      case kDecodeState_Token:
+        d->token = b;
+        if (b & KV_COMPRESS_TOKEN_MATCH) {
+          d->state = kDecodeState_MatchOffset;
+        } else {
+          d->remaining = (uint32_t)b + 1;
+          d->state = kDecodeState_Literals;
+        }
+        break;
+      case kDecodeState_Literals:
+        ok = prv_out_byte(d, b, cb, ctx);
+        if (--d->remaining == 0) {
+          d->state = kDecodeState_Token;
+        }
+        break;
+      case kDecodeState_MatchOffset: {
+        const uint32_t dist = ((((uint32_t)d->token & 0x1) << 8) | b) + 1;
+        const uint32_t match_len = ((d->token >> 1) & 0x1f) + KV_COMPRESS_MIN_MATCH;
+        d->state = kDecodeState_Token;
+        ok = prv_copy_match(d, dist, match_len, cb, ctx);
+        break;
+      }
+      default:
+        d->corrupt = true;
+        ok = false;
+        break;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+
+  return prv_emit(d, cb, ctx);
+}
+
+bool kv_decompress_finish(const sKvDecompressor *decompressor) {
+  return !decompressor->corrupt && decompressor->state == kDecodeState_Token;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+//! Small LZ77 codec for kv_store values, in the spirit of heatshrink and LZ4.
+//! The encoder needs the whole value in RAM, which kv_store_write() already
+//! has. The decoder is streaming and only keeps a window of recent output, so
+//! values far larger than RAM can be read back in pieces.
+//!
+//! The stream is a sequence of tokens:
+//!  - 0LLLLLLL: L + 1 literal bytes follow
+//!  - 1LLLLLOO OOOOOOOO: copy L + KV_COMPRESS_MIN_MATCH bytes starting O + 1
+//!    bytes back in the output
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KV_COMPRESS_WINDOW_SIZE (512)
+#define KV_COMPRESS_MIN_MATCH (3)
+#define KV_COMPRESS_MAX_MATCH (KV_COMPRESS_MIN_MATCH + 31)
+#define KV_COMPRESS_MAX_LITERALS (128)
+
+//! The encoder's match table has 2^KV_COMPRESS_HASH_BITS entries
+#ifndef KV_COMPRESS_HASH_BITS
+#define KV_COMPRESS_HASH_BITS (8)
+#endif
+
+#define KV_COMPRESS_OUT_CHUNK_SIZE (64)
+
+//! Receives the next piece of output. Return false to abort.
+typedef bool (*KvCompressOutputCallback)(const void *data, uint32_t len, void *ctx);
+
+//! Encoder scratch state, about 1 KiB with the default KV_COMPRESS_HASH_BITS
+typedef struct KvCompressor {
+  uint32_t head[1 << KV_COMPRESS_HASH_BITS];
+  uint8_t out[KV_COMPRESS_OUT_CHUNK_SIZE];
+  uint32_t out_len;
+  uint32_t total;
+  uint32_t max_len;
+  KvCompressOutputCallback cb;
+  void *ctx;
+  bool ok;
+} sKvCompressor;
+
+typedef struct KvDecompressor {
+  uint8_t window[KV_COMPRESS_WINDOW_SIZE];
+  //! Bytes decoded so far, and how many of those were handed to the callback
+  uint32_t total;
+  uint32_t emitted;
+  //! Token being decoded, and literals or match bytes it still has to produce
+  uint8_t token;
+  uint8_t state;
+  uint32_t remaining;
+  bool corrupt;
+} sKvDecompressor;
+
+//! Compresses `len` bytes from `in`, handing the output to `cb`. With `cb`
+//! NULL nothing is emitted, which sizes the output without writing it.
+//! Returns the compressed size, or 0 if it would exceed `max_len` bytes or
+//! `cb` aborted.
+uint32_t kv_compress(sKvCompressor *compressor, const void *in, uint32_t len, uint32_t max_len,
+                     KvCompressOutputCallback cb, void *ctx);
+
+void kv_decompress_init(sKvDecompressor *decompressor);
+
+//! Decodes the next `len` bytes of a stream, handing the output to `cb` in
+//! pieces of up to KV_COMPRESS_WINDOW_SIZE bytes. Returns false if the stream
+//! is corrupt or `cb` returned false.
+bool kv_decompress_feed(sKvDecompressor *decompressor, const void *in, uint32_t len,
+                        KvCompressOutputCallback cb, void *ctx);
+
+//! Returns true if the stream fed so far ended cleanly on a token boundary
+bool kv_decompress_finish(const sKvDecompressor *decompressor);
@@ -1,76 +1,1167 @@
 #include "kv_store.h"
+#include "kv_store_backend.h"
 #include "analytics/analytics.h"
 #include "mutex/mutex.h"
 
 #include "lfs.h"
-#include <stdio.h>
+#include <string.h>
 
-#define KV_DIR "/kv"
+//
+// Locking
+//
+// Writers take s_lock exclusively. Readers share it, so cache hits and filter
+// negatives run in parallel, and only serialize on the two pieces of state a
+// read can still touch:
+//  - s_cache_mutex guards the cache table (LRU ticks, read-miss inserts)
+//  - s_io_mutex guards the backend, as littlefs isn't reentrant
+//  - s_queue.mutex guards the async write queue
+// None of the inner mutexes is held while taking another.
+//
+// In async mode the worker also writes to flash with only the read lock held,
+// so readers aren't blocked behind slow progs and erases.
+//
 
-static lfs_file_t s_file;
-static char s_fname[256];
-static lfs_t *s_lfs_ptr;
-static Mutex *s_mutex;
+static RwLock *s_lock;
+static Mutex *s_cache_mutex;
+static Mutex *s_io_mutex;
+static const sKvStoreBackend *s_backend;
 
-static const char *prv_prefix_fname(const char *key) {
-  snprintf(s_fname, sizeof(s_fname), "%s/%s", KV_DIR, key);
-  return s_fname;
+static struct {
+  sKvStoreCacheEntry *entries;
+  size_t num_entries;
+  uint32_t tick;
+  //! Bumped when the async worker changes flash, so a reader which raced with
+  //! it doesn't cache the value it read beforehand
+  uint32_t gen;
+} s_cache;
+
+static struct {
+  Mutex *mutex;
+  //! Given once per queued write, taken by kv_store_async_worker()
+  Semaphore *work;
+  sKvStoreQueueEntry *entries;
+  size_t num_entries;
+  size_t depth;
+  uint32_t seq;
+  uint64_t (*clock_us)(void);
+  bool stop;
+} s_queue;
+
+static uint8_t s_stream_chunk[KV_STORE_STREAM_CHUNK_SIZE];
+static bool s_skip_unchanged_writes;
+
+static struct {
+  uint8_t *bits;
+  uint32_t num_bits;
+  uint8_t num_hashes;
+  //! Distinct keys added since the filter was last built
+  uint32_t num_keys;
+  //! Deleted keys whose bits are still set
+  uint32_t num_stale;
+} s_filter;
+
+//
+// RAM cache
+//
+// A small fully-associative cache. The table is tiny (tens of entries) so a
+// linear scan is cheaper than maintaining a hash table or linked list, and
+// LRU order is tracked with a monotonic use counter.
+//
+
+static bool prv_cache_enabled(void) {
+  return s_cache.num_entries > 0;
+}
+
+static bool prv_cache_can_hold(const char *key, uint32_t len) {
+  return prv_cache_enabled() &&
+         (strlen(key) <= KV_STORE_CACHE_KEY_MAX_LEN) &&
+         (len <= KV_STORE_CACHE_VAL_MAX_LEN);
+}
+
+static sKvStoreCacheEntry *prv_cache_find(const char *key) {
+  for (size_t i = 0; i < s_cache.num_entries; i++) {
+    sKvStoreCacheEntry *entry = &s_cache.entries[i];
+    if (entry->valid && strcmp(entry->key, key) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
 }
 
-void kv_store_init(lfs_t *lfs) {
-  s_lfs_ptr = lfs;
-  lfs_mkdir(s_lfs_ptr, "/kv");
-  s_mutex = mutex_create();
+static void prv_cache_touch(sKvStoreCacheEntry *entry) {
+  entry->last_used = ++s_cache.tick;
+}
+
+static bool prv_cache_writeback(sKvStoreCacheEntry *entry) {
+  if (!entry->dirty) {
+    return true;
+  }
+  if (!s_backend->write(entry->key, entry->val, entry->len)) {
+    return false;
+  }
+  entry->dirty = false;
+  return true;
+}
+
+//! Returns a free slot, evicting the least recently used entry if needed. A
+//! dirty victim is written back first; NULL is returned if that fails or if
+//! `allow_writeback` is false, as it is for readers who may not touch flash.
+static sKvStoreCacheEntry *prv_cache_alloc(bool allow_writeback) {
+  sKvStoreCacheEntry *victim = &s_cache.entries[0];
+  for (size_t i = 0; i < s_cache.num_entries; i++) {
+    sKvStoreCacheEntry *entry = &s_cache.entries[i];
+    if (!entry->valid) {
+      return entry;
+    }
+    if (entry->last_used < victim->last_used) {
+      victim = entry;
+    }
+  }
+
+  if (victim->dirty && !allow_writeback) {
+    return NULL;
+  }
+  if (!prv_cache_writeback(victim)) {
+    return NULL;
+  }
+  victim->valid = false;
+  return victim;
+}
+
+static bool prv_cache_insert(const char *key, const void *val, uint32_t len, bool dirty) {
+  sKvStoreCacheEntry *entry = prv_cache_find(key);
+  if (!entry) {
+    // A clean insert comes from a reader, which mustn't write back
+    entry = prv_cache_alloc(dirty);
+    if (!entry) {
+      return false;
+    }
+    strcpy(entry->key, key);
+    entry->valid = true;
+  }
+  memcpy(entry->val, val, len);
+  entry->len = len;
+  entry->dirty = dirty;
+  prv_cache_touch(entry);
+  return true;
+}
+
+static void prv_cache_invalidate(const char *key) {
+  if (!prv_cache_enabled()) {
+    return;
+  }
+  sKvStoreCacheEntry *entry = prv_cache_find(key);
+  if (entry) {
+    entry->valid = false;
+    entry->dirty = false;
+  }
+}
+
+//
+// Negative lookup filter
+//
+// A Bloom filter over every key in the store. If any of a key's bits is clear
+// the key definitely doesn't exist and a read can fail without touching flash.
+// Bits can't be cleared on delete since other keys may share them, so deletes
+// only add false positives. kv_store_compact() rebuilds the filter once enough
+// of it is stale.
+//
+
+static bool prv_filter_enabled(void) {
+  return s_filter.num_bits > 0;
+}
+
+// Two independent 32-bit hashes (FNV-1a and djb2) combined with double hashing
+static void prv_filter_hashes(const char *key, uint32_t *h1, uint32_t *h2) {
+  uint32_t fnv = 2166136261u;
+  uint32_t djb = 5381;
+  for (const char *c = key; *c != '\0'; ++c) {
+    fnv = (fnv ^ (uint8_t)*c) * 16777619u;
+    djb = (djb * 33) ^ (uint8_t)*c;
+  }
+  *h1 = fnv;
+  // An even step could cycle through only part of the table
+  *h2 = djb | 1;
+}
+
+static void prv_filter_add(const char *key) {
+  if (!prv_filter_enabled()) {
+    return;
+  }
+  uint32_t h1, h2;
+  prv_filter_hashes(key, &h1, &h2);
+  bool is_new = false;
+  for (uint32_t i = 0; i < s_filter.num_hashes; i++) {
+    const uint32_t bit = (h1 + i * h2) % s_filter.num_bits;
+    const uint8_t mask = (uint8_t)(1 << (bit % 8));
+    // The async worker adds keys while readers are checking bits
+    const uint8_t old = __atomic_fetch_or(&s_filter.bits[bit / 8], mask, __ATOMIC_RELAXED);
+    is_new |= (old & mask) == 0;
+  }
+  // A rewrite finds all of its bits set already. So does the odd new key the
+  // filter already had a false positive for, which goes uncounted.
+  if (is_new) {
+    __atomic_fetch_add(&s_filter.num_keys, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static bool prv_filter_may_contain(const char *key) {
+  if (!prv_filter_enabled()) {
+    return true;
+  }
+  uint32_t h1, h2;
+  prv_filter_hashes(key, &h1, &h2);
+  for (uint32_t i = 0; i < s_filter.num_hashes; i++) {
+    const uint32_t bit = (h1 + i * h2) % s_filter.num_bits;
+    if ((__atomic_load_n(&s_filter.bits[bit / 8], __ATOMIC_RELAXED) & (1 << (bit % 8))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void prv_filter_add_cb(const char *key, void *ctx) {
+  prv_filter_add(key);
+}
+
+static void prv_filter_rebuild(void) {
+  memset(s_filter.bits, 0, (s_filter.num_bits + 7) / 8);
+  s_filter.num_keys = 0;
+  s_filter.num_stale = 0;
+  if (!s_backend->for_each_key(prv_filter_add_cb, NULL)) {
+    // Without a complete key list the filter could hide existing keys
+    memset(s_filter.bits, 0xff, (s_filter.num_bits + 7) / 8);
+  }
+}
+
+//
+// Async write queue
+//
+// Like the cache, a small table which is scanned linearly. Each entry holds
+// the newest value for its key, so repeated writes to a key coalesce into one
+// flash write. Entries are written out oldest first.
+//
+
+static bool prv_queue_enabled(void) {
+  return s_queue.num_entries > 0;
+}
+
+static bool prv_queue_can_hold(const char *key, uint32_t len) {
+  return prv_queue_enabled() &&
+         (strlen(key) <= KV_STORE_CACHE_KEY_MAX_LEN) &&
+         (len <= KV_STORE_QUEUE_VAL_MAX_LEN);
+}
+
+static sKvStoreQueueEntry *prv_queue_find(const char *key) {
+  for (size_t i = 0; i < s_queue.num_entries; i++) {
+    sKvStoreQueueEntry *entry = &s_queue.entries[i];
+    if (entry->valid && strcmp(entry->key, key) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static sKvStoreQueueEntry *prv_queue_oldest(void) {
+  sKvStoreQueueEntry *oldest = NULL;
+  for (size_t i = 0; i < s_queue.num_entries; i++) {
+    sKvStoreQueueEntry *entry = &s_queue.entries[i];
+    // Differences keep the order right across a seq wrap
+    if (entry->valid && (!oldest || (int32_t)(entry->seq - oldest->seq) < 0)) {
+      oldest = entry;
+    }
+  }
+  return oldest;
+}
+
+static void prv_queue_remove(sKvStoreQueueEntry *entry) {
+  entry->valid = false;
+  s_queue.depth--;
+}
+
+//! Called with the write lock held when a newer value or a delete supersedes
+//! whatever is still queued for `key`
+static void prv_queue_drop(const char *key) {
+  if (!prv_queue_enabled()) {
+    return;
+  }
+  sKvStoreQueueEntry *entry = prv_queue_find(key);
+  if (entry) {
+    prv_queue_remove(entry);
+  }
+}
+
+static uint64_t prv_queue_now_us(void) {
+  return s_queue.clock_us ? s_queue.clock_us() : 0;
+}
+
+//! Called with the read lock held. Returns false if the queue is full.
+static bool prv_queue_push(const char *key, const void *val, uint32_t len) {
+  mutex_lock(s_queue.mutex);
+
+  sKvStoreQueueEntry *entry = prv_queue_find(key);
+  if (entry) {
+    if (s_skip_unchanged_writes && entry->len == len && memcmp(entry->val, val, len) == 0) {
+      mutex_unlock(s_queue.mutex);
+      analytics_inc(kSettingsFileWriteSkipped);
+      return true;
+    }
+    analytics_inc(kSettingsWriteCoalesced);
+  } else {
+    for (size_t i = 0; i < s_queue.num_entries && !entry; i++) {
+      if (!s_queue.entries[i].valid) {
+        entry = &s_queue.entries[i];
+      }
+    }
+    if (!entry) {
+      mutex_unlock(s_queue.mutex);
+      analytics_inc(kSettingsWriteQueueFull);
+      return false;
+    }
+    strcpy(entry->key, key);
+    entry->first_seq = s_queue.seq + 1;
+    entry->enqueued_us = prv_queue_now_us();
+    entry->valid = true;
+    s_queue.depth++;
+    analytics_inc(kSettingsWriteQueued);
+  }
+  memcpy(entry->val, val, len);
+  entry->len = len;
+  entry->seq = ++s_queue.seq;
+  const size_t depth = s_queue.depth;
+
+  mutex_unlock(s_queue.mutex);
+
+  analytics_set(kSettingsWriteQueueDepth, depth);
+  semaphore_give(s_queue.work);
+  return true;
+}
+
+static bool prv_flash_is_unchanged(const char *key, const void *val, uint32_t len);
+
+//! Writes one dequeued value to flash. The caller holds either the write lock,
+//! or the read lock and s_io_mutex.
+static bool prv_queue_write(const char *key, const void *val, uint32_t len,
+                            uint64_t enqueued_us) {
+  // Added before the entry leaves the queue so a reader never sees neither
+  prv_filter_add(key);
+
+  if (s_skip_unchanged_writes && prv_flash_is_unchanged(key, val, len)) {
+    analytics_inc(kSettingsFileWriteSkipped);
+  } else if (s_backend->write(key, val, len)) {
+    analytics_inc(kSettingsFileWrite);
+  } else {
+    return false;
+  }
+
+  if (s_queue.clock_us) {
+    analytics_set(kSettingsWriteQueueFlushLatencyUs,
+                  (uint32_t)(prv_queue_now_us() - enqueued_us));
+  }
+  return true;
+}
+
+//! Writes out the oldest entry with only the read lock held. Returns false once
+//! the queue is empty or a write fails.
+static bool prv_queue_drain_one(void) {
+  rwlock_read_lock(s_lock);
+
+  // Copied out so writers can keep coalescing into the entry meanwhile
+  char key[KV_STORE_CACHE_KEY_MAX_LEN + 1];
+  uint8_t val[KV_STORE_QUEUE_VAL_MAX_LEN];
+  uint32_t len = 0;
+  uint32_t seq = 0;
+  uint64_t enqueued_us = 0;
+
+  mutex_lock(s_queue.mutex);
+  sKvStoreQueueEntry *entry = prv_queue_oldest();
+  if (entry) {
+    strcpy(key, entry->key);
+    memcpy(val, entry->val, entry->len);
+    len = entry->len;
+    seq = entry->seq;
+    enqueued_us = entry->enqueued_us;
+  }
+  mutex_unlock(s_queue.mutex);
+
+  if (!entry) {
+    rwlock_read_unlock(s_lock);
+    return false;
+  }
+
+  mutex_lock(s_io_mutex);
+  const bool success = prv_queue_write(key, val, len, enqueued_us);
+  mutex_unlock(s_io_mutex);
+
+  if (success) {
+    if (prv_cache_enabled()) {
+      mutex_lock(s_cache_mutex);
+      prv_cache_invalidate(key);
+      s_cache.gen++;
+      mutex_unlock(s_cache_mutex);
+    }
+
+    mutex_lock(s_queue.mutex);
+    // A value which was coalesced in during the write stays queued
+    if (entry->valid && entry->seq == seq) {
+      prv_queue_remove(entry);
+    }
+    const size_t depth = s_queue.depth;
+    mutex_unlock(s_queue.mutex);
+
+    analytics_set(kSettingsWriteQueueDepth, depth);
+  }
+
+  rwlock_read_unlock(s_lock);
+  return success;
+}
+
+//! Called with the write lock held
+static bool prv_queue_flush(void) {
+  if (!prv_queue_enabled()) {
+    return true;
+  }
+
+  sKvStoreQueueEntry *entry;
+  while ((entry = prv_queue_oldest()) != NULL) {
+    if (!prv_queue_write(entry->key, entry->val, entry->len, entry->enqueued_us)) {
+      return false;
+    }
+    prv_cache_invalidate(entry->key);
+    prv_queue_remove(entry);
+  }
+  analytics_set(kSettingsWriteQueueDepth, 0);
+  return true;
+}
+
+//! Looks the key up in the queue with the read lock held. On a hit the value is
+//! handed to `hit_cb` under s_queue.mutex and true is returned.
+static bool prv_queue_read(const char *key,
+                           void (*hit_cb)(const uint8_t *val, uint32_t len, void *ctx),
+                           void *ctx) {
+  if (!prv_queue_enabled()) {
+    return false;
+  }
+
+  mutex_lock(s_queue.mutex);
+  const sKvStoreQueueEntry *entry = prv_queue_find(key);
+  if (entry) {
+    hit_cb(entry->val, entry->len, ctx);
+  }
+  mutex_unlock(s_queue.mutex);
+
+  return (entry != NULL);
+}
+
+//! Compacts the backend if writes have left enough stale data behind. Only
+//! takes the write lock when there is work to do.
+static void prv_compact_if_due(void) {
+  if (s_backend->compact_due == NULL) {
+    return;
+  }
+  rwlock_read_lock(s_lock);
+  const bool due = s_backend->compact_due();
+  rwlock_read_unlock(s_lock);
+  if (due) {
+    kv_store_compact();
+  }
+}
+
+bool kv_store_async_process(void) {
+  while (prv_queue_drain_one()) {
+  }
+
+  mutex_lock(s_queue.mutex);
+  const bool drained = (s_queue.depth == 0);
+  mutex_unlock(s_queue.mutex);
+
+  prv_compact_if_due();
+  return drained;
+}
+
+bool kv_store_async_process_one(bool *empty) {
+  const bool wrote = prv_queue_drain_one();
+
+  mutex_lock(s_queue.mutex);
+  *empty = (s_queue.depth == 0);
+  mutex_unlock(s_queue.mutex);
+
+  if (*empty) {
+    prv_compact_if_due();
+  }
+  // Nothing to write isn't a failure
+  return wrote || *empty;
+}
+
+bool kv_store_async_queued_seq(const char *key, uint32_t *seq) {
+  if (!prv_queue_enabled()) {
+    return false;
+  }
+
+  mutex_lock(s_queue.mutex);
+  const sKvStoreQueueEntry *entry = prv_queue_find(key);
+  if (entry) {
+    *seq = entry->seq;
+  }
+  mutex_unlock(s_queue.mutex);
+  return entry != NULL;
+}
+
+bool kv_store_async_pending(const char *key, uint32_t seq) {
+  if (!prv_queue_enabled()) {
+    return false;
+  }
+
+  mutex_lock(s_queue.mutex);
+  const sKvStoreQueueEntry *entry = prv_queue_find(key);
+  // Once written, a later value for the key goes in a new entry starting
+  // past `seq`. Compared as a difference so it survives the counter wrapping.
+  const bool pending = entry && (int32_t)(seq - entry->first_seq) >= 0;
+  mutex_unlock(s_queue.mutex);
+  return pending;
+}
+
+void kv_store_async_worker(void) {
+  while (true) {
+    semaphore_take(s_queue.work);
+
+    mutex_lock(s_queue.mutex);
+    const bool stop = s_queue.stop;
+    mutex_unlock(s_queue.mutex);
+    if (stop) {
+      return;
+    }
+
+    // Several gives may be pending for what is now a single pass; the extra
+    // wakeups find the queue empty and go back to sleep
+    kv_store_async_process();
+  }
+}
+
+bool kv_store_init(lfs_t *lfs, const sKvStoreConfig *config) {
+  // Locks outlive a deinit so the store can be re-initialized in place
+  if (!s_lock) {
+    s_lock = rwlock_create();
+    s_cache_mutex = mutex_create();
+    s_io_mutex = mutex_create();
+    s_queue.mutex = mutex_create();
+    s_queue.work = semaphore_create();
+  }
+
+  memset(&s_cache, 0, sizeof(s_cache));
+  if (config && config->cache_entries) {
+    s_cache.entries = config->cache_entries;
+    s_cache.num_entries = config->num_cache_entries;
+    memset(s_cache.entries, 0, s_cache.num_entries * sizeof(*s_cache.entries));
+  }
+
+  s_skip_unchanged_writes = config && config->skip_unchanged_writes;
+
+  s_queue.entries = NULL;
+  s_queue.num_entries = 0;
+  s_queue.depth = 0;
+  s_queue.clock_us = config ? config->clock_us : NULL;
+  s_queue.stop = false;
+  if (config && config->write_queue) {
+    s_queue.entries = config->write_queue;
+    s_queue.num_entries = config->write_queue_len;
+    memset(s_queue.entries, 0, s_queue.num_entries * sizeof(*s_queue.entries));
+  }
+
+  const bool use_log = (config && config->backend == kKvStoreBackend_Log);
+  s_backend = use_log ? &g_kv_store_log_backend : &g_kv_store_file_backend;
+  const bool opened = s_backend->init(lfs, config);
+
+  memset(&s_filter, 0, sizeof(s_filter));
+  if (config && config->filter_buf && config->filter_size_bytes > 0) {
+    s_filter.bits = config->filter_buf;
+    s_filter.num_bits = config->filter_size_bytes * 8;
+    s_filter.num_hashes = config->filter_num_hashes ? config->filter_num_hashes
+                                                    : KV_STORE_FILTER_DEFAULT_NUM_HASHES;
+    prv_filter_rebuild();
+  }
+  return opened;
+}
+
+void kv_store_deinit(void) {
+  kv_store_flush();
+
+  if (prv_queue_enabled()) {
+    mutex_lock(s_queue.mutex);
+    s_queue.stop = true;
+    mutex_unlock(s_queue.mutex);
+    semaphore_give(s_queue.work);
+  }
+
+  rwlock_write_lock(s_lock);
+  s_backend->deinit();
+  rwlock_write_unlock(s_lock);
+}
+
+//
+// Compare before write
+//
+
+typedef struct {
+  const uint8_t *val;
+  uint32_t len;
+  uint32_t offset;
+  bool equal;
+} sCompareCtx;
+
+static bool prv_compare_chunk(const void *chunk, uint32_t len, void *ctx) {
+  sCompareCtx *compare = ctx;
+  compare->equal = (compare->offset + len <= compare->len) &&
+                   (memcmp(&compare->val[compare->offset], chunk, len) == 0);
+  compare->offset += len;
+  return compare->equal;
+}
+
+//! Streams the stored value through a compare so no buffer the size of the
+//! value is needed
+static bool prv_flash_is_unchanged(const char *key, const void *val, uint32_t len) {
+  // A key the filter has never seen can't hold anything yet
+  if (!prv_filter_may_contain(key)) {
+    return false;
+  }
+
+  sCompareCtx compare = {
+    .val = val,
+    .len = len,
+    .equal = true,
+  };
+  const eKvStoreReadResult result =
+      s_backend->read_stream(key, 0, s_stream_chunk, sizeof(s_stream_chunk),
+                             prv_compare_chunk, &compare);
+  return (result == kKvStoreReadResult_Ok) && compare.equal && (compare.offset == len);
+}
+
+//! Called with the write lock held
+static bool prv_is_unchanged(const char *key, const void *val, uint32_t len) {
+  // A queued value is newer than anything in the cache or flash
+  const sKvStoreQueueEntry *queued = prv_queue_enabled() ? prv_queue_find(key) : NULL;
+  if (queued) {
+    return (queued->len == len) && (memcmp(queued->val, val, len) == 0);
+  }
+
+  if (prv_cache_enabled()) {
+    const sKvStoreCacheEntry *entry = prv_cache_find(key);
+    if (entry) {
+      return (entry->len == len) && (memcmp(entry->val, val, len) == 0);
+    }
+  }
+
+  return prv_flash_is_unchanged(key, val, len);
 }
 
 bool kv_store_write(const char *key, const void *val, uint32_t len) {
-  mutex_lock(s_mutex);
+  if (prv_queue_can_hold(key, len)) {
+    rwlock_read_lock(s_lock);
+    const bool queued = prv_queue_push(key, val, len);
+    if (queued && prv_cache_enabled()) {
+      // Reads check the queue first, this only drops a copy which is now stale
+      mutex_lock(s_cache_mutex);
+      prv_cache_invalidate(key);
+      mutex_unlock(s_cache_mutex);
+    }
+    rwlock_read_unlock(s_lock);
+    if (queued) {
+      return true;
+    }
+    // Queue full, fall through and write synchronously
+  }
+
+  rwlock_write_lock(s_lock);
+
+  if (s_skip_unchanged_writes && prv_is_unchanged(key, val, len)) {
+    if (prv_cache_can_hold(key, len) && !prv_cache_find(key)) {
+      // Keep a clean copy so the next compare doesn't need flash
+      prv_cache_insert(key, val, len, false);
+    }
+    rwlock_write_unlock(s_lock);
+    analytics_inc(kSettingsFileWriteSkipped);
+    return true;
+  }
+
+  prv_filter_add(key);
+  prv_queue_drop(key);
 
-  lfs_file_open(s_lfs_ptr, &s_file, prv_prefix_fname(key), LFS_O_WRONLY | LFS_O_CREAT);
-  uint32_t rv = lfs_file_write(s_lfs_ptr, &s_file, val, len);
-  lfs_file_close(s_lfs_ptr, &s_file);
+  bool success;
+  if (prv_cache_can_hold(key, len)) {
+    // Write-back: flash is only touched on eviction or kv_store_flush()
+    success = prv_cache_insert(key, val, len, true);
+  } else {
+    prv_cache_invalidate(key);
+    success = s_backend->write(key, val, len);
+  }
 
-  mutex_unlock(s_mutex);
+  rwlock_write_unlock(s_lock);
 
   analytics_inc(kSettingsFileWrite);
 
-  return (rv == len);
+  return success;
+}
+
+bool kv_store_write_batch(const sKvStoreBatchEntry *entries, size_t num_entries) {
+  if (num_entries == 0) {
+    return true;
+  }
+
+  rwlock_write_lock(s_lock);
+
+  const bool success = s_backend->write_batch(entries, num_entries);
+  // Values in RAM are only superseded once the batch is in. Nobody can look
+  // in between, as the write lock is held throughout.
+  if (success) {
+    for (size_t i = 0; i < num_entries; i++) {
+      prv_cache_invalidate(entries[i].key);
+      prv_queue_drop(entries[i].key);
+      prv_filter_add(entries[i].key);
+    }
+  }
+
+  rwlock_write_unlock(s_lock);
+
+  for (size_t i = 0; success && i < num_entries; i++) {
+    analytics_inc(kSettingsFileWrite);
+  }
+
+  return success;
+}
+
+//! Looks the key up in the cache with the read lock held. On a hit the value is
+//! handed to `hit_cb` under s_cache_mutex and true is returned. On a miss `gen`
+//! is set for the prv_cache_fill() which follows the flash read.
+static bool prv_cache_read(const char *key,
+                           void (*hit_cb)(const uint8_t *val, uint32_t len, void *ctx),
+                           void *ctx, uint32_t *gen) {
+  if (!prv_cache_enabled()) {
+    return false;
+  }
+
+  mutex_lock(s_cache_mutex);
+  sKvStoreCacheEntry *entry = prv_cache_find(key);
+  if (entry) {
+    prv_cache_touch(entry);
+    hit_cb(entry->val, entry->len, ctx);
+  }
+  *gen = s_cache.gen;
+  mutex_unlock(s_cache_mutex);
+
+  analytics_inc(entry ? kSettingsCacheHit : kSettingsCacheMiss);
+  return (entry != NULL);
+}
+
+//! Like prv_cache_read(), for lookups which don't read the value: nothing is
+//! counted and the entry's place in the LRU order is left alone.
+static bool prv_cache_peek(const char *key,
+                           void (*hit_cb)(const uint8_t *val, uint32_t len, void *ctx),
+                           void *ctx) {
+  if (!prv_cache_enabled()) {
+    return false;
+  }
+
+  mutex_lock(s_cache_mutex);
+  const sKvStoreCacheEntry *entry = prv_cache_find(key);
+  if (entry) {
+    hit_cb(entry->val, entry->len, ctx);
+  }
+  mutex_unlock(s_cache_mutex);
+
+  return (entry != NULL);
+}
+
+//! Caches a value just read from flash with the read lock held. Skipped if the
+//! async worker wrote to flash since `gen` was taken, as the value may be stale.
+static void prv_cache_fill(const char *key, const void *val, uint32_t len, uint32_t gen) {
+  if (!prv_cache_can_hold(key, len)) {
+    return;
+  }
+  mutex_lock(s_cache_mutex);
+  if (s_cache.gen == gen) {
+    // Best effort, with no clean slot to reuse the value just isn't cached
+    prv_cache_insert(key, val, len, false);
+  }
+  mutex_unlock(s_cache_mutex);
+}
+
+typedef struct {
+  void *buf;
+  uint32_t buf_len;
+  uint32_t *len_read;
+  bool success;
+} sRamReadCtx;
+
+static void prv_ram_read_copy(const uint8_t *val, uint32_t len, void *ctx) {
+  sRamReadCtx *read = ctx;
+  read->success = (read->buf_len >= len);
+  if (read->success) {
+    memcpy(read->buf, val, len);
+    *read->len_read = len;
+  }
 }
 
 bool kv_store_read(const char *key, void *buf, uint32_t buf_len, uint32_t *len_read) {
-  mutex_lock(s_mutex);
+  rwlock_read_lock(s_lock);
 
-  int rv = lfs_file_open(s_lfs_ptr, &s_file, prv_prefix_fname(key), LFS_O_RDONLY);
-  if (rv < 0) {
-    mutex_unlock(s_mutex);
+  // The queue and the cache may hold newer values than flash, so they are
+  // checked first, newest first
+  sRamReadCtx ram_read = {
+    .buf = buf,
+    .buf_len = buf_len,
+    .len_read = len_read,
+  };
+  uint32_t gen = 0;
+  if (prv_queue_read(key, prv_ram_read_copy, &ram_read) ||
+      prv_cache_read(key, prv_ram_read_copy, &ram_read, &gen)) {
+    rwlock_read_unlock(s_lock);
+    if (ram_read.success) {
+      analytics_inc(kSettingsFileRead);
+    }
+    return ram_read.success;
+  }
+
+  if (!prv_filter_may_contain(key)) {
+    rwlock_read_unlock(s_lock);
+    analytics_inc(kSettingsFilterNegative);
     return false;
   }
 
-  uint32_t len = lfs_file_size(s_lfs_ptr, &s_file);
-  if (buf_len < len) {
-    mutex_unlock(s_mutex);
+  mutex_lock(s_io_mutex);
+  const eKvStoreReadResult result = s_backend->read(key, buf, buf_len, len_read);
+  mutex_unlock(s_io_mutex);
+
+  if (result != kKvStoreReadResult_Ok) {
+    rwlock_read_unlock(s_lock);
+    if (prv_filter_enabled() && result == kKvStoreReadResult_NotFound) {
+      analytics_inc(kSettingsFilterFalsePositive);
+    }
     return false;
   }
 
-  len = lfs_file_read(s_lfs_ptr, &s_file, buf, buf_len);
-  lfs_file_close(s_lfs_ptr, &s_file);
-  *len_read = len;
+  prv_cache_fill(key, buf, *len_read, gen);
 
-  mutex_unlock(s_mutex);
+  rwlock_read_unlock(s_lock);
 
   analytics_inc(kSettingsFileRead);
 
   return true;
 }
 
+typedef struct {
+  uint32_t offset;
+  KvStoreReadCallback cb;
+  void *ctx;
+  bool success;
+} sRamStreamCtx;
+
+//! Hands the value over in the same pieces a flash read would, stopping when
+//! the callback asks to
+static void prv_ram_read_stream(const uint8_t *val, uint32_t len, void *ctx) {
+  sRamStreamCtx *stream = ctx;
+  stream->success = (stream->offset <= len);
+  for (uint32_t off = stream->offset; stream->success && off < len;) {
+    const uint32_t remaining = len - off;
+    const uint32_t n =
+        remaining < KV_STORE_STREAM_CHUNK_SIZE ? remaining : KV_STORE_STREAM_CHUNK_SIZE;
+    if (!stream->cb(&val[off], n, stream->ctx)) {
+      break;
+    }
+    off += n;
+  }
+}
+
+bool kv_store_read_stream(const char *key, uint32_t offset, KvStoreReadCallback cb, void *ctx) {
+  rwlock_read_lock(s_lock);
+
+  // The queue and the cache may hold newer values than flash, so they have to
+  // be checked first
+  sRamStreamCtx ram_stream = {
+    .offset = offset,
+    .cb = cb,
+    .ctx = ctx,
+  };
+  uint32_t gen;
+  if (prv_queue_read(key, prv_ram_read_stream, &ram_stream) ||
+      prv_cache_read(key, prv_ram_read_stream, &ram_stream, &gen)) {
+    rwlock_read_unlock(s_lock);
+    if (ram_stream.success) {
+      analytics_inc(kSettingsFileRead);
+    }
+    return ram_stream.success;
+  }
+
+  if (!prv_filter_may_contain(key)) {
+    rwlock_read_unlock(s_lock);
+    analytics_inc(kSettingsFilterNegative);
+    return false;
+  }
+
+  // s_stream_chunk is shared, so it is covered by s_io_mutex too
+  mutex_lock(s_io_mutex);
+  const eKvStoreReadResult result =
+      s_backend->read_stream(key, offset, s_stream_chunk, sizeof(s_stream_chunk), cb, ctx);
+  mutex_unlock(s_io_mutex);
+
+  rwlock_read_unlock(s_lock);
+
+  if (result != kKvStoreReadResult_Ok) {
+    if (prv_filter_enabled() && result == kKvStoreReadResult_NotFound) {
+      analytics_inc(kSettingsFilterFalsePositive);
+    }
+    return false;
+  }
+
+  analytics_inc(kSettingsFileRead);
+  return true;
+}
+
+static void prv_ram_read_size(const uint8_t *val, uint32_t len, void *ctx) {
+  *(uint32_t *)ctx = len;
+}
+
+bool kv_store_size(const char *key, uint32_t *size) {
+  rwlock_read_lock(s_lock);
+
+  // Only the length is looked at, so this doesn't count as a cache hit or miss
+  const bool in_ram = prv_queue_read(key, prv_ram_read_size, size) ||
+                      prv_cache_peek(key, prv_ram_read_size, size);
+
+  eKvStoreReadResult result = kKvStoreReadResult_Ok;
+  if (!in_ram) {
+    if (!prv_filter_may_contain(key)) {
+      result = kKvStoreReadResult_NotFound;
+    } else {
+      mutex_lock(s_io_mutex);
+      result = s_backend->size(key, size);
+      mutex_unlock(s_io_mutex);
+    }
+  }
+
+  rwlock_read_unlock(s_lock);
+
+  return (result == kKvStoreReadResult_Ok);
+}
+
 bool kv_store_delete(const char *key) {
-  mutex_lock(s_mutex);
+  rwlock_write_lock(s_lock);
+
+  // A key whose remove failed is still there, newer values in RAM included
+  const bool success = s_backend->remove(key);
+  if (success) {
+    prv_cache_invalidate(key);
+    prv_queue_drop(key);
+    if (prv_filter_enabled()) {
+      s_filter.num_stale++;
+    }
+  }
+
+  rwlock_write_unlock(s_lock);
+
+  if (success) {
+    analytics_inc(kSettingsFileDelete);
+  }
+
+  return success;
+}
+
+static bool prv_cache_flush(void) {
+  bool success = true;
+  for (size_t i = 0; i < s_cache.num_entries; i++) {
+    sKvStoreCacheEntry *entry = &s_cache.entries[i];
+    if (entry->valid && !prv_cache_writeback(entry)) {
+      success = false;
+    }
+  }
+  return success;
+}
+
+bool kv_store_flush(void) {
+  rwlock_write_lock(s_lock);
+
+  // The queue is newer than the cache, so it goes last
+  const bool success = prv_cache_flush() && prv_queue_flush();
+
+  rwlock_write_unlock(s_lock);
+
+  return success;
+}
+
+bool kv_store_foreach(const char *prefix, KvStoreForeachCallback cb, void *ctx) {
+  rwlock_write_lock(s_lock);
+
+  // The backend only sees flash, so it has to be up to date first
+  const bool success = prv_cache_flush() && prv_queue_flush() &&
+      s_backend->for_each(prefix ? prefix : "", s_stream_chunk, sizeof(s_stream_chunk), cb, ctx);
+
+  rwlock_write_unlock(s_lock);
+
+  return success;
+}
+
+//
+// Export / import
+//
+// A snapshot is an sExportHdr followed by one record per key: an
+// sExportRecordHdr, the key (no '\0') and the value. It ends with a record
+// whose key_len is 0 and whose val_len holds the number of records, so a
+// truncated snapshot is detected without knowing the key count up front.
+//
+
+#define KV_STORE_EXPORT_MAGIC 0x5845564B // "KVEX"
+#define KV_STORE_EXPORT_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+} sExportHdr;
+
+typedef struct {
+  uint16_t key_len;
+  uint16_t reserved;
+  uint32_t val_len;
+} sExportRecordHdr;
 
-  lfs_remove(s_lfs_ptr, prv_prefix_fname(key));
+typedef struct {
+  KvStoreExportCallback cb;
+  void *ctx;
+  uint32_t num_records;
+  bool success;
+} sExportCtx;
+
+static bool prv_export_chunk(const char *key, uint32_t size, uint32_t offset,
+                             const void *chunk, uint32_t len, void *ctx) {
+  sExportCtx *state = ctx;
+  if (offset == 0) {
+    const sExportRecordHdr hdr = {
+      .key_len = strlen(key),
+      .val_len = size,
+    };
+    state->success = state->cb(&hdr, sizeof(hdr), state->ctx) &&
+                      state->cb(key, hdr.key_len, state->ctx);
+    state->num_records++;
+  }
+  if (state->success && len > 0) {
+    state->success = state->cb(chunk, len, state->ctx);
+  }
+  return state->success;
+}
+
+bool kv_store_export(KvStoreExportCallback cb, void *ctx) {
+  const sExportHdr hdr = {
+    .magic = KV_STORE_EXPORT_MAGIC,
+    .version = KV_STORE_EXPORT_VERSION,
+  };
+  if (!cb(&hdr, sizeof(hdr), ctx)) {
+    return false;
+  }
+
+  sExportCtx state = {
+    .cb = cb,
+    .ctx = ctx,
+    .success = true,
+  };
+  if (!kv_store_foreach(NULL, prv_export_chunk, &state) || !state.success) {
+    return false;
+  }
+
+  const sExportRecordHdr end = {
+    .val_len = state.num_records,
+  };
+  return cb(&end, sizeof(end), ctx);
+}
+
+//! Walks the records of a snapshot. With `apply` false it only checks that the
+//! snapshot is well formed.
+static bool prv_import_records(const uint8_t *buf, uint32_t len, bool apply) {
+  sExportHdr hdr;
+  if (len < sizeof(hdr)) {
+    return false;
+  }
+  memcpy(&hdr, buf, sizeof(hdr));
+  if (hdr.magic != KV_STORE_EXPORT_MAGIC || hdr.version != KV_STORE_EXPORT_VERSION) {
+    return false;
+  }
+
+  uint32_t off = sizeof(hdr);
+  uint32_t num_records = 0;
+  while (len - off >= sizeof(sExportRecordHdr)) {
+    sExportRecordHdr record;
+    memcpy(&record, &buf[off], sizeof(record));
+    off += sizeof(record);
+    if (record.key_len == 0) {
+      return (record.val_len == num_records) && (off == len);
+    }
+    if (record.key_len > LFS_NAME_MAX || len - off < (uint64_t)record.key_len + record.val_len) {
+      return false;
+    }
+
+    if (apply) {
+      // Written one by one: a batch would need every key copied out to be
+      // NUL terminated, so a failure here leaves the import partly applied
+      char key[LFS_NAME_MAX + 1];
+      memcpy(key, &buf[off], record.key_len);
+      key[record.key_len] = '\0';
+      if (!kv_store_write(key, &buf[off + record.key_len], record.val_len)) {
+        return false;
+      }
+    }
+    off += record.key_len + record.val_len;
+    num_records++;
+  }
+  return false;
+}
+
+bool kv_store_import(const void *buf, uint32_t len) {
+  return prv_import_records(buf, len, false) && prv_import_records(buf, len, true);
+}
+
+bool kv_store_compact(void) {
+  rwlock_write_lock(s_lock);
+
+  const bool success = (s_backend->compact == NULL) || s_backend->compact();
+
+  // Deleted keys leave their bits behind; start over once they make up a
+  // large part of the filter
+  if (prv_filter_enabled() && s_filter.num_stale * 2 > s_filter.num_keys) {
+    prv_filter_rebuild();
+  }
+
+  rwlock_write_unlock(s_lock);
+
+  return success;
+}
+
+bool kv_store_filter_stats(sKvStoreFilterStats *stats) {
+  if (!prv_filter_enabled()) {
+    return false;
+  }
+
+  rwlock_read_lock(s_lock);
+
+  uint32_t bits_set = 0;
+  for (uint32_t i = 0; i < s_filter.num_bits; i++) {
+    if (__atomic_load_n(&s_filter.bits[i / 8], __ATOMIC_RELAXED) & (1 << (i % 8))) {
+      bits_set++;
+    }
+  }
+
+  // A missing key is a false positive when all of its bits happen to be set,
+  // so the rate is (fraction of bits set) ^ num_hashes
+  uint64_t fp_rate_ppm = 1000000;
+  for (uint32_t i = 0; i < s_filter.num_hashes; i++) {
+    fp_rate_ppm = fp_rate_ppm * bits_set / s_filter.num_bits;
+  }
 
-  mutex_unlock(s_mutex);
+  *stats = (sKvStoreFilterStats) {
+    .size_bytes = (s_filter.num_bits + 7) / 8,
+    .num_hashes = s_filter.num_hashes,
+    .num_keys = __atomic_load_n(&s_filter.num_keys, __ATOMIC_RELAXED),
+    .num_stale = s_filter.num_stale,
+    .fp_rate_ppm = (uint32_t)fp_rate_ppm,
+  };
 
-  analytics_inc(kSettingsFileDelete);
+  rwlock_read_unlock(s_lock);
 
   return true;
 }
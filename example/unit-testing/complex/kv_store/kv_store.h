@@ -1,13 +1,271 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "lfs.h"
+#include "kv_compress.h"
 
-void kv_store_init(lfs_t *lfs);
+//! Longest key (not including the '\0') which can live in the RAM cache
+#define KV_STORE_CACHE_KEY_MAX_LEN (31)
+//! Values larger than this bypass the RAM cache and go straight to flash
+#define KV_STORE_CACHE_VAL_MAX_LEN (64)
 
+#define KV_STORE_FILTER_DEFAULT_NUM_HASHES (3)
+
+//! Largest piece handed to a kv_store_read_stream() callback. Lives in a static
+//! buffer, so it doesn't cost the caller any stack.
+#ifndef KV_STORE_STREAM_CHUNK_SIZE
+#define KV_STORE_STREAM_CHUNK_SIZE (128)
+#endif
+
+//! Values larger than this bypass the async write queue and are written
+//! synchronously
+#define KV_STORE_QUEUE_VAL_MAX_LEN KV_STORE_CACHE_VAL_MAX_LEN
+
+#define KV_STORE_COMPRESS_DEFAULT_MIN_LEN (256)
+
+//! Shard directories are named with two hex digits
+#define KV_STORE_FILE_MAX_SHARDS (256)
+
+#define KV_STORE_LOG_DEFAULT_INDEX_LEN (64)
+#define KV_STORE_LOG_DEFAULT_COMPACT_PCT (50)
+
+typedef struct KvStoreCacheEntry {
+  char key[KV_STORE_CACHE_KEY_MAX_LEN + 1];
+  uint8_t val[KV_STORE_CACHE_VAL_MAX_LEN];
+  uint32_t len;
+  uint32_t last_used;
+  bool valid;
+  //! Set when the value in RAM is newer than the one in flash
+  bool dirty;
+} sKvStoreCacheEntry;
+
+//! A write waiting in the async queue
+typedef struct KvStoreQueueEntry {
+  char key[KV_STORE_CACHE_KEY_MAX_LEN + 1];
+  uint8_t val[KV_STORE_QUEUE_VAL_MAX_LEN];
+  uint32_t len;
+  //! When the entry was last overwritten, so the worker can tell if it changed
+  //! while being written
+  uint32_t seq;
+  //! `seq` of the oldest value coalesced into this entry
+  uint32_t first_seq;
+  //! When the oldest value coalesced into this entry was queued
+  uint64_t enqueued_us;
+  bool valid;
+} sKvStoreQueueEntry;
+
+typedef enum {
+  //! One littlefs file per key under /kv
+  kKvStoreBackend_FilePerKey = 0,
+  //! Every write is appended to a single log file. Much lower space and
+  //! metadata overhead for small values, at the cost of a RAM index.
+  kKvStoreBackend_Log,
+} eKvStoreBackend;
+
+//! RAM index slot for the log backend, 16 bytes per live key
+typedef struct KvStoreLogIndexEntry {
+  uint32_t key_hash;
+  uint32_t offset;
+  uint32_t val_len;
+  uint16_t key_len;
+  bool valid;
+} sKvStoreLogIndexEntry;
+
+typedef struct KvStoreConfig {
+  //! Optional write-back cache in front of littlefs. The storage is provided by
+  //! the caller so each product can size it. Leave NULL to disable caching.
+  sKvStoreCacheEntry *cache_entries;
+  size_t num_cache_entries;
+
+  eKvStoreBackend backend;
+  //! Log backend only. Bounds the number of live keys. When NULL a small
+  //! internal index of KV_STORE_LOG_DEFAULT_INDEX_LEN entries is used.
+  sKvStoreLogIndexEntry *log_index;
+  size_t log_index_len;
+  //! Log backend only. The log is compacted once this percentage of it is
+  //! stale. 0 selects KV_STORE_LOG_DEFAULT_COMPACT_PCT.
+  uint8_t log_compact_threshold_pct;
+
+  //! Optional Bloom filter over every stored key, so reading a key which doesn't
+  //! exist can fail without touching flash. With n keys, m = 8 * filter_size_bytes
+  //! bits and k hashes the false positive rate is about (1 - e^(-k*n/m))^k,
+  //! e.g. 10 bits per key with k = 3 gives ~1.7%. Leave NULL to disable.
+  uint8_t *filter_buf;
+  size_t filter_size_bytes;
+  //! 0 selects KV_STORE_FILTER_DEFAULT_NUM_HASHES
+  uint8_t filter_num_hashes;
+
+  //! Makes kv_store_write() a no-op when the key already holds the same value.
+  //! The old value is compared from the RAM cache when possible and otherwise
+  //! read back from flash, trading a few block reads for a program and erase.
+  bool skip_unchanged_writes;
+
+  //! File-per-key backend only. Optional encoder scratch; when set, values of
+  //! at least `compress_min_len` bytes are compressed before they are written
+  //! if that saves at least an eighth of their size. Each file records whether
+  //! it is compressed in a littlefs attribute, so reads decompress
+  //! transparently, even with this left NULL.
+  sKvCompressor *compressor;
+  //! 0 selects KV_STORE_COMPRESS_DEFAULT_MIN_LEN
+  uint32_t compress_min_len;
+
+  //! File-per-key backend only. Spreads the key files over this many
+  //! subdirectories of /kv_shards, picked by a hash of the key, so an open only
+  //! scans about 1/N of the keys instead of all of them. Each shard in use
+  //! costs a littlefs metadata pair (two blocks). 0 or 1 keeps every key
+  //! directly in /kv. The count is recorded in flash, and when it changes,
+  //! from flat or back to flat included, kv_store_init() moves every key to
+  //! its new place, failing if one can't be. At most KV_STORE_FILE_MAX_SHARDS.
+  uint16_t file_num_shards;
+
+  //! Optional async write mode. A kv_store_write() of a value up to
+  //! KV_STORE_QUEUE_VAL_MAX_LEN only lands in this queue, replacing any value
+  //! still pending for the same key, and returns without waiting for flash.
+  //! kv_store_async_worker() writes it out from its own task. Reads see queued
+  //! values. When the queue is full the write is made synchronously instead.
+  //! Leave NULL for synchronous writes.
+  sKvStoreQueueEntry *write_queue;
+  size_t write_queue_len;
+  //! Optional monotonic clock. When set, the time each write spent queued is
+  //! reported as kSettingsWriteQueueFlushLatencyUs.
+  uint64_t (*clock_us)(void);
+} sKvStoreConfig;
+
+typedef struct KvStoreFilterStats {
+  uint32_t size_bytes;
+  uint8_t num_hashes;
+  //! Distinct keys added since the filter was last rebuilt. Rewrites don't
+  //! count, nor does a new key whose bits were all set already.
+  uint32_t num_keys;
+  //! Deleted keys which still have bits set in the filter
+  uint32_t num_stale;
+  //! Chance, in parts per million, that a missing key still goes to flash.
+  //! Computed from the bits currently set.
+  uint32_t fp_rate_ppm;
+} sKvStoreFilterStats;
+
+//! Receives one piece of a streamed value. Return false to stop early. Called
+//! with the kv_store lock held, so it must not call back into kv_store.
+typedef bool (*KvStoreReadCallback)(const void *chunk, uint32_t len, void *ctx);
+
+//! Receives a piece of one value during kv_store_foreach(). Values are handed
+//! over in order, `offset` bytes into a value of `size` bytes; an empty value
+//! gets a single call with `len` 0. Return false to end the walk. Called with
+//! the kv_store lock held, so it must not call back into kv_store.
+typedef bool (*KvStoreForeachCallback)(const char *key, uint32_t size, uint32_t offset,
+                                       const void *chunk, uint32_t len, void *ctx);
+
+//! Receives the next piece of a kv_store_export() stream. Return false to
+//! abort the export.
+typedef bool (*KvStoreExportCallback)(const void *data, uint32_t len, void *ctx);
+
+typedef struct KvStoreBatchEntry {
+  const char *key;
+  const void *val;
+  uint32_t len;
+} sKvStoreBatchEntry;
+
+//! Initializes the store. `config` may be NULL to use the defaults (no cache).
+//! Returns false if the store couldn't be opened, in which case every other
+//! call fails. The log backend also refuses a log holding more live keys than
+//! `log_index_len`, rather than report the ones past it as missing.
+bool kv_store_init(lfs_t *lfs, const sKvStoreConfig *config);
+
+//! Flushes the cache and the write queue, stops kv_store_async_worker() and
+//! releases any resources held by the backend
+void kv_store_deinit(void);
+
+//! With `skip_unchanged_writes` set, rewriting the current value returns true
+//! without touching flash and counts kSettingsFileWriteSkipped. In async mode
+//! a queued write returns before it is durable; call kv_store_flush() where
+//! that matters.
 bool kv_store_write(const char *key, const void *val, uint32_t len);
 
+//! Writes every entry or none of them, taking the lock once, and returns false
+//! only if none were written. The log backend appends the whole batch in a
+//! single commit. The file-per-key backend commits it to a journal first and
+//! then writes each key, replaying the journal if one of those writes fails.
+//! Should flash keep failing, reads can see part of the batch until the next
+//! write or kv_store_init() finishes it; writes fail until then.
+bool kv_store_write_batch(const sKvStoreBatchEntry *entries, size_t num_entries);
+
 bool kv_store_read(const char *key, void *buf, uint32_t buf_len, uint32_t *len_read);
 
+//! Reads the value from `offset` to the end in pieces of up to
+//! KV_STORE_STREAM_CHUNK_SIZE bytes, so values of any size can be served or
+//! hashed without a buffer for the whole value. Returns false if the key doesn't
+//! exist, `offset` is past the end, or the read fails. Stopping early from the
+//! callback is not a failure.
+bool kv_store_read_stream(const char *key, uint32_t offset, KvStoreReadCallback cb, void *ctx);
+
+//! Looks up the length of a value without reading it
+bool kv_store_size(const char *key, uint32_t *size);
+
+//! Deleting a key which doesn't exist succeeds. Returns false if the key
+//! couldn't be removed, in which case it keeps its value.
 bool kv_store_delete(const char *key);
+
+//! Visits every key starting with `prefix` (NULL or "" for all keys) in a
+//! single pass over the backend, streaming each value alongside its key and
+//! size. Dirty cached values are flushed first and writers wait until the walk
+//! is done. Returns false if the walk failed; stopping early is not a failure.
+bool kv_store_foreach(const char *prefix, KvStoreForeachCallback cb, void *ctx);
+
+//! Serializes the whole store into a single stream, to snapshot it in one go.
+//! The stream is a header followed by one record per key (see kv_store.c).
+bool kv_store_export(KvStoreExportCallback cb, void *ctx);
+
+//! Restores a kv_store_export() snapshot held in `buf`, overwriting keys which
+//! already exist. The snapshot is validated before anything is written, so a
+//! truncated or corrupt one is rejected as a whole. The records are then
+//! written one at a time, not as a batch: if a write fails, e.g. with flash
+//! full, false is returned with the records before it already imported.
+//! Importing the same snapshot again once the cause is fixed completes it.
+bool kv_store_import(const void *buf, uint32_t len);
+
+//! Writes any values which only exist in the RAM cache or the async write
+//! queue out to flash.
+bool kv_store_flush(void);
+
+//! Async mode only. Writes every queued value to flash, then compacts the log
+//! backend if that's due. Returns false if a write failed; the value stays
+//! queued and is retried next time. Can be called from an idle loop on systems
+//! without a worker task.
+bool kv_store_async_process(void);
+
+//! Async mode only. Like kv_store_async_process() but writes at most the oldest
+//! queued value, so a single threaded caller can get back to other work
+//! between flash writes. Sets `empty` once nothing is left queued, which is
+//! when the log backend is compacted if that's due. Returns false if the write
+//! failed.
+bool kv_store_async_process_one(bool *empty);
+
+//! Async mode only. If a value for `key` is waiting in the write queue, sets
+//! `seq` to the number it was queued under and returns true. Returns false
+//! when nothing is queued for the key, e.g. right after a kv_store_write()
+//! which went straight to flash.
+bool kv_store_async_queued_seq(const char *key, uint32_t *seq);
+
+//! Async mode only. Returns true while the value queued for `key` under `seq`
+//! hasn't been written to flash yet. Values coalesced over it count as the
+//! same write, so it stays pending until the entry holding them is written.
+//! One which failed to write stays queued and pending, as it is retried.
+bool kv_store_async_pending(const char *key, uint32_t seq);
+
+//! Async mode only. Body of the task which drains the write queue: sleeps
+//! until writes are queued and writes them out with only a shared lock held,
+//! so reads carry on meanwhile. Returns once kv_store_deinit() is called.
+void kv_store_async_worker(void);
+
+//! Reclaims space held by overwritten and deleted values, once the log
+//! backend's stale threshold is crossed. Writes never compact: without a write
+//! queue, call this from an idle context; kv_store_async_worker() and
+//! kv_store_async_process() do it after draining the queue.
+bool kv_store_compact(void);
+
+//! Reports the current state of the negative lookup filter. Returns false if
+//! the filter is disabled.
+bool kv_store_filter_stats(sKvStoreFilterStats *stats);
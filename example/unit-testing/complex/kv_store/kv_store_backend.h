@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kv_store.h"
+#include "lfs.h"
+
+typedef enum {
+  kKvStoreReadResult_Ok,
+  kKvStoreReadResult_NotFound,
+  kKvStoreReadResult_BufferTooSmall,
+  kKvStoreReadResult_Error,
+} eKvStoreReadResult;
+
+typedef void (*KvStoreKeyCallback)(const char *key, void *ctx);
+
+//! Storage layouts behind the kv_store API. kv_store.c owns locking, caching and
+//! analytics. Calls below are never concurrent: writes hold the kv_store lock
+//! exclusively and reads are serialized on its I/O mutex.
+typedef struct KvStoreBackend {
+  //! Returns false if the store can't be used
+  bool (*init)(lfs_t *lfs, const sKvStoreConfig *config);
+  void (*deinit)(void);
+  bool (*write)(const char *key, const void *val, uint32_t len);
+  //! Must apply every entry or none of them
+  bool (*write_batch)(const sKvStoreBatchEntry *entries, size_t num_entries);
+  eKvStoreReadResult (*read)(const char *key, void *buf, uint32_t buf_len, uint32_t *len_read);
+  //! Reads from `offset` through `chunk`, calling `cb` for each piece
+  eKvStoreReadResult (*read_stream)(const char *key, uint32_t offset, uint8_t *chunk,
+                                    uint32_t chunk_len, KvStoreReadCallback cb, void *ctx);
+  eKvStoreReadResult (*size)(const char *key, uint32_t *size);
+  bool (*remove)(const char *key);
+  //! Calls `cb` once for every stored key. Returns false if the walk failed.
+  bool (*for_each_key)(KvStoreKeyCallback cb, void *ctx);
+  //! Streams every key matching `prefix` with its value through `chunk`
+  bool (*for_each)(const char *prefix, uint8_t *chunk, uint32_t chunk_len,
+                   KvStoreForeachCallback cb, void *ctx);
+  //! Optional, reclaims space held by stale values once enough has built up
+  bool (*compact)(void);
+  //! Optional, whether compact() has anything to do. Cheap, so it can be
+  //! polled with only the read lock held.
+  bool (*compact_due)(void);
+} sKvStoreBackend;
+
+//! One littlefs file per key under /kv
+extern const sKvStoreBackend g_kv_store_file_backend;
+
+//! All keys appended to a single log file, indexed in RAM
+extern const sKvStoreBackend g_kv_store_log_backend;
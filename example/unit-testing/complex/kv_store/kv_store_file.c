@@ -0,0 +1,813 @@
+#include "kv_store_backend.h"
+
+#include "lfs.h"
+#include <stdio.h>
+#include <string.h>
+
+#define KV_DIR "/kv"
+// Kept out of /kv so a shard can't share its name with a flat key file
+#define KV_SHARD_DIR "/kv_shards"
+#define KV_JOURNAL_FNAME "/kv_journal"
+#define KV_JOURNAL_MAGIC 0x4E4A564B // "KVJN"
+
+// Room for "/kv_shards/xx/<key>" in the sharded layout
+#define KV_FNAME_MAX_LEN (sizeof(KV_SHARD_DIR) + 3 + LFS_NAME_MAX + 1)
+
+#define KV_ATTR_ENCODING 0x7a // 'z'
+// On /kv, the number of key directories the keys are spread over: 1 when flat
+#define KV_ATTR_NUM_SHARDS 0x73 // 's'
+
+// File handles and path buffers live on the caller's stack so no state is
+// shared between calls. The front end still serializes access to littlefs.
+static lfs_t *s_lfs_ptr;
+
+static sKvCompressor *s_compressor;
+static uint32_t s_compress_min_len;
+// Backend calls are never concurrent, so a single decoder is enough
+static sKvDecompressor s_decompressor;
+
+//
+// Key layout
+//
+// littlefs finds a file by walking its directory entry by entry, so with every
+// key directly in /kv each open gets slower as keys are added. The sharded
+// layout puts a key in /kv_shards/<shard>/<key> instead, with the shard picked
+// by a hash of the key, so each directory only holds about 1/N of the keys.
+// Shard directories are created the first time a key lands in them. The
+// count in use is recorded on /kv, and kv_store_init() moves the keys over
+// whenever it changes.
+//
+
+// 0 or 1 for the flat layout
+static uint16_t s_num_shards;
+
+static bool prv_is_sharded(void) {
+  return s_num_shards > 1;
+}
+
+//! FNV-1a, like the log backend's index
+static uint32_t prv_key_shard(const char *key) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = key; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 16777619u;
+  }
+  return hash % s_num_shards;
+}
+
+//! Name of the `i`th directory holding key files: /kv itself when flat
+static const char *prv_key_dirname(char *dirname, uint32_t i) {
+  if (prv_is_sharded()) {
+    snprintf(dirname, KV_FNAME_MAX_LEN, "%s/%02x", KV_SHARD_DIR, (unsigned)i);
+  } else {
+    snprintf(dirname, KV_FNAME_MAX_LEN, "%s", KV_DIR);
+  }
+  return dirname;
+}
+
+static uint32_t prv_num_key_dirs(void) {
+  return prv_is_sharded() ? s_num_shards : 1;
+}
+
+static const char *prv_prefix_fname(char *fname, const char *key) {
+  if (prv_is_sharded()) {
+    snprintf(fname, KV_FNAME_MAX_LEN, "%s/%02x/%s", KV_SHARD_DIR,
+             (unsigned)prv_key_shard(key), key);
+  } else {
+    snprintf(fname, KV_FNAME_MAX_LEN, "%s/%s", KV_DIR, key);
+  }
+  return fname;
+}
+
+//
+// Value files
+//
+// Every value file carries a user attribute saying how its contents are
+// encoded. Raw values get an empty attribute, which also clears the flag a
+// previous compressed value left behind. Files without the attribute, such as
+// ones written before compression existed, read back as raw.
+//
+
+typedef enum {
+  kFileEncoding_Raw = 0,
+  kFileEncoding_Compressed = 1,
+} eFileEncoding;
+
+typedef struct {
+  uint8_t encoding;
+  uint8_t reserved[3];
+  //! Size of the value once decoded
+  uint32_t raw_len;
+} sFileEncodingAttr;
+
+//! littlefs keeps pointers to the attribute and file config until the file is
+//! closed, so they live next to the handle
+typedef struct {
+  lfs_file_t file;
+  sFileEncodingAttr attr;
+  struct lfs_attr lfs_attr;
+  struct lfs_file_config cfg;
+} sValueFile;
+
+//! Opens a value file. When reading, its encoding attribute is loaded too.
+static int prv_value_open(sValueFile *vf, const char *key, int flags) {
+  char fname[KV_FNAME_MAX_LEN];
+  char dirname[KV_FNAME_MAX_LEN];
+  memset(&vf->attr, 0, sizeof(vf->attr));
+  vf->lfs_attr = (struct lfs_attr) {
+    .type = KV_ATTR_ENCODING,
+    .buffer = &vf->attr,
+    .size = sizeof(vf->attr),
+  };
+  vf->cfg = (struct lfs_file_config) {
+    .attrs = &vf->lfs_attr,
+    .attr_count = 1,
+  };
+  prv_prefix_fname(fname, key);
+  int rv = lfs_file_opencfg(s_lfs_ptr, &vf->file, fname, flags, &vf->cfg);
+  if (rv == LFS_ERR_NOENT && (flags & LFS_O_CREAT) && prv_is_sharded()) {
+    // First key in its shard
+    lfs_mkdir(s_lfs_ptr, prv_key_dirname(dirname, prv_key_shard(key)));
+    rv = lfs_file_opencfg(s_lfs_ptr, &vf->file, fname, flags, &vf->cfg);
+  }
+  return rv;
+}
+
+static bool prv_value_is_compressed(const sValueFile *vf) {
+  return vf->attr.encoding == kFileEncoding_Compressed;
+}
+
+static uint32_t prv_value_size(sValueFile *vf) {
+  return prv_value_is_compressed(vf) ? vf->attr.raw_len
+                                     : (uint32_t)lfs_file_size(s_lfs_ptr, &vf->file);
+}
+
+//! Marks a value file opened for writing as holding a raw value
+static void prv_value_set_raw(sValueFile *vf) {
+  vf->lfs_attr.size = 0;
+}
+
+static eKvStoreReadResult prv_open_result(int rv) {
+  return (rv == LFS_ERR_NOENT) ? kKvStoreReadResult_NotFound : kKvStoreReadResult_Error;
+}
+
+static bool prv_value_write_cb(const void *data, uint32_t len, void *ctx) {
+  return lfs_file_write(s_lfs_ptr, ctx, data, len) == (lfs_ssize_t)len;
+}
+
+typedef struct {
+  uint32_t skip;
+  //! Largest piece handed to `cb`, the same as for a raw value
+  uint32_t max_len;
+  KvStoreReadCallback cb;
+  void *ctx;
+  bool stopped;
+} sDecodeCtx;
+
+//! The decoder hands over up to a window at a time, which is cut down to
+//! `max_len` pieces here
+static bool prv_decode_cb(const void *data, uint32_t len, void *ctx) {
+  sDecodeCtx *decode = ctx;
+  if (decode->skip >= len) {
+    decode->skip -= len;
+    return true;
+  }
+  const uint8_t *p = (const uint8_t *)data + decode->skip;
+  len -= decode->skip;
+  decode->skip = 0;
+  while (len > 0 && !decode->stopped) {
+    const uint32_t n = len < decode->max_len ? len : decode->max_len;
+    decode->stopped = !decode->cb(p, n, decode->ctx);
+    p += n;
+    len -= n;
+  }
+  return !decode->stopped;
+}
+
+//! Streams a compressed value file through the decoder, dropping the first
+//! `offset` decoded bytes
+static eKvStoreReadResult prv_value_decode(sValueFile *vf, uint32_t offset, uint8_t *chunk,
+                                           uint32_t chunk_len, KvStoreReadCallback cb, void *ctx) {
+  sDecodeCtx decode = {
+    .skip = offset,
+    .max_len = chunk_len,
+    .cb = cb,
+    .ctx = ctx,
+  };
+  kv_decompress_init(&s_decompressor);
+
+  lfs_ssize_t n;
+  while ((n = lfs_file_read(s_lfs_ptr, &vf->file, chunk, chunk_len)) > 0) {
+    if (!kv_decompress_feed(&s_decompressor, chunk, n, prv_decode_cb, &decode)) {
+      return decode.stopped ? kKvStoreReadResult_Ok : kKvStoreReadResult_Error;
+    }
+  }
+  if (n < 0 || !kv_decompress_finish(&s_decompressor) ||
+      s_decompressor.total != vf->attr.raw_len) {
+    return kKvStoreReadResult_Error;
+  }
+  return kKvStoreReadResult_Ok;
+}
+
+static bool prv_value_write(const char *key, const void *val, uint32_t len) {
+  // Sized before anything is written, so a value which doesn't shrink enough
+  // costs some CPU time but no flash
+  uint32_t compressed_len = 0;
+  if (s_compressor && len >= s_compress_min_len) {
+    compressed_len = kv_compress(s_compressor, val, len, len - len / 8, NULL, NULL);
+  }
+
+  sValueFile vf;
+  int rv = prv_value_open(&vf, key, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+  if (rv < 0) {
+    return false;
+  }
+
+  bool success;
+  if (compressed_len > 0) {
+    vf.attr.encoding = kFileEncoding_Compressed;
+    vf.attr.raw_len = len;
+    success = kv_compress(s_compressor, val, len, compressed_len, prv_value_write_cb,
+                          &vf.file) == compressed_len;
+  } else {
+    prv_value_set_raw(&vf);
+    success = lfs_file_write(s_lfs_ptr, &vf.file, val, len) == (lfs_ssize_t)len;
+  }
+
+  rv = lfs_file_close(s_lfs_ptr, &vf.file);
+  return success && (rv >= 0);
+}
+
+typedef struct {
+  uint8_t *buf;
+  uint32_t buf_len;
+  uint32_t len;
+} sCopyCtx;
+
+static bool prv_copy_cb(const void *data, uint32_t len, void *ctx) {
+  sCopyCtx *copy = ctx;
+  if (copy->len + len > copy->buf_len) {
+    return false;
+  }
+  memcpy(&copy->buf[copy->len], data, len);
+  copy->len += len;
+  return true;
+}
+
+static eKvStoreReadResult prv_file_read(const char *key, void *buf, uint32_t buf_len, uint32_t *len_read) {
+  sValueFile vf;
+  int rv = prv_value_open(&vf, key, LFS_O_RDONLY);
+  if (rv < 0) {
+    return prv_open_result(rv);
+  }
+
+  uint32_t len = prv_value_size(&vf);
+  if (buf_len < len) {
+    lfs_file_close(s_lfs_ptr, &vf.file);
+    return kKvStoreReadResult_BufferTooSmall;
+  }
+
+  eKvStoreReadResult result = kKvStoreReadResult_Ok;
+  if (prv_value_is_compressed(&vf)) {
+    uint8_t chunk[64];
+    sCopyCtx copy = {
+      .buf = buf,
+      .buf_len = len,
+    };
+    result = prv_value_decode(&vf, 0, chunk, sizeof(chunk), prv_copy_cb, &copy);
+    if (copy.len != len) {
+      result = kKvStoreReadResult_Error;
+    }
+  } else {
+    len = lfs_file_read(s_lfs_ptr, &vf.file, buf, buf_len);
+  }
+  lfs_file_close(s_lfs_ptr, &vf.file);
+
+  *len_read = len;
+  return result;
+}
+
+static eKvStoreReadResult prv_file_read_stream(const char *key, uint32_t offset, uint8_t *chunk,
+                                               uint32_t chunk_len, KvStoreReadCallback cb, void *ctx) {
+  sValueFile vf;
+  int rv = prv_value_open(&vf, key, LFS_O_RDONLY);
+  if (rv < 0) {
+    return prv_open_result(rv);
+  }
+
+  eKvStoreReadResult result = kKvStoreReadResult_Ok;
+  if (offset > prv_value_size(&vf)) {
+    result = kKvStoreReadResult_Error;
+  } else if (prv_value_is_compressed(&vf)) {
+    // No random access into a compressed value, decode up to `offset` and
+    // throw that part away
+    result = prv_value_decode(&vf, offset, chunk, chunk_len, cb, ctx);
+    lfs_file_close(s_lfs_ptr, &vf.file);
+    return result;
+  } else if (lfs_file_seek(s_lfs_ptr, &vf.file, offset, LFS_SEEK_SET) < 0) {
+    result = kKvStoreReadResult_Error;
+  }
+
+  while (result == kKvStoreReadResult_Ok) {
+    const lfs_ssize_t n = lfs_file_read(s_lfs_ptr, &vf.file, chunk, chunk_len);
+    if (n < 0) {
+      result = kKvStoreReadResult_Error;
+    }
+    if (n <= 0 || !cb(chunk, n, ctx)) {
+      break;
+    }
+  }
+
+  lfs_file_close(s_lfs_ptr, &vf.file);
+  return result;
+}
+
+static eKvStoreReadResult prv_file_size(const char *key, uint32_t *size) {
+  // Opened rather than stat'd, as a compressed file's size is in its attribute
+  sValueFile vf;
+  int rv = prv_value_open(&vf, key, LFS_O_RDONLY);
+  if (rv < 0) {
+    return prv_open_result(rv);
+  }
+  *size = prv_value_size(&vf);
+  lfs_file_close(s_lfs_ptr, &vf.file);
+  return kKvStoreReadResult_Ok;
+}
+
+static bool prv_file_for_each_key(KvStoreKeyCallback cb, void *ctx) {
+  char dirname[KV_FNAME_MAX_LEN];
+  for (uint32_t i = 0; i < prv_num_key_dirs(); i++) {
+    lfs_dir_t dir;
+    int rv = lfs_dir_open(s_lfs_ptr, &dir, prv_key_dirname(dirname, i));
+    if (rv == LFS_ERR_NOENT && prv_is_sharded()) {
+      // No key has landed in this shard yet
+      continue;
+    }
+    if (rv < 0) {
+      return false;
+    }
+
+    struct lfs_info info;
+    while ((rv = lfs_dir_read(s_lfs_ptr, &dir, &info)) > 0) {
+      // Also skips "." and ".."
+      if (info.type == LFS_TYPE_REG) {
+        cb(info.name, ctx);
+      }
+    }
+    lfs_dir_close(s_lfs_ptr, &dir);
+    if (rv != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+typedef struct {
+  const char *key;
+  uint32_t size;
+  uint32_t offset;
+  KvStoreForeachCallback cb;
+  void *ctx;
+  bool stop;
+} sForeachDecodeCtx;
+
+static bool prv_foreach_decode_cb(const void *data, uint32_t len, void *ctx) {
+  sForeachDecodeCtx *foreach = ctx;
+  foreach->stop = !foreach->cb(foreach->key, foreach->size, foreach->offset, data, len,
+                               foreach->ctx);
+  foreach->offset += len;
+  return !foreach->stop;
+}
+
+//! Streams one file to `cb`. Sets `stop` if the callback asked to end the walk.
+static bool prv_file_stream(const char *key, uint8_t *chunk, uint32_t chunk_len,
+                            KvStoreForeachCallback cb, void *ctx, bool *stop) {
+  sValueFile vf;
+  if (prv_value_open(&vf, key, LFS_O_RDONLY) < 0) {
+    return false;
+  }
+  const uint32_t size = prv_value_size(&vf);
+
+  bool success = true;
+  if (prv_value_is_compressed(&vf)) {
+    sForeachDecodeCtx foreach = {
+      .key = key,
+      .size = size,
+      .cb = cb,
+      .ctx = ctx,
+    };
+    success = prv_value_decode(&vf, 0, chunk, chunk_len, prv_foreach_decode_cb, &foreach) ==
+              kKvStoreReadResult_Ok;
+    *stop = foreach.stop;
+    lfs_file_close(s_lfs_ptr, &vf.file);
+    return success;
+  }
+
+  uint32_t offset = 0;
+  do {
+    const lfs_ssize_t n = lfs_file_read(s_lfs_ptr, &vf.file, chunk, chunk_len);
+    if (n < 0 || (n == 0 && offset < size)) {
+      success = false;
+      break;
+    }
+    *stop = !cb(key, size, offset, chunk, n, ctx);
+    offset += n;
+  } while (!*stop && offset < size);
+
+  lfs_file_close(s_lfs_ptr, &vf.file);
+  return success;
+}
+
+//! Streams every key file in one directory whose name starts with `prefix`
+static bool prv_dir_stream(const char *dirname, const char *prefix, uint8_t *chunk,
+                           uint32_t chunk_len, KvStoreForeachCallback cb, void *ctx, bool *stop) {
+  lfs_dir_t dir;
+  int rv = lfs_dir_open(s_lfs_ptr, &dir, dirname);
+  if (rv == LFS_ERR_NOENT && prv_is_sharded()) {
+    return true;
+  }
+  if (rv < 0) {
+    return false;
+  }
+
+  // Each key costs one open on top of the walk
+  const size_t prefix_len = strlen(prefix);
+  struct lfs_info info;
+  bool success = true;
+  rv = 0;
+  while (success && !*stop && (rv = lfs_dir_read(s_lfs_ptr, &dir, &info)) > 0) {
+    if (info.type != LFS_TYPE_REG || strncmp(info.name, prefix, prefix_len) != 0) {
+      continue;
+    }
+    success = prv_file_stream(info.name, chunk, chunk_len, cb, ctx, stop);
+  }
+  lfs_dir_close(s_lfs_ptr, &dir);
+  return success && (*stop || rv == 0);
+}
+
+static bool prv_file_for_each(const char *prefix, uint8_t *chunk, uint32_t chunk_len,
+                              KvStoreForeachCallback cb, void *ctx) {
+  char dirname[KV_FNAME_MAX_LEN];
+  bool stop = false;
+  for (uint32_t i = 0; i < prv_num_key_dirs() && !stop; i++) {
+    if (!prv_dir_stream(prv_key_dirname(dirname, i), prefix, chunk, chunk_len, cb, ctx, &stop)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//! Finds a key file in the shard directory `shard_dirname` which doesn't
+//! belong there with the current layout
+static bool prv_find_misplaced_in_shard(const char *shard_dirname, char *key, char *from) {
+  lfs_dir_t dir;
+  if (lfs_dir_open(s_lfs_ptr, &dir, shard_dirname) < 0) {
+    return false;
+  }
+
+  struct lfs_info info;
+  char to[KV_FNAME_MAX_LEN];
+  bool found = false;
+  while (!found && lfs_dir_read(s_lfs_ptr, &dir, &info) > 0) {
+    if (info.type == LFS_TYPE_REG) {
+      snprintf(from, KV_FNAME_MAX_LEN, "%s/%s", shard_dirname, info.name);
+      found = strcmp(from, prv_prefix_fname(to, info.name)) != 0;
+    }
+  }
+  if (found) {
+    strcpy(key, info.name);
+  }
+  lfs_dir_close(s_lfs_ptr, &dir);
+  return found;
+}
+
+//! Finds a key file which isn't where the current layout looks for it: flat
+//! in /kv while sharded, or in a shard directory for another shard count.
+//! Sets `from` to where it is.
+static bool prv_find_misplaced_key(char *key, char *from) {
+  lfs_dir_t dir;
+  struct lfs_info info;
+  bool found = false;
+
+  if (prv_is_sharded() && lfs_dir_open(s_lfs_ptr, &dir, KV_DIR) >= 0) {
+    while (!found && lfs_dir_read(s_lfs_ptr, &dir, &info) > 0) {
+      if (info.type == LFS_TYPE_REG) {
+        snprintf(from, KV_FNAME_MAX_LEN, "%s/%s", KV_DIR, info.name);
+        strcpy(key, info.name);
+        found = true;
+      }
+    }
+    lfs_dir_close(s_lfs_ptr, &dir);
+  }
+
+  if (!found && lfs_dir_open(s_lfs_ptr, &dir, KV_SHARD_DIR) >= 0) {
+    // Shard directories are named by two hex digits, which also skips "." and ".."
+    char shard_dirname[sizeof(KV_SHARD_DIR) + 3];
+    while (!found && lfs_dir_read(s_lfs_ptr, &dir, &info) > 0) {
+      if (info.type == LFS_TYPE_DIR && strlen(info.name) == 2) {
+        snprintf(shard_dirname, sizeof(shard_dirname), "%s/%.2s", KV_SHARD_DIR, info.name);
+        found = prv_find_misplaced_in_shard(shard_dirname, key, from);
+      }
+    }
+    lfs_dir_close(s_lfs_ptr, &dir);
+  }
+  return found;
+}
+
+//! Moves every key to where the current layout looks for it, when the shard
+//! count differs from the one the store was written with, and records the
+//! new count. Returns false if a key couldn't be moved, as it would no longer
+//! be found.
+static bool prv_migrate_keys(void) {
+  const uint16_t num_key_dirs = (uint16_t)prv_num_key_dirs();
+  uint16_t stored = 0;
+  const lfs_ssize_t rv =
+      lfs_getattr(s_lfs_ptr, KV_DIR, KV_ATTR_NUM_SHARDS, &stored, sizeof(stored));
+  if (rv == (lfs_ssize_t)sizeof(stored) && stored == num_key_dirs) {
+    return true;
+  }
+
+  // Cleared first, so a reset partway through moves the rest next boot
+  // whichever count that boot uses
+  if (rv >= 0 && lfs_removeattr(s_lfs_ptr, KV_DIR, KV_ATTR_NUM_SHARDS) < 0) {
+    return false;
+  }
+
+  char key[LFS_NAME_MAX + 1];
+  char from[KV_FNAME_MAX_LEN];
+  char to[KV_FNAME_MAX_LEN];
+  char dirname[KV_FNAME_MAX_LEN];
+  // A rename shifts the entries of the directory being read, so the walk
+  // starts over after each move
+  while (prv_find_misplaced_key(key, from)) {
+    if (prv_is_sharded()) {
+      lfs_mkdir(s_lfs_ptr, prv_key_dirname(dirname, prv_key_shard(key)));
+    }
+    if (lfs_rename(s_lfs_ptr, from, prv_prefix_fname(to, key)) < 0) {
+      return false;
+    }
+  }
+
+  // Shards which are out of use cost a metadata pair each. Only empty
+  // directories can be removed, so this can't lose a key.
+  for (uint32_t i = prv_is_sharded() ? s_num_shards : 0; i < KV_STORE_FILE_MAX_SHARDS; i++) {
+    snprintf(dirname, sizeof(dirname), "%s/%02x", KV_SHARD_DIR, (unsigned)i);
+    lfs_remove(s_lfs_ptr, dirname);
+  }
+  if (!prv_is_sharded()) {
+    lfs_remove(s_lfs_ptr, KV_SHARD_DIR);
+  }
+
+  return lfs_setattr(s_lfs_ptr, KV_DIR, KV_ATTR_NUM_SHARDS, &num_key_dirs,
+                     sizeof(num_key_dirs)) >= 0;
+}
+
+//
+// Batch journal
+//
+// littlefs only guarantees atomicity per file, so a batch is first written to a
+// single journal file (one commit) and then applied key by key. The journal
+// ends with a trailer, so a journal cut short by a reset is detected and
+// discarded, and a complete one is replayed by kv_store_init(). Once committed
+// a batch is only ever rolled forward: if applying it fails it's replayed from
+// the journal, and until that succeeds nothing else is written, since a later
+// replay would overwrite it.
+//
+
+#define KV_JOURNAL_MAX_REPLAYS 2
+
+//! A committed journal is still on flash
+static bool s_journal_pending;
+
+typedef struct {
+  uint32_t key_len;
+  uint32_t val_len;
+} sJournalRecordHdr;
+
+typedef struct {
+  uint32_t num_entries;
+  uint32_t magic;
+} sJournalTrailer;
+
+static bool prv_journal_append(lfs_file_t *journal, const void *data, uint32_t len) {
+  return lfs_file_write(s_lfs_ptr, journal, data, len) == (lfs_ssize_t)len;
+}
+
+static bool prv_journal_write(const sKvStoreBatchEntry *entries, size_t num_entries) {
+  lfs_file_t journal;
+  int rv = lfs_file_open(s_lfs_ptr, &journal, KV_JOURNAL_FNAME,
+                         LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+  if (rv < 0) {
+    return false;
+  }
+
+  bool success = true;
+  for (size_t i = 0; i < num_entries && success; i++) {
+    const sJournalRecordHdr hdr = {
+      .key_len = strlen(entries[i].key),
+      .val_len = entries[i].len,
+    };
+    success = prv_journal_append(&journal, &hdr, sizeof(hdr)) &&
+              prv_journal_append(&journal, entries[i].key, hdr.key_len) &&
+              prv_journal_append(&journal, entries[i].val, hdr.val_len);
+  }
+
+  const sJournalTrailer trailer = {
+    .num_entries = num_entries,
+    .magic = KV_JOURNAL_MAGIC,
+  };
+  success = success && prv_journal_append(&journal, &trailer, sizeof(trailer));
+
+  rv = lfs_file_close(s_lfs_ptr, &journal);
+  if (!success || rv < 0) {
+    lfs_remove(s_lfs_ptr, KV_JOURNAL_FNAME);
+    return false;
+  }
+  return true;
+}
+
+static bool prv_journal_read_at(lfs_file_t *journal, lfs_soff_t off, void *buf, uint32_t len) {
+  if (lfs_file_seek(s_lfs_ptr, journal, off, LFS_SEEK_SET) < 0) {
+    return false;
+  }
+  return lfs_file_read(s_lfs_ptr, journal, buf, len) == (lfs_ssize_t)len;
+}
+
+static bool prv_journal_is_complete(lfs_file_t *journal) {
+  const lfs_soff_t size = lfs_file_size(s_lfs_ptr, journal);
+  sJournalTrailer trailer;
+  if (size < (lfs_soff_t)sizeof(trailer) ||
+      !prv_journal_read_at(journal, size - sizeof(trailer), &trailer, sizeof(trailer)) ||
+      trailer.magic != KV_JOURNAL_MAGIC) {
+    return false;
+  }
+
+  const lfs_soff_t records_end = size - sizeof(trailer);
+  lfs_soff_t off = 0;
+  uint32_t count = 0;
+  while (off < records_end) {
+    sJournalRecordHdr hdr;
+    if (!prv_journal_read_at(journal, off, &hdr, sizeof(hdr)) ||
+        hdr.key_len == 0 || hdr.key_len > LFS_NAME_MAX) {
+      return false;
+    }
+    off += sizeof(hdr) + hdr.key_len + hdr.val_len;
+    count++;
+  }
+  return (off == records_end) && (count == trailer.num_entries);
+}
+
+//! Copies `len` bytes from the journal's current position into the key's file
+static bool prv_journal_apply_record(lfs_file_t *journal, const char *key, uint32_t len) {
+  sValueFile vf;
+  int rv = prv_value_open(&vf, key, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+  if (rv < 0) {
+    return false;
+  }
+  prv_value_set_raw(&vf);
+
+  bool success = true;
+  uint8_t chunk[64];
+  while (len > 0 && success) {
+    const uint32_t chunk_len = len < sizeof(chunk) ? len : sizeof(chunk);
+    success = (lfs_file_read(s_lfs_ptr, journal, chunk, chunk_len) == (lfs_ssize_t)chunk_len) &&
+              (lfs_file_write(s_lfs_ptr, &vf.file, chunk, chunk_len) == (lfs_ssize_t)chunk_len);
+    len -= chunk_len;
+  }
+
+  rv = lfs_file_close(s_lfs_ptr, &vf.file);
+  return success && (rv >= 0);
+}
+
+static void prv_journal_replay(void) {
+  lfs_file_t journal;
+  char key[LFS_NAME_MAX + 1];
+  int rv = lfs_file_open(s_lfs_ptr, &journal, KV_JOURNAL_FNAME, LFS_O_RDONLY);
+  if (rv < 0) {
+    // No batch was in flight
+    s_journal_pending = false;
+    return;
+  }
+
+  // An incomplete journal means the batch never committed; drop it
+  bool discard = !prv_journal_is_complete(&journal);
+
+  const lfs_soff_t records_end = lfs_file_size(s_lfs_ptr, &journal) - sizeof(sJournalTrailer);
+  lfs_soff_t off = 0;
+  while (!discard && off < records_end) {
+    sJournalRecordHdr hdr;
+    if (!prv_journal_read_at(&journal, off, &hdr, sizeof(hdr)) ||
+        lfs_file_read(s_lfs_ptr, &journal, key, hdr.key_len) != (lfs_ssize_t)hdr.key_len) {
+      break;
+    }
+    key[hdr.key_len] = '\0';
+    if (!prv_journal_apply_record(&journal, key, hdr.val_len)) {
+      break;
+    }
+    off += sizeof(hdr) + hdr.key_len + hdr.val_len;
+  }
+  lfs_file_close(s_lfs_ptr, &journal);
+
+  // Keep a complete journal which failed to apply so it's retried
+  s_journal_pending = true;
+  if (discard || off >= records_end) {
+    s_journal_pending = lfs_remove(s_lfs_ptr, KV_JOURNAL_FNAME) < 0;
+  }
+}
+
+//! Finishes a committed batch which couldn't be fully applied yet. Returns
+//! false if it still can't be, and nothing else may be written.
+static bool prv_journal_settle(void) {
+  if (s_journal_pending) {
+    prv_journal_replay();
+  }
+  return !s_journal_pending;
+}
+
+static bool prv_file_write(const char *key, const void *val, uint32_t len) {
+  return prv_journal_settle() && prv_value_write(key, val, len);
+}
+
+static bool prv_file_remove(const char *key) {
+  if (!prv_journal_settle()) {
+    return false;
+  }
+  char fname[KV_FNAME_MAX_LEN];
+  const int rv = lfs_remove(s_lfs_ptr, prv_prefix_fname(fname, key));
+  // A key which was never written is as good as removed
+  return rv == 0 || rv == LFS_ERR_NOENT;
+}
+
+static bool prv_file_write_batch(const sKvStoreBatchEntry *entries, size_t num_entries) {
+  if (!prv_journal_settle()) {
+    return false;
+  }
+
+  // A single file write is already atomic, only pay for the journal when it
+  // buys us something
+  if (num_entries == 1) {
+    return prv_value_write(entries[0].key, entries[0].val, entries[0].len);
+  }
+
+  if (!prv_journal_write(entries, num_entries)) {
+    return false;
+  }
+
+  // Committed, so from here on the batch is rolled forward and true returned
+  bool applied = true;
+  for (size_t i = 0; i < num_entries && applied; i++) {
+    applied = prv_value_write(entries[i].key, entries[i].val, entries[i].len);
+  }
+  if (applied) {
+    s_journal_pending = lfs_remove(s_lfs_ptr, KV_JOURNAL_FNAME) < 0;
+    return true;
+  }
+
+  // Start over from the journal, which holds every value of the batch. If
+  // that fails too, the next write or kv_store_init() tries again.
+  s_journal_pending = true;
+  for (int i = 0; i < KV_JOURNAL_MAX_REPLAYS && s_journal_pending; i++) {
+    prv_journal_replay();
+  }
+  return true;
+}
+
+static bool prv_file_init(lfs_t *lfs, const sKvStoreConfig *config) {
+  s_lfs_ptr = lfs;
+  s_compressor = config ? config->compressor : NULL;
+  s_compress_min_len = KV_STORE_COMPRESS_DEFAULT_MIN_LEN;
+  if (config && config->compress_min_len) {
+    s_compress_min_len = config->compress_min_len;
+  }
+  s_num_shards = config ? config->file_num_shards : 0;
+  if (s_num_shards > KV_STORE_FILE_MAX_SHARDS) {
+    s_num_shards = KV_STORE_FILE_MAX_SHARDS;
+  }
+  lfs_mkdir(s_lfs_ptr, KV_DIR);
+  if (prv_is_sharded()) {
+    lfs_mkdir(s_lfs_ptr, KV_SHARD_DIR);
+  }
+  if (!prv_migrate_keys()) {
+    return false;
+  }
+  prv_journal_replay();
+  return true;
+}
+
+static void prv_file_deinit(void) {
+}
+
+const sKvStoreBackend g_kv_store_file_backend = {
+  .init = prv_file_init,
+  .deinit = prv_file_deinit,
+  .write = prv_file_write,
+  .write_batch = prv_file_write_batch,
+  .read = prv_file_read,
+  .read_stream = prv_file_read_stream,
+  .size = prv_file_size,
+  .remove = prv_file_remove,
+  .for_each_key = prv_file_for_each_key,
+  .for_each = prv_file_for_each,
+  .compact = NULL,
+  .compact_due = NULL,
+};
@@ -0,0 +1,555 @@
+#include "kv_store_backend.h"
+
+#include "lfs.h"
+#include <string.h>
+
+//
+// Log-structured backend
+//
+// Every write or delete appends a record to a single file and is committed
+// with one lfs_file_sync(). A RAM index maps a hash of each live key to the
+// offset of its newest record. Only the hash is kept in RAM, so a hit is
+// confirmed by comparing the key stored in the record.
+//
+// Once enough of the log is stale, the live records are copied into a new
+// file which atomically replaces the old one with lfs_rename(). Writes don't
+// do this themselves, kv_store.c runs it off the write path.
+//
+
+#define KV_LOG_FNAME "/kv.log"
+#define KV_LOG_COMPACT_FNAME "/kv.log.tmp"
+
+#define KV_LOG_FLAG_TOMBSTONE (1 << 0)
+
+typedef struct {
+  uint16_t key_len;
+  uint16_t flags;
+  uint32_t val_len;
+} sLogRecordHdr;
+
+static sKvStoreLogIndexEntry s_default_index[KV_STORE_LOG_DEFAULT_INDEX_LEN];
+
+static struct {
+  lfs_t *lfs;
+  lfs_file_t file;
+  bool file_open;
+
+  sKvStoreLogIndexEntry *index;
+  size_t index_len;
+
+  //! Offset where the next record will be appended
+  uint32_t end;
+  //! Bytes belonging to the newest record of a live key
+  uint32_t live_bytes;
+  uint8_t compact_threshold_pct;
+} s_log;
+
+static char s_key_buf[LFS_NAME_MAX + 1];
+
+// FNV-1a
+static uint32_t prv_hash(const char *key, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t prv_record_size(uint32_t key_len, uint32_t val_len) {
+  return sizeof(sLogRecordHdr) + key_len + val_len;
+}
+
+static uint32_t prv_entry_size(const sKvStoreLogIndexEntry *entry) {
+  return prv_record_size(entry->key_len, entry->val_len);
+}
+
+static bool prv_read_at(lfs_file_t *file, uint32_t off, void *buf, uint32_t len) {
+  if (lfs_file_seek(s_log.lfs, file, off, LFS_SEEK_SET) < 0) {
+    return false;
+  }
+  return lfs_file_read(s_log.lfs, file, buf, len) == (lfs_ssize_t)len;
+}
+
+static bool prv_key_matches(const sKvStoreLogIndexEntry *entry, const char *key,
+                            size_t key_len, uint32_t hash) {
+  if (!entry->valid || entry->key_hash != hash || entry->key_len != key_len) {
+    return false;
+  }
+
+  // Hashes match, confirm against the key stored in the record
+  const uint32_t key_off = entry->offset + sizeof(sLogRecordHdr);
+  uint8_t chunk[32];
+  for (size_t done = 0; done < key_len; done += sizeof(chunk)) {
+    const size_t n = (key_len - done) < sizeof(chunk) ? (key_len - done) : sizeof(chunk);
+    if (!prv_read_at(&s_log.file, key_off + done, chunk, n) ||
+        memcmp(chunk, &key[done], n) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static sKvStoreLogIndexEntry *prv_index_find(const char *key, size_t key_len) {
+  const uint32_t hash = prv_hash(key, key_len);
+  for (size_t i = 0; i < s_log.index_len; i++) {
+    if (prv_key_matches(&s_log.index[i], key, key_len, hash)) {
+      return &s_log.index[i];
+    }
+  }
+  return NULL;
+}
+
+static sKvStoreLogIndexEntry *prv_index_alloc(void) {
+  for (size_t i = 0; i < s_log.index_len; i++) {
+    if (!s_log.index[i].valid) {
+      return &s_log.index[i];
+    }
+  }
+  return NULL;
+}
+
+static size_t prv_index_num_free(void) {
+  size_t num_free = 0;
+  for (size_t i = 0; i < s_log.index_len; i++) {
+    if (!s_log.index[i].valid) {
+      num_free++;
+    }
+  }
+  return num_free;
+}
+
+//! Points the index at a record which was just appended at `offset`
+static bool prv_index_apply(const char *key, size_t key_len, uint16_t flags,
+                            uint32_t val_len, uint32_t offset) {
+  sKvStoreLogIndexEntry *entry = prv_index_find(key, key_len);
+  if (entry) {
+    s_log.live_bytes -= prv_entry_size(entry);
+    entry->valid = false;
+  }
+  if (flags & KV_LOG_FLAG_TOMBSTONE) {
+    return true;
+  }
+
+  entry = prv_index_alloc();
+  if (!entry) {
+    return false;
+  }
+  *entry = (sKvStoreLogIndexEntry) {
+    .key_hash = prv_hash(key, key_len),
+    .offset = offset,
+    .val_len = val_len,
+    .key_len = key_len,
+    .valid = true,
+  };
+  s_log.live_bytes += prv_entry_size(entry);
+  return true;
+}
+
+static bool prv_append(const char *key, uint16_t flags, const void *val, uint32_t val_len) {
+  const sLogRecordHdr hdr = {
+    .key_len = strlen(key),
+    .flags = flags,
+    .val_len = val_len,
+  };
+  if (lfs_file_seek(s_log.lfs, &s_log.file, s_log.end, LFS_SEEK_SET) < 0) {
+    return false;
+  }
+
+  const bool success =
+      (lfs_file_write(s_log.lfs, &s_log.file, &hdr, sizeof(hdr)) == sizeof(hdr)) &&
+      (lfs_file_write(s_log.lfs, &s_log.file, key, hdr.key_len) == hdr.key_len) &&
+      (lfs_file_write(s_log.lfs, &s_log.file, val, val_len) == (lfs_ssize_t)val_len);
+  if (success) {
+    s_log.end += prv_record_size(hdr.key_len, val_len);
+  }
+  return success;
+}
+
+//! Commits everything appended since the last commit, or rolls it back
+static bool prv_commit(uint32_t rollback_end) {
+  if (lfs_file_sync(s_log.lfs, &s_log.file) >= 0) {
+    return true;
+  }
+  lfs_file_truncate(s_log.lfs, &s_log.file, rollback_end);
+  s_log.end = rollback_end;
+  return false;
+}
+
+static bool prv_log_open(void) {
+  int rv = lfs_file_open(s_log.lfs, &s_log.file, KV_LOG_FNAME, LFS_O_RDWR | LFS_O_CREAT);
+  s_log.file_open = (rv >= 0);
+  return s_log.file_open;
+}
+
+static void prv_log_close(void) {
+  if (s_log.file_open) {
+    lfs_file_close(s_log.lfs, &s_log.file);
+    s_log.file_open = false;
+  }
+}
+
+//! Rebuilds the RAM index by replaying the log from the start. Returns false
+//! if the log holds more live keys than the index can track.
+static bool prv_log_scan(void) {
+  const uint32_t size = lfs_file_size(s_log.lfs, &s_log.file);
+  uint32_t off = 0;
+  bool index_overflow = false;
+  while (off + sizeof(sLogRecordHdr) <= size) {
+    sLogRecordHdr hdr;
+    if (!prv_read_at(&s_log.file, off, &hdr, sizeof(hdr)) ||
+        hdr.key_len == 0 || hdr.key_len > LFS_NAME_MAX ||
+        off + prv_record_size(hdr.key_len, hdr.val_len) > size ||
+        lfs_file_read(s_log.lfs, &s_log.file, s_key_buf, hdr.key_len) != hdr.key_len) {
+      break;
+    }
+    if (!prv_index_apply(s_key_buf, hdr.key_len, hdr.flags, hdr.val_len, off)) {
+      index_overflow = true;
+    }
+    off += prv_record_size(hdr.key_len, hdr.val_len);
+  }
+
+  // Anything past the last good record can't be trusted, drop it
+  s_log.end = off;
+  if (off != size) {
+    lfs_file_truncate(s_log.lfs, &s_log.file, off);
+    lfs_file_sync(s_log.lfs, &s_log.file);
+  }
+  return !index_overflow;
+}
+
+static bool prv_copy_record(lfs_file_t *dst, const sKvStoreLogIndexEntry *entry) {
+  uint8_t chunk[64];
+  uint32_t remaining = prv_entry_size(entry);
+  uint32_t off = entry->offset;
+  while (remaining > 0) {
+    const uint32_t n = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+    if (!prv_read_at(&s_log.file, off, chunk, n) ||
+        lfs_file_write(s_log.lfs, dst, chunk, n) != (lfs_ssize_t)n) {
+      return false;
+    }
+    off += n;
+    remaining -= n;
+  }
+  return true;
+}
+
+static bool prv_log_compact_due(void) {
+  if (!s_log.file_open) {
+    return false;
+  }
+  const uint32_t stale = s_log.end - s_log.live_bytes;
+  // Don't bother until at least a block's worth of space can be reclaimed
+  if (stale < s_log.lfs->cfg->block_size) {
+    return false;
+  }
+  return (uint64_t)stale * 100 >= (uint64_t)s_log.end * s_log.compact_threshold_pct;
+}
+
+static bool prv_log_compact(void) {
+  if (!s_log.file_open) {
+    return false;
+  }
+  if (!prv_log_compact_due()) {
+    return true;
+  }
+
+  lfs_file_t dst;
+  int rv = lfs_file_open(s_log.lfs, &dst, KV_LOG_COMPACT_FNAME,
+                         LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+  if (rv < 0) {
+    return false;
+  }
+
+  bool success = true;
+  for (size_t i = 0; i < s_log.index_len && success; i++) {
+    if (s_log.index[i].valid) {
+      success = prv_copy_record(&dst, &s_log.index[i]);
+    }
+  }
+  rv = lfs_file_close(s_log.lfs, &dst);
+  if (!success || rv < 0) {
+    lfs_remove(s_log.lfs, KV_LOG_COMPACT_FNAME);
+    return false;
+  }
+
+  // The rename is the commit point, the old log stays valid until then
+  prv_log_close();
+  rv = lfs_rename(s_log.lfs, KV_LOG_COMPACT_FNAME, KV_LOG_FNAME);
+  if (!prv_log_open()) {
+    return false;
+  }
+  if (rv < 0) {
+    lfs_remove(s_log.lfs, KV_LOG_COMPACT_FNAME);
+    return false;
+  }
+
+  // Records were copied in index order, so the new offsets follow from that
+  uint32_t off = 0;
+  for (size_t i = 0; i < s_log.index_len; i++) {
+    if (s_log.index[i].valid) {
+      s_log.index[i].offset = off;
+      off += prv_entry_size(&s_log.index[i]);
+    }
+  }
+  s_log.end = off;
+  s_log.live_bytes = off;
+  return true;
+}
+
+static bool prv_log_init(lfs_t *lfs, const sKvStoreConfig *config) {
+  prv_log_close();
+  memset(&s_log, 0, sizeof(s_log));
+  s_log.lfs = lfs;
+
+  if (config && config->log_index) {
+    s_log.index = config->log_index;
+    s_log.index_len = config->log_index_len;
+  } else {
+    s_log.index = s_default_index;
+    s_log.index_len = KV_STORE_LOG_DEFAULT_INDEX_LEN;
+  }
+  memset(s_log.index, 0, s_log.index_len * sizeof(*s_log.index));
+
+  s_log.compact_threshold_pct = KV_STORE_LOG_DEFAULT_COMPACT_PCT;
+  if (config && config->log_compact_threshold_pct) {
+    s_log.compact_threshold_pct = config->log_compact_threshold_pct;
+  }
+
+  // A leftover compaction file never got renamed into place, so the log is
+  // still the source of truth
+  lfs_remove(lfs, KV_LOG_COMPACT_FNAME);
+
+  if (!prv_log_open()) {
+    return false;
+  }
+  if (!prv_log_scan()) {
+    // Keys the index lost track of would read as missing and be dropped by
+    // the next compaction, so the log stays closed and every call fails
+    prv_log_close();
+    return false;
+  }
+  return true;
+}
+
+static void prv_log_deinit(void) {
+  prv_log_close();
+}
+
+//! Whether one of the first `num_entries` entries is for `key`, so a key
+//! written twice in one batch only needs one index slot
+static bool prv_batch_has_key(const sKvStoreBatchEntry *entries, size_t num_entries,
+                              const char *key) {
+  for (size_t i = 0; i < num_entries; i++) {
+    if (strcmp(entries[i].key, key) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool prv_log_write_batch(const sKvStoreBatchEntry *entries, size_t num_entries) {
+  if (!s_log.file_open) {
+    return false;
+  }
+
+  // Make sure every new key fits in the index before touching flash so the
+  // batch can't be left half applied
+  size_t num_new_keys = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    const size_t key_len = strlen(entries[i].key);
+    if (key_len == 0 || key_len > LFS_NAME_MAX) {
+      return false;
+    }
+    if (!prv_index_find(entries[i].key, key_len) &&
+        !prv_batch_has_key(entries, i, entries[i].key)) {
+      num_new_keys++;
+    }
+  }
+  if (num_new_keys > prv_index_num_free()) {
+    return false;
+  }
+
+  const uint32_t start = s_log.end;
+  bool success = true;
+  for (size_t i = 0; i < num_entries && success; i++) {
+    success = prv_append(entries[i].key, 0, entries[i].val, entries[i].len);
+  }
+  if (!success) {
+    lfs_file_truncate(s_log.lfs, &s_log.file, start);
+    s_log.end = start;
+    return false;
+  }
+  if (!prv_commit(start)) {
+    return false;
+  }
+
+  uint32_t off = start;
+  for (size_t i = 0; i < num_entries; i++) {
+    const size_t key_len = strlen(entries[i].key);
+    prv_index_apply(entries[i].key, key_len, 0, entries[i].len, off);
+    off += prv_record_size(key_len, entries[i].len);
+  }
+  return true;
+}
+
+static bool prv_log_write(const char *key, const void *val, uint32_t len) {
+  const sKvStoreBatchEntry entry = {
+    .key = key,
+    .val = val,
+    .len = len,
+  };
+  return prv_log_write_batch(&entry, 1);
+}
+
+static eKvStoreReadResult prv_log_read(const char *key, void *buf, uint32_t buf_len, uint32_t *len_read) {
+  if (!s_log.file_open) {
+    return kKvStoreReadResult_Error;
+  }
+  const size_t key_len = strlen(key);
+  const sKvStoreLogIndexEntry *entry = prv_index_find(key, key_len);
+  if (!entry) {
+    return kKvStoreReadResult_NotFound;
+  }
+  if (buf_len < entry->val_len) {
+    return kKvStoreReadResult_BufferTooSmall;
+  }
+
+  const uint32_t val_off = entry->offset + sizeof(sLogRecordHdr) + key_len;
+  if (!prv_read_at(&s_log.file, val_off, buf, entry->val_len)) {
+    return kKvStoreReadResult_Error;
+  }
+  *len_read = entry->val_len;
+  return kKvStoreReadResult_Ok;
+}
+
+static eKvStoreReadResult prv_log_read_stream(const char *key, uint32_t offset, uint8_t *chunk,
+                                              uint32_t chunk_len, KvStoreReadCallback cb, void *ctx) {
+  if (!s_log.file_open) {
+    return kKvStoreReadResult_Error;
+  }
+  const size_t key_len = strlen(key);
+  const sKvStoreLogIndexEntry *entry = prv_index_find(key, key_len);
+  if (!entry) {
+    return kKvStoreReadResult_NotFound;
+  }
+  if (offset > entry->val_len) {
+    return kKvStoreReadResult_Error;
+  }
+
+  uint32_t off = entry->offset + sizeof(sLogRecordHdr) + key_len + offset;
+  uint32_t remaining = entry->val_len - offset;
+  if (lfs_file_seek(s_log.lfs, &s_log.file, off, LFS_SEEK_SET) < 0) {
+    return kKvStoreReadResult_Error;
+  }
+  while (remaining > 0) {
+    const uint32_t n = remaining < chunk_len ? remaining : chunk_len;
+    if (lfs_file_read(s_log.lfs, &s_log.file, chunk, n) != (lfs_ssize_t)n) {
+      return kKvStoreReadResult_Error;
+    }
+    remaining -= n;
+    if (!cb(chunk, n, ctx)) {
+      break;
+    }
+  }
+  return kKvStoreReadResult_Ok;
+}
+
+static eKvStoreReadResult prv_log_size(const char *key, uint32_t *size) {
+  if (!s_log.file_open) {
+    return kKvStoreReadResult_Error;
+  }
+  const sKvStoreLogIndexEntry *entry = prv_index_find(key, strlen(key));
+  if (!entry) {
+    return kKvStoreReadResult_NotFound;
+  }
+  *size = entry->val_len;
+  return kKvStoreReadResult_Ok;
+}
+
+static bool prv_log_remove(const char *key) {
+  if (!s_log.file_open) {
+    return false;
+  }
+  const size_t key_len = strlen(key);
+  if (!prv_index_find(key, key_len)) {
+    return true;
+  }
+
+  const uint32_t start = s_log.end;
+  if (!prv_append(key, KV_LOG_FLAG_TOMBSTONE, NULL, 0) || !prv_commit(start)) {
+    return false;
+  }
+  prv_index_apply(key, key_len, KV_LOG_FLAG_TOMBSTONE, 0, start);
+  return true;
+}
+
+static bool prv_log_for_each(const char *prefix, uint8_t *chunk, uint32_t chunk_len,
+                             KvStoreForeachCallback cb, void *ctx) {
+  if (!s_log.file_open) {
+    return false;
+  }
+  const size_t prefix_len = strlen(prefix);
+  for (size_t i = 0; i < s_log.index_len; i++) {
+    const sKvStoreLogIndexEntry *entry = &s_log.index[i];
+    if (!entry->valid) {
+      continue;
+    }
+    const uint32_t key_off = entry->offset + sizeof(sLogRecordHdr);
+    if (!prv_read_at(&s_log.file, key_off, s_key_buf, entry->key_len)) {
+      return false;
+    }
+    s_key_buf[entry->key_len] = '\0';
+    if (strncmp(s_key_buf, prefix, prefix_len) != 0) {
+      continue;
+    }
+
+    // The value directly follows the key, so no further seek is needed
+    uint32_t offset = 0;
+    do {
+      const uint32_t remaining = entry->val_len - offset;
+      const uint32_t n = remaining < chunk_len ? remaining : chunk_len;
+      if (lfs_file_read(s_log.lfs, &s_log.file, chunk, n) != (lfs_ssize_t)n) {
+        return false;
+      }
+      if (!cb(s_key_buf, entry->val_len, offset, chunk, n, ctx)) {
+        return true;
+      }
+      offset += n;
+    } while (offset < entry->val_len);
+  }
+  return true;
+}
+
+static bool prv_log_for_each_key(KvStoreKeyCallback cb, void *ctx) {
+  if (!s_log.file_open) {
+    return false;
+  }
+  for (size_t i = 0; i < s_log.index_len; i++) {
+    const sKvStoreLogIndexEntry *entry = &s_log.index[i];
+    if (!entry->valid) {
+      continue;
+    }
+    if (!prv_read_at(&s_log.file, entry->offset + sizeof(sLogRecordHdr), s_key_buf, entry->key_len)) {
+      return false;
+    }
+    s_key_buf[entry->key_len] = '\0';
+    cb(s_key_buf, ctx);
+  }
+  return true;
+}
+
+const sKvStoreBackend g_kv_store_log_backend = {
+  .init = prv_log_init,
+  .deinit = prv_log_deinit,
+  .write = prv_log_write,
+  .write_batch = prv_log_write_batch,
+  .read = prv_log_read,
+  .read_stream = prv_log_read_stream,
+  .size = prv_log_size,
+  .remove = prv_log_remove,
+  .for_each_key = prv_log_for_each_key,
+  .for_each = prv_log_for_each,
+  .compact = prv_log_compact,
+  .compact_due = prv_log_compact_due,
+};
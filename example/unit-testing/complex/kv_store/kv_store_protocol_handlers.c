@@ -5,26 +5,91 @@
 #include <stdint.h>
 #include <string.h>
 
-void kv_store_read_protocol_cmd(
-    const uint8_t *buffer, size_t len,
-    uint8_t *resp_buffer, size_t *resp_len) {
+//! An async write which kv_store has queued and which is acked once its value
+//! is in flash
+typedef struct {
+  sProtocolRequest req;
+  //! The key and the number kv_store queued the value under
+  char key[KV_STORE_CACHE_KEY_MAX_LEN + 1];
+  uint32_t seq;
+} sPendingWrite;
+
+static sPendingWrite s_pending[KV_STORE_PROTOCOL_MAX_PENDING];
+static size_t s_num_pending;
+
+//! Where a streamed read lands in the response
+typedef struct {
+  uint8_t *buf;
+  uint32_t buf_len;
+  uint32_t len;
+} sReadPieceCtx;
+
+static bool prv_read_piece_cb(const void *chunk, uint32_t len, void *ctx) {
+  sReadPieceCtx *piece = (sReadPieceCtx *)ctx;
+  const uint32_t n = (len < piece->buf_len - piece->len) ? len : piece->buf_len - piece->len;
+  memcpy(&piece->buf[piece->len], chunk, n);
+  piece->len += n;
+  // Stops once the response is full, the client asks for the rest
+  return piece->len < piece->buf_len;
+}
+
+//! Reads as much of the value from `offset` as fits in `buf`
+static bool prv_read_piece(const char *key, uint32_t offset, uint8_t *buf, uint32_t buf_len,
+                           uint32_t *len_read) {
+  if (offset == 0) {
+    // Whole values which fit go through kv_store_read(), which also keeps
+    // them in the RAM cache
+    if (kv_store_read(key, buf, buf_len, len_read)) {
+      return true;
+    }
+    uint32_t size;
+    if (!kv_store_size(key, &size) || size <= buf_len) {
+      return false;
+    }
+  }
+
+  sReadPieceCtx piece = {
+    .buf = buf,
+    .buf_len = buf_len,
+  };
+  if (!kv_store_read_stream(key, offset, prv_read_piece_cb, &piece)) {
+    return false;
+  }
+  *len_read = piece.len;
+  return true;
+}
+
+void kv_store_read_protocol_cmd(const uint8_t *buffer, size_t len, sProtocolResponse *resp) {
+
+  // Buffer should be in format:
+  // <key_bytes>\0[<offset (uint32_t)>]
 
   // Forgo error checking for simplicity
   const char *key = (char *)buffer;
-  // Simply read the value into the resp_buffer
+  const size_t key_len = strlen(key) + 1;
+  uint32_t offset = 0;
+  if (len >= key_len + sizeof(offset)) {
+    memcpy(&offset, &buffer[key_len], sizeof(offset));
+  }
+
+  // Read the value straight into the response, so it's only copied once on
+  // its way from flash to the transport
+  const size_t space = protocol_response_space(resp);
+  uint8_t *val = protocol_response_reserve(resp, space);
   bool success = false;
+  uint32_t len_read = 0;
   int retries_left = 3;
   while (--retries_left >= 0) {
-    success = kv_store_read(key, resp_buffer, (uint32_t)*resp_len, (uint32_t *)resp_len);
+    success = prv_read_piece(key, offset, val, (uint32_t)space, &len_read);
     if (success){
       break;
     }
   }
+  // An empty response when the key couldn't be read
+  protocol_response_commit(resp, success ? len_read : 0);
 }
 
-void kv_store_write_protocol_cmd(
-    const uint8_t *buffer, size_t len,
-    uint8_t *resp_buffer, size_t *resp_len) {
+static bool prv_write(const uint8_t *buffer, size_t len) {
 
   // Buffer should be in format:
   // <key_bytes>\0<value_bytes>
@@ -37,8 +102,79 @@ void kv_store_write_protocol_cmd(
   const uint8_t *val_ptr = buffer + key_len + 1;
   const size_t val_len = len - key_len - 1;
 
-  kv_store_write(key, val_ptr, val_len);
-  // Write an ACK of sorts
-  *resp_buffer = 1;
-  *resp_len = 1;
+  return kv_store_write(key, val_ptr, val_len);
+}
+
+static void prv_write_ack(sProtocolResponse *resp, bool success) {
+  // Write an ACK of sorts, 0 when the write failed
+  const uint8_t ack = success ? 1 : 0;
+  protocol_response_write(resp, &ack, sizeof(ack));
+}
+
+static void prv_complete_write(const sProtocolRequest *req) {
+  uint8_t buf[1];
+  sProtocolResponse resp;
+  protocol_response_init(&resp, buf, sizeof(buf), 0);
+  prv_write_ack(&resp, true);
+  protocol_complete(req, kProtocolCode_Ok, &resp);
+}
+
+void kv_store_write_protocol_cmd(const uint8_t *buffer, size_t len, sProtocolResponse *resp) {
+  prv_write_ack(resp, prv_write(buffer, len));
+}
+
+eProtocolCode kv_store_write_protocol_async_cmd(const sProtocolRequest *req,
+                                                const uint8_t *buffer, size_t len,
+                                                sProtocolResponse *resp) {
+  // Only turned away before kv_store sees it, so a retry can't apply it twice
+  if (s_num_pending == KV_STORE_PROTOCOL_MAX_PENDING) {
+    return kProtocolCode_Busy;
+  }
+  if (!prv_write(buffer, len)) {
+    prv_write_ack(resp, false);
+    return kProtocolCode_Ok;
+  }
+
+  // Values too large for the queue, or written while it was full, are
+  // already in flash
+  sPendingWrite *pending = &s_pending[s_num_pending];
+  const char *key = (const char *)buffer;
+  if (!kv_store_async_queued_seq(key, &pending->seq)) {
+    prv_write_ack(resp, true);
+    return kProtocolCode_Ok;
+  }
+  pending->req = *req;
+  strcpy(pending->key, key);
+  s_num_pending++;
+  return kProtocolCode_Pending;
+}
+
+bool kv_store_protocol_process(void) {
+  if (s_num_pending == 0) {
+    return false;
+  }
+
+  // One flash write per call, so frames which arrive meanwhile aren't held up
+  // behind the whole queue. A value which fails to write stays queued, and its
+  // request pending, until a later call gets it out.
+  bool empty = false;
+  kv_store_async_process_one(&empty);
+
+  // Taken off the list before completing, so the callbacks can queue more
+  sProtocolRequest done[KV_STORE_PROTOCOL_MAX_PENDING];
+  size_t num_done = 0;
+  size_t num_left = 0;
+  for (size_t i = 0; i < s_num_pending; i++) {
+    if (kv_store_async_pending(s_pending[i].key, s_pending[i].seq)) {
+      s_pending[num_left++] = s_pending[i];
+    } else {
+      done[num_done++] = s_pending[i].req;
+    }
+  }
+  s_num_pending = num_left;
+
+  for (size_t i = 0; i < num_done; i++) {
+    prv_complete_write(&done[i]);
+  }
+  return true;
 }
@@ -1,10 +1,42 @@
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-void kv_store_read_protocol_cmd(
-    const uint8_t *buffer, size_t len,
-    uint8_t *resp_buffer, size_t *resp_len);
+#include "protocol/protocol.h"
+#include "protocol/response.h"
 
-void kv_store_write_protocol_cmd(
-    const uint8_t *buffer, size_t len,
-    uint8_t *resp_buffer, size_t *resp_len);
+//! Async writes which can wait for kv_store_protocol_process() to ack them
+#ifndef KV_STORE_PROTOCOL_MAX_PENDING
+#define KV_STORE_PROTOCOL_MAX_PENDING (8)
+#endif
+
+//! Responds with the value of the key in the payload, or nothing if it can't
+//! be read. A value longer than the response is cut off there; the client
+//! gets the rest by sending the offset to carry on from as a uint32_t after
+//! the key's '\0', until a response comes back empty. The value is copied
+//! into the response rather than referenced: kv_store's cache entries and
+//! stream chunks can change as soon as the handler returns.
+void kv_store_read_protocol_cmd(const uint8_t *buffer, size_t len, sProtocolResponse *resp);
+
+//! Acks with 1, or 0 if kv_store_write() failed
+void kv_store_write_protocol_cmd(const uint8_t *buffer, size_t len, sProtocolResponse *resp);
+
+//! Async variant of kv_store_write_protocol_cmd(), for a kv_store with a
+//! `write_queue`. The value goes to kv_store_write(), and if kv_store queued
+//! it the handler returns kProtocolCode_Pending; kv_store_protocol_process()
+//! sends the ack once that value is in flash. A write kv_store_write() refuses
+//! is acked 0 at once, and one it wrote straight to flash is acked 1. With
+//! KV_STORE_PROTOCOL_MAX_PENDING acks outstanding the write isn't attempted
+//! and kProtocolCode_Busy is returned, for the client to retry.
+eProtocolCode kv_store_write_protocol_async_cmd(const sProtocolRequest *req,
+                                                const uint8_t *buffer, size_t len,
+                                                sProtocolResponse *resp);
+
+//! Writes the oldest value in kv_store's write queue with
+//! kv_store_async_process_one(), then acks each pending async write whose
+//! value has reached flash, in its own or a later coalesced write. Queued
+//! writes are never acked 0: kv_store keeps a value which failed to write and
+//! retries it, so its ack waits for that. Call it from the transport's loop
+//! whenever there's nothing received to handle. Returns false if no write was
+//! pending.
+bool kv_store_protocol_process(void);
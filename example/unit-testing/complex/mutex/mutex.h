@@ -5,3 +5,27 @@ Mutex *mutex_create(void);
 void mutex_lock(Mutex *mutex);
 
 void mutex_unlock(Mutex *mutex);
+
+//! Reader/writer lock. Any number of readers may hold it at once; a writer
+//! holds it alone. Neither side is recursive and a read lock can't be upgraded.
+typedef struct RwLock RwLock;
+
+RwLock *rwlock_create(void);
+
+void rwlock_read_lock(RwLock *rwlock);
+
+void rwlock_read_unlock(RwLock *rwlock);
+
+void rwlock_write_lock(RwLock *rwlock);
+
+void rwlock_write_unlock(RwLock *rwlock);
+
+//! Counting semaphore, used to wake a worker task when there is work for it
+typedef struct Semaphore Semaphore;
+
+Semaphore *semaphore_create(void);
+
+void semaphore_give(Semaphore *semaphore);
+
+//! Blocks until the count is non-zero, then decrements it
+void semaphore_take(Semaphore *semaphore);
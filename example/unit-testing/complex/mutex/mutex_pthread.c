@@ -0,0 +1,86 @@
+//! Host implementation of mutex.h on top of pthreads, used to run the modules
+//! under real concurrency in the benchmarks.
+
+#include "mutex/mutex.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct Mutex {
+  pthread_mutex_t mutex;
+} Mutex;
+
+typedef struct RwLock {
+  pthread_rwlock_t rwlock;
+} RwLock;
+
+typedef struct Semaphore {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint32_t count;
+} Semaphore;
+
+Mutex *mutex_create(void) {
+  Mutex *mutex = malloc(sizeof(*mutex));
+  assert(mutex);
+  pthread_mutex_init(&mutex->mutex, NULL);
+  return mutex;
+}
+
+void mutex_lock(Mutex *mutex) {
+  pthread_mutex_lock(&mutex->mutex);
+}
+
+void mutex_unlock(Mutex *mutex) {
+  pthread_mutex_unlock(&mutex->mutex);
+}
+
+RwLock *rwlock_create(void) {
+  RwLock *rwlock = malloc(sizeof(*rwlock));
+  assert(rwlock);
+  pthread_rwlock_init(&rwlock->rwlock, NULL);
+  return rwlock;
+}
+
+void rwlock_read_lock(RwLock *rwlock) {
+  pthread_rwlock_rdlock(&rwlock->rwlock);
+}
+
+void rwlock_read_unlock(RwLock *rwlock) {
+  pthread_rwlock_unlock(&rwlock->rwlock);
+}
+
+void rwlock_write_lock(RwLock *rwlock) {
+  pthread_rwlock_wrlock(&rwlock->rwlock);
+}
+
+void rwlock_write_unlock(RwLock *rwlock) {
+  pthread_rwlock_unlock(&rwlock->rwlock);
+}
+
+Semaphore *semaphore_create(void) {
+  Semaphore *semaphore = malloc(sizeof(*semaphore));
+  assert(semaphore);
+  pthread_mutex_init(&semaphore->mutex, NULL);
+  pthread_cond_init(&semaphore->cond, NULL);
+  semaphore->count = 0;
+  return semaphore;
+}
+
+void semaphore_give(Semaphore *semaphore) {
+  pthread_mutex_lock(&semaphore->mutex);
+  semaphore->count++;
+  pthread_cond_signal(&semaphore->cond);
+  pthread_mutex_unlock(&semaphore->mutex);
+}
+
+void semaphore_take(Semaphore *semaphore) {
+  pthread_mutex_lock(&semaphore->mutex);
+  while (semaphore->count == 0) {
+    pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
+  }
+  semaphore->count--;
+  pthread_mutex_unlock(&semaphore->mutex);
+}
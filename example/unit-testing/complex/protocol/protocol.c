@@ -1,39 +1,272 @@
 #include "protocol/protocol.h"
 #include "protocol/registry.h"
+#include "protocol/stats.h"
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
 
+const sProtocolCommand *protocol_registry_find(const sProtocolCommand *commands,
+                                               size_t num_commands, uint32_t code) {
+  if (num_commands == 0) {
+    return NULL;
+  }
+  // Narrows down to the last entry <= code. The loop runs log2(n) times no
+  // matter where the code is and the compare can compile to a conditional move,
+  // so there are no mispredicted branches to pay for.
+  const sProtocolCommand *base = commands;
+  size_t n = num_commands;
+  while (n > 1) {
+    const size_t half = n / 2;
+    base = (base[half].code <= code) ? &base[half] : base;
+    n -= half;
+  }
+  return (base->code == code) ? base : NULL;
+}
+
+bool protocol_registry_sorted(const sProtocolCommand *commands, size_t num_commands) {
+  for (size_t i = 1; i < num_commands; i++) {
+    if (commands[i - 1].code >= commands[i].code) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const sProtocolCommand *protocol_command_find(uint32_t code) {
+  // Checked once, the table is const
+  static enum { kRegistryOrder_Unknown, kRegistryOrder_Sorted, kRegistryOrder_Unsorted } s_order;
+  if (s_order == kRegistryOrder_Unknown) {
+    s_order = protocol_registry_sorted(g_protocol_commands, g_num_protocol_commands)
+                  ? kRegistryOrder_Sorted
+                  : kRegistryOrder_Unsorted;
+  }
+  if (s_order == kRegistryOrder_Sorted) {
+    return protocol_registry_find(g_protocol_commands, g_num_protocol_commands, code);
+  }
+  for (size_t i = 0; i < g_num_protocol_commands; i++) {
+    if (g_protocol_commands[i].code == code) {
+      return &g_protocol_commands[i];
+    }
+  }
+  return NULL;
+}
+
+static uint32_t prv_read_u32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+//! `req` is NULL when the response is needed before returning. Otherwise a
+//! command with an async handler may leave it pending.
+static eProtocolCode prv_dispatch(uint32_t code, const uint8_t *payload, size_t payload_len,
+                                  sProtocolResponse *resp, sProtocolRequest *req) {
+  // Find the right handler
+  const sProtocolCommand *command = protocol_command_find(code);
+  if (command == NULL) {
+    protocol_stats_record_error(kProtocolCode_CommandNotFound, NULL);
+    return kProtocolCode_CommandNotFound;
+  }
+
+  const uint64_t start = protocol_stats_start();
+  eProtocolCode rv = kProtocolCode_Ok;
+  if (req != NULL && command->async_handler != NULL) {
+    req->command = command;
+    req->start = start;
+    rv = command->async_handler(req, payload, payload_len, resp);
+  } else {
+    command->handler(payload, payload_len, resp);
+  }
+  if (rv != kProtocolCode_Pending) {
+    protocol_stats_record(command, start);
+  }
+  return rv;
+}
+
+void protocol_complete(const sProtocolRequest *req, eProtocolCode rv,
+                       const sProtocolResponse *resp) {
+  protocol_stats_record(req->command, req->start);
+
+  sProtocolResponse empty;
+  if (resp == NULL) {
+    protocol_response_init(&empty, NULL, 0, 0);
+    resp = &empty;
+  }
+  if (req->cb) {
+    req->cb(req->id, req->code, rv, resp, req->ctx);
+  }
+}
+
+//! Counts a rejected frame against the command it was meant for
+static void prv_record_malformed(uint32_t code) {
+  protocol_stats_record_error(kProtocolCode_MalformedMsg, protocol_command_find(code));
+}
+
 eProtocolCode protocol_handle(
     const uint8_t *buffer, size_t len,
     uint8_t *resp_buffer, size_t *resp_len) {
   // Need at least a command and size
-  if (len < 8) {
+  if (len < PROTOCOL_HEADER_LEN) {
+    protocol_stats_record_error(kProtocolCode_MalformedMsg, NULL);
     return kProtocolCode_MalformedMsg;
   }
-  uint8_t *iter = (void *)buffer;
 
-  // Parse the desired command code
-  uint32_t code = *(uint32_t *)(void *)iter;
-  iter += sizeof(uint32_t);
-  len -= sizeof(uint32_t);
+  // Parse the desired command code and the size of its payload
+  const uint32_t code = prv_read_u32(buffer);
+  const uint32_t payload_size = prv_read_u32(&buffer[sizeof(uint32_t)]);
+  if (payload_size != len - PROTOCOL_HEADER_LEN) {
+    prv_record_malformed(code);
+    return kProtocolCode_MalformedMsg;
+  }
 
-  // Parse the desired command code
-  uint32_t payload_size = *(uint32_t *)(void *)iter;
-  iter += sizeof(uint32_t);
-  len -= sizeof(uint32_t);
+  sProtocolResponse resp;
+  protocol_response_init(&resp, resp_buffer, *resp_len, 0);
+  const eProtocolCode rv =
+      prv_dispatch(code, &buffer[PROTOCOL_HEADER_LEN], payload_size, &resp, NULL);
+  // Anything referenced is copied in behind the buffered bytes
+  protocol_response_flatten(&resp);
+  *resp_len = protocol_response_len(&resp);
+  return rv;
+}
 
-  // Find the right handler
-  for (const sProtocolCommand *command = g_protocol_commands; \
-    command < &g_protocol_commands[g_num_protocol_commands]; \
-    ++command) {
-    if (code == command->code) {
-      command->handler(iter, len, resp_buffer, resp_len);
-      return kProtocolCode_Ok;
+//
+// Batches
+//
+
+static void prv_write_u32(uint8_t *p, uint32_t v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+void protocol_batch_cmd(const uint8_t *buffer, size_t len, sProtocolResponse *resp) {
+  // The count and item headers are reserved up front and filled in once known
+  uint8_t *count = protocol_response_reserve(resp, sizeof(uint32_t));
+  if (len < sizeof(uint32_t) || count == NULL) {
+    return;
+  }
+  protocol_response_commit(resp, sizeof(uint32_t));
+  const uint32_t num_items = prv_read_u32(buffer);
+  size_t off = sizeof(uint32_t);
+
+  uint32_t num_run = 0;
+  uint8_t *item_hdr;
+  while (num_run < num_items &&
+         (item_hdr = protocol_response_reserve(resp, PROTOCOL_HEADER_LEN)) != NULL) {
+    protocol_response_commit(resp, PROTOCOL_HEADER_LEN);
+    const size_t item_start = protocol_response_len(resp);
+    eProtocolCode rv = kProtocolCode_MalformedMsg;
+
+    const size_t remaining = len - off;
+    uint32_t payload_size = 0;
+    bool complete = remaining >= PROTOCOL_HEADER_LEN;
+    if (complete) {
+      payload_size = prv_read_u32(&buffer[off + sizeof(uint32_t)]);
+      complete = payload_size <= remaining - PROTOCOL_HEADER_LEN;
     }
+    if (complete) {
+      const uint32_t code = prv_read_u32(&buffer[off]);
+      if (code != PROTOCOL_BATCH_CODE) {
+        rv = prv_dispatch(code, &buffer[off + PROTOCOL_HEADER_LEN], payload_size, resp, NULL);
+      } else {
+        prv_record_malformed(code);
+      }
+    } else {
+      protocol_stats_record_error(kProtocolCode_MalformedMsg, NULL);
+    }
+
+    prv_write_u32(item_hdr, rv);
+    prv_write_u32(&item_hdr[sizeof(uint32_t)],
+                  (uint32_t)(protocol_response_len(resp) - item_start));
+    num_run++;
+    if (!complete) {
+      // No way to find where the next item starts
+      break;
+    }
+    off += PROTOCOL_HEADER_LEN + payload_size;
   }
 
-  // Failed to find a command
-  return kProtocolCode_CommandNotFound;
+  prv_write_u32(count, num_run);
+}
+
+//
+// Incremental parser
+//
+// The header is always gathered into the parser, as it's only 8 bytes. A
+// payload is only copied into `frame_buf` if it doesn't arrive in the same
+// protocol_feed() call as the end of its header.
+//
+
+void protocol_parser_init(sProtocolParser *parser, const sProtocolParserConfig *config) {
+  memset(parser, 0, sizeof(*parser));
+  parser->config = *config;
+}
+
+static void prv_parser_complete(sProtocolParser *parser, const uint8_t *payload) {
+  const sProtocolParserConfig *config = &parser->config;
+  sProtocolResponse resp;
+  protocol_response_init(&resp, config->resp_buf, config->resp_buf_len, config->resp_max_len);
+  sProtocolRequest req = {
+    .id = parser->next_request_id++,
+    .code = parser->code,
+    .cb = config->cb,
+    .ctx = config->ctx,
+  };
+  eProtocolCode rv = kProtocolCode_MalformedMsg;
+  if (!parser->discard) {
+    rv = prv_dispatch(parser->code, payload, parser->payload_size, &resp, &req);
+  } else {
+    prv_record_malformed(parser->code);
+  }
+  // A pending request is reported by protocol_complete() instead
+  if (config->cb && rv != kProtocolCode_Pending) {
+    config->cb(req.id, parser->code, rv, &resp, config->ctx);
+  }
+
+  parser->hdr_len = 0;
+  parser->payload_len = 0;
+  parser->discard = false;
+}
+
+size_t protocol_feed(sProtocolParser *parser, const uint8_t *bytes, size_t len) {
+  size_t num_frames = 0;
+  while (len > 0) {
+    if (parser->hdr_len < PROTOCOL_HEADER_LEN) {
+      const size_t want = PROTOCOL_HEADER_LEN - parser->hdr_len;
+      const size_t n = len < want ? len : want;
+      memcpy(&parser->hdr[parser->hdr_len], bytes, n);
+      parser->hdr_len += n;
+      bytes += n;
+      len -= n;
+      if (parser->hdr_len < PROTOCOL_HEADER_LEN) {
+        break;
+      }
+      parser->code = prv_read_u32(parser->hdr);
+      parser->payload_size = prv_read_u32(&parser->hdr[sizeof(uint32_t)]);
+      parser->discard = parser->payload_size > parser->config.frame_buf_len;
+
+      // The whole payload is already here, hand it over in place
+      if (parser->payload_size <= len && !parser->discard) {
+        const uint8_t *payload = bytes;
+        bytes += parser->payload_size;
+        len -= parser->payload_size;
+        prv_parser_complete(parser, payload);
+        num_frames++;
+        continue;
+      }
+    }
+
+    const size_t want = parser->payload_size - parser->payload_len;
+    const size_t n = len < want ? len : want;
+    if (!parser->discard) {
+      memcpy(&parser->config.frame_buf[parser->payload_len], bytes, n);
+    }
+    parser->payload_len += n;
+    bytes += n;
+    len -= n;
+    if (parser->payload_len == parser->payload_size) {
+      prv_parser_complete(parser, parser->config.frame_buf);
+      num_frames++;
+    }
+  }
+  return num_frames;
 }
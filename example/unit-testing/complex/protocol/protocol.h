@@ -4,16 +4,101 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "protocol/response.h"
+
 typedef enum {
   kProtocolCode_Ok = 0,
   kProtocolCode_MalformedMsg = 1,
   kProtocolCode_CommandNotFound = 2,
+  //! Only returned by async handlers: the response follows through
+  //! protocol_complete()
+  kProtocolCode_Pending = 3,
+  //! Only returned by async handlers: the command can't be taken on right
+  //! now and wasn't run. The client may send it again.
+  kProtocolCode_Busy = 4,
 
   kProtocolCode_32bit = 0x7FFFFFFF, 
 } eProtocolCode;
 
+//! Every frame starts with a little endian code and payload size
+#define PROTOCOL_HEADER_LEN (8)
+
+//! Code of the batch command, see protocol_batch_cmd()
+#define PROTOCOL_BATCH_CODE (2000)
+
 //! Call this when a character is received. The character is processed synchronously.
+//! `buffer` must hold exactly one message; a payload size which doesn't match
+//! the bytes after the header is rejected as kProtocolCode_MalformedMsg.
 eProtocolCode protocol_handle(
     const uint8_t *buffer, size_t len,
     uint8_t *resp_buffer, size_t *resp_len);
 
+//! Receives the outcome of each frame protocol_feed() dispatched. Frames are
+//! numbered by `request_id` in the order they arrived, and reported in that
+//! order unless an async handler left one pending: that one is reported when
+//! it's completed, after the frames behind it.
+//! `resp` may reference memory outside `resp_buf`, so send it with
+//! protocol_response_iov() or protocol_response_copy() before returning.
+//! Frames which were rejected (unknown code, payload too large) are reported
+//! too, with an empty response.
+typedef void (*ProtocolResponseCallback)(uint32_t request_id, uint32_t code, eProtocolCode rv,
+    const sProtocolResponse *resp, void *ctx);
+
+struct ProtocolCommand;
+
+//! A request which an async handler took on. The handler keeps a copy and
+//! passes it to protocol_complete() once it's done.
+typedef struct ProtocolRequest {
+  uint32_t id;
+  uint32_t code;
+  ProtocolResponseCallback cb;
+  void *ctx;
+  //! For the stats, which count the time until the request completes
+  const struct ProtocolCommand *command;
+  uint64_t start;
+} sProtocolRequest;
+
+//! Reports the outcome of a request its handler left kProtocolCode_Pending to
+//! the transport the request came from. `resp` NULL sends an empty response.
+void protocol_complete(const sProtocolRequest *req, eProtocolCode rv,
+                       const sProtocolResponse *resp);
+
+typedef struct ProtocolParserConfig {
+  //! Holds a frame which arrives split across protocol_feed() calls. Its size
+  //! is the largest payload accepted; larger frames are skipped and reported
+  //! as kProtocolCode_MalformedMsg.
+  uint8_t *frame_buf;
+  size_t frame_buf_len;
+  //! Backs the response writer handed to the handler of each frame
+  uint8_t *resp_buf;
+  size_t resp_buf_len;
+  //! Longest response the transport can send, counting memory handlers
+  //! reference rather than copy. 0 limits it to `resp_buf_len`.
+  size_t resp_max_len;
+  ProtocolResponseCallback cb;
+  void *ctx;
+} sProtocolParserConfig;
+
+//! Incremental frame parser. Bytes may arrive in any split: partial headers,
+//! partial payloads, or several frames in one go.
+typedef struct ProtocolParser {
+  sProtocolParserConfig config;
+  uint8_t hdr[PROTOCOL_HEADER_LEN];
+  size_t hdr_len;
+  uint32_t code;
+  uint32_t payload_size;
+  //! Payload bytes buffered, or skipped when `discard` is set
+  size_t payload_len;
+  bool discard;
+  uint32_t next_request_id;
+} sProtocolParser;
+
+void protocol_parser_init(sProtocolParser *parser, const sProtocolParserConfig *config);
+
+//! Consumes `len` received bytes and dispatches every frame they complete.
+//! A frame which arrives whole within one call is handed to its handler
+//! straight from `bytes`, so pipelined requests are never copied. Commands
+//! with an async handler are dispatched to it, and may still be pending when
+//! this returns. Returns the number of frames dispatched.
+size_t protocol_feed(sProtocolParser *parser, const uint8_t *bytes, size_t len);
+
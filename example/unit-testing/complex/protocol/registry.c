@@ -1,13 +1,20 @@
 #include "protocol/registry.h"
+#include "protocol/protocol.h"
+#include "protocol/stats.h"
 #include "kv_store/kv_store_protocol_handlers.h"
 
 #include <stddef.h>
 
 
+// Keep sorted by code, protocol_handle() binary searches this table.
+// TestIntegrationProtocolKvStore.RegistrySorted checks it.
 static const sProtocolCommand s_protocol_commands[] = {
   {1000 /* 0x03E8 */, kv_store_read_protocol_cmd},
-  {1001 /* 0x03E9 */, kv_store_write_protocol_cmd},
+  {1001 /* 0x03E9 */, kv_store_write_protocol_cmd, kv_store_write_protocol_async_cmd},
+  {PROTOCOL_BATCH_CODE /* 0x07D0 */, protocol_batch_cmd},
+  {PROTOCOL_STATS_CODE /* 0x07D1 */, protocol_stats_cmd},
 };
 
 const sProtocolCommand *const g_protocol_commands = s_protocol_commands;
-const size_t g_num_protocol_commands = 2;
+const size_t g_num_protocol_commands =
+    sizeof(s_protocol_commands) / sizeof(s_protocol_commands[0]);
@@ -1,15 +1,62 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-typedef void (*ProtocolHandler)(const uint8_t *buffer, size_t len,
-    uint8_t *resp_buffer, size_t *resp_len);
+#include "protocol/protocol.h"
+#include "protocol/response.h"
+
+//! Handles one command. Whatever is added to `resp` is sent back; it is
+//! bounded by the transport's buffer, see protocol/response.h.
+typedef void (*ProtocolHandler)(const uint8_t *buffer, size_t len, sProtocolResponse *resp);
+
+//! Handler for a command which may take a while, such as a flash write. It
+//! either finishes before returning, fills in `resp` like a ProtocolHandler
+//! and returns kProtocolCode_Ok, or it copies `req` and whatever it needs from
+//! `buffer` (which isn't valid afterwards), returns kProtocolCode_Pending and
+//! calls protocol_complete() later. The transport answers the requests behind
+//! it in the meantime.
+typedef eProtocolCode (*ProtocolAsyncHandler)(const sProtocolRequest *req, const uint8_t *buffer,
+                                              size_t len, sProtocolResponse *resp);
 
 typedef struct ProtocolCommand {
   uint32_t code;
   ProtocolHandler handler;
+  //! Optional. protocol_feed() uses it instead of `handler`. protocol_handle()
+  //! and batches, which answer before they return, always use `handler`.
+  ProtocolAsyncHandler async_handler;
 } sProtocolCommand;
 
+//! The registry. Entries must be sorted by ascending `code`, with no
+//! duplicates, so protocol_handle() can binary search it. A table which isn't
+//! is searched linearly instead, see protocol_command_find().
 extern const sProtocolCommand *const g_protocol_commands;
 extern const size_t g_num_protocol_commands;
+
+//! Looks up `code` in a table sorted by ascending code in O(log n). Returns
+//! NULL if it isn't there.
+const sProtocolCommand *protocol_registry_find(const sProtocolCommand *commands,
+                                               size_t num_commands, uint32_t code);
+
+//! Whether `commands` is sorted by strictly ascending code, as
+//! protocol_registry_find() needs
+bool protocol_registry_sorted(const sProtocolCommand *commands, size_t num_commands);
+
+//! Looks up `code` in g_protocol_commands. The order is checked on the first
+//! call; if it's wrong every lookup falls back to a linear search, so a
+//! misplaced entry is slower to reach rather than unreachable.
+const sProtocolCommand *protocol_command_find(uint32_t code);
+
+//! Handler for PROTOCOL_BATCH_CODE, which runs several commands in one round
+//! trip. All integers are little endian.
+//!
+//! Request:  u32 num_items, then per item: u32 code, u32 payload_size, payload
+//! Response: u32 num_items, then per item: u32 status, u32 resp_len, resp
+//!
+//! Items run in order through the registry, each adding to the same response
+//! after its item header, and `status` holds their eProtocolCode. A batch can't
+//! contain another batch. Execution stops at an item which is cut short
+//! (reported as kProtocolCode_MalformedMsg) or once the response buffer is
+//! full; the response's num_items says how many items were run.
+void protocol_batch_cmd(const uint8_t *buffer, size_t len, sProtocolResponse *resp);
@@ -0,0 +1,129 @@
+#include "protocol/response.h"
+
+#include <string.h>
+
+void protocol_response_init(sProtocolResponse *resp, uint8_t *buf, size_t capacity,
+                            size_t max_len) {
+  memset(resp, 0, sizeof(*resp));
+  resp->buf = buf;
+  resp->capacity = capacity;
+  resp->max_len = max_len ? max_len : capacity;
+}
+
+size_t protocol_response_space(const sProtocolResponse *resp) {
+  const size_t buf_space = resp->capacity - resp->used;
+  const size_t len_space = resp->max_len - resp->len;
+  return buf_space < len_space ? buf_space : len_space;
+}
+
+uint8_t *protocol_response_reserve(sProtocolResponse *resp, size_t len) {
+  if (len > protocol_response_space(resp)) {
+    return NULL;
+  }
+  resp->reserved = len;
+  return &resp->buf[resp->used];
+}
+
+static bool prv_add_segment(sProtocolResponse *resp, const void *base, size_t len) {
+  if (resp->num_segs == PROTOCOL_RESPONSE_MAX_SEGMENTS) {
+    return false;
+  }
+  resp->segs[resp->num_segs++] = (sProtocolIoVec) {
+    .base = base,
+    .len = len,
+  };
+  resp->len += len;
+  return true;
+}
+
+//! Appends bytes already placed at the end of the used part of `buf`
+static bool prv_add_buffered(sProtocolResponse *resp, size_t len) {
+  const uint8_t *start = &resp->buf[resp->used];
+  sProtocolIoVec *last = resp->num_segs ? &resp->segs[resp->num_segs - 1] : NULL;
+  if (last && (const uint8_t *)last->base + last->len == start) {
+    // Carries on from the previous write, grow that segment
+    last->len += len;
+    resp->len += len;
+  } else if (!prv_add_segment(resp, start, len)) {
+    return false;
+  }
+  resp->used += len;
+  return true;
+}
+
+void protocol_response_commit(sProtocolResponse *resp, size_t len) {
+  if (len > resp->reserved) {
+    len = resp->reserved;
+  }
+  resp->reserved = 0;
+  if (len > 0) {
+    prv_add_buffered(resp, len);
+  }
+}
+
+bool protocol_response_write(sProtocolResponse *resp, const void *data, size_t len) {
+  uint8_t *dst = protocol_response_reserve(resp, len);
+  if (dst == NULL) {
+    return false;
+  }
+  memcpy(dst, data, len);
+  resp->reserved = 0;
+  return (len == 0) || prv_add_buffered(resp, len);
+}
+
+bool protocol_response_ref(sProtocolResponse *resp, const void *data, size_t len) {
+  if (len > resp->max_len - resp->len) {
+    return false;
+  }
+  // Keep the last segment for a final copy
+  if (resp->num_segs + 1 < PROTOCOL_RESPONSE_MAX_SEGMENTS) {
+    return prv_add_segment(resp, data, len);
+  }
+  return protocol_response_write(resp, data, len);
+}
+
+size_t protocol_response_len(const sProtocolResponse *resp) {
+  return resp->len;
+}
+
+size_t protocol_response_iov(const sProtocolResponse *resp, const sProtocolIoVec **iov) {
+  *iov = resp->segs;
+  return resp->num_segs;
+}
+
+size_t protocol_response_copy(const sProtocolResponse *resp, uint8_t *out, size_t out_len) {
+  size_t off = 0;
+  for (size_t i = 0; i < resp->num_segs && off < out_len; i++) {
+    const size_t n = resp->segs[i].len < out_len - off ? resp->segs[i].len : out_len - off;
+    memmove(&out[off], resp->segs[i].base, n);
+    off += n;
+  }
+  return off;
+}
+
+bool protocol_response_flatten(sProtocolResponse *resp) {
+  if (resp->len > resp->capacity) {
+    return false;
+  }
+
+  // Buffered segments only ever move towards the end of `buf`, as the final
+  // offset of each is its buffer offset plus the referenced bytes before it.
+  // Working from the last segment back, nothing is overwritten before it has
+  // been moved.
+  size_t end = resp->len;
+  for (size_t i = resp->num_segs; i > 0; i--) {
+    const sProtocolIoVec *seg = &resp->segs[i - 1];
+    end -= seg->len;
+    memmove(&resp->buf[end], seg->base, seg->len);
+  }
+
+  if (resp->len > 0) {
+    resp->segs[0] = (sProtocolIoVec) {
+      .base = resp->buf,
+      .len = resp->len,
+    };
+    resp->num_segs = 1;
+  }
+  resp->used = resp->len;
+  return true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+//! Response writer handed to every ProtocolHandler. A response is a list of
+//! segments: bytes written or reserved in the writer's buffer, and references
+//! to memory owned by someone else (iovec style), which are sent as they are
+//! instead of being copied. Transports which can send a list of buffers take
+//! the segments from protocol_response_iov(); protocol_handle() flattens them
+//! into its caller's buffer.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! References beyond this many segments are copied into the buffer instead
+#ifndef PROTOCOL_RESPONSE_MAX_SEGMENTS
+#define PROTOCOL_RESPONSE_MAX_SEGMENTS (8)
+#endif
+
+typedef struct ProtocolIoVec {
+  const void *base;
+  size_t len;
+} sProtocolIoVec;
+
+typedef struct ProtocolResponse {
+  uint8_t *buf;
+  size_t capacity;
+  //! Bytes of `buf` handed out so far
+  size_t used;
+  //! Bytes reserved by protocol_response_reserve() and not committed yet
+  size_t reserved;
+  //! Longest response the transport takes, counting referenced bytes
+  size_t max_len;
+  size_t len;
+  sProtocolIoVec segs[PROTOCOL_RESPONSE_MAX_SEGMENTS];
+  size_t num_segs;
+} sProtocolResponse;
+
+//! Starts an empty response backed by `buf`. `max_len` bounds the whole
+//! response including referenced memory; 0 limits it to `capacity`.
+void protocol_response_init(sProtocolResponse *resp, uint8_t *buf, size_t capacity,
+                            size_t max_len);
+
+//! Number of bytes which can still be reserved or written
+size_t protocol_response_space(const sProtocolResponse *resp);
+
+//! Returns `len` bytes of the buffer to fill in place, or NULL if they don't
+//! fit. Nothing is part of the response until protocol_response_commit().
+uint8_t *protocol_response_reserve(sProtocolResponse *resp, size_t len);
+
+//! Adds the first `len` bytes of the last reservation to the response. The
+//! rest of the reservation is given back.
+void protocol_response_commit(sProtocolResponse *resp, size_t len);
+
+//! Copies `len` bytes into the response. Returns false if they don't fit.
+bool protocol_response_write(sProtocolResponse *resp, const void *data, size_t len);
+
+//! Adds `len` bytes of caller memory to the response without copying them.
+//! The memory must stay valid until the response has been sent. Falls back to
+//! a copy once every segment is in use. Returns false if they don't fit.
+bool protocol_response_ref(sProtocolResponse *resp, const void *data, size_t len);
+
+//! Total length of the response
+size_t protocol_response_len(const sProtocolResponse *resp);
+
+//! Points `iov` at the response's segments and returns how many there are
+size_t protocol_response_iov(const sProtocolResponse *resp, const sProtocolIoVec **iov);
+
+//! Gathers the response into `out`. Returns the number of bytes copied, which
+//! is less than protocol_response_len() if `out` is too small.
+size_t protocol_response_copy(const sProtocolResponse *resp, uint8_t *out, size_t out_len);
+
+//! Moves the whole response into the writer's own buffer, so it's contiguous
+//! at `buf`. Returns false, leaving the response as it was, if it doesn't fit.
+bool protocol_response_flatten(sProtocolResponse *resp);
@@ -0,0 +1,149 @@
+#include "protocol/stats.h"
+
+#include <string.h>
+
+static sProtocolStats *s_stats;
+
+void protocol_stats_init(sProtocolStats *stats) {
+  s_stats = stats;
+  protocol_stats_reset();
+}
+
+void protocol_stats_reset(void) {
+  if (s_stats == NULL) {
+    return;
+  }
+  memset(s_stats->commands, 0, s_stats->num_commands * sizeof(s_stats->commands[0]));
+  s_stats->num_malformed = 0;
+  s_stats->num_not_found = 0;
+  s_stats->num_untracked = 0;
+}
+
+static sProtocolCommandStats *prv_command_stats(const sProtocolCommand *command) {
+  if (command == NULL || command < g_protocol_commands ||
+      command >= &g_protocol_commands[g_num_protocol_commands]) {
+    return NULL;
+  }
+  const size_t idx = (size_t)(command - g_protocol_commands);
+  return (idx < s_stats->num_commands) ? &s_stats->commands[idx] : NULL;
+}
+
+const sProtocolCommandStats *protocol_stats_find(uint32_t code) {
+  if (s_stats == NULL) {
+    return NULL;
+  }
+  return prv_command_stats(protocol_command_find(code));
+}
+
+static size_t prv_bucket(uint64_t ticks) {
+  if (ticks == 0) {
+    return 0;
+  }
+  // floor(log2(ticks)) + 1
+  const size_t bucket = 64 - (size_t)__builtin_clzll(ticks);
+  return bucket < PROTOCOL_STATS_NUM_BUCKETS ? bucket : PROTOCOL_STATS_NUM_BUCKETS - 1;
+}
+
+uint64_t protocol_stats_percentile(const sProtocolCommandStats *stats, uint32_t pct) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < PROTOCOL_STATS_NUM_BUCKETS; i++) {
+    total += stats->buckets[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  // Rank of the call the percentile lands on, rounded up
+  const uint64_t rank = (total * pct + 99) / 100;
+  uint64_t seen = 0;
+  size_t i = 0;
+  for (; i < PROTOCOL_STATS_NUM_BUCKETS - 1; i++) {
+    seen += stats->buckets[i];
+    if (seen >= rank && seen > 0) {
+      break;
+    }
+  }
+  if (i == 0) {
+    return 0;
+  }
+  return (i == PROTOCOL_STATS_NUM_BUCKETS - 1) ? (1ull << (i - 1)) : (1ull << i);
+}
+
+uint64_t protocol_stats_start(void) {
+  return (s_stats && s_stats->clock) ? s_stats->clock() : 0;
+}
+
+void protocol_stats_record(const sProtocolCommand *command, uint64_t start) {
+  if (s_stats == NULL) {
+    return;
+  }
+  sProtocolCommandStats *stats = prv_command_stats(command);
+  if (stats == NULL) {
+    s_stats->num_untracked++;
+    return;
+  }
+  stats->num_calls++;
+  const uint64_t elapsed = s_stats->clock ? s_stats->clock() - start : 0;
+  stats->buckets[prv_bucket(elapsed)]++;
+}
+
+void protocol_stats_record_error(eProtocolCode rv, const sProtocolCommand *command) {
+  if (s_stats == NULL) {
+    return;
+  }
+  if (rv == kProtocolCode_CommandNotFound) {
+    s_stats->num_not_found++;
+    return;
+  }
+  s_stats->num_malformed++;
+  sProtocolCommandStats *stats = prv_command_stats(command);
+  if (stats) {
+    stats->num_malformed++;
+  }
+}
+
+static bool prv_put_u32(sProtocolResponse *resp, uint32_t v) {
+  return protocol_response_write(resp, &v, sizeof(v));
+}
+
+void protocol_stats_cmd(const uint8_t *buffer, size_t len, sProtocolResponse *resp) {
+  if (s_stats == NULL) {
+    return;
+  }
+  const bool reset = (len >= 1) && (buffer[0] != 0);
+
+  uint8_t *hdr = protocol_response_reserve(resp, 4 * sizeof(uint32_t));
+  if (hdr == NULL) {
+    return;
+  }
+  protocol_response_commit(resp, 4 * sizeof(uint32_t));
+
+  const size_t record_len = (3 + PROTOCOL_STATS_NUM_BUCKETS) * sizeof(uint32_t);
+  uint32_t num_records = 0;
+  for (size_t i = 0; i < s_stats->num_commands && i < g_num_protocol_commands; i++) {
+    const sProtocolCommandStats *stats = &s_stats->commands[i];
+    if (stats->num_calls == 0 && stats->num_malformed == 0) {
+      continue;
+    }
+    if (protocol_response_space(resp) < record_len) {
+      break;
+    }
+    prv_put_u32(resp, g_protocol_commands[i].code);
+    prv_put_u32(resp, stats->num_calls);
+    prv_put_u32(resp, stats->num_malformed);
+    protocol_response_write(resp, stats->buckets, sizeof(stats->buckets));
+    num_records++;
+  }
+
+  const uint32_t counts[4] = {
+    s_stats->num_malformed,
+    s_stats->num_not_found,
+    s_stats->num_untracked,
+    num_records,
+  };
+  memcpy(hdr, counts, sizeof(counts));
+
+  if (reset) {
+    protocol_stats_reset();
+  }
+}
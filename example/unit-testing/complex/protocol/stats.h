@@ -0,0 +1,77 @@
+#pragma once
+
+//! Optional instrumentation for protocol_handle() and protocol_feed(): call
+//! and error counts and a latency histogram per command. Off until
+//! protocol_stats_init() is given storage, and then costs two clock reads
+//! per command. Not thread safe, like the rest of the protocol layer.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol/protocol.h"
+#include "protocol/registry.h"
+
+//! Bucket 0 counts calls which took no measurable time, bucket i > 0 those
+//! which took [2^(i-1), 2^i) clock ticks, and the last bucket anything longer
+#define PROTOCOL_STATS_NUM_BUCKETS (16)
+
+//! Code of the command which dumps the stats, see protocol_stats_cmd()
+#define PROTOCOL_STATS_CODE (2001)
+
+typedef struct ProtocolCommandStats {
+  uint32_t num_calls;
+  //! Frames for this command rejected as kProtocolCode_MalformedMsg
+  uint32_t num_malformed;
+  uint32_t buckets[PROTOCOL_STATS_NUM_BUCKETS];
+} sProtocolCommandStats;
+
+typedef struct ProtocolStats {
+  //! One slot per registry entry, in registry order. Calls to commands past
+  //! `num_commands` only count towards `num_untracked`.
+  sProtocolCommandStats *commands;
+  size_t num_commands;
+  //! Any monotonic counter: microseconds, or a cycle counter for finer
+  //! buckets. When NULL calls are counted but not timed.
+  uint64_t (*clock)(void);
+  //! Every frame rejected as malformed, including those counted against a
+  //! command
+  uint32_t num_malformed;
+  uint32_t num_not_found;
+  uint32_t num_untracked;
+} sProtocolStats;
+
+//! Starts recording into `stats`, which must stay valid while in use. Clears
+//! its counters. NULL stops recording.
+void protocol_stats_init(sProtocolStats *stats);
+
+void protocol_stats_reset(void);
+
+//! Stats of the command registered for `code`, or NULL if it isn't tracked
+const sProtocolCommandStats *protocol_stats_find(uint32_t code);
+
+//! Latency, in clock ticks, which `pct` percent of the calls took at most.
+//! Only as precise as the buckets: returns the upper end of the bucket the
+//! percentile falls in, or the lower end for the last bucket.
+uint64_t protocol_stats_percentile(const sProtocolCommandStats *stats, uint32_t pct);
+
+//! Handler for PROTOCOL_STATS_CODE. A payload of one non-zero byte also resets
+//! the stats once they've been dumped. All integers are little endian.
+//!
+//! Response: u32 num_malformed, u32 num_not_found, u32 num_untracked,
+//!           u32 num_records, then per command which was called or rejected:
+//!           u32 code, u32 num_calls, u32 num_malformed,
+//!           u32 buckets[PROTOCOL_STATS_NUM_BUCKETS]
+void protocol_stats_cmd(const uint8_t *buffer, size_t len, sProtocolResponse *resp);
+
+//
+// Hooks called by protocol.c
+//
+
+//! Returns the time a command starts, to pass to protocol_stats_record()
+uint64_t protocol_stats_start(void);
+
+void protocol_stats_record(const sProtocolCommand *command, uint64_t start);
+
+//! `command` is the command the rejected frame was for, when known
+void protocol_stats_record_error(eProtocolCode rv, const sProtocolCommand *command);
@@ -0,0 +1,23 @@
+// Prints the per command stats recorded by protocol/stats.h, so benchmarks
+// show which commands got slower. Meant to be used with bench_now_ns() as the
+// clock, so the histogram is in nanoseconds.
+#include <stdio.h>
+
+#include "protocol/registry.h"
+#include "protocol/stats.h"
+
+static inline void bench_protocol_stats_print(const sProtocolStats *stats) {
+  printf("  %-8s %8s %9s %10s %10s\n", "code", "calls", "malformed", "p50 ns <=", "p99 ns <=");
+  for (size_t i = 0; i < stats->num_commands && i < g_num_protocol_commands; i++) {
+    const sProtocolCommandStats *cmd = &stats->commands[i];
+    if (cmd->num_calls == 0 && cmd->num_malformed == 0) {
+      continue;
+    }
+    printf("  %-8u %8u %9u %10llu %10llu\n", (unsigned)g_protocol_commands[i].code,
+           (unsigned)cmd->num_calls, (unsigned)cmd->num_malformed,
+           (unsigned long long)protocol_stats_percentile(cmd, 50),
+           (unsigned long long)protocol_stats_percentile(cmd, 99));
+  }
+  printf("  %u malformed, %u not found, %u untracked\n", (unsigned)stats->num_malformed,
+         (unsigned)stats->num_not_found, (unsigned)stats->num_untracked);
+}
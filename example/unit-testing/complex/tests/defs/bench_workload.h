@@ -0,0 +1,91 @@
+// Helpers shared by the bench_*.cpp benchmarks. Everything is deterministic so
+// numbers are comparable between runs.
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint32_t s_bench_rand_state = 0x1234567;
+
+static inline void bench_rand_seed(uint32_t seed) {
+  s_bench_rand_state = seed ? seed : 1;
+}
+
+// xorshift32. The _r variant keeps its state in the caller, for benchmarks
+// which generate load from several threads.
+static inline uint32_t bench_rand_r(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static inline uint32_t bench_rand(void) {
+  return bench_rand_r(&s_bench_rand_state);
+}
+
+#define BENCH_ZIPF_MAX_KEYS 1024
+
+static double s_bench_zipf_cdf[BENCH_ZIPF_MAX_KEYS];
+static size_t s_bench_zipf_num_keys;
+
+//! Key i is picked with probability proportional to 1 / (i + 1)^skew
+static inline void bench_zipf_init(size_t num_keys, double skew) {
+  double sum = 0;
+  for (size_t i = 0; i < num_keys; i++) {
+    sum += 1.0 / pow((double)(i + 1), skew);
+    s_bench_zipf_cdf[i] = sum;
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    s_bench_zipf_cdf[i] /= sum;
+  }
+  s_bench_zipf_num_keys = num_keys;
+}
+
+static inline size_t bench_zipf_next_r(uint32_t *state) {
+  const double u = (double)bench_rand_r(state) / (double)UINT32_MAX;
+  size_t lo = 0;
+  size_t hi = s_bench_zipf_num_keys - 1;
+  while (lo < hi) {
+    const size_t mid = (lo + hi) / 2;
+    if (s_bench_zipf_cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static inline size_t bench_zipf_next(void) {
+  return bench_zipf_next_r(&s_bench_rand_state);
+}
+
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline double bench_ops_per_sec(size_t num_ops, uint64_t elapsed_ns) {
+  return elapsed_ns ? (double)num_ops * 1e9 / (double)elapsed_ns : 0.0;
+}
+
+static inline int prv_bench_u64_cmp(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a;
+  const uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+//! Sorts `samples` in place and returns the value at percentile `pct` (0-100)
+static inline uint64_t bench_percentile(uint64_t *samples, size_t num_samples, double pct) {
+  if (num_samples == 0) {
+    return 0;
+  }
+  qsort(samples, num_samples, sizeof(*samples), prv_bench_u64_cmp);
+  size_t idx = (size_t)(pct / 100.0 * (double)num_samples);
+  return samples[idx < num_samples ? idx : num_samples - 1];
+}
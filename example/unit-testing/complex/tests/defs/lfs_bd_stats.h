@@ -0,0 +1,123 @@
+#pragma once
+
+// Instrumented block device for the littlefs based tests. The callbacks wrap
+// the block device picked by lfs_default_config.h, so bd.stats keeps working, and additionally record count, bytes
+// and a simulated latency for every read, prog, erase and sync. Wrap a single
+// kv_store call in bd_stats_snapshot() / bd_stats_since() to see what it cost.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lfs.h"
+
+typedef enum {
+  kBdOp_Read,
+  kBdOp_Prog,
+  kBdOp_Erase,
+  kBdOp_Sync,
+  kBdOp_NumOps,
+} eBdOp;
+
+typedef struct {
+  uint64_t count;
+  uint64_t bytes;
+  //! Time the operations would have taken on the simulated part
+  uint64_t latency_us;
+} sBdOpStats;
+
+typedef struct {
+  sBdOpStats ops[kBdOp_NumOps];
+} sBdStats;
+
+//! Rough NOR flash timings. Nothing sleeps; the numbers are only accumulated.
+typedef struct {
+  uint32_t read_ns_per_byte;
+  uint32_t prog_ns_per_byte;
+  uint32_t erase_us_per_block;
+  uint32_t sync_us;
+} sBdLatencyModel;
+
+static const sBdLatencyModel s_bd_default_latency = {
+  .read_ns_per_byte = 100,
+  .prog_ns_per_byte = 3000,
+  .erase_us_per_block = 30000,
+  .sync_us = 0,
+};
+
+static sBdLatencyModel s_bd_latency = s_bd_default_latency;
+static sBdStats s_bd_stats;
+
+static inline void prv_bd_stats_record(eBdOp op, uint64_t bytes, uint64_t latency_ns) {
+  sBdOpStats *stats = &s_bd_stats.ops[op];
+  stats->count++;
+  stats->bytes += bytes;
+  stats->latency_us += latency_ns / 1000;
+}
+
+static inline int bd_stats_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
+                                void *buffer, lfs_size_t size) {
+  prv_bd_stats_record(kBdOp_Read, size, (uint64_t)size * s_bd_latency.read_ns_per_byte);
+  return LFS_TEST_BD(read)(c, block, off, buffer, size);
+}
+
+static inline int bd_stats_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off,
+                                const void *buffer, lfs_size_t size) {
+  prv_bd_stats_record(kBdOp_Prog, size, (uint64_t)size * s_bd_latency.prog_ns_per_byte);
+  return LFS_TEST_BD(prog)(c, block, off, buffer, size);
+}
+
+static inline int bd_stats_erase(const struct lfs_config *c, lfs_block_t block) {
+  prv_bd_stats_record(kBdOp_Erase, c->block_size,
+                      (uint64_t)s_bd_latency.erase_us_per_block * 1000);
+  return LFS_TEST_BD(erase)(c, block);
+}
+
+static inline int bd_stats_sync(const struct lfs_config *c) {
+  prv_bd_stats_record(kBdOp_Sync, 0, (uint64_t)s_bd_latency.sync_us * 1000);
+  return LFS_TEST_BD(sync)(c);
+}
+
+//! Clears the counters and restores the default latency model
+static inline void bd_stats_reset(void) {
+  memset(&s_bd_stats, 0, sizeof(s_bd_stats));
+  s_bd_latency = s_bd_default_latency;
+}
+
+static inline void bd_stats_set_latency(const sBdLatencyModel *model) {
+  s_bd_latency = *model;
+}
+
+static inline sBdStats bd_stats_snapshot(void) {
+  return s_bd_stats;
+}
+
+//! Traffic since `before` was taken with bd_stats_snapshot()
+static inline sBdStats bd_stats_since(const sBdStats *before) {
+  sBdStats delta;
+  for (int i = 0; i < kBdOp_NumOps; i++) {
+    delta.ops[i].count = s_bd_stats.ops[i].count - before->ops[i].count;
+    delta.ops[i].bytes = s_bd_stats.ops[i].bytes - before->ops[i].bytes;
+    delta.ops[i].latency_us = s_bd_stats.ops[i].latency_us - before->ops[i].latency_us;
+  }
+  return delta;
+}
+
+static inline uint64_t bd_stats_latency_us(const sBdStats *stats) {
+  uint64_t total = 0;
+  for (int i = 0; i < kBdOp_NumOps; i++) {
+    total += stats->ops[i].latency_us;
+  }
+  return total;
+}
+
+static inline void bd_stats_print(const char *label, const sBdStats *stats) {
+  printf("  %-20s %5llu reads %7llu B  %5llu progs %7llu B  %4llu erases  %4llu syncs  %8llu us\n",
+         label,
+         (unsigned long long)stats->ops[kBdOp_Read].count,
+         (unsigned long long)stats->ops[kBdOp_Read].bytes,
+         (unsigned long long)stats->ops[kBdOp_Prog].count,
+         (unsigned long long)stats->ops[kBdOp_Prog].bytes,
+         (unsigned long long)stats->ops[kBdOp_Erase].count,
+         (unsigned long long)stats->ops[kBdOp_Sync].count,
+         (unsigned long long)bd_stats_latency_us(stats));
+}
@@ -27,9 +27,24 @@
 #define LFS_LOOKAHEAD_SIZE 16
 #endif
 
+// Block device under test. The RAM backed fake flash is the default as it
+// keeps host syscalls out of the numbers; build with -DLFS_TEST_USE_EMUBD to
+// run against the littlefs file-per-block emulator instead.
+#ifdef LFS_TEST_USE_EMUBD
+#include "emubd/lfs_emubd.h"
+typedef lfs_emubd_t lfs_test_bd_t;
+#define LFS_TEST_BD(op) lfs_emubd_##op
+#else
+#include "fakes/fake_flash.h"
+typedef sFakeFlash lfs_test_bd_t;
+#define LFS_TEST_BD(op) fake_flash_##op
+#endif
+
+#include "defs/lfs_bd_stats.h"
+
 // lfs declarations
 static lfs_t lfs;
-static lfs_emubd_t bd;
+static lfs_test_bd_t bd;
 // other declarations for convenience
 static lfs_file_t file;
 static lfs_dir_t dir;
@@ -39,10 +54,10 @@ static char path[1024];
 
 const struct lfs_config cfg = {
   .context = &bd,
-  .read  = &lfs_emubd_read,
-  .prog  = &lfs_emubd_prog,
-  .erase = &lfs_emubd_erase,
-  .sync  = &lfs_emubd_sync,
+  .read  = &bd_stats_read,
+  .prog  = &bd_stats_prog,
+  .erase = &bd_stats_erase,
+  .sync  = &bd_stats_sync,
 
   .read_size      = LFS_READ_SIZE,
   .prog_size      = LFS_PROG_SIZE,
@@ -52,3 +67,16 @@ const struct lfs_config cfg = {
   .cache_size     = LFS_CACHE_SIZE,
   .lookahead_size = LFS_LOOKAHEAD_SIZE,
 };
+
+//! `path` is only used by lfs_emubd, which keeps one file per block under it
+static inline int lfs_test_bd_create(const char *path) {
+#ifdef LFS_TEST_USE_EMUBD
+  return lfs_emubd_create(&cfg, path);
+#else
+  return fake_flash_create(&cfg, NULL);
+#endif
+}
+
+static inline void lfs_test_bd_destroy(void) {
+  LFS_TEST_BD(destroy)(&cfg);
+}
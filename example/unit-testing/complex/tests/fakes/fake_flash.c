@@ -0,0 +1,107 @@
+#include "fakes/fake_flash.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static const sFakeFlashConfig s_default_config = {
+  .erase_value = 0xff,
+};
+
+static void prv_delay(uint32_t ns) {
+  if (ns == 0) {
+    return;
+  }
+  const struct timespec ts = {
+    .tv_sec = ns / 1000000000,
+    .tv_nsec = ns % 1000000000,
+  };
+  nanosleep(&ts, NULL);
+}
+
+static uint8_t *prv_addr(const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off,
+                         lfs_size_t size) {
+  sFakeFlash *flash = cfg->context;
+  assert(block < cfg->block_count);
+  assert(off + size <= cfg->block_size);
+  return &flash->mem[(size_t)block * cfg->block_size + off];
+}
+
+int fake_flash_create(const struct lfs_config *cfg, const sFakeFlashConfig *config) {
+  sFakeFlash *flash = cfg->context;
+  memset(flash, 0, sizeof(*flash));
+  flash->config = config ? *config : s_default_config;
+  flash->size = (size_t)cfg->block_size * cfg->block_count;
+  flash->fd = -1;
+
+  if (flash->config.mmap_path) {
+    flash->fd = open(flash->config.mmap_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (flash->fd < 0 || ftruncate(flash->fd, flash->size) < 0) {
+      return LFS_ERR_IO;
+    }
+    flash->mem = mmap(NULL, flash->size, PROT_READ | PROT_WRITE, MAP_SHARED, flash->fd, 0);
+    if (flash->mem == MAP_FAILED) {
+      flash->mem = NULL;
+      return LFS_ERR_IO;
+    }
+  } else {
+    flash->mem = malloc(flash->size);
+    if (!flash->mem) {
+      return LFS_ERR_NOMEM;
+    }
+  }
+
+  // A new part comes erased
+  memset(flash->mem, flash->config.erase_value, flash->size);
+  return 0;
+}
+
+void fake_flash_destroy(const struct lfs_config *cfg) {
+  sFakeFlash *flash = cfg->context;
+  if (flash->fd >= 0) {
+    if (flash->mem) {
+      munmap(flash->mem, flash->size);
+    }
+    close(flash->fd);
+  } else {
+    free(flash->mem);
+  }
+  flash->mem = NULL;
+  flash->fd = -1;
+}
+
+int fake_flash_read(const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off,
+                    void *buffer, lfs_size_t size) {
+  sFakeFlash *flash = cfg->context;
+  memcpy(buffer, prv_addr(cfg, block, off, size), size);
+  flash->stats.read_count++;
+  prv_delay(flash->config.read_delay_ns);
+  return 0;
+}
+
+int fake_flash_prog(const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off,
+                    const void *buffer, lfs_size_t size) {
+  sFakeFlash *flash = cfg->context;
+  memcpy(prv_addr(cfg, block, off, size), buffer, size);
+  flash->stats.prog_count++;
+  prv_delay(flash->config.prog_delay_ns);
+  return 0;
+}
+
+int fake_flash_erase(const struct lfs_config *cfg, lfs_block_t block) {
+  sFakeFlash *flash = cfg->context;
+  memset(prv_addr(cfg, block, 0, cfg->block_size), flash->config.erase_value, cfg->block_size);
+  flash->stats.erase_count++;
+  prv_delay(flash->config.erase_delay_ns);
+  return 0;
+}
+
+int fake_flash_sync(const struct lfs_config *cfg) {
+  // Writes land in the buffer immediately. With mmap_path set the kernel
+  // writes them back to the file, no msync needed for a test run.
+  return 0;
+}
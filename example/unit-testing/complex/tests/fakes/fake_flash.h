@@ -0,0 +1,54 @@
+#pragma once
+
+//! Block device for littlefs which keeps the whole part in one buffer, either
+//! on the heap or mmap'd from a single file. Much faster than lfs_emubd, which
+//! stores every block as its own file, so test and benchmark time goes to
+//! littlefs and kv_store rather than host syscalls. Geometry comes from the
+//! lfs_config it is created with.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lfs.h"
+
+typedef struct {
+  //! Value erased bytes read back as. NOR parts erase to 0xff.
+  uint8_t erase_value;
+  //! When set the part is mmap'd from this file, so its contents can be
+  //! inspected or kept between runs. NULL keeps it in heap RAM.
+  const char *mmap_path;
+  //! Optional time each operation really takes, to model a slow part in wall
+  //! clock benchmarks. 0 returns immediately.
+  uint32_t read_delay_ns;
+  uint32_t prog_delay_ns;
+  uint32_t erase_delay_ns;
+} sFakeFlashConfig;
+
+typedef struct FakeFlash {
+  uint8_t *mem;
+  size_t size;
+  int fd;
+  sFakeFlashConfig config;
+  //! Same counters as lfs_emubd, so tests can use either
+  struct {
+    uint64_t read_count;
+    uint64_t prog_count;
+    uint64_t erase_count;
+  } stats;
+} sFakeFlash;
+
+//! `cfg->context` must point at an sFakeFlash. `config` may be NULL for an
+//! instant, heap backed part which erases to 0xff.
+int fake_flash_create(const struct lfs_config *cfg, const sFakeFlashConfig *config);
+
+void fake_flash_destroy(const struct lfs_config *cfg);
+
+int fake_flash_read(const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off,
+                    void *buffer, lfs_size_t size);
+
+int fake_flash_prog(const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off,
+                    const void *buffer, lfs_size_t size);
+
+int fake_flash_erase(const struct lfs_config *cfg, lfs_block_t block);
+
+int fake_flash_sync(const struct lfs_config *cfg);
@@ -3,7 +3,7 @@
 #include "lfs.h"
 #include <stdio.h>
 
-void kv_store_init(lfs_t *lfs) {
+void kv_store_init(lfs_t *lfs, const sKvStoreConfig *config) {
   // memset RAM buffer
 }
 
@@ -18,3 +18,7 @@ uint32_t kv_store_read(const char *key, void *buf, uint32_t buf_len) {
 bool kv_store_delete(const char *key) {
   // Delete value from RAM key-value store
 }
+
+bool kv_store_flush(void) {
+  // Nothing to flush, everything lives in RAM
+}
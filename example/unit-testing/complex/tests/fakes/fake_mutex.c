@@ -13,13 +13,29 @@ typedef struct Mutex {
   uint8_t lock_count;
 } Mutex;
 
+typedef struct RwLock {
+  uint8_t readers;
+  uint8_t writers;
+} RwLock;
+
 static Mutex s_mutexes[NUM_MUTEXES];
 static uint32_t s_mutex_index;
 
+static RwLock s_rwlocks[NUM_MUTEXES];
+static uint32_t s_rwlock_index;
+
+typedef struct Semaphore {
+  uint32_t count;
+} Semaphore;
+
+static Semaphore s_semaphores[NUM_MUTEXES];
+static uint32_t s_semaphore_index;
+
 // Fake Helpers
 
 void fake_mutex_init(void) {
   memset(s_mutexes, 0, sizeof(s_mutexes));
+  memset(s_rwlocks, 0, sizeof(s_rwlocks));
 }
 
 bool fake_mutex_all_unlocked(void) {
@@ -27,6 +43,9 @@ bool fake_mutex_all_unlocked(void) {
     if (s_mutexes[i].lock_count > 0) {
       return false;
     }
+    if (s_rwlocks[i].readers > 0 || s_rwlocks[i].writers > 0) {
+      return false;
+    }
   }
   return true;
 }
@@ -45,3 +64,46 @@ void mutex_lock(Mutex *mutex) {
 void mutex_unlock(Mutex *mutex) {
   mutex->lock_count--;
 }
+
+// The fake never blocks, so it asserts on anything which would deadlock a real
+// rwlock instead
+
+RwLock *rwlock_create(void) {
+  assert(s_rwlock_index < NUM_MUTEXES);
+  return &s_rwlocks[s_rwlock_index++];
+}
+
+void rwlock_read_lock(RwLock *rwlock) {
+  assert(rwlock->writers == 0);
+  rwlock->readers++;
+}
+
+void rwlock_read_unlock(RwLock *rwlock) {
+  assert(rwlock->readers > 0);
+  rwlock->readers--;
+}
+
+void rwlock_write_lock(RwLock *rwlock) {
+  assert(rwlock->readers == 0 && rwlock->writers == 0);
+  rwlock->writers++;
+}
+
+void rwlock_write_unlock(RwLock *rwlock) {
+  assert(rwlock->writers == 1);
+  rwlock->writers--;
+}
+
+Semaphore *semaphore_create(void) {
+  assert(s_semaphore_index < NUM_MUTEXES);
+  return &s_semaphores[s_semaphore_index++];
+}
+
+void semaphore_give(Semaphore *semaphore) {
+  semaphore->count++;
+}
+
+// Taking an empty semaphore would block forever in a single threaded test
+void semaphore_take(Semaphore *semaphore) {
+  assert(semaphore->count > 0);
+  semaphore->count--;
+}
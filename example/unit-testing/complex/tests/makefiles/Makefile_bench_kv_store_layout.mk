@@ -0,0 +1,20 @@
+COMPONENT_NAME=bench_kv_store_layout
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/littlefs/lfs.c \
+  $(PROJECT_SRC_DIR)/littlefs/lfs_util.c \
+  $(PROJECT_SRC_DIR)/littlefs/emubd/lfs_emubd.c \
+  $(UNITTEST_ROOT)/fakes/fake_flash.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_file.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_compress.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_log.c \
+  $(UNITTEST_ROOT)/fakes/fake_mutex.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/bench_kv_store_layout.cpp
+
+# 4 MiB, enough for 10,000 small files
+CPPUTEST_CPPFLAGS += -DLFS_BLOCK_COUNT=8192
+
+include $(CPPUTEST_MAKFILE_INFRA)
@@ -0,0 +1,19 @@
+COMPONENT_NAME=bench_kv_store_threads
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/littlefs/lfs.c \
+  $(PROJECT_SRC_DIR)/littlefs/lfs_util.c \
+  $(PROJECT_SRC_DIR)/littlefs/emubd/lfs_emubd.c \
+  $(UNITTEST_ROOT)/fakes/fake_flash.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_file.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_compress.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_log.c \
+  $(PROJECT_SRC_DIR)/mutex/mutex_pthread.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/bench_kv_store_threads.cpp
+
+CPPUTEST_LDFLAGS += -pthread
+
+include $(CPPUTEST_MAKFILE_INFRA)
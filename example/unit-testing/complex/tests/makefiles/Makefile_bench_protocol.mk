@@ -0,0 +1,11 @@
+COMPONENT_NAME=bench_protocol
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/protocol/protocol.c \
+  $(PROJECT_SRC_DIR)/protocol/response.c \
+  $(PROJECT_SRC_DIR)/protocol/stats.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/bench_protocol.cpp
+
+include $(CPPUTEST_MAKFILE_INFRA)
@@ -0,0 +1,25 @@
+COMPONENT_NAME=bench_protocol_pipeline
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/littlefs/lfs.c \
+  $(PROJECT_SRC_DIR)/littlefs/lfs_util.c \
+  $(PROJECT_SRC_DIR)/littlefs/emubd/lfs_emubd.c \
+  $(UNITTEST_ROOT)/fakes/fake_flash.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_file.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_compress.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_log.c \
+  $(PROJECT_SRC_DIR)/protocol/protocol.c \
+  $(PROJECT_SRC_DIR)/protocol/response.c \
+  $(PROJECT_SRC_DIR)/protocol/stats.c \
+  $(PROJECT_SRC_DIR)/protocol/registry.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_protocol_handlers.c \
+  $(UNITTEST_ROOT)/fakes/fake_mutex.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/bench_protocol_pipeline.cpp
+
+# Room for an ack per request at the deepest pipeline, so no write is turned away
+CPPUTEST_CPPFLAGS += -DKV_STORE_PROTOCOL_MAX_PENDING=16
+
+include $(CPPUTEST_MAKFILE_INFRA)
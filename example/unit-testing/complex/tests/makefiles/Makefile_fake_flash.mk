@@ -0,0 +1,9 @@
+COMPONENT_NAME=fake_flash
+
+SRC_FILES = \
+  $(UNITTEST_ROOT)/fakes/fake_flash.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/test_fake_flash.cpp
+
+include $(CPPUTEST_MAKFILE_INFRA)
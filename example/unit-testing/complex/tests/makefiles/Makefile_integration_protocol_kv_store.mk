@@ -4,8 +4,14 @@ SRC_FILES = \
   $(PROJECT_SRC_DIR)/littlefs/lfs.c \
   $(PROJECT_SRC_DIR)/littlefs/lfs_util.c \
   $(PROJECT_SRC_DIR)/littlefs/emubd/lfs_emubd.c \
+  $(UNITTEST_ROOT)/fakes/fake_flash.c \
   $(PROJECT_SRC_DIR)/kv_store/kv_store.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_file.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_compress.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_log.c \
   $(PROJECT_SRC_DIR)/protocol/protocol.c \
+  $(PROJECT_SRC_DIR)/protocol/response.c \
+  $(PROJECT_SRC_DIR)/protocol/stats.c \
   $(PROJECT_SRC_DIR)/protocol/registry.c \
   $(PROJECT_SRC_DIR)/kv_store/kv_store_protocol_handlers.c \
   $(UNITTEST_ROOT)/fakes/fake_mutex.c \
@@ -0,0 +1,9 @@
+COMPONENT_NAME=kv_compress
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/kv_store/kv_compress.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/test_kv_compress.cpp
+
+include $(CPPUTEST_MAKFILE_INFRA)
@@ -4,6 +4,7 @@ SRC_FILES = \
   $(PROJECT_SRC_DIR)/littlefs/lfs.c \
   $(PROJECT_SRC_DIR)/littlefs/lfs_util.c \
   $(PROJECT_SRC_DIR)/littlefs/emubd/lfs_emubd.c \
+  $(UNITTEST_ROOT)/fakes/fake_flash.c \
 
 TEST_SRC_FILES = \
   $(UNITTEST_SRC_DIR)/test_littlefs_format.c
@@ -2,6 +2,8 @@ COMPONENT_NAME=protocol
 
 SRC_FILES = \
   $(PROJECT_SRC_DIR)/protocol/protocol.c \
+  $(PROJECT_SRC_DIR)/protocol/response.c \
+  $(PROJECT_SRC_DIR)/protocol/stats.c \
 
 TEST_SRC_FILES = \
   $(UNITTEST_SRC_DIR)/test_protocol.cpp
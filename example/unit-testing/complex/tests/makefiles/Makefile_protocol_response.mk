@@ -0,0 +1,9 @@
+COMPONENT_NAME=protocol_response
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/protocol/response.c \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/test_protocol_response.cpp
+
+include $(CPPUTEST_MAKFILE_INFRA)
@@ -4,10 +4,14 @@ SRC_FILES = \
   $(PROJECT_SRC_DIR)/littlefs/lfs.c \
   $(PROJECT_SRC_DIR)/littlefs/lfs_util.c \
   $(PROJECT_SRC_DIR)/littlefs/emubd/lfs_emubd.c \
+  $(UNITTEST_ROOT)/fakes/fake_flash.c \
   $(PROJECT_SRC_DIR)/kv_store/kv_store.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_file.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_compress.c \
+  $(PROJECT_SRC_DIR)/kv_store/kv_store_log.c \
   $(UNITTEST_ROOT)/fakes/fake_mutex.c \
 
 TEST_SRC_FILES = \
-  $(UNITTEST_SRC_DIR)/test_kv_store.c
+  $(UNITTEST_SRC_DIR)/test_kv_store.cpp
 
 include $(CPPUTEST_MAKFILE_INFRA)
@@ -0,0 +1,643 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <string.h>
+  #include <stddef.h>
+  #include <stdio.h>
+
+  #include "lfs.h"
+
+  #include "defs/lfs_default_config.h"
+  #include "defs/bench_workload.h"
+  #include "kv_store/kv_store.h"
+
+  #include "analytics/analytics.h"
+  #include "fakes/fake_mutex.h"
+}
+
+static uint32_t s_analytics_counts[kSettingsWriteQueueFlushLatencyUs + 1];
+
+void analytics_inc(eAnalyticsKey key) {
+  s_analytics_counts[key]++;
+}
+
+void analytics_set(eAnalyticsKey key, uint32_t value) {
+  s_analytics_counts[key] = value;
+}
+
+// Benchmarks run against the fake flash and report the traffic it records.
+// They also assert the expected direction of the result so a regression
+// fails the unit test run.
+
+#define BENCH_NUM_KEYS 64
+#define BENCH_NUM_OPS 2000
+
+static sKvStoreCacheEntry s_cache_entries[8];
+
+static void prv_key_name(char *buf, size_t buf_len, size_t i) {
+  snprintf(buf, buf_len, "key%u", (unsigned)i);
+}
+
+static void prv_populate(void) {
+  char key[16];
+  for (size_t i = 0; i < BENCH_NUM_KEYS; i++) {
+    prv_key_name(key, sizeof(key), i);
+    uint32_t val = (uint32_t)i;
+    kv_store_write(key, &val, sizeof(val));
+  }
+  kv_store_flush();
+}
+
+//! Returns the number of block device reads for a Zipfian read workload
+static uint64_t prv_run_skewed_reads(const sKvStoreConfig *config) {
+  fake_mutex_init();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+  kv_store_init(&lfs, config);
+  prv_populate();
+
+  bench_rand_seed(1);
+  bench_zipf_init(BENCH_NUM_KEYS, 1.0);
+
+  const uint64_t reads_before = bd.stats.read_count;
+  char key[16];
+  for (size_t i = 0; i < BENCH_NUM_OPS; i++) {
+    prv_key_name(key, sizeof(key), bench_zipf_next());
+    uint32_t val;
+    uint32_t len;
+    kv_store_read(key, &val, sizeof(val), &len);
+  }
+  const uint64_t reads = bd.stats.read_count - reads_before;
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+  return reads;
+}
+
+TEST_GROUP(BenchKvStoreCache) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreCache, ZipfianReads) {
+  const uint64_t uncached = prv_run_skewed_reads(NULL);
+
+  sKvStoreConfig config = {};
+  config.cache_entries = s_cache_entries;
+  config.num_cache_entries = sizeof(s_cache_entries) / sizeof(s_cache_entries[0]);
+  const uint64_t cached = prv_run_skewed_reads(&config);
+
+  printf("\nkv_store cache: %d zipf reads over %d keys, %u entries\n",
+         BENCH_NUM_OPS, BENCH_NUM_KEYS, (unsigned)config.num_cache_entries);
+  printf("  block reads uncached: %llu\n", (unsigned long long)uncached);
+  printf("  block reads cached:   %llu (%.1f%% saved)\n", (unsigned long long)cached,
+         100.0 * (double)(uncached - cached) / (double)uncached);
+
+  CHECK(cached < uncached);
+}
+
+#define BENCH_BATCH_NUM_KEYS 40
+#define BENCH_BATCH_VAL_LEN 16
+
+typedef struct {
+  uint64_t progs;
+  uint64_t erases;
+} sFlashCost;
+
+static sFlashCost prv_run_provisioning(bool batched) {
+  fake_mutex_init();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+  kv_store_init(&lfs, NULL);
+
+  static char keys[BENCH_BATCH_NUM_KEYS][16];
+  static uint8_t vals[BENCH_BATCH_NUM_KEYS][BENCH_BATCH_VAL_LEN];
+  sKvStoreBatchEntry entries[BENCH_BATCH_NUM_KEYS];
+  for (size_t i = 0; i < BENCH_BATCH_NUM_KEYS; i++) {
+    prv_key_name(keys[i], sizeof(keys[i]), i);
+    memset(vals[i], (int)i, sizeof(vals[i]));
+    entries[i].key = keys[i];
+    entries[i].val = vals[i];
+    entries[i].len = sizeof(vals[i]);
+  }
+
+  const uint64_t progs_before = bd.stats.prog_count;
+  const uint64_t erases_before = bd.stats.erase_count;
+  if (batched) {
+    CHECK(kv_store_write_batch(entries, BENCH_BATCH_NUM_KEYS));
+  } else {
+    for (size_t i = 0; i < BENCH_BATCH_NUM_KEYS; i++) {
+      CHECK(kv_store_write(entries[i].key, entries[i].val, entries[i].len));
+    }
+  }
+  sFlashCost cost;
+  cost.progs = bd.stats.prog_count - progs_before;
+  cost.erases = bd.stats.erase_count - erases_before;
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+  return cost;
+}
+
+TEST_GROUP(BenchKvStoreBatch) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreBatch, Provisioning) {
+  const sFlashCost single = prv_run_provisioning(false);
+  const sFlashCost batched = prv_run_provisioning(true);
+
+  printf("\nkv_store batch: %d keys x %d bytes\n", BENCH_BATCH_NUM_KEYS, BENCH_BATCH_VAL_LEN);
+  printf("  single writes: %llu progs, %llu erases\n",
+         (unsigned long long)single.progs, (unsigned long long)single.erases);
+  printf("  write_batch:   %llu progs, %llu erases\n",
+         (unsigned long long)batched.progs, (unsigned long long)batched.erases);
+
+  // The file-per-key layout still needs one commit per key, so atomicity costs
+  // one extra journal write. Make sure that overhead stays bounded.
+  CHECK(batched.progs <= 2 * single.progs);
+}
+
+#define BENCH_BACKEND_NUM_KEYS 200
+#define BENCH_BACKEND_NUM_OPS 1000
+
+static sKvStoreLogIndexEntry s_bench_log_index[256];
+
+typedef struct {
+  double writes_per_sec;
+  double reads_per_sec;
+  double space_amplification;
+} sBackendResult;
+
+static sBackendResult prv_run_small_values(eKvStoreBackend backend) {
+  fake_mutex_init();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+
+  sKvStoreConfig config = {};
+  config.backend = backend;
+  config.log_index = s_bench_log_index;
+  config.log_index_len = sizeof(s_bench_log_index) / sizeof(s_bench_log_index[0]);
+  kv_store_init(&lfs, &config);
+
+  // 4-16 byte settings, the case the log backend is meant for
+  static uint32_t val_lens[BENCH_BACKEND_NUM_KEYS];
+  bench_rand_seed(2);
+  char key[16];
+  uint8_t val[16];
+  memset(val, 0x42, sizeof(val));
+
+  const uint64_t write_start = bench_now_ns();
+  for (size_t i = 0; i < BENCH_BACKEND_NUM_KEYS; i++) {
+    prv_key_name(key, sizeof(key), i);
+    val_lens[i] = 4 + bench_rand() % 13;
+    CHECK(kv_store_write(key, val, val_lens[i]));
+  }
+  for (size_t i = 0; i < BENCH_BACKEND_NUM_OPS; i++) {
+    const size_t k = bench_rand() % BENCH_BACKEND_NUM_KEYS;
+    prv_key_name(key, sizeof(key), k);
+    CHECK(kv_store_write(key, val, val_lens[k]));
+  }
+  const uint64_t write_ns = bench_now_ns() - write_start;
+
+  const uint64_t read_start = bench_now_ns();
+  for (size_t i = 0; i < BENCH_BACKEND_NUM_OPS; i++) {
+    prv_key_name(key, sizeof(key), bench_rand() % BENCH_BACKEND_NUM_KEYS);
+    uint32_t len;
+    CHECK(kv_store_read(key, val, sizeof(val), &len));
+  }
+  const uint64_t read_ns = bench_now_ns() - read_start;
+
+  size_t logical_bytes = 0;
+  for (size_t i = 0; i < BENCH_BACKEND_NUM_KEYS; i++) {
+    prv_key_name(key, sizeof(key), i);
+    logical_bytes += strlen(key) + val_lens[i];
+  }
+  const lfs_ssize_t blocks_used = lfs_fs_size(&lfs);
+
+  sBackendResult result;
+  result.writes_per_sec = bench_ops_per_sec(BENCH_BACKEND_NUM_KEYS + BENCH_BACKEND_NUM_OPS, write_ns);
+  result.reads_per_sec = bench_ops_per_sec(BENCH_BACKEND_NUM_OPS, read_ns);
+  result.space_amplification = (double)blocks_used * LFS_BLOCK_SIZE / (double)logical_bytes;
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+  return result;
+}
+
+TEST_GROUP(BenchKvStoreBackend) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreBackend, SmallValues) {
+  const sBackendResult file = prv_run_small_values(kKvStoreBackend_FilePerKey);
+  const sBackendResult log = prv_run_small_values(kKvStoreBackend_Log);
+
+  printf("\nkv_store backends: %d keys, 4-16 byte values, %d overwrites + %d reads\n",
+         BENCH_BACKEND_NUM_KEYS, BENCH_BACKEND_NUM_OPS, BENCH_BACKEND_NUM_OPS);
+  printf("  file per key: %10.0f writes/s %10.0f reads/s  space amplification %.1fx\n",
+         file.writes_per_sec, file.reads_per_sec, file.space_amplification);
+  printf("  log:          %10.0f writes/s %10.0f reads/s  space amplification %.1fx\n",
+         log.writes_per_sec, log.reads_per_sec, log.space_amplification);
+
+  CHECK(log.space_amplification < file.space_amplification);
+}
+
+#define BENCH_FILTER_NUM_KEYS 64
+#define BENCH_FILTER_NUM_LOOKUPS 1000
+// Share of lookups for optional keys which were never written
+#define BENCH_FILTER_MISS_PCT 90
+
+static uint8_t s_bench_filter_buf[256];
+
+typedef struct {
+  uint64_t block_reads;
+  uint32_t false_positives;
+  uint32_t est_fp_rate_ppm;
+} sFilterResult;
+
+static sFilterResult prv_run_optional_key_probes(size_t filter_size_bytes) {
+  fake_mutex_init();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+
+  sKvStoreConfig config = {};
+  config.filter_buf = filter_size_bytes ? s_bench_filter_buf : NULL;
+  config.filter_size_bytes = filter_size_bytes;
+  kv_store_init(&lfs, &config);
+
+  char key[16];
+  for (size_t i = 0; i < BENCH_FILTER_NUM_KEYS; i++) {
+    prv_key_name(key, sizeof(key), i);
+    kv_store_write(key, "v", 1);
+  }
+
+  memset(s_analytics_counts, 0, sizeof(s_analytics_counts));
+  bench_rand_seed(3);
+  const uint64_t reads_before = bd.stats.read_count;
+  for (size_t i = 0; i < BENCH_FILTER_NUM_LOOKUPS; i++) {
+    if (bench_rand() % 100 < BENCH_FILTER_MISS_PCT) {
+      snprintf(key, sizeof(key), "opt%u", (unsigned)(bench_rand() % 1000));
+    } else {
+      prv_key_name(key, sizeof(key), bench_rand() % BENCH_FILTER_NUM_KEYS);
+    }
+    char buf[4];
+    uint32_t len;
+    kv_store_read(key, buf, sizeof(buf), &len);
+  }
+
+  sFilterResult result;
+  result.block_reads = bd.stats.read_count - reads_before;
+  result.false_positives = s_analytics_counts[kSettingsFilterFalsePositive];
+  sKvStoreFilterStats stats = {};
+  kv_store_filter_stats(&stats);
+  result.est_fp_rate_ppm = stats.fp_rate_ppm;
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+  return result;
+}
+
+TEST_GROUP(BenchKvStoreFilter) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreFilter, OptionalKeyProbes) {
+  const sFilterResult none = prv_run_optional_key_probes(0);
+
+  printf("\nkv_store filter: %d keys, %d lookups, %d%% for missing keys\n",
+         BENCH_FILTER_NUM_KEYS, BENCH_FILTER_NUM_LOOKUPS, BENCH_FILTER_MISS_PCT);
+  printf("  no filter:          %6llu block reads\n", (unsigned long long)none.block_reads);
+
+  const size_t sizes[] = {16, 32, 64, 128, 256};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    const sFilterResult result = prv_run_optional_key_probes(sizes[i]);
+    printf("  %3u byte filter:    %6llu block reads  est fp %5.2f%%  false positives %u\n",
+           (unsigned)sizes[i], (unsigned long long)result.block_reads,
+           (double)result.est_fp_rate_ppm / 10000.0, (unsigned)result.false_positives);
+    CHECK(result.block_reads <= none.block_reads);
+  }
+}
+
+#define BENCH_SYNC_NUM_KEYS 32
+#define BENCH_SYNC_NUM_SYNCS 20
+#define BENCH_SYNC_CHANGE_PCT 10
+
+typedef struct {
+  sFlashCost flash;
+  uint64_t reads;
+  uint32_t skipped;
+} sSyncResult;
+
+//! Re-persists every setting on each config sync, with only a few changed
+static sSyncResult prv_run_config_syncs(bool skip_unchanged_writes) {
+  fake_mutex_init();
+  memset(s_analytics_counts, 0, sizeof(s_analytics_counts));
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+
+  sKvStoreConfig config = {};
+  config.skip_unchanged_writes = skip_unchanged_writes;
+  kv_store_init(&lfs, &config);
+
+  uint32_t vals[BENCH_SYNC_NUM_KEYS] = {};
+  char key[16];
+  for (size_t i = 0; i < BENCH_SYNC_NUM_KEYS; i++) {
+    prv_key_name(key, sizeof(key), i);
+    CHECK(kv_store_write(key, &vals[i], sizeof(vals[i])));
+  }
+
+  bench_rand_seed(4);
+  const uint64_t reads_before = bd.stats.read_count;
+  const uint64_t progs_before = bd.stats.prog_count;
+  const uint64_t erases_before = bd.stats.erase_count;
+  for (size_t sync = 0; sync < BENCH_SYNC_NUM_SYNCS; sync++) {
+    for (size_t i = 0; i < BENCH_SYNC_NUM_KEYS; i++) {
+      if (bench_rand() % 100 < BENCH_SYNC_CHANGE_PCT) {
+        vals[i]++;
+      }
+      prv_key_name(key, sizeof(key), i);
+      CHECK(kv_store_write(key, &vals[i], sizeof(vals[i])));
+    }
+  }
+
+  sSyncResult result;
+  result.reads = bd.stats.read_count - reads_before;
+  result.flash.progs = bd.stats.prog_count - progs_before;
+  result.flash.erases = bd.stats.erase_count - erases_before;
+  result.skipped = s_analytics_counts[kSettingsFileWriteSkipped];
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+  return result;
+}
+
+TEST_GROUP(BenchKvStoreSkipUnchanged) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreSkipUnchanged, ConfigSync) {
+  const sSyncResult always = prv_run_config_syncs(false);
+  const sSyncResult skip = prv_run_config_syncs(true);
+
+  printf("\nkv_store config sync: %d keys x %d syncs, %d%% of values change\n",
+         BENCH_SYNC_NUM_KEYS, BENCH_SYNC_NUM_SYNCS, BENCH_SYNC_CHANGE_PCT);
+  printf("  always write:    %6llu progs  %5llu erases  %6llu block reads\n",
+         (unsigned long long)always.flash.progs, (unsigned long long)always.flash.erases,
+         (unsigned long long)always.reads);
+  printf("  skip unchanged:  %6llu progs  %5llu erases  %6llu block reads  %u writes skipped\n",
+         (unsigned long long)skip.flash.progs, (unsigned long long)skip.flash.erases,
+         (unsigned long long)skip.reads, (unsigned)skip.skipped);
+
+  CHECK(skip.skipped > 0);
+  CHECK(skip.flash.erases < always.flash.erases);
+  CHECK(skip.flash.progs < always.flash.progs);
+}
+
+typedef struct {
+  sBdStats write_new;
+  sBdStats overwrite;
+  sBdStats read;
+  sBdStats read_missing;
+  sBdStats remove;
+} sOpCosts;
+
+//! Block device cost of one call of each kind, on a store already holding
+//! BENCH_NUM_KEYS keys
+static sOpCosts prv_measure_op_costs(eKvStoreBackend backend) {
+  fake_mutex_init();
+  bd_stats_reset();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+
+  sKvStoreConfig config = {};
+  config.backend = backend;
+  config.log_index = s_bench_log_index;
+  config.log_index_len = sizeof(s_bench_log_index) / sizeof(s_bench_log_index[0]);
+  kv_store_init(&lfs, &config);
+  prv_populate();
+
+  uint32_t val = 0x1234;
+  uint32_t len;
+  sOpCosts costs;
+  sBdStats before;
+
+  before = bd_stats_snapshot();
+  CHECK(kv_store_write("new_key", &val, sizeof(val)));
+  costs.write_new = bd_stats_since(&before);
+
+  before = bd_stats_snapshot();
+  CHECK(kv_store_write("key1", &val, sizeof(val)));
+  costs.overwrite = bd_stats_since(&before);
+
+  before = bd_stats_snapshot();
+  CHECK(kv_store_read("key2", &val, sizeof(val), &len));
+  costs.read = bd_stats_since(&before);
+
+  before = bd_stats_snapshot();
+  CHECK_FALSE(kv_store_read("missing", &val, sizeof(val), &len));
+  costs.read_missing = bd_stats_since(&before);
+
+  before = bd_stats_snapshot();
+  CHECK(kv_store_delete("key3"));
+  costs.remove = bd_stats_since(&before);
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+  return costs;
+}
+
+static void prv_print_op_costs(const char *name, const sOpCosts *costs) {
+  printf("%s:\n", name);
+  bd_stats_print("write (new key)", &costs->write_new);
+  bd_stats_print("write (overwrite)", &costs->overwrite);
+  bd_stats_print("read", &costs->read);
+  bd_stats_print("read (missing)", &costs->read_missing);
+  bd_stats_print("delete", &costs->remove);
+}
+
+TEST_GROUP(BenchKvStoreFlashCost) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreFlashCost, PerOperation) {
+  const sOpCosts file = prv_measure_op_costs(kKvStoreBackend_FilePerKey);
+  const sOpCosts log = prv_measure_op_costs(kKvStoreBackend_Log);
+
+  printf("\nkv_store flash cost per call, %d keys stored, 4 byte values\n", BENCH_NUM_KEYS);
+  prv_print_op_costs("file per key", &file);
+  prv_print_op_costs("log", &log);
+
+  // Reads must never write, and every write must be durable when it returns
+  const sOpCosts *all[] = {&file, &log};
+  for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+    CHECK_EQUAL(0, all[i]->read.ops[kBdOp_Prog].count + all[i]->read.ops[kBdOp_Erase].count);
+    CHECK_EQUAL(0, all[i]->read_missing.ops[kBdOp_Prog].count);
+    CHECK(all[i]->write_new.ops[kBdOp_Sync].count > 0);
+    CHECK(all[i]->overwrite.ops[kBdOp_Sync].count > 0);
+  }
+}
+
+#define BENCH_COMPRESS_NUM_WRITES 20
+#define BENCH_COMPRESS_NUM_READS 50
+#define BENCH_COMPRESS_MAX_LEN 4096
+
+static sKvCompressor s_bench_compressor;
+static uint8_t s_payload[BENCH_COMPRESS_MAX_LEN];
+static uint8_t s_read_buf[BENCH_COMPRESS_MAX_LEN];
+
+//! Device config as JSON, the multi-kilobyte blobs compression is meant for
+static uint32_t prv_make_json_payload(uint8_t *buf, uint32_t buf_len) {
+  char *p = (char *)buf;
+  uint32_t len = snprintf(p, buf_len, "{\"version\":3,\"sensors\":[");
+  for (unsigned i = 0; len < buf_len - 160; i++) {
+    len += snprintf(&p[len], buf_len - len,
+                    "{\"id\":%u,\"name\":\"sensor_%u\",\"enabled\":%s,\"period_ms\":%u,"
+                    "\"threshold\":%u},",
+                    i, i, (i % 3) ? "true" : "false", 250u << (i % 4), 100 + (bench_rand() % 900));
+  }
+  len += snprintf(&p[len], buf_len - len, "{}]}");
+  return len;
+}
+
+//! CBOR-style samples: small integer keys followed by slowly drifting values
+static uint32_t prv_make_cbor_payload(uint8_t *buf, uint32_t buf_len) {
+  uint32_t len = 0;
+  uint16_t temp = 2150;
+  uint32_t ts = 1600000000;
+  while (len + 12 <= buf_len) {
+    temp += (bench_rand() % 5) - 2;
+    ts += 60;
+    const uint8_t record[12] = {
+      0xa3, 0x01, 0x1a, (uint8_t)(ts >> 24), (uint8_t)(ts >> 16), (uint8_t)(ts >> 8),
+      (uint8_t)ts, 0x02, 0x19, (uint8_t)(temp >> 8), (uint8_t)temp, 0xf5,
+    };
+    memcpy(&buf[len], record, sizeof(record));
+    len += sizeof(record);
+  }
+  return len;
+}
+
+//! Already compressed or encrypted data, which must not get any bigger
+static uint32_t prv_make_random_payload(uint8_t *buf, uint32_t buf_len) {
+  for (uint32_t i = 0; i < buf_len; i++) {
+    buf[i] = (uint8_t)bench_rand();
+  }
+  return buf_len;
+}
+
+typedef struct {
+  uint32_t stored_bytes;
+  //! Per write
+  uint64_t write_ns;
+  uint64_t write_flash_us;
+  uint64_t prog_bytes;
+  double read_mb_per_sec;
+} sCompressResult;
+
+static sCompressResult prv_run_blob(const uint8_t *payload, uint32_t len, bool compress) {
+  fake_mutex_init();
+  bd_stats_reset();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+
+  sKvStoreConfig config = {};
+  config.compressor = compress ? &s_bench_compressor : NULL;
+  kv_store_init(&lfs, &config);
+
+  sCompressResult result = {};
+  const sBdStats before = bd_stats_snapshot();
+  const uint64_t write_start = bench_now_ns();
+  for (size_t i = 0; i < BENCH_COMPRESS_NUM_WRITES; i++) {
+    CHECK(kv_store_write("blob", payload, len));
+  }
+  result.write_ns = (bench_now_ns() - write_start) / BENCH_COMPRESS_NUM_WRITES;
+  const sBdStats cost = bd_stats_since(&before);
+  result.write_flash_us = bd_stats_latency_us(&cost) / BENCH_COMPRESS_NUM_WRITES;
+  result.prog_bytes = cost.ops[kBdOp_Prog].bytes / BENCH_COMPRESS_NUM_WRITES;
+
+  struct lfs_info info;
+  lfs_stat(&lfs, "/kv/blob", &info);
+  result.stored_bytes = info.size;
+
+  const uint64_t read_start = bench_now_ns();
+  for (size_t i = 0; i < BENCH_COMPRESS_NUM_READS; i++) {
+    uint32_t read_len;
+    CHECK(kv_store_read("blob", s_read_buf, sizeof(s_read_buf), &read_len));
+    LONGS_EQUAL(len, read_len);
+  }
+  const uint64_t read_ns = bench_now_ns() - read_start;
+  MEMCMP_EQUAL(payload, s_read_buf, len);
+  result.read_mb_per_sec =
+      bench_ops_per_sec(BENCH_COMPRESS_NUM_READS, read_ns) * len / (1024.0 * 1024.0);
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+  return result;
+}
+
+static void prv_print_blob(const char *label, const sCompressResult *result) {
+  printf("  %-16s %5u B stored  write %8llu ns + %6llu us flash  %6llu B progged  "
+         "read %6.1f MiB/s\n",
+         label, (unsigned)result->stored_bytes, (unsigned long long)result->write_ns,
+         (unsigned long long)result->write_flash_us, (unsigned long long)result->prog_bytes,
+         result->read_mb_per_sec);
+}
+
+TEST_GROUP(BenchKvStoreCompression) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreCompression, Blobs) {
+  typedef uint32_t (*PayloadGenerator)(uint8_t *buf, uint32_t buf_len);
+  const struct {
+    const char *name;
+    PayloadGenerator make;
+    bool compressible;
+  } payloads[] = {
+    {"json", prv_make_json_payload, true},
+    {"cbor samples", prv_make_cbor_payload, true},
+    {"random", prv_make_random_payload, false},
+  };
+
+  printf("\nkv_store compression: %d writes and %d reads of one value\n",
+         BENCH_COMPRESS_NUM_WRITES, BENCH_COMPRESS_NUM_READS);
+  for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+    bench_rand_seed(5);
+    const uint32_t len = payloads[i].make(s_payload, sizeof(s_payload));
+
+    const sCompressResult raw = prv_run_blob(s_payload, len, false);
+    const sCompressResult compressed = prv_run_blob(s_payload, len, true);
+
+    printf("%s, %u bytes:\n", payloads[i].name, (unsigned)len);
+    prv_print_blob("raw", &raw);
+    prv_print_blob("compressed", &compressed);
+
+    if (payloads[i].compressible) {
+      CHECK(compressed.prog_bytes < raw.prog_bytes);
+      CHECK(compressed.write_flash_us < raw.write_flash_us);
+    } else {
+      LONGS_EQUAL(raw.stored_bytes, compressed.stored_bytes);
+    }
+  }
+}
@@ -0,0 +1,187 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <pthread.h>
+  #include <string.h>
+  #include <stddef.h>
+  #include <stdio.h>
+  #include <time.h>
+
+  #include "lfs.h"
+
+  #include "defs/lfs_default_config.h"
+  #include "defs/bench_workload.h"
+  #include "kv_store/kv_store.h"
+
+  #include "analytics/analytics.h"
+}
+
+// Compares how long kv_store_write() blocks its caller with and without the
+// async write queue. The fake flash is given real prog and erase times, the
+// writer pauses between writes the way an application would between setting
+// changes, and a second thread runs kv_store_async_worker() on the pthread
+// port of mutex.h.
+
+#define BENCH_NUM_KEYS 32
+#define BENCH_NUM_WRITES 1000
+#define BENCH_THINK_TIME_US 600
+
+static sKvStoreQueueEntry s_write_queue[8];
+
+static uint64_t s_write_ns[BENCH_NUM_WRITES];
+
+static pthread_mutex_t s_analytics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t s_analytics_counts[kSettingsWriteQueueFlushLatencyUs + 1];
+static uint64_t s_flush_latency_us[BENCH_NUM_WRITES];
+static size_t s_num_flushes;
+static uint32_t s_max_depth;
+
+void analytics_inc(eAnalyticsKey key) {
+  pthread_mutex_lock(&s_analytics_mutex);
+  s_analytics_counts[key]++;
+  pthread_mutex_unlock(&s_analytics_mutex);
+}
+
+// The gauges are sampled so the run can report a distribution
+void analytics_set(eAnalyticsKey key, uint32_t value) {
+  pthread_mutex_lock(&s_analytics_mutex);
+  s_analytics_counts[key] = value;
+  if (key == kSettingsWriteQueueDepth && value > s_max_depth) {
+    s_max_depth = value;
+  }
+  if (key == kSettingsWriteQueueFlushLatencyUs && s_num_flushes < BENCH_NUM_WRITES) {
+    s_flush_latency_us[s_num_flushes++] = value;
+  }
+  pthread_mutex_unlock(&s_analytics_mutex);
+}
+
+static uint64_t prv_clock_us(void) {
+  return bench_now_ns() / 1000;
+}
+
+static void *prv_worker(void *arg) {
+  kv_store_async_worker();
+  return NULL;
+}
+
+static void prv_think(void) {
+  struct timespec ts = {};
+  ts.tv_nsec = BENCH_THINK_TIME_US * 1000;
+  nanosleep(&ts, NULL);
+}
+
+typedef struct {
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+  uint64_t flush_p99_us;
+  uint32_t max_depth;
+  uint32_t num_failures;
+} sAsyncResult;
+
+static sAsyncResult prv_run(bool async) {
+  // Rough NOR timings, slept for real
+  sFakeFlashConfig flash_config = {};
+  flash_config.erase_value = 0xff;
+  flash_config.read_delay_ns = 1000;
+  flash_config.prog_delay_ns = 20000;
+  flash_config.erase_delay_ns = 500000;
+  fake_flash_create(&cfg, &flash_config);
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+
+  // No write-back cache, so the synchronous run pays for flash on every write
+  // rather than only on eviction
+  sKvStoreConfig config = {};
+  if (async) {
+    config.write_queue = s_write_queue;
+    config.write_queue_len = sizeof(s_write_queue) / sizeof(s_write_queue[0]);
+    config.clock_us = prv_clock_us;
+  }
+  kv_store_init(&lfs, &config);
+
+  memset(s_analytics_counts, 0, sizeof(s_analytics_counts));
+  s_num_flushes = 0;
+  s_max_depth = 0;
+
+  pthread_t worker;
+  if (async) {
+    pthread_create(&worker, NULL, prv_worker, NULL);
+  }
+
+  bench_rand_seed(1);
+  sAsyncResult result = {};
+  char key[16];
+  for (size_t i = 0; i < BENCH_NUM_WRITES; i++) {
+    const size_t k = bench_zipf_next();
+    snprintf(key, sizeof(key), "key%u", (unsigned)k);
+    uint32_t val[4] = { (uint32_t)k, (uint32_t)i };
+
+    const uint64_t start = bench_now_ns();
+    if (!kv_store_write(key, val, sizeof(val))) {
+      result.num_failures++;
+    }
+    s_write_ns[i] = bench_now_ns() - start;
+    prv_think();
+  }
+
+  kv_store_deinit();
+  if (async) {
+    pthread_join(worker, NULL);
+  }
+
+  // Everything written must have reached flash
+  kv_store_init(&lfs, NULL);
+  for (size_t k = 0; k < BENCH_NUM_KEYS; k++) {
+    snprintf(key, sizeof(key), "key%u", (unsigned)k);
+    uint32_t size;
+    if (kv_store_size(key, &size) && size != 4 * sizeof(uint32_t)) {
+      result.num_failures++;
+    }
+  }
+  kv_store_deinit();
+
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+
+  for (size_t i = 0; i < BENCH_NUM_WRITES; i++) {
+    if (s_write_ns[i] > result.max_ns) {
+      result.max_ns = s_write_ns[i];
+    }
+  }
+  result.p50_ns = bench_percentile(s_write_ns, BENCH_NUM_WRITES, 50);
+  result.p99_ns = bench_percentile(s_write_ns, BENCH_NUM_WRITES, 99);
+  result.flush_p99_us = bench_percentile(s_flush_latency_us, s_num_flushes, 99);
+  result.max_depth = s_max_depth;
+  return result;
+}
+
+TEST_GROUP(BenchKvStoreAsync) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreAsync, CallerWriteLatency) {
+  bench_zipf_init(BENCH_NUM_KEYS, 1.0);
+
+  const sAsyncResult sync = prv_run(false);
+  const sAsyncResult async = prv_run(true);
+
+  printf("\nkv_store writes: %d writes over %d Zipfian keys, %d us between writes\n",
+         BENCH_NUM_WRITES, BENCH_NUM_KEYS, BENCH_THINK_TIME_US);
+  printf("  synchronous: p50 %8llu ns  p99 %8llu ns  max %8llu ns\n",
+         (unsigned long long)sync.p50_ns, (unsigned long long)sync.p99_ns,
+         (unsigned long long)sync.max_ns);
+  printf("  async queue: p50 %8llu ns  p99 %8llu ns  max %8llu ns\n",
+         (unsigned long long)async.p50_ns, (unsigned long long)async.p99_ns,
+         (unsigned long long)async.max_ns);
+  printf("  async queue: flush latency p99 %llu us, max depth %u, %u coalesced, %u full\n",
+         (unsigned long long)async.flush_p99_us, (unsigned)async.max_depth,
+         (unsigned)s_analytics_counts[kSettingsWriteCoalesced],
+         (unsigned)s_analytics_counts[kSettingsWriteQueueFull]);
+
+  LONGS_EQUAL(0, sync.num_failures);
+  LONGS_EQUAL(0, async.num_failures);
+  // The latencies are wall clock and depend on the host, so they're only
+  // printed rather than compared
+}
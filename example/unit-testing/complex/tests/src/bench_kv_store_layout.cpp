@@ -0,0 +1,111 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <string.h>
+  #include <stddef.h>
+  #include <stdio.h>
+
+  #include "lfs.h"
+
+  #include "defs/lfs_default_config.h"
+  #include "defs/bench_workload.h"
+  #include "kv_store/kv_store.h"
+
+  #include "stubs/stub_analytics.h"
+  #include "fakes/fake_mutex.h"
+}
+
+// Sweeps the number of keys in the file-per-key backend and measures what it
+// costs to open one of them, with every key directly in /kv versus spread
+// over shard directories. The flash is built larger than the default (see
+// Makefile_bench_kv_store_layout.mk) so 10,000 files fit.
+
+#define BENCH_NUM_LOOKUPS 500
+#define BENCH_NUM_SHARDS 64
+
+static const size_t s_key_counts[] = { 10, 100, 1000, 10000 };
+#define BENCH_NUM_KEY_COUNTS (sizeof(s_key_counts) / sizeof(s_key_counts[0]))
+
+static uint64_t s_lookup_ns[BENCH_NUM_LOOKUPS];
+
+typedef struct {
+  double reads_per_open;
+  double flash_us_per_open;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+} sLayoutResult;
+
+static sLayoutResult prv_run(size_t num_keys, uint16_t num_shards) {
+  fake_mutex_init();
+  bd_stats_reset();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+
+  sKvStoreConfig config = {};
+  config.file_num_shards = num_shards;
+  kv_store_init(&lfs, &config);
+
+  char key[16];
+  for (size_t i = 0; i < num_keys; i++) {
+    snprintf(key, sizeof(key), "key%u", (unsigned)i);
+    const uint32_t val = (uint32_t)i;
+    CHECK(kv_store_write(key, &val, sizeof(val)));
+  }
+
+  // kv_store_size() is little more than the open
+  bench_rand_seed(1);
+  const sBdStats before = bd_stats_snapshot();
+  for (size_t i = 0; i < BENCH_NUM_LOOKUPS; i++) {
+    snprintf(key, sizeof(key), "key%u", (unsigned)(bench_rand() % num_keys));
+    uint32_t size = 0;
+    const uint64_t start = bench_now_ns();
+    CHECK(kv_store_size(key, &size));
+    s_lookup_ns[i] = bench_now_ns() - start;
+    LONGS_EQUAL(sizeof(uint32_t), size);
+  }
+  const sBdStats cost = bd_stats_since(&before);
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+
+  sLayoutResult result = {};
+  result.reads_per_open = (double)cost.ops[kBdOp_Read].count / BENCH_NUM_LOOKUPS;
+  result.flash_us_per_open = (double)bd_stats_latency_us(&cost) / BENCH_NUM_LOOKUPS;
+  result.p50_ns = bench_percentile(s_lookup_ns, BENCH_NUM_LOOKUPS, 50);
+  result.p99_ns = bench_percentile(s_lookup_ns, BENCH_NUM_LOOKUPS, 99);
+  return result;
+}
+
+static void prv_print(const char *label, size_t num_keys, const sLayoutResult *result) {
+  printf("  %-11s %6u keys: %8.1f reads/open %9.1f flash us/open  p50 %8llu ns  p99 %8llu ns\n",
+         label, (unsigned)num_keys, result->reads_per_open, result->flash_us_per_open,
+         (unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns);
+}
+
+TEST_GROUP(BenchKvStoreLayout) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreLayout, OpenLatencyVsKeyCount) {
+  sLayoutResult flat[BENCH_NUM_KEY_COUNTS];
+  sLayoutResult sharded[BENCH_NUM_KEY_COUNTS];
+
+  printf("\nkv_store open cost: %d random lookups, flat /kv vs %d shards\n", BENCH_NUM_LOOKUPS,
+         BENCH_NUM_SHARDS);
+  for (size_t i = 0; i < BENCH_NUM_KEY_COUNTS; i++) {
+    flat[i] = prv_run(s_key_counts[i], 0);
+    prv_print("flat", s_key_counts[i], &flat[i]);
+    sharded[i] = prv_run(s_key_counts[i], BENCH_NUM_SHARDS);
+    prv_print("sharded", s_key_counts[i], &sharded[i]);
+  }
+
+  // The flat layout's cost grows with the key count, the sharded one's only
+  // with the keys per shard
+  const size_t last = BENCH_NUM_KEY_COUNTS - 1;
+  CHECK(sharded[last].reads_per_open < flat[last].reads_per_open);
+  CHECK(flat[last].reads_per_open > 10 * flat[0].reads_per_open);
+  CHECK(sharded[last].reads_per_open < flat[last].reads_per_open / 4);
+}
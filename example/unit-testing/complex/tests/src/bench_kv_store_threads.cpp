@@ -0,0 +1,163 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <pthread.h>
+  #include <string.h>
+  #include <stddef.h>
+  #include <stdio.h>
+
+  #include "lfs.h"
+
+  #include "defs/lfs_default_config.h"
+  #include "defs/bench_workload.h"
+  #include "kv_store/kv_store.h"
+
+  #include "stubs/stub_analytics.h"
+}
+
+// Runs kv_store under real contention, using the pthread port of mutex.h.
+// Each thread issues a mix of Zipfian reads, reads of keys which don't exist
+// and overwrites. Every value encodes its key so torn or misrouted reads are
+// caught, and the run fails if any operation does.
+
+#define BENCH_NUM_KEYS 64
+#define BENCH_OPS_PER_THREAD 2000
+#define BENCH_MAX_THREADS 8
+#define BENCH_WRITE_PCT 10
+#define BENCH_MISS_PCT 10
+
+static sKvStoreCacheEntry s_cache_entries[8];
+static uint8_t s_filter_buf[BENCH_NUM_KEYS * 10 / 8];
+static sKvStoreLogIndexEntry s_log_index[BENCH_NUM_KEYS];
+
+static uint64_t s_latency_ns[BENCH_MAX_THREADS * BENCH_OPS_PER_THREAD];
+
+typedef struct {
+  size_t thread_idx;
+  uint64_t *latency_ns;
+  uint32_t num_failures;
+} sWorker;
+
+static void prv_key_name(char *buf, size_t buf_len, size_t i) {
+  snprintf(buf, buf_len, "key%u", (unsigned)i);
+}
+
+static void *prv_worker(void *arg) {
+  sWorker *worker = (sWorker *)arg;
+  uint32_t rand_state = 0x9e3779b9 * (uint32_t)(worker->thread_idx + 1);
+
+  char key[16];
+  for (size_t i = 0; i < BENCH_OPS_PER_THREAD; i++) {
+    const uint32_t pct = bench_rand_r(&rand_state) % 100;
+    const size_t k = bench_zipf_next_r(&rand_state);
+    uint32_t val;
+    uint32_t len;
+    bool ok;
+
+    const uint64_t start = bench_now_ns();
+    if (pct < BENCH_WRITE_PCT) {
+      prv_key_name(key, sizeof(key), k);
+      val = ((uint32_t)k << 16) | (uint32_t)i;
+      ok = kv_store_write(key, &val, sizeof(val));
+    } else if (pct < BENCH_WRITE_PCT + BENCH_MISS_PCT) {
+      prv_key_name(key, sizeof(key), BENCH_NUM_KEYS + k);
+      ok = !kv_store_read(key, &val, sizeof(val), &len);
+    } else {
+      prv_key_name(key, sizeof(key), k);
+      ok = kv_store_read(key, &val, sizeof(val), &len) && (len == sizeof(val)) &&
+           ((val >> 16) == k);
+    }
+    worker->latency_ns[i] = bench_now_ns() - start;
+
+    if (!ok) {
+      worker->num_failures++;
+    }
+  }
+  return NULL;
+}
+
+typedef struct {
+  double ops_per_sec;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint32_t num_failures;
+} sThreadResult;
+
+static sThreadResult prv_run(eKvStoreBackend backend, size_t num_threads) {
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+
+  sKvStoreConfig config = {};
+  config.backend = backend;
+  config.cache_entries = s_cache_entries;
+  config.num_cache_entries = sizeof(s_cache_entries) / sizeof(s_cache_entries[0]);
+  config.filter_buf = s_filter_buf;
+  config.filter_size_bytes = sizeof(s_filter_buf);
+  config.log_index = s_log_index;
+  config.log_index_len = sizeof(s_log_index) / sizeof(s_log_index[0]);
+  kv_store_init(&lfs, &config);
+
+  char key[16];
+  for (size_t i = 0; i < BENCH_NUM_KEYS; i++) {
+    prv_key_name(key, sizeof(key), i);
+    const uint32_t val = (uint32_t)i << 16;
+    CHECK(kv_store_write(key, &val, sizeof(val)));
+  }
+  CHECK(kv_store_flush());
+
+  pthread_t threads[BENCH_MAX_THREADS];
+  sWorker workers[BENCH_MAX_THREADS];
+  const uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < num_threads; i++) {
+    workers[i].thread_idx = i;
+    workers[i].latency_ns = &s_latency_ns[i * BENCH_OPS_PER_THREAD];
+    workers[i].num_failures = 0;
+    pthread_create(&threads[i], NULL, prv_worker, &workers[i]);
+  }
+  for (size_t i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  const uint64_t elapsed = bench_now_ns() - start;
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+
+  const size_t num_ops = num_threads * BENCH_OPS_PER_THREAD;
+  sThreadResult result = {};
+  result.ops_per_sec = bench_ops_per_sec(num_ops, elapsed);
+  result.p50_ns = bench_percentile(s_latency_ns, num_ops, 50);
+  result.p99_ns = bench_percentile(s_latency_ns, num_ops, 99);
+  for (size_t i = 0; i < num_threads; i++) {
+    result.num_failures += workers[i].num_failures;
+  }
+  return result;
+}
+
+static void prv_sweep_threads(eKvStoreBackend backend, const char *name) {
+  bench_zipf_init(BENCH_NUM_KEYS, 1.0);
+
+  printf("\nkv_store %s: %d ops/thread, %d%% writes, %d%% missing keys\n", name,
+         BENCH_OPS_PER_THREAD, BENCH_WRITE_PCT, BENCH_MISS_PCT);
+  for (size_t num_threads = 1; num_threads <= BENCH_MAX_THREADS; num_threads *= 2) {
+    const sThreadResult result = prv_run(backend, num_threads);
+    printf("  %zu threads: %10.0f ops/s  p50 %6llu ns  p99 %8llu ns\n", num_threads,
+           result.ops_per_sec, (unsigned long long)result.p50_ns,
+           (unsigned long long)result.p99_ns);
+    LONGS_EQUAL(0, result.num_failures);
+  }
+}
+
+TEST_GROUP(BenchKvStoreThreads) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchKvStoreThreads, FilePerKey) {
+  prv_sweep_threads(kKvStoreBackend_FilePerKey, "file per key");
+}
+
+TEST(BenchKvStoreThreads, Log) {
+  prv_sweep_threads(kKvStoreBackend_Log, "log");
+}
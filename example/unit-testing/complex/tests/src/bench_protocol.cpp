@@ -0,0 +1,216 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <string.h>
+  #include <stddef.h>
+  #include <stdio.h>
+
+  #include "defs/bench_workload.h"
+  #include "protocol/protocol.h"
+  #include "protocol/registry.h"
+  #include "protocol/stats.h"
+}
+
+// Measures command dispatch as the registry grows: the linear scan
+// protocol_handle() used to do against protocol_registry_find()'s binary
+// search, and then protocol_handle() end to end on a registry of
+// BENCH_REGISTRY_LEN commands. BenchProtocolStream pushes a stream of
+// pipelined frames through protocol_feed() in chunks of random size.
+
+#define BENCH_MAX_COMMANDS 2048
+#define BENCH_NUM_LOOKUPS 200000
+#define BENCH_REGISTRY_LEN 128
+
+static const size_t s_registry_sizes[] = { 2, 8, 32, 128, 512, BENCH_MAX_COMMANDS };
+#define BENCH_NUM_SIZES (sizeof(s_registry_sizes) / sizeof(s_registry_sizes[0]))
+
+#define BENCH_STREAM_NUM_FRAMES 20000
+#define BENCH_STREAM_MAX_PAYLOAD 64
+#define BENCH_STREAM_LEN \
+  (BENCH_STREAM_NUM_FRAMES * (PROTOCOL_HEADER_LEN + BENCH_STREAM_MAX_PAYLOAD))
+
+static uint32_t s_num_calls;
+static uint64_t s_payload_bytes;
+static uint32_t s_num_in_place;
+
+static uint8_t s_stream[BENCH_STREAM_LEN];
+
+static void prv_command(const uint8_t *buffer, size_t len, sProtocolResponse *resp) {
+  s_num_calls++;
+  s_payload_bytes += len;
+  if (buffer >= s_stream && buffer < &s_stream[sizeof(s_stream)]) {
+    s_num_in_place++;
+  }
+}
+
+static sProtocolCommand s_commands[BENCH_MAX_COMMANDS];
+static uint32_t s_lookup_codes[BENCH_NUM_LOOKUPS];
+
+const sProtocolCommand *const g_protocol_commands = s_commands;
+const size_t g_num_protocol_commands = BENCH_REGISTRY_LEN;
+
+//! Sorted codes with gaps, like a registry which groups commands by subsystem
+static void prv_build_registry(size_t num_commands) {
+  for (size_t i = 0; i < num_commands; i++) {
+    s_commands[i].code = 1000 + 3 * (uint32_t)i;
+    s_commands[i].handler = prv_command;
+  }
+  bench_rand_seed(1);
+  for (size_t i = 0; i < BENCH_NUM_LOOKUPS; i++) {
+    s_lookup_codes[i] = s_commands[bench_rand() % num_commands].code;
+  }
+}
+
+//! What protocol_handle() did before the registry was sorted
+static const sProtocolCommand *prv_linear_find(const sProtocolCommand *commands,
+                                               size_t num_commands, uint32_t code) {
+  for (size_t i = 0; i < num_commands; i++) {
+    if (commands[i].code == code) {
+      return &commands[i];
+    }
+  }
+  return NULL;
+}
+
+typedef const sProtocolCommand *(*FindFn)(const sProtocolCommand *commands, size_t num_commands,
+                                          uint32_t code);
+
+static double prv_ns_per_lookup(FindFn find, size_t num_commands) {
+  size_t found = 0;
+  const uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < BENCH_NUM_LOOKUPS; i++) {
+    found += (find(s_commands, num_commands, s_lookup_codes[i]) != NULL);
+  }
+  const uint64_t elapsed = bench_now_ns() - start;
+  LONGS_EQUAL(BENCH_NUM_LOOKUPS, found);
+  return (double)elapsed / BENCH_NUM_LOOKUPS;
+}
+
+TEST_GROUP(BenchProtocolDispatch) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchProtocolDispatch, LookupVsRegistrySize) {
+  printf("\nprotocol dispatch: %d lookups of random registered codes\n", BENCH_NUM_LOOKUPS);
+  for (size_t i = 0; i < BENCH_NUM_SIZES; i++) {
+    prv_build_registry(s_registry_sizes[i]);
+    const double linear = prv_ns_per_lookup(prv_linear_find, s_registry_sizes[i]);
+    const double binary = prv_ns_per_lookup(protocol_registry_find, s_registry_sizes[i]);
+    printf("  %5u commands: linear %8.1f ns/lookup  binary search %6.1f ns/lookup\n",
+           (unsigned)s_registry_sizes[i], linear, binary);
+  }
+  // Both searches found every code. The timings are for reading, not
+  // asserting: they vary with the host and the build.
+}
+
+//! Returns the time per protocol_handle() call
+static double prv_ns_per_msg(void) {
+  uint8_t msg[8] = {};
+  uint8_t resp[16];
+  s_num_calls = 0;
+  const uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < BENCH_NUM_LOOKUPS; i++) {
+    memcpy(msg, &s_lookup_codes[i], sizeof(uint32_t));
+    size_t resp_len = sizeof(resp);
+    protocol_handle(msg, sizeof(msg), resp, &resp_len);
+  }
+  const uint64_t elapsed = bench_now_ns() - start;
+  LONGS_EQUAL(BENCH_NUM_LOOKUPS, s_num_calls);
+  return (double)elapsed / BENCH_NUM_LOOKUPS;
+}
+
+static uint64_t prv_clock_ns(void) {
+  return bench_now_ns();
+}
+
+TEST(BenchProtocolDispatch, ProtocolHandle) {
+  prv_build_registry(BENCH_REGISTRY_LEN);
+  const double plain_ns = prv_ns_per_msg();
+
+  static sProtocolCommandStats s_command_stats[BENCH_REGISTRY_LEN];
+  sProtocolStats stats = {};
+  stats.commands = s_command_stats;
+  stats.num_commands = BENCH_REGISTRY_LEN;
+  stats.clock = prv_clock_ns;
+  protocol_stats_init(&stats);
+  const double stats_ns = prv_ns_per_msg();
+  protocol_stats_init(NULL);
+
+  printf("\nprotocol_handle: %d commands, %.1f ns/msg, %.1f ns/msg with stats\n",
+         BENCH_REGISTRY_LEN, plain_ns, stats_ns);
+
+  uint32_t num_calls = 0;
+  for (size_t i = 0; i < BENCH_REGISTRY_LEN; i++) {
+    num_calls += s_command_stats[i].num_calls;
+  }
+  LONGS_EQUAL(BENCH_NUM_LOOKUPS, num_calls);
+}
+
+//! Fills s_stream with back to back frames for registered commands
+static size_t prv_build_stream(void) {
+  prv_build_registry(BENCH_REGISTRY_LEN);
+  size_t len = 0;
+  for (size_t i = 0; i < BENCH_STREAM_NUM_FRAMES; i++) {
+    const uint32_t code = s_lookup_codes[i];
+    const uint32_t payload_size = bench_rand() % (BENCH_STREAM_MAX_PAYLOAD + 1);
+    memcpy(&s_stream[len], &code, sizeof(code));
+    memcpy(&s_stream[len + sizeof(code)], &payload_size, sizeof(payload_size));
+    len += PROTOCOL_HEADER_LEN;
+    for (uint32_t j = 0; j < payload_size; j++) {
+      s_stream[len++] = (uint8_t)bench_rand();
+    }
+  }
+  return len;
+}
+
+static const size_t s_max_chunk_sizes[] = { 1, 16, 256, 4096 };
+
+TEST_GROUP(BenchProtocolStream) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchProtocolStream, RandomChunks) {
+  const size_t stream_len = prv_build_stream();
+
+  uint8_t frame_buf[BENCH_STREAM_MAX_PAYLOAD];
+  uint8_t resp_buf[16];
+  sProtocolParserConfig config = {};
+  config.frame_buf = frame_buf;
+  config.frame_buf_len = sizeof(frame_buf);
+  config.resp_buf = resp_buf;
+  config.resp_buf_len = sizeof(resp_buf);
+
+  printf("\nprotocol_feed: %d frames, %u bytes, payloads of 0-%d bytes\n",
+         BENCH_STREAM_NUM_FRAMES, (unsigned)stream_len, BENCH_STREAM_MAX_PAYLOAD);
+  for (size_t i = 0; i < sizeof(s_max_chunk_sizes) / sizeof(s_max_chunk_sizes[0]); i++) {
+    sProtocolParser parser;
+    protocol_parser_init(&parser, &config);
+    s_num_calls = 0;
+    s_payload_bytes = 0;
+    s_num_in_place = 0;
+
+    bench_rand_seed(2);
+    size_t num_frames = 0;
+    const uint64_t start = bench_now_ns();
+    for (size_t off = 0; off < stream_len;) {
+      size_t n = 1 + bench_rand() % s_max_chunk_sizes[i];
+      n = (n < stream_len - off) ? n : (stream_len - off);
+      num_frames += protocol_feed(&parser, &s_stream[off], n);
+      off += n;
+    }
+    const uint64_t elapsed = bench_now_ns() - start;
+
+    printf("  chunks of 1-%-4u bytes: %7.1f MB/s %6.2f Mframes/s  %5.1f%% dispatched in place\n",
+           (unsigned)s_max_chunk_sizes[i], (double)stream_len * 1e3 / elapsed,
+           (double)num_frames * 1e3 / elapsed, 100.0 * s_num_in_place / num_frames);
+
+    LONGS_EQUAL(BENCH_STREAM_NUM_FRAMES, num_frames);
+    LONGS_EQUAL(BENCH_STREAM_NUM_FRAMES, s_num_calls);
+    LONGS_EQUAL(stream_len - BENCH_STREAM_NUM_FRAMES * PROTOCOL_HEADER_LEN, s_payload_bytes);
+  }
+
+  // With large reads nearly every frame arrives whole and isn't copied
+  CHECK(s_num_in_place > BENCH_STREAM_NUM_FRAMES * 9 / 10);
+}
@@ -0,0 +1,204 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <string.h>
+  #include <stddef.h>
+  #include <stdio.h>
+
+  #include "lfs.h"
+
+  #include "defs/lfs_default_config.h"
+  #include "defs/bench_workload.h"
+  #include "defs/bench_protocol_stats.h"
+  #include "kv_store/kv_store.h"
+  #include "protocol/protocol.h"
+  #include "protocol/stats.h"
+
+  #include "stubs/stub_analytics.h"
+  #include "fakes/fake_mutex.h"
+}
+
+// Runs the same kv read/write workload over the protocol with a growing
+// number of commands per PROTOCOL_BATCH_CODE frame. The loopback transport
+// hands each frame straight to protocol_handle() and charges a fixed round
+// trip time for it, so the time per run is
+//   round trips * BENCH_RTT_US + time spent handling + simulated flash time
+
+#define BENCH_RTT_US 50000
+#define BENCH_NUM_OPS 1024
+#define BENCH_NUM_KEYS 32
+#define BENCH_VAL_LEN 16
+#define BENCH_READ_PCT 80
+
+#define BENCH_READ_CODE 1000
+#define BENCH_WRITE_CODE 1001
+
+static const size_t s_batch_sizes[] = { 1, 2, 4, 8, 16, 32, 64 };
+#define BENCH_NUM_BATCH_SIZES (sizeof(s_batch_sizes) / sizeof(s_batch_sizes[0]))
+
+static uint8_t s_req[4096];
+static uint8_t s_resp[4096];
+
+typedef struct {
+  uint32_t round_trips;
+  uint32_t num_ok;
+  uint64_t handle_ns;
+} sLoopback;
+
+static void prv_put_u32(size_t *off, uint32_t v) {
+  memcpy(&s_req[*off], &v, sizeof(v));
+  *off += sizeof(v);
+}
+
+static uint32_t prv_get_u32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+//! Sends one frame across the link and counts the items which succeeded
+static void prv_loopback_round_trip(sLoopback *link, size_t req_len, size_t num_items) {
+  size_t resp_len = sizeof(s_resp);
+  const uint64_t start = bench_now_ns();
+  eProtocolCode rv = protocol_handle(s_req, req_len, s_resp, &resp_len);
+  link->handle_ns += bench_now_ns() - start;
+  link->round_trips++;
+
+  CHECK_EQUAL(kProtocolCode_Ok, rv);
+  if (num_items == 0) {
+    // A lone command: its response is the frame's response
+    link->num_ok++;
+    return;
+  }
+  LONGS_EQUAL(num_items, prv_get_u32(s_resp));
+  size_t off = sizeof(uint32_t);
+  for (size_t i = 0; i < num_items; i++) {
+    link->num_ok += (prv_get_u32(&s_resp[off]) == kProtocolCode_Ok);
+    off += PROTOCOL_HEADER_LEN + prv_get_u32(&s_resp[off + sizeof(uint32_t)]);
+  }
+}
+
+//! Appends the next op of the workload as a frame header and payload
+static void prv_put_op(size_t *off) {
+  char key[16];
+  snprintf(key, sizeof(key), "key%u", (unsigned)bench_zipf_next());
+  const uint32_t key_len = (uint32_t)strlen(key) + 1;
+
+  if (bench_rand() % 100 < BENCH_READ_PCT) {
+    prv_put_u32(off, BENCH_READ_CODE);
+    prv_put_u32(off, key_len);
+    memcpy(&s_req[*off], key, key_len);
+    *off += key_len;
+  } else {
+    prv_put_u32(off, BENCH_WRITE_CODE);
+    prv_put_u32(off, key_len + BENCH_VAL_LEN);
+    memcpy(&s_req[*off], key, key_len);
+    memset(&s_req[*off + key_len], (int)bench_rand(), BENCH_VAL_LEN);
+    *off += key_len + BENCH_VAL_LEN;
+  }
+}
+
+static double prv_run(size_t batch_size, sLoopback *link) {
+  fake_mutex_init();
+  bd_stats_reset();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+  kv_store_init(&lfs, NULL);
+
+  // Every key exists, so reads succeed
+  uint8_t val[BENCH_VAL_LEN] = {};
+  char key[16];
+  for (size_t i = 0; i < BENCH_NUM_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%u", (unsigned)i);
+    kv_store_write(key, val, sizeof(val));
+  }
+
+  bench_rand_seed(1);
+  memset(link, 0, sizeof(*link));
+  const sBdStats before = bd_stats_snapshot();
+  for (size_t op = 0; op < BENCH_NUM_OPS; op += batch_size) {
+    size_t off = 0;
+    if (batch_size == 1) {
+      prv_put_op(&off);
+      prv_loopback_round_trip(link, off, 0);
+      continue;
+    }
+
+    prv_put_u32(&off, PROTOCOL_BATCH_CODE);
+    prv_put_u32(&off, 0);
+    prv_put_u32(&off, batch_size);
+    for (size_t i = 0; i < batch_size; i++) {
+      prv_put_op(&off);
+    }
+    const uint32_t payload_size = off - PROTOCOL_HEADER_LEN;
+    memcpy(&s_req[sizeof(uint32_t)], &payload_size, sizeof(payload_size));
+    prv_loopback_round_trip(link, off, batch_size);
+  }
+  const sBdStats cost = bd_stats_since(&before);
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+
+  const double total_us = (double)link->round_trips * BENCH_RTT_US +
+                          (double)link->handle_ns / 1000 + (double)bd_stats_latency_us(&cost);
+  return BENCH_NUM_OPS * 1e6 / total_us;
+}
+
+TEST_GROUP(BenchProtocolBatch) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchProtocolBatch, OpsPerSecVsBatchSize) {
+  bench_zipf_init(BENCH_NUM_KEYS, 1.0);
+
+  uint32_t round_trips[BENCH_NUM_BATCH_SIZES];
+  printf("\nprotocol batches: %d kv ops (%d%% reads) over a %d ms round trip link\n",
+         BENCH_NUM_OPS, BENCH_READ_PCT, BENCH_RTT_US / 1000);
+  for (size_t i = 0; i < BENCH_NUM_BATCH_SIZES; i++) {
+    sLoopback link;
+    const double ops_per_sec = prv_run(s_batch_sizes[i], &link);
+    printf("  batch of %2u: %5u round trips %9.1f ops/s  %6.1f us handling per op\n",
+           (unsigned)s_batch_sizes[i], (unsigned)link.round_trips, ops_per_sec,
+           (double)link.handle_ns / 1000 / BENCH_NUM_OPS);
+    LONGS_EQUAL(BENCH_NUM_OPS, link.num_ok);
+    round_trips[i] = link.round_trips;
+  }
+
+  // ops/s includes the measured handling time, so only the round trips,
+  // which dominate it over a real link, are asserted
+  for (size_t i = 1; i < BENCH_NUM_BATCH_SIZES; i++) {
+    CHECK(round_trips[i] < round_trips[i - 1]);
+  }
+}
+
+static uint64_t prv_clock_ns(void) {
+  return bench_now_ns();
+}
+
+TEST(BenchProtocolBatch, PerCommandStats) {
+  bench_zipf_init(BENCH_NUM_KEYS, 1.0);
+
+  static sProtocolCommandStats s_command_stats[8];
+  sProtocolStats stats = {};
+  stats.commands = s_command_stats;
+  stats.num_commands = sizeof(s_command_stats) / sizeof(s_command_stats[0]);
+  stats.clock = prv_clock_ns;
+  protocol_stats_init(&stats);
+
+  sLoopback link;
+  prv_run(16, &link);
+  protocol_stats_init(NULL);
+
+  printf("\nprotocol stats: batches of 16\n");
+  bench_protocol_stats_print(&stats);
+
+  const sProtocolCommandStats *batch = &s_command_stats[2];
+  LONGS_EQUAL(PROTOCOL_BATCH_CODE, g_protocol_commands[2].code);
+  LONGS_EQUAL(BENCH_NUM_OPS / 16, batch->num_calls);
+  LONGS_EQUAL(BENCH_NUM_OPS, s_command_stats[0].num_calls + s_command_stats[1].num_calls);
+  LONGS_EQUAL(0, stats.num_malformed);
+  LONGS_EQUAL(0, stats.num_not_found);
+}
@@ -0,0 +1,235 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <string.h>
+  #include <stddef.h>
+  #include <stdio.h>
+  #include <stdlib.h>
+
+  #include "lfs.h"
+
+  #include "defs/lfs_default_config.h"
+  #include "defs/bench_workload.h"
+  #include "kv_store/kv_store.h"
+  #include "protocol/protocol.h"
+
+  #include "stubs/stub_analytics.h"
+  #include "fakes/fake_mutex.h"
+}
+
+// End to end throughput of the kv commands: every request is a frame handed
+// to protocol_handle(), which runs the registered handler against the real
+// kv_store on the RAM backed flash. Each workload mix and value size is one
+// run, reported as a row of
+//   ops/s, p50/p99 latency, flash reads/progs/erases per request
+// Latency is host time in protocol_handle() plus the simulated flash time of
+// the request, so it reflects what the part would see rather than only how
+// fast the host is.
+//
+// The rows are written as CSV and JSON to BENCH_RESULTS_PATH.{csv,json}
+// (override the path with the BENCH_RESULTS environment variable) so runs at
+// different commits can be compared. BENCH_COMMIT, when set, is copied into
+// every row.
+
+#ifndef BENCH_RESULTS_PATH
+#define BENCH_RESULTS_PATH "build/bench_protocol_kv_store"
+#endif
+
+#define BENCH_NUM_OPS 2000
+#define BENCH_NUM_KEYS 64
+#define BENCH_ZIPF_SKEW 0.99
+
+#define BENCH_READ_CODE 1000
+#define BENCH_WRITE_CODE 1001
+
+typedef struct {
+  const char *name;
+  uint32_t read_pct;
+} sBenchWorkload;
+
+static const sBenchWorkload s_workloads[] = {
+  { "read_heavy", 95 },
+  { "mixed", 50 },
+  { "write_heavy", 5 },
+};
+#define BENCH_NUM_WORKLOADS (sizeof(s_workloads) / sizeof(s_workloads[0]))
+
+static const uint32_t s_value_sizes[] = { 16, 128, 1024 };
+#define BENCH_NUM_VALUE_SIZES (sizeof(s_value_sizes) / sizeof(s_value_sizes[0]))
+
+typedef struct {
+  const char *workload;
+  uint32_t value_size;
+  uint32_t num_ok;
+  double ops_per_sec;
+  double p50_us;
+  double p99_us;
+  double reads_per_op;
+  double progs_per_op;
+  double erases_per_op;
+  double bytes_read_per_op;
+  double bytes_prog_per_op;
+} sBenchResult;
+
+static sBenchResult s_results[BENCH_NUM_WORKLOADS * BENCH_NUM_VALUE_SIZES];
+static uint64_t s_latency_ns[BENCH_NUM_OPS];
+static uint8_t s_req[PROTOCOL_HEADER_LEN + 16 + 1024];
+static uint8_t s_resp[2048];
+
+//! Builds the next request of the workload and returns its length
+static size_t prv_make_request(const sBenchWorkload *workload, uint32_t value_size) {
+  char key[16];
+  snprintf(key, sizeof(key), "key%u", (unsigned)bench_zipf_next());
+  const uint32_t key_len = (uint32_t)strlen(key) + 1;
+
+  const bool is_read = (bench_rand() % 100) < workload->read_pct;
+  const uint32_t code = is_read ? BENCH_READ_CODE : BENCH_WRITE_CODE;
+  const uint32_t payload_size = is_read ? key_len : key_len + value_size;
+  memcpy(&s_req[0], &code, sizeof(code));
+  memcpy(&s_req[sizeof(code)], &payload_size, sizeof(payload_size));
+  memcpy(&s_req[PROTOCOL_HEADER_LEN], key, key_len);
+  if (!is_read) {
+    memset(&s_req[PROTOCOL_HEADER_LEN + key_len], (int)bench_rand(), value_size);
+  }
+  return PROTOCOL_HEADER_LEN + payload_size;
+}
+
+static void prv_run(const sBenchWorkload *workload, uint32_t value_size, sBenchResult *result) {
+  fake_mutex_init();
+  bd_stats_reset();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+  kv_store_init(&lfs, NULL);
+
+  // Every key exists, so reads succeed and return a full value
+  static uint8_t val[1024];
+  memset(val, 0xa5, value_size);
+  char key[16];
+  for (size_t i = 0; i < BENCH_NUM_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%u", (unsigned)i);
+    kv_store_write(key, val, value_size);
+  }
+
+  bench_rand_seed(1);
+  memset(result, 0, sizeof(*result));
+  result->workload = workload->name;
+  result->value_size = value_size;
+
+  uint64_t total_ns = 0;
+  const sBdStats before = bd_stats_snapshot();
+  for (size_t op = 0; op < BENCH_NUM_OPS; op++) {
+    const size_t req_len = prv_make_request(workload, value_size);
+    size_t resp_len = sizeof(s_resp);
+
+    const sBdStats op_before = bd_stats_snapshot();
+    const uint64_t start = bench_now_ns();
+    const eProtocolCode rv = protocol_handle(s_req, req_len, s_resp, &resp_len);
+    const uint64_t host_ns = bench_now_ns() - start;
+    const sBdStats op_cost = bd_stats_since(&op_before);
+
+    s_latency_ns[op] = host_ns + bd_stats_latency_us(&op_cost) * 1000;
+    total_ns += s_latency_ns[op];
+    result->num_ok += (rv == kProtocolCode_Ok && resp_len > 0);
+  }
+  const sBdStats cost = bd_stats_since(&before);
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+
+  result->ops_per_sec = bench_ops_per_sec(BENCH_NUM_OPS, total_ns);
+  result->p50_us = (double)bench_percentile(s_latency_ns, BENCH_NUM_OPS, 50) / 1000;
+  result->p99_us = (double)bench_percentile(s_latency_ns, BENCH_NUM_OPS, 99) / 1000;
+  result->reads_per_op = (double)cost.ops[kBdOp_Read].count / BENCH_NUM_OPS;
+  result->progs_per_op = (double)cost.ops[kBdOp_Prog].count / BENCH_NUM_OPS;
+  result->erases_per_op = (double)cost.ops[kBdOp_Erase].count / BENCH_NUM_OPS;
+  result->bytes_read_per_op = (double)cost.ops[kBdOp_Read].bytes / BENCH_NUM_OPS;
+  result->bytes_prog_per_op = (double)cost.ops[kBdOp_Prog].bytes / BENCH_NUM_OPS;
+}
+
+static void prv_write_results(const char *path, const sBenchResult *results, size_t num_results) {
+  const char *commit = getenv("BENCH_COMMIT");
+  commit = commit ? commit : "";
+
+  char file_path[256];
+  snprintf(file_path, sizeof(file_path), "%s.csv", path);
+  FILE *csv = fopen(file_path, "w");
+  snprintf(file_path, sizeof(file_path), "%s.json", path);
+  FILE *json = fopen(file_path, "w");
+  if (!csv || !json) {
+    printf("  couldn't open %s.{csv,json}, results not saved\n", path);
+  }
+
+  if (csv) {
+    fprintf(csv, "commit,workload,value_size,num_ops,ops_per_sec,p50_us,p99_us,"
+                 "reads_per_op,progs_per_op,erases_per_op,bytes_read_per_op,bytes_prog_per_op\n");
+  }
+  if (json) {
+    fprintf(json, "[\n");
+  }
+  for (size_t i = 0; i < num_results; i++) {
+    const sBenchResult *r = &results[i];
+    if (csv) {
+      fprintf(csv, "%s,%s,%u,%u,%.1f,%.1f,%.1f,%.2f,%.2f,%.3f,%.1f,%.1f\n",
+              commit, r->workload, (unsigned)r->value_size, BENCH_NUM_OPS, r->ops_per_sec,
+              r->p50_us, r->p99_us, r->reads_per_op, r->progs_per_op, r->erases_per_op,
+              r->bytes_read_per_op, r->bytes_prog_per_op);
+    }
+    if (json) {
+      fprintf(json,
+              "  {\"commit\": \"%s\", \"workload\": \"%s\", \"value_size\": %u, "
+              "\"num_ops\": %u, \"ops_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+              "\"reads_per_op\": %.2f, \"progs_per_op\": %.2f, \"erases_per_op\": %.3f, "
+              "\"bytes_read_per_op\": %.1f, \"bytes_prog_per_op\": %.1f}%s\n",
+              commit, r->workload, (unsigned)r->value_size, BENCH_NUM_OPS, r->ops_per_sec,
+              r->p50_us, r->p99_us, r->reads_per_op, r->progs_per_op, r->erases_per_op,
+              r->bytes_read_per_op, r->bytes_prog_per_op, (i + 1 < num_results) ? "," : "");
+    }
+  }
+  if (json) {
+    fprintf(json, "]\n");
+    fclose(json);
+  }
+  if (csv) {
+    fclose(csv);
+  }
+}
+
+TEST_GROUP(BenchProtocolKvStore) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchProtocolKvStore, Workloads) {
+  bench_zipf_init(BENCH_NUM_KEYS, BENCH_ZIPF_SKEW);
+
+  printf("\nprotocol + kv_store: %d requests over %d zipfian keys per run\n", BENCH_NUM_OPS,
+         BENCH_NUM_KEYS);
+  printf("  %-11s %5s %10s %9s %9s %7s %7s %7s\n", "workload", "size", "ops/s", "p50 us",
+         "p99 us", "reads", "progs", "erases");
+  size_t num_results = 0;
+  for (size_t w = 0; w < BENCH_NUM_WORKLOADS; w++) {
+    for (size_t s = 0; s < BENCH_NUM_VALUE_SIZES; s++) {
+      sBenchResult *r = &s_results[num_results++];
+      prv_run(&s_workloads[w], s_value_sizes[s], r);
+      printf("  %-11s %5u %10.1f %9.1f %9.1f %7.2f %7.2f %7.3f\n", r->workload,
+             (unsigned)r->value_size, r->ops_per_sec, r->p50_us, r->p99_us, r->reads_per_op,
+             r->progs_per_op, r->erases_per_op);
+      LONGS_EQUAL(BENCH_NUM_OPS, r->num_ok);
+    }
+  }
+
+  const char *path = getenv("BENCH_RESULTS");
+  prv_write_results(path ? path : BENCH_RESULTS_PATH, s_results, num_results);
+
+  // Writes cost flash programs that reads don't, so at every value size the
+  // read heavy mix programs the least. ops/s and latencies are wall clock and
+  // go to the results files for comparing commits on the same host instead.
+  for (size_t s = 0; s < BENCH_NUM_VALUE_SIZES; s++) {
+    const sBenchResult *read_heavy = &s_results[s];
+    const sBenchResult *write_heavy =
+        &s_results[(BENCH_NUM_WORKLOADS - 1) * BENCH_NUM_VALUE_SIZES + s];
+    CHECK(read_heavy->progs_per_op < write_heavy->progs_per_op);
+  }
+}
@@ -0,0 +1,271 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <string.h>
+  #include <stddef.h>
+  #include <stdio.h>
+
+  #include "lfs.h"
+
+  #include "defs/lfs_default_config.h"
+  #include "defs/bench_workload.h"
+  #include "kv_store/kv_store.h"
+  #include "kv_store/kv_store_protocol_handlers.h"
+  #include "protocol/protocol.h"
+
+  #include "stubs/stub_analytics.h"
+  #include "fakes/fake_mutex.h"
+}
+
+// A client keeps up to `depth` kv requests in flight over a link with a fixed
+// one way delay, and a single threaded device answers them. Time is simulated:
+// the device is busy for the flash time lfs_bd_stats.h charges each call. The
+// host time is left out, which is small next to the flash and would make the
+// results, and the checks on them, depend on the machine running the bench.
+//
+// In sync mode the device runs every frame through protocol_handle(), so a
+// read queued behind a write waits for the flash. In async mode it feeds the
+// frames to protocol_feed(), where the async handler leaves writes in
+// kv_store's write queue, kv_store_protocol_process() flushes them when no
+// frame is waiting, and responses come back out of order, matched by request
+// ID.
+
+#define BENCH_LINK_US 2000
+#define BENCH_NUM_OPS 1000
+#define BENCH_NUM_KEYS 32
+#define BENCH_VAL_LEN 64
+#define BENCH_READ_PCT 70
+
+#define BENCH_READ_CODE 1000
+#define BENCH_WRITE_CODE 1001
+
+static const size_t s_depths[] = { 1, 2, 4, 8, 16 };
+#define BENCH_NUM_DEPTHS (sizeof(s_depths) / sizeof(s_depths[0]))
+
+typedef struct {
+  size_t off;
+  size_t len;
+  bool is_read;
+  uint64_t sent_us;
+  //! When the response reaches the client, once the device has answered
+  uint64_t resp_us;
+  bool answered;
+  bool done;
+} sBenchRequest;
+
+static uint8_t s_stream[BENCH_NUM_OPS * (PROTOCOL_HEADER_LEN + 16 + BENCH_VAL_LEN)];
+static sBenchRequest s_reqs[BENCH_NUM_OPS];
+
+//! Requests the device answered during the current step, to be stamped with
+//! the time the step finished
+static uint32_t s_answered[BENCH_NUM_OPS];
+static size_t s_num_answered;
+
+typedef struct {
+  double ops_per_sec;
+  uint64_t read_p50_us;
+  uint64_t read_p99_us;
+  uint64_t write_p99_us;
+} sPipelineResult;
+
+static void prv_build_stream(void) {
+  bench_rand_seed(3);
+  size_t off = 0;
+  for (size_t i = 0; i < BENCH_NUM_OPS; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "key%u", (unsigned)bench_zipf_next());
+    const uint32_t key_len = (uint32_t)strlen(key) + 1;
+    const bool is_read = (bench_rand() % 100) < BENCH_READ_PCT;
+    const uint32_t code = is_read ? BENCH_READ_CODE : BENCH_WRITE_CODE;
+    const uint32_t payload_size = is_read ? key_len : key_len + BENCH_VAL_LEN;
+
+    s_reqs[i].off = off;
+    s_reqs[i].len = PROTOCOL_HEADER_LEN + payload_size;
+    s_reqs[i].is_read = is_read;
+    memcpy(&s_stream[off], &code, sizeof(code));
+    memcpy(&s_stream[off + sizeof(code)], &payload_size, sizeof(payload_size));
+    memcpy(&s_stream[off + PROTOCOL_HEADER_LEN], key, key_len);
+    if (!is_read) {
+      memset(&s_stream[off + PROTOCOL_HEADER_LEN + key_len], (int)i, BENCH_VAL_LEN);
+    }
+    off += s_reqs[i].len;
+  }
+}
+
+static void prv_answered_cb(uint32_t request_id, uint32_t code, eProtocolCode rv,
+                            const sProtocolResponse *resp, void *ctx) {
+  CHECK_EQUAL(kProtocolCode_Ok, rv);
+  s_answered[s_num_answered++] = request_id;
+}
+
+//! Runs one step of device work and returns how long it kept the device busy
+static uint64_t prv_device_step(bool async, sProtocolParser *parser, size_t next_rx) {
+  const sBdStats before = bd_stats_snapshot();
+  if (next_rx == BENCH_NUM_OPS) {
+    kv_store_protocol_process();
+  } else if (async) {
+    protocol_feed(parser, &s_stream[s_reqs[next_rx].off], s_reqs[next_rx].len);
+  } else {
+    uint8_t resp[BENCH_VAL_LEN];
+    size_t resp_len = sizeof(resp);
+    CHECK_EQUAL(kProtocolCode_Ok,
+                protocol_handle(&s_stream[s_reqs[next_rx].off], s_reqs[next_rx].len, resp,
+                                &resp_len));
+    s_answered[s_num_answered++] = (uint32_t)next_rx;
+  }
+  const sBdStats cost = bd_stats_since(&before);
+  return bd_stats_latency_us(&cost);
+}
+
+static void prv_run(bool async, size_t depth, sPipelineResult *result) {
+  fake_mutex_init();
+  bd_stats_reset();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
+  static sKvStoreQueueEntry s_write_queue[16];
+  sKvStoreConfig kv_config = {};
+  if (async) {
+    kv_config.write_queue = s_write_queue;
+    kv_config.write_queue_len = sizeof(s_write_queue) / sizeof(s_write_queue[0]);
+  }
+  kv_store_init(&lfs, &kv_config);
+
+  uint8_t val[BENCH_VAL_LEN] = {};
+  char key[16];
+  for (size_t i = 0; i < BENCH_NUM_KEYS; i++) {
+    snprintf(key, sizeof(key), "key%u", (unsigned)i);
+    kv_store_write(key, val, sizeof(val));
+  }
+
+  static uint8_t s_frame_buf[64 + BENCH_VAL_LEN];
+  static uint8_t s_resp_buf[BENCH_VAL_LEN];
+  sProtocolParserConfig config = {};
+  config.frame_buf = s_frame_buf;
+  config.frame_buf_len = sizeof(s_frame_buf);
+  config.resp_buf = s_resp_buf;
+  config.resp_buf_len = sizeof(s_resp_buf);
+  config.cb = prv_answered_cb;
+  sProtocolParser parser;
+  protocol_parser_init(&parser, &config);
+
+  for (size_t i = 0; i < BENCH_NUM_OPS; i++) {
+    s_reqs[i].sent_us = 0;
+    s_reqs[i].answered = false;
+    s_reqs[i].done = false;
+  }
+
+  // The first `depth` requests go out at once, the rest as responses arrive
+  size_t num_sent = depth < BENCH_NUM_OPS ? depth : BENCH_NUM_OPS;
+  size_t next_rx = 0;
+  size_t oldest = 0;
+  size_t num_done = 0;
+  size_t num_in_flight = 0;
+  uint64_t device_us = 0;
+  uint64_t end_us = 0;
+  while (num_done < BENCH_NUM_OPS) {
+    // The device is idle until the next frame lands, unless writes are queued
+    uint64_t device_ready_us = UINT64_MAX;
+    const bool frame_waiting = next_rx < num_sent;
+    if (frame_waiting) {
+      const uint64_t arrival_us = s_reqs[next_rx].sent_us + BENCH_LINK_US;
+      device_ready_us = arrival_us > device_us ? arrival_us : device_us;
+    }
+    const bool can_process = async && num_in_flight > 0 &&
+                             (!frame_waiting || device_ready_us > device_us);
+    if (can_process) {
+      device_ready_us = device_us;
+    }
+
+    // The earliest response the client hasn't seen yet
+    while (s_reqs[oldest].done) {
+      oldest++;
+    }
+    size_t resp_idx = BENCH_NUM_OPS;
+    for (size_t i = oldest; i < num_sent; i++) {
+      if (s_reqs[i].answered && !s_reqs[i].done &&
+          (resp_idx == BENCH_NUM_OPS || s_reqs[i].resp_us < s_reqs[resp_idx].resp_us)) {
+        resp_idx = i;
+      }
+    }
+    if (resp_idx != BENCH_NUM_OPS && s_reqs[resp_idx].resp_us <= device_ready_us) {
+      const uint64_t now_us = s_reqs[resp_idx].resp_us;
+      end_us = now_us;
+      s_reqs[resp_idx].done = true;
+      num_done++;
+      if (num_sent < BENCH_NUM_OPS) {
+        s_reqs[num_sent++].sent_us = now_us;
+      }
+      continue;
+    }
+
+    // Device step: the next frame if it has landed, otherwise a queued write
+    device_us = device_ready_us;
+    s_num_answered = 0;
+    const bool rx = frame_waiting && (!can_process ||
+                                      s_reqs[next_rx].sent_us + BENCH_LINK_US <= device_us);
+    device_us += prv_device_step(async, &parser, rx ? next_rx : BENCH_NUM_OPS);
+    if (rx) {
+      next_rx++;
+      num_in_flight++;
+    }
+    for (size_t i = 0; i < s_num_answered; i++) {
+      s_reqs[s_answered[i]].resp_us = device_us + BENCH_LINK_US;
+      s_reqs[s_answered[i]].answered = true;
+      num_in_flight--;
+    }
+  }
+
+  kv_store_deinit();
+  lfs_unmount(&lfs);
+  lfs_test_bd_destroy();
+
+  static uint64_t s_read_us[BENCH_NUM_OPS];
+  static uint64_t s_write_us[BENCH_NUM_OPS];
+  size_t num_reads = 0;
+  size_t num_writes = 0;
+  for (size_t i = 0; i < BENCH_NUM_OPS; i++) {
+    if (s_reqs[i].is_read) {
+      s_read_us[num_reads++] = s_reqs[i].resp_us - s_reqs[i].sent_us;
+    } else {
+      s_write_us[num_writes++] = s_reqs[i].resp_us - s_reqs[i].sent_us;
+    }
+  }
+  result->ops_per_sec = bench_ops_per_sec(BENCH_NUM_OPS, end_us * 1000);
+  result->read_p50_us = bench_percentile(s_read_us, num_reads, 50);
+  result->read_p99_us = bench_percentile(s_read_us, num_reads, 99);
+  result->write_p99_us = bench_percentile(s_write_us, num_writes, 99);
+}
+
+TEST_GROUP(BenchProtocolPipeline) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(BenchProtocolPipeline, SyncVsAsyncHandlers) {
+  bench_zipf_init(BENCH_NUM_KEYS, 1.0);
+  prv_build_stream();
+
+  sPipelineResult sync_results[BENCH_NUM_DEPTHS];
+  sPipelineResult async_results[BENCH_NUM_DEPTHS];
+  printf("\nprotocol pipelining: %d kv ops (%d%% reads), %d ms one way link\n", BENCH_NUM_OPS,
+         BENCH_READ_PCT, BENCH_LINK_US / 1000);
+  printf("  %-5s %5s %9s %12s %12s %13s\n", "mode", "depth", "ops/s", "read p50 us",
+         "read p99 us", "write p99 us");
+  for (size_t i = 0; i < BENCH_NUM_DEPTHS; i++) {
+    for (int async = 0; async <= 1; async++) {
+      sPipelineResult *r = async ? &async_results[i] : &sync_results[i];
+      prv_run(async, s_depths[i], r);
+      printf("  %-5s %5u %9.1f %12llu %12llu %13llu\n", async ? "async" : "sync",
+             (unsigned)s_depths[i], r->ops_per_sec, (unsigned long long)r->read_p50_us,
+             (unsigned long long)r->read_p99_us, (unsigned long long)r->write_p99_us);
+    }
+  }
+
+  // Keeping more requests in flight hides the link, whichever the handlers
+  CHECK(sync_results[BENCH_NUM_DEPTHS - 1].ops_per_sec > 2 * sync_results[0].ops_per_sec);
+  CHECK(async_results[BENCH_NUM_DEPTHS - 1].ops_per_sec > 2 * async_results[0].ops_per_sec);
+  // Once requests queue up, reads no longer wait behind flash writes
+  CHECK(async_results[BENCH_NUM_DEPTHS - 1].read_p99_us <
+        sync_results[BENCH_NUM_DEPTHS - 1].read_p99_us);
+}
@@ -0,0 +1,92 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <stdio.h>
+  #include <string.h>
+  #include <unistd.h>
+
+  #include "lfs.h"
+  #include "fakes/fake_flash.h"
+}
+
+static sFakeFlash s_flash;
+
+static const struct lfs_config s_cfg = {
+  .context = &s_flash,
+  .read  = &fake_flash_read,
+  .prog  = &fake_flash_prog,
+  .erase = &fake_flash_erase,
+  .sync  = &fake_flash_sync,
+
+  .read_size      = 16,
+  .prog_size      = 16,
+  .block_size     = 256,
+  .block_count    = 8,
+  .block_cycles   = 100,
+  .cache_size     = 16,
+  .lookahead_size = 16,
+};
+
+TEST_GROUP(TestFakeFlash) {
+  void setup() {}
+
+  void teardown() {
+    fake_flash_destroy(&s_cfg);
+  }
+};
+
+TEST(TestFakeFlash, Test_ProgEraseRoundTrip) {
+  LONGS_EQUAL(0, fake_flash_create(&s_cfg, NULL));
+
+  uint8_t buf[16];
+  LONGS_EQUAL(0, fake_flash_read(&s_cfg, 3, 32, buf, sizeof(buf)));
+  LONGS_EQUAL(0xff, buf[0]);
+
+  const uint8_t data[16] = {1, 2, 3};
+  LONGS_EQUAL(0, fake_flash_prog(&s_cfg, 3, 32, data, sizeof(data)));
+  LONGS_EQUAL(0, fake_flash_read(&s_cfg, 3, 32, buf, sizeof(buf)));
+  MEMCMP_EQUAL(data, buf, sizeof(data));
+
+  LONGS_EQUAL(0, fake_flash_erase(&s_cfg, 3));
+  LONGS_EQUAL(0, fake_flash_read(&s_cfg, 3, 32, buf, sizeof(buf)));
+  LONGS_EQUAL(0xff, buf[1]);
+
+  CHECK_EQUAL(3, s_flash.stats.read_count);
+  CHECK_EQUAL(1, s_flash.stats.prog_count);
+  CHECK_EQUAL(1, s_flash.stats.erase_count);
+}
+
+TEST(TestFakeFlash, Test_ConfigurableEraseValue) {
+  sFakeFlashConfig config = {};
+  config.erase_value = 0x00;
+  LONGS_EQUAL(0, fake_flash_create(&s_cfg, &config));
+
+  uint8_t buf[16];
+  LONGS_EQUAL(0, fake_flash_read(&s_cfg, 7, 240, buf, sizeof(buf)));
+  LONGS_EQUAL(0x00, buf[15]);
+}
+
+TEST(TestFakeFlash, Test_MmapBackedFile) {
+  const char *path = "fake_flash_test.bin";
+  sFakeFlashConfig config = {};
+  config.erase_value = 0xff;
+  config.mmap_path = path;
+  LONGS_EQUAL(0, fake_flash_create(&s_cfg, &config));
+
+  const uint8_t data[16] = {0xde, 0xad, 0xbe, 0xef};
+  LONGS_EQUAL(0, fake_flash_prog(&s_cfg, 1, 0, data, sizeof(data)));
+  fake_flash_destroy(&s_cfg);
+
+  // The whole part is a single file, block after block
+  FILE *f = fopen(path, "rb");
+  CHECK(f != NULL);
+  uint8_t buf[4];
+  fseek(f, 256, SEEK_SET);
+  LONGS_EQUAL(sizeof(buf), fread(buf, 1, sizeof(buf), f));
+  fseek(f, 0, SEEK_END);
+  LONGS_EQUAL(256 * 8, ftell(f));
+  fclose(f);
+  unlink(path);
+
+  MEMCMP_EQUAL(data, buf, sizeof(buf));
+}
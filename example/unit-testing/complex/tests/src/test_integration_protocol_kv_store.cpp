@@ -9,10 +9,10 @@ extern "C" {
   #include "protocol/registry.h"
 
   #include "lfs.h"
-  #include "emubd/lfs_emubd.h"
 
   #include "defs/lfs_default_config.h"
   #include "kv_store/kv_store.h"
+  #include "kv_store/kv_store_protocol_handlers.h"
 
 
   #include "stubs/stub_analytics.h"
@@ -28,22 +28,28 @@ TEST_GROUP(TestIntegrationProtocolKvStore) {
   void setup() {
     fake_mutex_init();
 
-    lfs_emubd_create(&cfg, "blocks");
+    lfs_test_bd_create("blocks");
     lfs_format(&lfs, &cfg);
     lfs_mount(&lfs, &cfg);
 
-    kv_store_init(&lfs);
+    kv_store_init(&lfs, NULL);
     memset(s_resp_buffer, 0, s_resp_buffer_len);
   }
 
   void teardown() {
-    lfs_emubd_destroy(&cfg);
+    kv_store_deinit();
+    lfs_test_bd_destroy();
     lfs_unmount(&lfs);
 
     CHECK(fake_mutex_all_unlocked());
   }
 };
 
+TEST(TestIntegrationProtocolKvStore, RegistrySorted) {
+  // The table in protocol/registry.c, which dispatch binary searches
+  CHECK_TRUE(protocol_registry_sorted(g_protocol_commands, g_num_protocol_commands));
+}
+
 TEST(TestIntegrationProtocolKvStore, Read) {
   const uint8_t in_bytes[] = {
       0xE8, 0x03, 0x00, 0x00,       // Code (1000)
@@ -68,6 +74,39 @@ TEST(TestIntegrationProtocolKvStore, Read) {
 }
 
 
+TEST(TestIntegrationProtocolKvStore, ReadInPieces) {
+  // Larger than the response buffer the transport offers
+  uint8_t val[100];
+  for (size_t i = 0; i < sizeof(val); i++) {
+    val[i] = (uint8_t)i;
+  }
+  CHECK_TRUE(kv_store_write("big", val, sizeof(val)));
+
+  uint8_t got[sizeof(val)];
+  uint32_t offset = 0;
+  while (true) {
+    uint8_t in_bytes[PROTOCOL_HEADER_LEN + 8];
+    const uint32_t code = 1000;
+    const uint32_t payload_size = 8;
+    memcpy(&in_bytes[0], &code, sizeof(code));
+    memcpy(&in_bytes[4], &payload_size, sizeof(payload_size));
+    memcpy(&in_bytes[PROTOCOL_HEADER_LEN], "big", 4);
+    memcpy(&in_bytes[PROTOCOL_HEADER_LEN + 4], &offset, sizeof(offset));
+
+    size_t len = 32;
+    CHECK_EQUAL(kProtocolCode_Ok, protocol_handle(in_bytes, sizeof(in_bytes), s_resp_buffer, &len));
+    if (len == 0) {
+      break;
+    }
+    CHECK(offset + len <= sizeof(got));
+    memcpy(&got[offset], s_resp_buffer, len);
+    offset += len;
+  }
+
+  LONGS_EQUAL(sizeof(val), offset);
+  MEMCMP_EQUAL(val, got, sizeof(val));
+}
+
 TEST(TestIntegrationProtocolKvStore, Write) {
   const uint8_t in_bytes[] = {
       0xE9, 0x03, 0x00, 0x00,        // Code (1001)
@@ -96,3 +135,193 @@ TEST(TestIntegrationProtocolKvStore, Write) {
   kv_store_read("hello", s_resp_buffer, sizeof(s_resp_buffer), &val_len);
   MEMCMP_EQUAL(val_bytes, s_resp_buffer, sizeof(val_bytes));
 }
+
+TEST(TestIntegrationProtocolKvStore, RegistryIsSorted) {
+  // protocol_handle() binary searches the registry
+  for (size_t i = 1; i < g_num_protocol_commands; i++) {
+    CHECK(g_protocol_commands[i - 1].code < g_protocol_commands[i].code);
+  }
+}
+
+TEST(TestIntegrationProtocolKvStore, Batch) {
+  const uint8_t in_bytes[] = {
+      0xD0, 0x07, 0x00, 0x00,        // Code (2000, batch)
+      0x2F, 0x00, 0x00, 0x00,        // Payload Size (47)
+      0x03, 0x00, 0x00, 0x00,        // Number of items (3)
+      0xE9, 0x03, 0x00, 0x00,        // Code (1001, write)
+      0x0B, 0x00, 0x00, 0x00,        // Payload Size (11)
+      'h', 'e', 'l', 'l', 'o', '\0',
+      'w', 'o', 'r', 'l', 'd',
+      0xE8, 0x03, 0x00, 0x00,        // Code (1000, read)
+      0x06, 0x00, 0x00, 0x00,        // Payload Size (6)
+      'h', 'e', 'l', 'l', 'o', '\0',
+      0xE8, 0x03, 0x00, 0x00,        // Code (1000, read)
+      0x02, 0x00, 0x00, 0x00,        // Payload Size (2)
+      'x', '\0',
+  };
+
+  const uint8_t out_bytes[] = {
+      0x03, 0x00, 0x00, 0x00,        // Number of items (3)
+      0x00, 0x00, 0x00, 0x00,        // Status (Ok)
+      0x01, 0x00, 0x00, 0x00,        // Response length (1)
+      1,
+      0x00, 0x00, 0x00, 0x00,        // Status (Ok)
+      0x05, 0x00, 0x00, 0x00,        // Response length (5)
+      'w', 'o', 'r', 'l', 'd',
+      0x00, 0x00, 0x00, 0x00,        // Status (Ok)
+      0x00, 0x00, 0x00, 0x00,        // Response length (0), no such key
+  };
+
+  size_t len = s_resp_buffer_len;
+  eProtocolCode rv = protocol_handle(in_bytes, sizeof(in_bytes), s_resp_buffer, &len);
+
+  CHECK_EQUAL(kProtocolCode_Ok, rv);
+  LONGS_EQUAL(sizeof(out_bytes), len);
+  MEMCMP_EQUAL(out_bytes, s_resp_buffer, sizeof(out_bytes));
+}
+
+//
+// Async event loop
+//
+// The shape of a host transport using the async write handler: feed whatever
+// was received, and when there's nothing left to parse, spend the time on
+// queued flash writes. Every response carries its request ID, so the client
+// can match them up in whatever order they come back.
+//
+
+typedef struct {
+  uint32_t request_ids[8];
+  uint8_t resps[8][16];
+  size_t resp_lens[8];
+  size_t num_resps;
+} sEventLoopSent;
+
+static void prv_send_cb(uint32_t request_id, uint32_t code, eProtocolCode rv,
+                        const sProtocolResponse *resp, void *ctx) {
+  sEventLoopSent *sent = (sEventLoopSent *)ctx;
+  CHECK_EQUAL(kProtocolCode_Ok, rv);
+  sent->request_ids[sent->num_resps] = request_id;
+  sent->resp_lens[sent->num_resps] =
+      protocol_response_copy(resp, sent->resps[sent->num_resps], sizeof(sent->resps[0]));
+  sent->num_resps++;
+}
+
+static size_t prv_put_frame(uint8_t *buf, uint32_t code, const char *key, const char *val) {
+  const uint32_t key_len = (uint32_t)strlen(key) + 1;
+  const uint32_t val_len = val ? (uint32_t)strlen(val) : 0;
+  const uint32_t payload_size = key_len + val_len;
+  memcpy(&buf[0], &code, sizeof(code));
+  memcpy(&buf[sizeof(code)], &payload_size, sizeof(payload_size));
+  memcpy(&buf[PROTOCOL_HEADER_LEN], key, key_len);
+  if (val) {
+    memcpy(&buf[PROTOCOL_HEADER_LEN + key_len], val, val_len);
+  }
+  return PROTOCOL_HEADER_LEN + payload_size;
+}
+
+static void prv_event_loop(sProtocolParser *parser, const uint8_t *rx, size_t rx_len) {
+  size_t off = 0;
+  while (true) {
+    if (off < rx_len) {
+      // Stands in for a read() from the socket
+      const size_t n = (rx_len - off) < 16 ? (rx_len - off) : 16;
+      protocol_feed(parser, &rx[off], n);
+      off += n;
+      continue;
+    }
+    if (!kv_store_protocol_process()) {
+      break;
+    }
+  }
+}
+
+//! Restarts kv_store with a write queue, which the async handler relies on
+static void prv_init_async_kv_store(void) {
+  static sKvStoreQueueEntry s_write_queue[8];
+  sKvStoreConfig kv_config = {};
+  kv_config.write_queue = s_write_queue;
+  kv_config.write_queue_len = sizeof(s_write_queue) / sizeof(s_write_queue[0]);
+  kv_store_deinit();
+  CHECK(kv_store_init(&lfs, &kv_config));
+}
+
+static void prv_init_parser(sProtocolParser *parser, uint8_t *frame_buf, size_t frame_buf_len,
+                            sEventLoopSent *sent) {
+  sProtocolParserConfig config = {};
+  config.frame_buf = frame_buf;
+  config.frame_buf_len = frame_buf_len;
+  config.resp_buf = s_resp_buffer;
+  config.resp_buf_len = s_resp_buffer_len;
+  config.cb = prv_send_cb;
+  config.ctx = sent;
+  protocol_parser_init(parser, &config);
+}
+
+TEST(TestIntegrationProtocolKvStore, AsyncEventLoop) {
+  prv_init_async_kv_store();
+
+  uint8_t rx[128];
+  size_t rx_len = 0;
+  rx_len += prv_put_frame(&rx[rx_len], 1001, "hello", "world");
+  rx_len += prv_put_frame(&rx[rx_len], 1000, "hello", NULL);
+  rx_len += prv_put_frame(&rx[rx_len], 1001, "foo", "bar");
+  rx_len += prv_put_frame(&rx[rx_len], 1000, "foo", NULL);
+
+  uint8_t frame_buf[64];
+  sEventLoopSent sent = {};
+  sProtocolParser parser;
+  prv_init_parser(&parser, frame_buf, sizeof(frame_buf), &sent);
+
+  prv_event_loop(&parser, rx, rx_len);
+
+  // The reads didn't wait for the writes ahead of them, and saw their values
+  LONGS_EQUAL(4, sent.num_resps);
+  LONGS_EQUAL(1, sent.request_ids[0]);
+  MEMCMP_EQUAL("world", sent.resps[0], sent.resp_lens[0]);
+  LONGS_EQUAL(3, sent.request_ids[1]);
+  MEMCMP_EQUAL("bar", sent.resps[1], sent.resp_lens[1]);
+  // Each write was acked as soon as its own value was flushed
+  LONGS_EQUAL(0, sent.request_ids[2]);
+  LONGS_EQUAL(1, sent.resp_lens[2]);
+  LONGS_EQUAL(1, sent.resps[2][0]);
+  LONGS_EQUAL(2, sent.request_ids[3]);
+  LONGS_EQUAL(1, sent.resp_lens[3]);
+  LONGS_EQUAL(1, sent.resps[3][0]);
+
+  // And the writes made it to flash
+  uint8_t val[8];
+  uint32_t val_len;
+  CHECK(kv_store_read("foo", val, sizeof(val), &val_len));
+  LONGS_EQUAL(3, val_len);
+  MEMCMP_EQUAL("bar", val, 3);
+}
+
+TEST(TestIntegrationProtocolKvStore, AsyncAcksFollowFlushes) {
+  prv_init_async_kv_store();
+
+  uint8_t rx[64];
+  size_t rx_len = 0;
+  rx_len += prv_put_frame(&rx[rx_len], 1001, "hello", "world");
+  rx_len += prv_put_frame(&rx[rx_len], 1001, "foo", "bar");
+
+  uint8_t frame_buf[64];
+  sEventLoopSent sent = {};
+  sProtocolParser parser;
+  prv_init_parser(&parser, frame_buf, sizeof(frame_buf), &sent);
+  protocol_feed(&parser, rx, rx_len);
+  LONGS_EQUAL(0, sent.num_resps);
+
+  // The first write is acked once it's in flash, while the second is queued
+  CHECK(kv_store_protocol_process());
+  LONGS_EQUAL(1, sent.num_resps);
+  LONGS_EQUAL(0, sent.request_ids[0]);
+  LONGS_EQUAL(1, sent.resps[0][0]);
+  uint32_t seq;
+  CHECK(kv_store_async_queued_seq("foo", &seq));
+
+  CHECK(kv_store_protocol_process());
+  LONGS_EQUAL(2, sent.num_resps);
+  LONGS_EQUAL(1, sent.request_ids[1]);
+  LONGS_EQUAL(1, sent.resps[1][0]);
+  CHECK_FALSE(kv_store_protocol_process());
+}
@@ -0,0 +1,139 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <string.h>
+  #include <stdio.h>
+
+  #include "kv_store/kv_compress.h"
+}
+
+static sKvCompressor s_compressor;
+static sKvDecompressor s_decompressor;
+
+typedef struct {
+  uint8_t buf[8192];
+  uint32_t len;
+  uint32_t num_calls;
+} sSink;
+
+static sSink s_compressed;
+static sSink s_decoded;
+
+static bool prv_sink_cb(const void *data, uint32_t len, void *ctx) {
+  sSink *sink = (sSink *)ctx;
+  CHECK(sink->len + len <= sizeof(sink->buf));
+  memcpy(&sink->buf[sink->len], data, len);
+  sink->len += len;
+  sink->num_calls++;
+  return true;
+}
+
+//! Compresses and decodes `in`, feeding the decoder `feed_len` bytes at a time
+static uint32_t prv_round_trip(const void *in, uint32_t len, uint32_t feed_len) {
+  memset(&s_compressed, 0, sizeof(s_compressed));
+  memset(&s_decoded, 0, sizeof(s_decoded));
+
+  const uint32_t compressed_len =
+      kv_compress(&s_compressor, in, len, sizeof(s_compressed.buf), prv_sink_cb, &s_compressed);
+  LONGS_EQUAL(s_compressed.len, compressed_len);
+
+  kv_decompress_init(&s_decompressor);
+  for (uint32_t off = 0; off < compressed_len; off += feed_len) {
+    const uint32_t n = (compressed_len - off) < feed_len ? (compressed_len - off) : feed_len;
+    CHECK(kv_decompress_feed(&s_decompressor, &s_compressed.buf[off], n, prv_sink_cb,
+                             &s_decoded));
+  }
+  CHECK(kv_decompress_finish(&s_decompressor));
+  LONGS_EQUAL(len, s_decoded.len);
+  MEMCMP_EQUAL(in, s_decoded.buf, len);
+  return compressed_len;
+}
+
+static uint32_t prv_make_json(char *buf, uint32_t buf_len) {
+  uint32_t len = 0;
+  len += snprintf(&buf[len], buf_len - len, "{\"sensors\":[");
+  for (int i = 0; i < 40 && len < buf_len - 128; i++) {
+    len += snprintf(&buf[len], buf_len - len,
+                    "{\"id\":%d,\"name\":\"temp_%d\",\"enabled\":true,\"period_ms\":%d},",
+                    i, i, 1000 * (i % 4 + 1));
+  }
+  len += snprintf(&buf[len], buf_len - len, "]}");
+  return len;
+}
+
+TEST_GROUP(TestKvCompress) {
+  void setup() {}
+  void teardown() {}
+};
+
+TEST(TestKvCompress, Test_RoundTripsText) {
+  char json[4096];
+  const uint32_t len = prv_make_json(json, sizeof(json));
+
+  const uint32_t compressed_len = prv_round_trip(json, len, 64);
+  CHECK(compressed_len * 3 < len);
+}
+
+TEST(TestKvCompress, Test_FeedOneByteAtATime) {
+  char json[4096];
+  const uint32_t len = prv_make_json(json, sizeof(json));
+  prv_round_trip(json, len, 1);
+}
+
+TEST(TestKvCompress, Test_OverlappingMatch) {
+  // A run is encoded as a match which overlaps its own output
+  uint8_t val[1000];
+  memset(val, 'a', sizeof(val));
+  const uint32_t compressed_len = prv_round_trip(val, sizeof(val), 7);
+  CHECK(compressed_len < 100);
+}
+
+TEST(TestKvCompress, Test_MatchesAcrossWindowWrap) {
+  // Longer than the window, so the decoder wraps and emits in pieces
+  uint8_t val[3 * KV_COMPRESS_WINDOW_SIZE + 17];
+  for (size_t i = 0; i < sizeof(val); i++) {
+    val[i] = (uint8_t)((i * 7) % 251);
+  }
+  prv_round_trip(val, sizeof(val), 100);
+  CHECK(s_decoded.num_calls > 1);
+}
+
+TEST(TestKvCompress, Test_IncompressibleExceedsLimit) {
+  uint8_t val[512];
+  uint32_t state = 1;
+  for (size_t i = 0; i < sizeof(val); i++) {
+    state = state * 1103515245 + 12345;
+    val[i] = (uint8_t)(state >> 16);
+  }
+
+  // Still round trips, at the cost of a token per 128 literals
+  const uint32_t compressed_len = prv_round_trip(val, sizeof(val), 64);
+  CHECK(compressed_len > sizeof(val));
+
+  // With a limit it gives up instead
+  LONGS_EQUAL(0, kv_compress(&s_compressor, val, sizeof(val), sizeof(val), NULL, NULL));
+}
+
+TEST(TestKvCompress, Test_SizingPassMatchesOutput) {
+  char json[4096];
+  const uint32_t len = prv_make_json(json, sizeof(json));
+  const uint32_t sized = kv_compress(&s_compressor, json, len, len, NULL, NULL);
+  LONGS_EQUAL(prv_round_trip(json, len, 64), sized);
+}
+
+TEST(TestKvCompress, Test_DetectsCorruptStream) {
+  // A match reaching back before the start of the output
+  const uint8_t bad_offset[] = { 0x00, 'a', 0x80, 0x05 };
+  memset(&s_decoded, 0, sizeof(s_decoded));
+  kv_decompress_init(&s_decompressor);
+  CHECK_FALSE(kv_decompress_feed(&s_decompressor, bad_offset, sizeof(bad_offset), prv_sink_cb,
+                                 &s_decoded));
+  CHECK_FALSE(kv_decompress_finish(&s_decompressor));
+
+  // Cut off in the middle of a literal run
+  const uint8_t truncated[] = { 0x03, 'a', 'b' };
+  kv_decompress_init(&s_decompressor);
+  CHECK(kv_decompress_feed(&s_decompressor, truncated, sizeof(truncated), prv_sink_cb,
+                           &s_decoded));
+  CHECK_FALSE(kv_decompress_finish(&s_decompressor));
+}
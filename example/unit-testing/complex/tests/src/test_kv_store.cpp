@@ -3,9 +3,9 @@
 extern "C" {
   #include <string.h>
   #include <stddef.h>
+  #include <stdio.h>
 
   #include "lfs.h"
-  #include "emubd/lfs_emubd.h"
 
   #include "defs/lfs_default_config.h"
   #include "kv_store/kv_store.h"
@@ -14,26 +14,39 @@ extern "C" {
   #include "fakes/fake_mutex.h"
 }
 
-TEST_GROUP(TestKvStore) {
-  void setup() {
-    fake_mutex_init();
+static void prv_setup(const sKvStoreConfig *config) {
+  fake_mutex_init();
 
-    lfs_emubd_create(&cfg, "blocks");
-    lfs_format(&lfs, &cfg);
-    lfs_mount(&lfs, &cfg);
+  bd_stats_reset();
+  lfs_test_bd_create("blocks");
+  lfs_format(&lfs, &cfg);
+  lfs_mount(&lfs, &cfg);
 
-    kv_store_init(&lfs);
-  }
+  kv_store_init(&lfs, config);
+}
 
-  void teardown() {
-    lfs_emubd_destroy(&cfg);
-    lfs_unmount(&lfs);
+static void prv_teardown(void) {
+  kv_store_deinit();
 
-    CHECK(fake_mutex_all_unlocked());
-  }
-};
+  lfs_test_bd_destroy();
+  lfs_unmount(&lfs);
 
-TEST(TestKvStore, Test_SimpleKvStore) {
+  CHECK(fake_mutex_all_unlocked());
+}
+
+static const sKvStoreConfig *s_config;
+
+static void prv_reboot(void) {
+  kv_store_deinit();
+  kv_store_init(&lfs, s_config);
+}
+
+//
+// Behavior every backend must provide. Each of these runs in both the
+// TestKvStore (file per key) and TestKvStoreLog groups.
+//
+
+static void prv_test_simple_kv_store(void) {
   bool rv;
 
   const char *key = "hello";
@@ -51,3 +64,1504 @@ TEST(TestKvStore, Test_SimpleKvStore) {
   rv = kv_store_read(key, buf, 0, &read_len);
   CHECK_FALSE(rv);
 }
+
+static void prv_test_write_batch(void) {
+  const sKvStoreBatchEntry entries[] = {
+    {"a", "1", 1},
+    {"b", "22", 2},
+    {"c", "333", 3},
+  };
+  CHECK(kv_store_write_batch(entries, sizeof(entries) / sizeof(entries[0])));
+
+  char buf[16];
+  uint32_t read_len;
+  CHECK(kv_store_read("b", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(2, read_len);
+  MEMCMP_EQUAL("22", buf, 2);
+  CHECK(kv_store_read("c", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("333", buf, 3);
+
+  // Journal is removed once the batch has been applied
+  struct lfs_info info;
+  LONGS_EQUAL(LFS_ERR_NOENT, lfs_stat(&lfs, "/kv_journal", &info));
+}
+
+static void prv_test_overwrite_and_delete(void) {
+  char buf[16];
+  uint32_t read_len;
+
+  CHECK(kv_store_write("key", "long value", 10));
+  CHECK(kv_store_write("key", "short", 5));
+  CHECK(kv_store_read("key", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(5, read_len);
+  MEMCMP_EQUAL("short", buf, 5);
+
+  CHECK(kv_store_delete("key"));
+  CHECK_FALSE(kv_store_read("key", buf, sizeof(buf), &read_len));
+
+  // Deleting a missing key is not an error
+  CHECK(kv_store_delete("key"));
+}
+
+static void prv_test_persists_across_reboot(void) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "2", 1));
+  CHECK(kv_store_write("a", "3", 1));
+  CHECK(kv_store_delete("b"));
+
+  prv_reboot();
+
+  char buf[16];
+  uint32_t read_len;
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(1, read_len);
+  MEMCMP_EQUAL("3", buf, 1);
+  CHECK_FALSE(kv_store_read("b", buf, sizeof(buf), &read_len));
+}
+
+typedef struct {
+  uint8_t buf[1024];
+  uint32_t len;
+  uint32_t num_chunks;
+  uint32_t stop_after;
+  uint32_t max_chunk_len;
+} sStreamCtx;
+
+static bool prv_stream_cb(const void *chunk, uint32_t len, void *ctx) {
+  sStreamCtx *stream = (sStreamCtx *)ctx;
+  CHECK(stream->len + len <= sizeof(stream->buf));
+  if (len > stream->max_chunk_len) {
+    stream->max_chunk_len = len;
+  }
+  memcpy(&stream->buf[stream->len], chunk, len);
+  stream->len += len;
+  stream->num_chunks++;
+  return stream->num_chunks != stream->stop_after;
+}
+
+static void prv_test_read_stream(void) {
+  uint8_t val[700];
+  for (size_t i = 0; i < sizeof(val); i++) {
+    val[i] = (uint8_t)i;
+  }
+  CHECK(kv_store_write("big", val, sizeof(val)));
+
+  uint32_t size;
+  CHECK(kv_store_size("big", &size));
+  LONGS_EQUAL(sizeof(val), size);
+  CHECK_FALSE(kv_store_size("missing", &size));
+
+  sStreamCtx stream = {};
+  CHECK(kv_store_read_stream("big", 0, prv_stream_cb, &stream));
+  LONGS_EQUAL(sizeof(val), stream.len);
+  MEMCMP_EQUAL(val, stream.buf, sizeof(val));
+  CHECK(stream.num_chunks > 1);
+
+  stream = {};
+  CHECK(kv_store_read_stream("big", 650, prv_stream_cb, &stream));
+  LONGS_EQUAL(50, stream.len);
+  MEMCMP_EQUAL(&val[650], stream.buf, 50);
+
+  // Stopping early from the callback is not an error
+  stream = {};
+  stream.stop_after = 1;
+  CHECK(kv_store_read_stream("big", 0, prv_stream_cb, &stream));
+  LONGS_EQUAL(KV_STORE_STREAM_CHUNK_SIZE, stream.len);
+
+  // Reading from the very end yields nothing
+  stream = {};
+  CHECK(kv_store_read_stream("big", sizeof(val), prv_stream_cb, &stream));
+  LONGS_EQUAL(0, stream.len);
+
+  CHECK_FALSE(kv_store_read_stream("big", sizeof(val) + 1, prv_stream_cb, &stream));
+  CHECK_FALSE(kv_store_read_stream("missing", 0, prv_stream_cb, &stream));
+}
+
+typedef struct {
+  char keys[8][16];
+  uint32_t sizes[8];
+  uint32_t num_keys;
+  uint8_t val[1024];
+  uint32_t val_len;
+  uint32_t stop_after_keys;
+} sForeachCtx;
+
+static bool prv_foreach_cb(const char *key, uint32_t size, uint32_t offset,
+                           const void *chunk, uint32_t len, void *ctx) {
+  sForeachCtx *foreach = (sForeachCtx *)ctx;
+  if (offset == 0) {
+    if (foreach->num_keys == foreach->stop_after_keys) {
+      return false;
+    }
+    CHECK(foreach->num_keys < 8);
+    strcpy(foreach->keys[foreach->num_keys], key);
+    foreach->sizes[foreach->num_keys] = size;
+    foreach->num_keys++;
+    foreach->val_len = 0;
+  }
+  LONGS_EQUAL(foreach->val_len, offset);
+  memcpy(&foreach->val[foreach->val_len], chunk, len);
+  foreach->val_len += len;
+  return true;
+}
+
+static int prv_foreach_find(const sForeachCtx *foreach, const char *key) {
+  for (uint32_t i = 0; i < foreach->num_keys; i++) {
+    if (strcmp(foreach->keys[i], key) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+static void prv_test_foreach(void) {
+  CHECK(kv_store_write("net.ssid", "home", 4));
+  CHECK(kv_store_write("net.pass", "", 0));
+  CHECK(kv_store_write("led", "1", 1));
+  uint8_t big[300];
+  memset(big, 0x5a, sizeof(big));
+  CHECK(kv_store_write("net.cert", big, sizeof(big)));
+
+  sForeachCtx foreach = {};
+  foreach.stop_after_keys = UINT32_MAX;
+  CHECK(kv_store_foreach("net.", prv_foreach_cb, &foreach));
+  LONGS_EQUAL(3, foreach.num_keys);
+  CHECK(prv_foreach_find(&foreach, "led") < 0);
+  const int pass = prv_foreach_find(&foreach, "net.pass");
+  CHECK(pass >= 0);
+  LONGS_EQUAL(0, foreach.sizes[pass]);
+  const int cert = prv_foreach_find(&foreach, "net.cert");
+  CHECK(cert >= 0);
+  LONGS_EQUAL(sizeof(big), foreach.sizes[cert]);
+
+  foreach = {};
+  foreach.stop_after_keys = UINT32_MAX;
+  CHECK(kv_store_foreach(NULL, prv_foreach_cb, &foreach));
+  LONGS_EQUAL(4, foreach.num_keys);
+
+  // Ending the walk early is not a failure
+  foreach = {};
+  foreach.stop_after_keys = 1;
+  CHECK(kv_store_foreach(NULL, prv_foreach_cb, &foreach));
+  LONGS_EQUAL(1, foreach.num_keys);
+}
+
+typedef struct {
+  uint8_t buf[1024];
+  uint32_t len;
+} sExportBuf;
+
+static bool prv_export_cb(const void *data, uint32_t len, void *ctx) {
+  sExportBuf *out = (sExportBuf *)ctx;
+  if (out->len + len > sizeof(out->buf)) {
+    return false;
+  }
+  memcpy(&out->buf[out->len], data, len);
+  out->len += len;
+  return true;
+}
+
+static void prv_test_export_import(void) {
+  uint8_t big[300];
+  memset(big, 0x33, sizeof(big));
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("big", big, sizeof(big)));
+  CHECK(kv_store_write("empty", "", 0));
+
+  static sExportBuf snapshot;
+  snapshot = {};
+  CHECK(kv_store_export(prv_export_cb, &snapshot));
+
+  // Restore into an empty store
+  prv_teardown();
+  prv_setup(s_config);
+  CHECK(kv_store_import(snapshot.buf, snapshot.len));
+
+  char buf[512];
+  uint32_t read_len;
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("1", buf, 1);
+  CHECK(kv_store_read("big", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(sizeof(big), read_len);
+  MEMCMP_EQUAL(big, buf, sizeof(big));
+  CHECK(kv_store_read("empty", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(0, read_len);
+
+  // A truncated snapshot is rejected without writing anything
+  prv_teardown();
+  prv_setup(s_config);
+  CHECK_FALSE(kv_store_import(snapshot.buf, snapshot.len - 1));
+  CHECK_FALSE(kv_store_read("a", buf, sizeof(buf), &read_len));
+
+  // An export which can't be delivered fails
+  sExportBuf *small = &snapshot;
+  small->len = sizeof(small->buf) - 8;
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK_FALSE(kv_store_export(prv_export_cb, small));
+}
+
+#define KV_STORE_BACKEND_TESTS(group) \
+  TEST(group, Test_SimpleKvStore) { prv_test_simple_kv_store(); } \
+  TEST(group, Test_WriteBatch) { prv_test_write_batch(); } \
+  TEST(group, Test_OverwriteAndDelete) { prv_test_overwrite_and_delete(); } \
+  TEST(group, Test_PersistsAcrossReboot) { prv_test_persists_across_reboot(); } \
+  TEST(group, Test_ReadStream) { prv_test_read_stream(); } \
+  TEST(group, Test_Foreach) { prv_test_foreach(); } \
+  TEST(group, Test_ExportImport) { prv_test_export_import(); }
+
+TEST_GROUP(TestKvStore) {
+  void setup() {
+    s_config = NULL;
+    prv_setup(s_config);
+  }
+
+  void teardown() {
+    prv_teardown();
+  }
+};
+
+KV_STORE_BACKEND_TESTS(TestKvStore)
+
+static void prv_write_journal(const uint8_t *data, size_t len) {
+  lfs_file_open(&lfs, &file, "/kv_journal", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+  lfs_file_write(&lfs, &file, data, len);
+  lfs_file_close(&lfs, &file);
+}
+
+TEST(TestKvStore, Test_ReplaysCommittedJournal) {
+  const uint8_t journal[] = {
+    0x01, 0x00, 0x00, 0x00,       // Key length (1)
+    0x02, 0x00, 0x00, 0x00,       // Value length (2)
+    'k', 'v', 'v',                // Key + Value
+    0x01, 0x00, 0x00, 0x00,       // Number of entries (1)
+    0x4B, 0x56, 0x4A, 0x4E,       // Magic
+  };
+  prv_write_journal(journal, sizeof(journal));
+
+  // Simulate a reboot
+  kv_store_init(&lfs, NULL);
+
+  char buf[16];
+  uint32_t read_len;
+  CHECK(kv_store_read("k", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(2, read_len);
+  MEMCMP_EQUAL("vv", buf, 2);
+}
+
+TEST(TestKvStore, Test_DiscardsTornJournal) {
+  const uint8_t journal[] = {
+    0x01, 0x00, 0x00, 0x00,       // Key length (1)
+    0x02, 0x00, 0x00, 0x00,       // Value length (2)
+    'k', 'v',                     // Cut short, no trailer
+  };
+  prv_write_journal(journal, sizeof(journal));
+
+  kv_store_init(&lfs, NULL);
+
+  char buf[16];
+  uint32_t read_len;
+  CHECK_FALSE(kv_store_read("k", buf, sizeof(buf), &read_len));
+  struct lfs_info info;
+  LONGS_EQUAL(LFS_ERR_NOENT, lfs_stat(&lfs, "/kv_journal", &info));
+}
+
+TEST(TestKvStore, Test_BatchRolledForwardAfterCommit) {
+  // A directory where "b"'s file goes makes its write fail after the journal
+  // has been committed
+  lfs_mkdir(&lfs, "/kv/b");
+  const sKvStoreBatchEntry entries[] = {
+    {"a", "1", 1},
+    {"b", "2", 1},
+  };
+  CHECK(kv_store_write_batch(entries, 2));
+
+  // The journal is kept, and nothing else is written until it's applied
+  struct lfs_info info;
+  LONGS_EQUAL(0, lfs_stat(&lfs, "/kv_journal", &info));
+  CHECK_FALSE(kv_store_write("c", "3", 1));
+
+  lfs_remove(&lfs, "/kv/b");
+  CHECK(kv_store_write("c", "3", 1));
+  LONGS_EQUAL(LFS_ERR_NOENT, lfs_stat(&lfs, "/kv_journal", &info));
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("b", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("2", buf, 1);
+  CHECK(kv_store_read("c", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("3", buf, 1);
+}
+
+//! Commits a batch which can't be applied, which keeps the file backend
+//! refusing writes until the directory standing in "b"'s way is removed
+static void prv_leave_journal_pending(void) {
+  lfs_mkdir(&lfs, "/kv/b");
+  const sKvStoreBatchEntry entries[] = {
+    {"a", "1", 1},
+    {"b", "2", 1},
+  };
+  CHECK(kv_store_write_batch(entries, 2));
+}
+
+static void prv_settle_journal(void) {
+  lfs_remove(&lfs, "/kv/b");
+}
+
+TEST(TestKvStore, Test_FailedDeleteKeepsKey) {
+  CHECK(kv_store_write("k", "v", 1));
+  prv_leave_journal_pending();
+
+  CHECK_FALSE(kv_store_delete("k"));
+
+  prv_settle_journal();
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("k", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("v", buf, 1);
+  CHECK(kv_store_delete("k"));
+  CHECK_FALSE(kv_store_read("k", buf, sizeof(buf), &read_len));
+}
+
+TEST_GROUP(TestKvStoreSharded) {
+  void setup() {
+    static sKvStoreConfig config = {};
+    config.file_num_shards = 4;
+    s_config = &config;
+    prv_setup(s_config);
+  }
+
+  void teardown() {
+    prv_teardown();
+  }
+};
+
+KV_STORE_BACKEND_TESTS(TestKvStoreSharded)
+
+//! Number of shard directories under /kv_shards holding `key`
+static int prv_num_shards_holding(const char *key) {
+  char fname[64];
+  int count = 0;
+  for (int i = 0; i < KV_STORE_FILE_MAX_SHARDS; i++) {
+    snprintf(fname, sizeof(fname), "/kv_shards/%02x/%s", i, key);
+    struct lfs_info info;
+    if (lfs_stat(&lfs, fname, &info) == 0) {
+      count++;
+    }
+  }
+  return count;
+}
+
+TEST(TestKvStoreSharded, Test_KeysLiveInShardDirs) {
+  char key[16];
+  for (int i = 0; i < 32; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    CHECK(kv_store_write(key, &i, sizeof(i)));
+    LONGS_EQUAL(1, prv_num_shards_holding(key));
+  }
+
+  // Nothing directly in /kv, and the keys are spread over every shard
+  struct lfs_info info;
+  LONGS_EQUAL(LFS_ERR_NOENT, lfs_stat(&lfs, "/kv/key0", &info));
+  char dirname[16];
+  for (int i = 0; i < 4; i++) {
+    snprintf(dirname, sizeof(dirname), "/kv_shards/%02x", i);
+    LONGS_EQUAL(0, lfs_stat(&lfs, dirname, &info));
+    LONGS_EQUAL(LFS_TYPE_DIR, info.type);
+  }
+}
+
+TEST(TestKvStoreSharded, Test_MigratesFlatKeys) {
+  kv_store_deinit();
+  kv_store_init(&lfs, NULL);
+  char key[16];
+  for (int i = 0; i < 10; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    CHECK(kv_store_write(key, &i, sizeof(i)));
+  }
+  struct lfs_info info;
+  LONGS_EQUAL(0, lfs_stat(&lfs, "/kv/key0", &info));
+
+  prv_reboot();
+
+  for (int i = 0; i < 10; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    LONGS_EQUAL(1, prv_num_shards_holding(key));
+    int val;
+    uint32_t read_len;
+    CHECK(kv_store_read(key, &val, sizeof(val), &read_len));
+    LONGS_EQUAL(i, val);
+  }
+  LONGS_EQUAL(LFS_ERR_NOENT, lfs_stat(&lfs, "/kv/key0", &info));
+}
+
+TEST(TestKvStoreSharded, Test_MigratesKeysNamedLikeShards) {
+  kv_store_deinit();
+  kv_store_init(&lfs, NULL);
+  const char *keys[] = { "00", "01", "02", "03" };
+  for (int i = 0; i < 4; i++) {
+    CHECK(kv_store_write(keys[i], &i, sizeof(i)));
+  }
+
+  kv_store_deinit();
+  CHECK(kv_store_init(&lfs, s_config));
+
+  for (int i = 0; i < 4; i++) {
+    LONGS_EQUAL(1, prv_num_shards_holding(keys[i]));
+    int val;
+    uint32_t read_len;
+    CHECK(kv_store_read(keys[i], &val, sizeof(val), &read_len));
+    LONGS_EQUAL(i, val);
+  }
+}
+
+//! Writes key0..key<count - 1>, each holding its index
+static void prv_write_numbered_keys(int count) {
+  char key[16];
+  for (int i = 0; i < count; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    CHECK(kv_store_write(key, &i, sizeof(i)));
+  }
+}
+
+static void prv_check_numbered_keys(int count) {
+  char key[16];
+  for (int i = 0; i < count; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    int val;
+    uint32_t read_len;
+    CHECK(kv_store_read(key, &val, sizeof(val), &read_len));
+    LONGS_EQUAL(i, val);
+  }
+}
+
+TEST(TestKvStoreSharded, Test_MovesKeysWhenShardCountChanges) {
+  prv_write_numbered_keys(32);
+
+  sKvStoreConfig config = {};
+  config.file_num_shards = 8;
+  kv_store_deinit();
+  CHECK(kv_store_init(&lfs, &config));
+
+  prv_check_numbered_keys(32);
+  // Some keys hash to shards 4-7, and shards beyond the count are gone once
+  // they've been emptied
+  struct lfs_info info;
+  int num_upper = 0;
+  char dirname[16];
+  for (int i = 4; i < 8; i++) {
+    snprintf(dirname, sizeof(dirname), "/kv_shards/%02x", i);
+    num_upper += lfs_stat(&lfs, dirname, &info) == 0;
+  }
+  CHECK(num_upper > 0);
+
+  kv_store_deinit();
+  CHECK(kv_store_init(&lfs, s_config));
+  prv_check_numbered_keys(32);
+  for (int i = 4; i < 8; i++) {
+    snprintf(dirname, sizeof(dirname), "/kv_shards/%02x", i);
+    LONGS_EQUAL(LFS_ERR_NOENT, lfs_stat(&lfs, dirname, &info));
+  }
+}
+
+TEST(TestKvStoreSharded, Test_MovesKeysBackWhenUnsharded) {
+  prv_write_numbered_keys(10);
+
+  kv_store_deinit();
+  CHECK(kv_store_init(&lfs, NULL));
+
+  prv_check_numbered_keys(10);
+  struct lfs_info info;
+  LONGS_EQUAL(0, lfs_stat(&lfs, "/kv/key0", &info));
+  LONGS_EQUAL(LFS_ERR_NOENT, lfs_stat(&lfs, "/kv_shards", &info));
+}
+
+TEST(TestKvStoreSharded, Test_RecordsShardCount) {
+  uint16_t num_shards = 0;
+  LONGS_EQUAL(sizeof(num_shards),
+              lfs_getattr(&lfs, "/kv", 's', &num_shards, sizeof(num_shards)));
+  LONGS_EQUAL(4, num_shards);
+
+  kv_store_deinit();
+  CHECK(kv_store_init(&lfs, NULL));
+  LONGS_EQUAL(sizeof(num_shards),
+              lfs_getattr(&lfs, "/kv", 's', &num_shards, sizeof(num_shards)));
+  LONGS_EQUAL(1, num_shards);
+}
+
+TEST(TestKvStoreSharded, Test_FailsIfKeyCantBeMoved) {
+  prv_write_numbered_keys(10);
+
+  // A directory named like a key in the destination blocks the move
+  kv_store_deinit();
+  lfs_mkdir(&lfs, "/kv/key0");
+  CHECK_FALSE(kv_store_init(&lfs, NULL));
+
+  // Once it's cleared, the next boot picks the move up where it stopped
+  lfs_remove(&lfs, "/kv/key0");
+  CHECK(kv_store_init(&lfs, NULL));
+  prv_check_numbered_keys(10);
+}
+
+TEST(TestKvStoreSharded, Test_ReplaysJournalIntoShard) {
+  const uint8_t journal[] = {
+    0x01, 0x00, 0x00, 0x00,       // Key length (1)
+    0x02, 0x00, 0x00, 0x00,       // Value length (2)
+    'k', 'v', 'v',                // Key + Value
+    0x01, 0x00, 0x00, 0x00,       // Number of entries (1)
+    0x4B, 0x56, 0x4A, 0x4E,       // Magic
+  };
+  prv_write_journal(journal, sizeof(journal));
+
+  prv_reboot();
+
+  LONGS_EQUAL(1, prv_num_shards_holding("k"));
+  char buf[16];
+  uint32_t read_len;
+  CHECK(kv_store_read("k", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("vv", buf, 2);
+}
+
+static sKvStoreLogIndexEntry s_log_index[8];
+
+TEST_GROUP(TestKvStoreLog) {
+  void setup() {
+    static sKvStoreConfig config = {};
+    config.backend = kKvStoreBackend_Log;
+    config.log_index = s_log_index;
+    config.log_index_len = sizeof(s_log_index) / sizeof(s_log_index[0]);
+    s_config = &config;
+    prv_setup(s_config);
+  }
+
+  void teardown() {
+    prv_teardown();
+  }
+};
+
+KV_STORE_BACKEND_TESTS(TestKvStoreLog)
+
+static lfs_soff_t prv_log_size(void) {
+  struct lfs_info info;
+  LONGS_EQUAL(0, lfs_stat(&lfs, "/kv.log", &info));
+  return info.size;
+}
+
+TEST(TestKvStoreLog, Test_SingleFileForAllKeys) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "2", 1));
+
+  struct lfs_info info;
+  LONGS_EQUAL(LFS_ERR_NOENT, lfs_stat(&lfs, "/kv/a", &info));
+  CHECK(prv_log_size() > 0);
+}
+
+TEST(TestKvStoreLog, Test_CompactsStaleRecords) {
+  uint8_t val[64];
+  memset(val, 0x5A, sizeof(val));
+
+  // Overwrite the same key until well over a block of the log is stale
+  for (int i = 0; i < 64; i++) {
+    val[0] = (uint8_t)i;
+    CHECK(kv_store_write("key", val, sizeof(val)));
+  }
+  // Writes leave the compaction to kv_store_compact()
+  CHECK(prv_log_size() > LFS_BLOCK_SIZE * 4);
+
+  CHECK(kv_store_compact());
+  CHECK(prv_log_size() < LFS_BLOCK_SIZE);
+  prv_reboot();
+
+  uint8_t buf[64];
+  uint32_t read_len;
+  CHECK(kv_store_read("key", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(sizeof(val), read_len);
+  MEMCMP_EQUAL(val, buf, sizeof(val));
+}
+
+TEST(TestKvStoreLog, Test_AsyncProcessCompacts) {
+  uint8_t val[64] = {};
+  for (int i = 0; i < 64; i++) {
+    CHECK(kv_store_write("key", val, sizeof(val)));
+  }
+  CHECK(kv_store_async_process());
+  CHECK(prv_log_size() < LFS_BLOCK_SIZE);
+
+  // Nothing is due below the threshold
+  const lfs_soff_t size = prv_log_size();
+  CHECK(kv_store_write("key", val, sizeof(val)));
+  CHECK(kv_store_async_process());
+  CHECK(prv_log_size() > size);
+}
+
+TEST(TestKvStoreLog, Test_InitFailsWhenIndexOverflows) {
+  char key[8];
+  for (size_t i = 0; i < sizeof(s_log_index) / sizeof(s_log_index[0]); i++) {
+    snprintf(key, sizeof(key), "k%u", (unsigned)i);
+    CHECK(kv_store_write(key, "v", 1));
+  }
+  kv_store_deinit();
+
+  // A smaller index than the one the log was written with
+  sKvStoreConfig config = *s_config;
+  config.log_index_len = 4;
+  CHECK_FALSE(kv_store_init(&lfs, &config));
+
+  // Rather than reporting k4..k7 as missing, nothing is served
+  char buf[4];
+  uint32_t read_len;
+  CHECK_FALSE(kv_store_read("k0", buf, sizeof(buf), &read_len));
+  CHECK_FALSE(kv_store_write("k8", "v", 1));
+
+  kv_store_deinit();
+  CHECK(kv_store_init(&lfs, s_config));
+  CHECK(kv_store_read("k7", buf, sizeof(buf), &read_len));
+}
+
+TEST(TestKvStoreLog, Test_IndexFullRejectsBatch) {
+  char key[8];
+  for (size_t i = 0; i < sizeof(s_log_index) / sizeof(s_log_index[0]); i++) {
+    snprintf(key, sizeof(key), "k%u", (unsigned)i);
+    CHECK(kv_store_write(key, "v", 1));
+  }
+
+  const sKvStoreBatchEntry entries[] = {
+    {"k0", "w", 1},
+    {"new", "w", 1},
+  };
+  CHECK_FALSE(kv_store_write_batch(entries, 2));
+
+  // Nothing from the batch was applied
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("k0", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("v", buf, 1);
+}
+
+TEST(TestKvStoreLog, Test_BatchCountsRepeatedKeyOnce) {
+  // One index slot left
+  char key[8];
+  for (size_t i = 0; i + 1 < sizeof(s_log_index) / sizeof(s_log_index[0]); i++) {
+    snprintf(key, sizeof(key), "k%u", (unsigned)i);
+    CHECK(kv_store_write(key, "v", 1));
+  }
+
+  const sKvStoreBatchEntry entries[] = {
+    {"new", "1", 1},
+    {"new", "2", 1},
+  };
+  CHECK(kv_store_write_batch(entries, 2));
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("new", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("2", buf, 1);
+}
+
+TEST(TestKvStoreLog, Test_DropsTornTail) {
+  CHECK(kv_store_write("a", "1", 1));
+  const lfs_soff_t good_size = prv_log_size();
+  kv_store_deinit();
+
+  // Half a record header, as if a write never finished
+  const uint8_t junk[] = {0x05, 0x00, 0x00};
+  lfs_file_open(&lfs, &file, "/kv.log", LFS_O_WRONLY | LFS_O_APPEND);
+  lfs_file_write(&lfs, &file, junk, sizeof(junk));
+  lfs_file_close(&lfs, &file);
+
+  kv_store_init(&lfs, s_config);
+  LONGS_EQUAL(good_size, prv_log_size());
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("1", buf, 1);
+}
+
+static sKvStoreCacheEntry s_cache_entries[2];
+
+static bool prv_exists_in_flash(const char *key) {
+  char fname[64];
+  snprintf(fname, sizeof(fname), "/kv/%s", key);
+  struct lfs_info info;
+  return lfs_stat(&lfs, fname, &info) == 0;
+}
+
+TEST_GROUP(TestKvStoreCache) {
+  void setup() {
+    static sKvStoreConfig config = {};
+    config.cache_entries = s_cache_entries;
+    config.num_cache_entries = sizeof(s_cache_entries) / sizeof(s_cache_entries[0]);
+    s_config = &config;
+    prv_setup(s_config);
+  }
+
+  void teardown() {
+    prv_teardown();
+  }
+};
+
+TEST(TestKvStoreCache, Test_WriteBackUntilFlush) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK_FALSE(prv_exists_in_flash("a"));
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(1, read_len);
+  MEMCMP_EQUAL("1", buf, 1);
+
+  CHECK(kv_store_flush());
+  CHECK(prv_exists_in_flash("a"));
+}
+
+TEST(TestKvStoreCache, Test_HitDoesNotTouchFlash) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_flush());
+
+  char buf[4];
+  uint32_t read_len;
+  const uint64_t reads_before = bd.stats.read_count;
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  CHECK_EQUAL(reads_before, bd.stats.read_count);
+}
+
+TEST(TestKvStoreCache, Test_RefusedBatchKeepsDirtyValue) {
+  prv_leave_journal_pending();
+  CHECK(kv_store_write("c", "3", 1));
+
+  const sKvStoreBatchEntry entries[] = {
+    {"c", "x", 1},
+    {"d", "y", 1},
+  };
+  CHECK_FALSE(kv_store_write_batch(entries, 2));
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("c", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("3", buf, 1);
+
+  prv_settle_journal();
+  CHECK(kv_store_flush());
+  CHECK(kv_store_read("c", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("3", buf, 1);
+  CHECK_FALSE(kv_store_read("d", buf, sizeof(buf), &read_len));
+}
+
+TEST(TestKvStoreCache, Test_FailedDeleteKeepsDirtyValue) {
+  CHECK(kv_store_write("c", "3", 1));
+  prv_leave_journal_pending();
+
+  CHECK_FALSE(kv_store_delete("c"));
+
+  prv_settle_journal();
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("c", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("3", buf, 1);
+  CHECK(kv_store_flush());
+  CHECK(prv_exists_in_flash("c"));
+}
+
+TEST(TestKvStoreCache, Test_StreamsDirtyValue) {
+  CHECK(kv_store_write("a", "hello", 5));
+  CHECK_FALSE(prv_exists_in_flash("a"));
+
+  uint32_t size;
+  CHECK(kv_store_size("a", &size));
+  LONGS_EQUAL(5, size);
+
+  sStreamCtx stream = {};
+  CHECK(kv_store_read_stream("a", 2, prv_stream_cb, &stream));
+  LONGS_EQUAL(3, stream.len);
+  MEMCMP_EQUAL("llo", stream.buf, 3);
+}
+
+TEST(TestKvStoreCache, Test_ForeachSeesDirtyValues) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK_FALSE(prv_exists_in_flash("a"));
+
+  sForeachCtx foreach = {};
+  foreach.stop_after_keys = UINT32_MAX;
+  CHECK(kv_store_foreach(NULL, prv_foreach_cb, &foreach));
+  LONGS_EQUAL(1, foreach.num_keys);
+  MEMCMP_EQUAL("1", foreach.val, 1);
+}
+
+TEST(TestKvStoreCache, Test_EvictsLeastRecentlyUsed) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "2", 1));
+
+  // Touch "a" so "b" becomes the eviction victim
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+
+  CHECK(kv_store_write("c", "3", 1));
+  CHECK_FALSE(prv_exists_in_flash("a"));
+  CHECK(prv_exists_in_flash("b"));
+  CHECK_FALSE(prv_exists_in_flash("c"));
+
+  CHECK(kv_store_read("b", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("2", buf, 1);
+}
+
+TEST(TestKvStoreCache, Test_SizeIsNotARead) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "2", 1));
+
+  memset(s_analytics_counts, 0, sizeof(s_analytics_counts));
+  uint32_t size;
+  CHECK(kv_store_size("a", &size));
+  LONGS_EQUAL(0, s_analytics_counts[kSettingsCacheHit]);
+  LONGS_EQUAL(0, s_analytics_counts[kSettingsCacheMiss]);
+
+  // Nor does it make "a" recently used, so it's still the one evicted
+  CHECK(kv_store_write("c", "3", 1));
+  CHECK(prv_exists_in_flash("a"));
+  CHECK_FALSE(prv_exists_in_flash("b"));
+}
+
+TEST(TestKvStoreCache, Test_StreamFromCacheIsARead) {
+  CHECK(kv_store_write("a", "hello", 5));
+
+  memset(s_analytics_counts, 0, sizeof(s_analytics_counts));
+  sStreamCtx stream = {};
+  stream.stop_after = 1;
+  CHECK(kv_store_read_stream("a", 0, prv_stream_cb, &stream));
+  LONGS_EQUAL(1, stream.num_chunks);
+  LONGS_EQUAL(1, s_analytics_counts[kSettingsFileRead]);
+  LONGS_EQUAL(1, s_analytics_counts[kSettingsCacheHit]);
+}
+
+TEST(TestKvStoreCache, Test_LargeValueBypassesCache) {
+  uint8_t val[KV_STORE_CACHE_VAL_MAX_LEN + 1];
+  memset(val, 0xA5, sizeof(val));
+  CHECK(kv_store_write("big", val, sizeof(val)));
+  CHECK(prv_exists_in_flash("big"));
+}
+
+TEST(TestKvStoreCache, Test_DeleteDropsCachedValue) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_delete("a"));
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK_FALSE(kv_store_read("a", buf, sizeof(buf), &read_len));
+
+  CHECK(kv_store_flush());
+  CHECK_FALSE(prv_exists_in_flash("a"));
+}
+
+static uint8_t s_filter_buf[32];
+
+TEST_GROUP(TestKvStoreFilter) {
+  void setup() {
+    static sKvStoreConfig config = {};
+    config.filter_buf = s_filter_buf;
+    config.filter_size_bytes = sizeof(s_filter_buf);
+    s_config = &config;
+    prv_setup(s_config);
+  }
+
+  void teardown() {
+    prv_teardown();
+  }
+};
+
+TEST(TestKvStoreFilter, Test_MissingKeySkipsFlash) {
+  CHECK(kv_store_write("present", "1", 1));
+
+  char buf[4];
+  uint32_t read_len;
+  const uint64_t reads_before = bd.stats.read_count;
+  CHECK_FALSE(kv_store_read("missing", buf, sizeof(buf), &read_len));
+  CHECK_EQUAL(reads_before, bd.stats.read_count);
+
+  CHECK(kv_store_read("present", buf, sizeof(buf), &read_len));
+}
+
+TEST(TestKvStoreFilter, Test_BuiltFromExistingKeys) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "2", 1));
+
+  prv_reboot();
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  CHECK(kv_store_read("b", buf, sizeof(buf), &read_len));
+
+  sKvStoreFilterStats stats;
+  CHECK(kv_store_filter_stats(&stats));
+  LONGS_EQUAL(2, stats.num_keys);
+}
+
+TEST(TestKvStoreFilter, Test_ReportsFalsePositiveRate) {
+  sKvStoreFilterStats stats;
+  CHECK(kv_store_filter_stats(&stats));
+  LONGS_EQUAL(sizeof(s_filter_buf), stats.size_bytes);
+  LONGS_EQUAL(KV_STORE_FILTER_DEFAULT_NUM_HASHES, stats.num_hashes);
+  LONGS_EQUAL(0, stats.fp_rate_ppm);
+
+  char key[8];
+  for (int i = 0; i < 20; i++) {
+    snprintf(key, sizeof(key), "k%d", i);
+    CHECK(kv_store_write(key, "v", 1));
+  }
+
+  // 256 bits for 20 keys is ~13 bits per key, a little over 1%
+  CHECK(kv_store_filter_stats(&stats));
+  LONGS_EQUAL(20, stats.num_keys);
+  CHECK(stats.fp_rate_ppm > 0);
+  CHECK(stats.fp_rate_ppm < 50000);
+}
+
+TEST(TestKvStoreFilter, Test_CompactRebuildsAfterDeletes) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "1", 1));
+  CHECK(kv_store_write("c", "1", 1));
+  CHECK(kv_store_delete("a"));
+  CHECK(kv_store_delete("b"));
+
+  sKvStoreFilterStats stats;
+  CHECK(kv_store_filter_stats(&stats));
+  LONGS_EQUAL(2, stats.num_stale);
+
+  CHECK(kv_store_compact());
+  CHECK(kv_store_filter_stats(&stats));
+  LONGS_EQUAL(1, stats.num_keys);
+  LONGS_EQUAL(0, stats.num_stale);
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("c", buf, sizeof(buf), &read_len));
+}
+
+TEST(TestKvStoreFilter, Test_RewritesDontCountAsKeys) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "1", 1));
+  CHECK(kv_store_write("c", "1", 1));
+  for (int i = 0; i < 10; i++) {
+    CHECK(kv_store_write("c", &i, sizeof(i)));
+  }
+  CHECK(kv_store_delete("a"));
+  CHECK(kv_store_delete("b"));
+
+  sKvStoreFilterStats stats;
+  CHECK(kv_store_filter_stats(&stats));
+  LONGS_EQUAL(3, stats.num_keys);
+
+  // Two of three keys are gone, however often the third was written
+  CHECK(kv_store_compact());
+  CHECK(kv_store_filter_stats(&stats));
+  LONGS_EQUAL(1, stats.num_keys);
+  LONGS_EQUAL(0, stats.num_stale);
+}
+
+TEST_GROUP(TestKvStoreSkipUnchanged) {
+  void setup() {
+    static sKvStoreConfig config = {};
+    config.skip_unchanged_writes = true;
+    s_config = &config;
+    prv_setup(s_config);
+  }
+
+  void teardown() {
+    prv_teardown();
+  }
+};
+
+TEST(TestKvStoreSkipUnchanged, Test_IdenticalWriteSkipsFlash) {
+  CHECK(kv_store_write("a", "hello", 5));
+
+  const uint64_t progs_before = bd.stats.prog_count;
+  const uint64_t erases_before = bd.stats.erase_count;
+  CHECK(kv_store_write("a", "hello", 5));
+  CHECK_EQUAL(progs_before, bd.stats.prog_count);
+  CHECK_EQUAL(erases_before, bd.stats.erase_count);
+}
+
+TEST(TestKvStoreSkipUnchanged, Test_ChangedValueIsWritten) {
+  char buf[16];
+  uint32_t read_len;
+
+  CHECK(kv_store_write("a", "hello", 5));
+  CHECK(kv_store_write("a", "jello", 5));
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("jello", buf, 5);
+
+  // Same prefix, different length
+  CHECK(kv_store_write("a", "jell", 4));
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(4, read_len);
+}
+
+TEST(TestKvStoreSkipUnchanged, Test_LargeValueComparedInChunks) {
+  uint8_t val[3 * KV_STORE_STREAM_CHUNK_SIZE];
+  memset(val, 0xa5, sizeof(val));
+  CHECK(kv_store_write("big", val, sizeof(val)));
+
+  uint64_t progs_before = bd.stats.prog_count;
+  CHECK(kv_store_write("big", val, sizeof(val)));
+  CHECK_EQUAL(progs_before, bd.stats.prog_count);
+
+  // A difference in the last chunk still has to be written
+  val[sizeof(val) - 1] = 0;
+  CHECK(kv_store_write("big", val, sizeof(val)));
+  CHECK(bd.stats.prog_count > progs_before);
+
+  sStreamCtx stream = {};
+  CHECK(kv_store_read_stream("big", sizeof(val) - 1, prv_stream_cb, &stream));
+  LONGS_EQUAL(1, stream.len);
+  LONGS_EQUAL(0, stream.buf[0]);
+}
+
+TEST(TestKvStoreSkipUnchanged, Test_ComparesAgainstCache) {
+  prv_teardown();
+  static sKvStoreConfig config = {};
+  config.skip_unchanged_writes = true;
+  config.cache_entries = s_cache_entries;
+  config.num_cache_entries = sizeof(s_cache_entries) / sizeof(s_cache_entries[0]);
+  s_config = &config;
+  prv_setup(s_config);
+
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("a", "1", 1));
+
+  // The skipped write must not lose the pending dirty value
+  CHECK_FALSE(prv_exists_in_flash("a"));
+  CHECK(kv_store_flush());
+  CHECK(prv_exists_in_flash("a"));
+
+  // Once clean, comparing against the cache doesn't read flash either
+  const uint64_t reads_before = bd.stats.read_count;
+  const uint64_t progs_before = bd.stats.prog_count;
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK_EQUAL(reads_before, bd.stats.read_count);
+  CHECK_EQUAL(progs_before, bd.stats.prog_count);
+}
+
+static sKvStoreQueueEntry s_write_queue[2];
+
+// Nothing drains the queue here unless a test calls kv_store_async_process()
+TEST_GROUP(TestKvStoreQueue) {
+  void setup() {
+    static sKvStoreConfig config = {};
+    config.cache_entries = s_cache_entries;
+    config.num_cache_entries = sizeof(s_cache_entries) / sizeof(s_cache_entries[0]);
+    config.write_queue = s_write_queue;
+    config.write_queue_len = sizeof(s_write_queue) / sizeof(s_write_queue[0]);
+    s_config = &config;
+    prv_setup(s_config);
+  }
+
+  void teardown() {
+    prv_teardown();
+  }
+};
+
+TEST(TestKvStoreQueue, Test_ReadsSeeQueuedValue) {
+  CHECK(kv_store_write("a", "hello", 5));
+  CHECK_FALSE(prv_exists_in_flash("a"));
+
+  char buf[8];
+  uint32_t read_len;
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(5, read_len);
+  MEMCMP_EQUAL("hello", buf, 5);
+
+  uint32_t size;
+  CHECK(kv_store_size("a", &size));
+  LONGS_EQUAL(5, size);
+
+  sStreamCtx stream = {};
+  CHECK(kv_store_read_stream("a", 1, prv_stream_cb, &stream));
+  MEMCMP_EQUAL("ello", stream.buf, 4);
+
+  CHECK(kv_store_async_process());
+  CHECK(prv_exists_in_flash("a"));
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("hello", buf, 5);
+}
+
+TEST(TestKvStoreQueue, Test_OverwriteHidesCachedValue) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_async_process());
+
+  // Pulls "1" into the cache
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+
+  CHECK(kv_store_write("a", "2", 1));
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("2", buf, 1);
+
+  CHECK(kv_store_async_process());
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("2", buf, 1);
+}
+
+TEST(TestKvStoreQueue, Test_CoalescesRepeatedWrites) {
+  sBdStats before = bd_stats_snapshot();
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_async_process());
+  const sBdStats single = bd_stats_since(&before);
+
+  before = bd_stats_snapshot();
+  CHECK(kv_store_write("b", "1", 1));
+  CHECK(kv_store_write("b", "2", 1));
+  CHECK(kv_store_write("b", "3", 1));
+  CHECK(kv_store_async_process());
+  const sBdStats coalesced = bd_stats_since(&before);
+
+  CHECK_EQUAL(single.ops[kBdOp_Sync].count, coalesced.ops[kBdOp_Sync].count);
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("b", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("3", buf, 1);
+}
+
+TEST(TestKvStoreQueue, Test_FullQueueWritesSynchronously) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "2", 1));
+  CHECK(kv_store_write("c", "3", 1));
+  CHECK_FALSE(prv_exists_in_flash("a"));
+  CHECK_FALSE(prv_exists_in_flash("b"));
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("c", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("3", buf, 1);
+}
+
+TEST(TestKvStoreQueue, Test_ProcessOneWritesOldestValue) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "2", 1));
+
+  bool empty = true;
+  CHECK(kv_store_async_process_one(&empty));
+  CHECK_FALSE(empty);
+  CHECK(prv_exists_in_flash("a"));
+  CHECK_FALSE(prv_exists_in_flash("b"));
+
+  CHECK(kv_store_async_process_one(&empty));
+  CHECK(empty);
+  CHECK(prv_exists_in_flash("b"));
+
+  // Nothing left to write isn't a failure
+  CHECK(kv_store_async_process_one(&empty));
+  CHECK(empty);
+}
+
+TEST(TestKvStoreQueue, Test_TracksWhenQueuedValueIsWritten) {
+  uint32_t a_first, a_second, b_seq;
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_async_queued_seq("a", &a_first));
+  CHECK(kv_store_write("a", "2", 1));
+  CHECK(kv_store_async_queued_seq("a", &a_second));
+  CHECK(a_first != a_second);
+  CHECK(kv_store_write("b", "3", 1));
+  CHECK(kv_store_async_queued_seq("b", &b_seq));
+  CHECK(kv_store_async_pending("a", a_first));
+  CHECK(kv_store_async_pending("a", a_second));
+
+  // Both values for "a" went out in one write
+  bool empty;
+  CHECK(kv_store_async_process_one(&empty));
+  CHECK_FALSE(kv_store_async_pending("a", a_first));
+  CHECK_FALSE(kv_store_async_pending("a", a_second));
+  CHECK(kv_store_async_pending("b", b_seq));
+
+  // A new value for the key doesn't make the written ones pending again
+  uint32_t a_third;
+  CHECK(kv_store_write("a", "4", 1));
+  CHECK(kv_store_async_queued_seq("a", &a_third));
+  CHECK_FALSE(kv_store_async_pending("a", a_second));
+  CHECK(kv_store_async_pending("a", a_third));
+
+  // Written synchronously with the queue full
+  uint32_t c_seq;
+  CHECK(kv_store_write("c", "5", 1));
+  CHECK_FALSE(kv_store_async_queued_seq("c", &c_seq));
+}
+
+TEST(TestKvStoreQueue, Test_RefusedBatchKeepsQueuedValue) {
+  prv_leave_journal_pending();
+  CHECK(kv_store_write("c", "3", 1));
+
+  const sKvStoreBatchEntry entries[] = {
+    {"c", "x", 1},
+    {"d", "y", 1},
+  };
+  CHECK_FALSE(kv_store_write_batch(entries, 2));
+
+  prv_settle_journal();
+  CHECK(kv_store_async_process());
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("c", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("3", buf, 1);
+}
+
+TEST(TestKvStoreQueue, Test_DeleteDropsQueuedWrite) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_delete("a"));
+  CHECK(kv_store_async_process());
+
+  char buf[4];
+  uint32_t read_len;
+  CHECK_FALSE(kv_store_read("a", buf, sizeof(buf), &read_len));
+  CHECK_FALSE(prv_exists_in_flash("a"));
+}
+
+TEST(TestKvStoreQueue, Test_FlushDrainsQueue) {
+  CHECK(kv_store_write("a", "1", 1));
+  CHECK(kv_store_write("b", "2", 1));
+  CHECK(kv_store_flush());
+  CHECK(prv_exists_in_flash("a"));
+  CHECK(prv_exists_in_flash("b"));
+
+  // The queued values are durable, so they survive a reboot
+  prv_reboot();
+  char buf[4];
+  uint32_t read_len;
+  CHECK(kv_store_read("b", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL("2", buf, 1);
+}
+
+static sKvCompressor s_compressor;
+
+static uint32_t prv_stored_size(const char *key) {
+  char fname[64];
+  snprintf(fname, sizeof(fname), "/kv/%s", key);
+  struct lfs_info info;
+  CHECK(lfs_stat(&lfs, fname, &info) == 0);
+  return info.size;
+}
+
+//! Repetitive, like the JSON blobs compression is meant for
+static void prv_fill_compressible(uint8_t *val, uint32_t len) {
+  for (uint32_t i = 0; i < len; i++) {
+    val[i] = "{\"enabled\":true,\"period_ms\":1000}"[i % 32];
+  }
+}
+
+TEST_GROUP(TestKvStoreCompress) {
+  void setup() {
+    static sKvStoreConfig config = {};
+    config.compressor = &s_compressor;
+    config.compress_min_len = 64;
+    s_config = &config;
+    prv_setup(s_config);
+  }
+
+  void teardown() {
+    prv_teardown();
+  }
+};
+
+TEST(TestKvStoreCompress, Test_LargeValueStoredCompressed) {
+  uint8_t val[700];
+  prv_fill_compressible(val, sizeof(val));
+  CHECK(kv_store_write("blob", val, sizeof(val)));
+  CHECK(prv_stored_size("blob") < sizeof(val) / 4);
+
+  uint8_t buf[sizeof(val)];
+  uint32_t read_len;
+  CHECK(kv_store_read("blob", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(sizeof(val), read_len);
+  MEMCMP_EQUAL(val, buf, sizeof(val));
+
+  uint32_t size;
+  CHECK(kv_store_size("blob", &size));
+  LONGS_EQUAL(sizeof(val), size);
+
+  // The buffer has to fit the decoded value, not the stored one
+  CHECK_FALSE(kv_store_read("blob", buf, sizeof(val) - 1, &read_len));
+}
+
+TEST(TestKvStoreCompress, Test_StreamsFromOffset) {
+  uint8_t val[700];
+  prv_fill_compressible(val, sizeof(val));
+  for (uint32_t i = 0; i < sizeof(val); i += 50) {
+    val[i] = (uint8_t)i;
+  }
+  CHECK(kv_store_write("blob", val, sizeof(val)));
+
+  sStreamCtx stream = {};
+  CHECK(kv_store_read_stream("blob", 601, prv_stream_cb, &stream));
+  LONGS_EQUAL(sizeof(val) - 601, stream.len);
+  MEMCMP_EQUAL(&val[601], stream.buf, stream.len);
+
+  CHECK_FALSE(kv_store_read_stream("blob", sizeof(val) + 1, prv_stream_cb, &stream));
+}
+
+TEST(TestKvStoreCompress, Test_StreamsInBoundedChunks) {
+  uint8_t val[700];
+  prv_fill_compressible(val, sizeof(val));
+  CHECK(kv_store_write("blob", val, sizeof(val)));
+  CHECK(prv_stored_size("blob") < sizeof(val));
+
+  // The decoder works a whole window at a time, bigger than a stream chunk
+  sStreamCtx stream = {};
+  CHECK(kv_store_read_stream("blob", 0, prv_stream_cb, &stream));
+  LONGS_EQUAL(sizeof(val), stream.len);
+  MEMCMP_EQUAL(val, stream.buf, sizeof(val));
+  LONGS_EQUAL(KV_STORE_STREAM_CHUNK_SIZE, stream.max_chunk_len);
+
+  // Stopping early still works within a window
+  sStreamCtx stopped = {};
+  stopped.stop_after = 2;
+  CHECK(kv_store_read_stream("blob", 0, prv_stream_cb, &stopped));
+  LONGS_EQUAL(2 * KV_STORE_STREAM_CHUNK_SIZE, stopped.len);
+}
+
+TEST(TestKvStoreCompress, Test_SmallOrIncompressibleStoredRaw) {
+  uint8_t val[300];
+  uint32_t state = 1;
+  for (size_t i = 0; i < sizeof(val); i++) {
+    state = state * 1103515245 + 12345;
+    val[i] = (uint8_t)(state >> 16);
+  }
+  CHECK(kv_store_write("noise", val, sizeof(val)));
+  LONGS_EQUAL(sizeof(val), prv_stored_size("noise"));
+
+  CHECK(kv_store_write("small", "aaaaaaaa", 8));
+  LONGS_EQUAL(8, prv_stored_size("small"));
+}
+
+TEST(TestKvStoreCompress, Test_RawOverwriteClearsFlag) {
+  uint8_t val[700];
+  prv_fill_compressible(val, sizeof(val));
+  CHECK(kv_store_write("blob", val, sizeof(val)));
+  CHECK(kv_store_write("blob", "raw", 3));
+
+  char buf[8];
+  uint32_t read_len;
+  CHECK(kv_store_read("blob", buf, sizeof(buf), &read_len));
+  LONGS_EQUAL(3, read_len);
+  MEMCMP_EQUAL("raw", buf, 3);
+}
+
+TEST(TestKvStoreCompress, Test_ReadableWithoutCompressor) {
+  uint8_t val[700];
+  prv_fill_compressible(val, sizeof(val));
+  CHECK(kv_store_write("blob", val, sizeof(val)));
+
+  kv_store_deinit();
+  kv_store_init(&lfs, NULL);
+
+  uint8_t buf[sizeof(val)];
+  uint32_t read_len;
+  CHECK(kv_store_read("blob", buf, sizeof(buf), &read_len));
+  MEMCMP_EQUAL(val, buf, sizeof(val));
+
+  sForeachCtx foreach = {};
+  foreach.stop_after_keys = UINT32_MAX;
+  CHECK(kv_store_foreach(NULL, prv_foreach_cb, &foreach));
+  LONGS_EQUAL(1, foreach.num_keys);
+  LONGS_EQUAL(sizeof(val), foreach.sizes[0]);
+  MEMCMP_EQUAL(val, foreach.val, sizeof(val));
+}
+
+//
+// Flash traffic budgets. These catch changes which quietly add block device
+// operations to a kv_store call.
+//
+
+TEST_GROUP(TestKvStoreFlashCost) {
+  void setup() {
+    s_config = NULL;
+    prv_setup(s_config);
+  }
+
+  void teardown() {
+    prv_teardown();
+  }
+
+  void reinit(const sKvStoreConfig *config) {
+    prv_teardown();
+    s_config = config;
+    prv_setup(s_config);
+  }
+};
+
+TEST(TestKvStoreFlashCost, Test_ReadOnlyReads) {
+  CHECK(kv_store_write("a", "hello", 5));
+
+  char buf[8];
+  uint32_t read_len;
+  const sBdStats before = bd_stats_snapshot();
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  const sBdStats cost = bd_stats_since(&before);
+
+  CHECK(cost.ops[kBdOp_Read].count > 0);
+  CHECK_EQUAL(0, cost.ops[kBdOp_Prog].count);
+  CHECK_EQUAL(0, cost.ops[kBdOp_Erase].count);
+  CHECK_EQUAL(0, cost.ops[kBdOp_Sync].count);
+}
+
+TEST(TestKvStoreFlashCost, Test_FilteredMissAndCacheHitAreFree) {
+  static sKvStoreConfig config = {};
+  config.cache_entries = s_cache_entries;
+  config.num_cache_entries = sizeof(s_cache_entries) / sizeof(s_cache_entries[0]);
+  config.filter_buf = s_filter_buf;
+  config.filter_size_bytes = sizeof(s_filter_buf);
+  reinit(&config);
+
+  CHECK(kv_store_write("a", "1", 1));
+
+  char buf[4];
+  uint32_t read_len;
+  const sBdStats before = bd_stats_snapshot();
+  CHECK(kv_store_read("a", buf, sizeof(buf), &read_len));
+  CHECK_FALSE(kv_store_read("missing", buf, sizeof(buf), &read_len));
+  const sBdStats cost = bd_stats_since(&before);
+
+  CHECK_EQUAL(0, bd_stats_latency_us(&cost));
+  for (int i = 0; i < kBdOp_NumOps; i++) {
+    CHECK_EQUAL(0, cost.ops[i].count);
+  }
+}
+
+TEST(TestKvStoreFlashCost, Test_LogBatchSyncsLessThanSingleWrites) {
+  static sKvStoreConfig config = {};
+  config.backend = kKvStoreBackend_Log;
+  reinit(&config);
+
+  const sKvStoreBatchEntry entries[] = {
+    {"a", "1", 1}, {"b", "2", 1}, {"c", "3", 1}, {"d", "4", 1},
+  };
+  const size_t num_entries = sizeof(entries) / sizeof(entries[0]);
+
+  sBdStats before = bd_stats_snapshot();
+  for (size_t i = 0; i < num_entries; i++) {
+    CHECK(kv_store_write(entries[i].key, entries[i].val, entries[i].len));
+  }
+  const sBdStats single = bd_stats_since(&before);
+
+  before = bd_stats_snapshot();
+  CHECK(kv_store_write_batch(entries, num_entries));
+  const sBdStats batched = bd_stats_since(&before);
+
+  CHECK(batched.ops[kBdOp_Sync].count < single.ops[kBdOp_Sync].count);
+  CHECK(batched.ops[kBdOp_Prog].bytes < single.ops[kBdOp_Prog].bytes);
+}
+
+TEST(TestKvStoreFlashCost, Test_UnchangedWriteProgramsNothing) {
+  static sKvStoreConfig config = {};
+  config.skip_unchanged_writes = true;
+  reinit(&config);
+
+  CHECK(kv_store_write("a", "hello", 5));
+
+  const sBdStats before = bd_stats_snapshot();
+  CHECK(kv_store_write("a", "hello", 5));
+  const sBdStats cost = bd_stats_since(&before);
+
+  CHECK_EQUAL(0, cost.ops[kBdOp_Prog].count);
+  CHECK_EQUAL(0, cost.ops[kBdOp_Erase].count);
+}
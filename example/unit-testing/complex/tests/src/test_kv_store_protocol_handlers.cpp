@@ -12,9 +12,11 @@ extern "C" {
 
 static uint8_t s_resp_buffer[1024];
 static const size_t s_resp_buffer_len = sizeof(s_resp_buffer);
+static sProtocolResponse s_resp;
 
 TEST_GROUP(TestKvStoreProtocolHandlers) {
   void setup() {
+    protocol_response_init(&s_resp, s_resp_buffer, s_resp_buffer_len, 0);
   }
 
   void teardown() {
@@ -49,6 +51,71 @@ bool kv_store_read(
       .returnBoolValueOrDefault(true);
 }
 
+bool kv_store_size(const char *key, uint32_t *size) {
+  return mock()
+      .actualCall(__func__)
+      .withStringParameter("key", key)
+      .withOutputParameter("size", size)
+      .returnBoolValueOrDefault(false);
+}
+
+//! Value kv_store_read_stream() hands out
+static const char *s_stream_val = "0123456789";
+
+bool kv_store_read_stream(const char *key, uint32_t offset, KvStoreReadCallback cb, void *ctx) {
+  const bool found = mock()
+      .actualCall(__func__)
+      .withStringParameter("key", key)
+      .withUnsignedIntParameter("offset", offset)
+      .returnBoolValueOrDefault(true);
+  // In small pieces, like kv_store does
+  const uint32_t len = (uint32_t)strlen(s_stream_val);
+  for (uint32_t off = offset; found && off < len; off += 4) {
+    const uint32_t n = (len - off) < 4 ? (len - off) : 4;
+    if (!cb(&s_stream_val[off], n, ctx)) {
+      break;
+    }
+  }
+  return found;
+}
+
+bool kv_store_async_process_one(bool *empty) {
+  *empty = true;
+  return mock()
+      .actualCall(__func__)
+      .withOutputParameter("empty", empty)
+      .returnBoolValueOrDefault(true);
+}
+
+bool kv_store_async_queued_seq(const char *key, uint32_t *seq) {
+  return mock()
+      .actualCall(__func__)
+      .withStringParameter("key", key)
+      .withOutputParameter("seq", seq)
+      .returnBoolValueOrDefault(true);
+}
+
+bool kv_store_async_pending(const char *key, uint32_t seq) {
+  return mock()
+      .actualCall(__func__)
+      .withStringParameter("key", key)
+      .withUnsignedIntParameter("seq", seq)
+      .returnBoolValueOrDefault(false);
+}
+
+void protocol_complete(const sProtocolRequest *req, eProtocolCode rv,
+                       const sProtocolResponse *resp) {
+  mock()
+      .actualCall(__func__)
+      .withUnsignedIntParameter("id", req->id)
+      .withIntParameter("rv", rv)
+      .withMemoryBufferParameter("resp", resp->buf, protocol_response_len(resp));
+}
+
+static const uint8_t s_ack[] = { 1 };
+static const uint8_t s_nack[] = { 0 };
+static const bool s_false = false;
+
 
 TEST(TestKvStoreProtocolHandlers, Write) {
   // Key: "hello"
@@ -74,12 +141,10 @@ TEST(TestKvStoreProtocolHandlers, Write) {
                                  sizeof(kv_val_bytes))
       .withIntParameter("len", sizeof(kv_val_bytes));
 
-  size_t len = s_resp_buffer_len;
-  kv_store_write_protocol_cmd(
-      in_bytes, sizeof(in_bytes), 
-      s_resp_buffer, &len);
+  kv_store_write_protocol_cmd(in_bytes, sizeof(in_bytes), &s_resp);
 
   mock().checkExpectations();
+  LONGS_EQUAL(sizeof(out_bytes), protocol_response_len(&s_resp));
   MEMCMP_EQUAL(out_bytes, s_resp_buffer, sizeof(out_bytes));
 }
 
@@ -100,6 +165,10 @@ TEST(TestKvStoreProtocolHandlers, Read) {
       .withOutputParameterReturning("buf", out_bytes, sizeof(out_bytes))
       .withOutputParameterReturning("len_read", &out_len, sizeof(out_len))
       .andReturnValue(false);
+  mock()
+      .expectNCalls(2, "kv_store_size")
+      .withStringParameter("key", "hello")
+      .ignoreOtherParameters();
 
   mock()
       .expectOneCall("kv_store_read")
@@ -108,11 +177,312 @@ TEST(TestKvStoreProtocolHandlers, Read) {
       .withOutputParameterReturning("len_read", &out_len, sizeof(out_len))
       .andReturnValue(true);
 
-  size_t len = s_resp_buffer_len;
-  kv_store_read_protocol_cmd(
-      in_bytes, sizeof(in_bytes), 
-      s_resp_buffer, &len);
+  kv_store_read_protocol_cmd(in_bytes, sizeof(in_bytes), &s_resp);
 
   mock().checkExpectations();
+  LONGS_EQUAL(sizeof(out_bytes), protocol_response_len(&s_resp));
   MEMCMP_EQUAL(out_bytes, s_resp_buffer, sizeof(out_bytes));
 }
+
+TEST(TestKvStoreProtocolHandlers, ReadMissingKey) {
+  const uint8_t in_bytes[] = {
+      'n', 'o', 'p', 'e', '\0' // Key
+  };
+
+  mock()
+      .expectNCalls(3, "kv_store_read")
+      .withStringParameter("key", "nope")
+      .ignoreOtherParameters()
+      .andReturnValue(false);
+  mock()
+      .expectNCalls(3, "kv_store_size")
+      .withStringParameter("key", "nope")
+      .ignoreOtherParameters();
+
+  kv_store_read_protocol_cmd(in_bytes, sizeof(in_bytes), &s_resp);
+
+  mock().checkExpectations();
+  LONGS_EQUAL(0, protocol_response_len(&s_resp));
+}
+
+TEST(TestKvStoreProtocolHandlers, ReadLargerThanResponse) {
+  const uint8_t in_bytes[] = { 'k', '\0' };
+  uint8_t buf[4];
+  sProtocolResponse resp;
+  protocol_response_init(&resp, buf, sizeof(buf), 0);
+
+  // Too large for kv_store_read() into the response, so the start is streamed
+  const uint32_t size = 10;
+  mock()
+      .expectOneCall("kv_store_read")
+      .withStringParameter("key", "k")
+      .ignoreOtherParameters()
+      .andReturnValue(false);
+  mock()
+      .expectOneCall("kv_store_size")
+      .withStringParameter("key", "k")
+      .withOutputParameterReturning("size", &size, sizeof(size))
+      .andReturnValue(true);
+  mock()
+      .expectOneCall("kv_store_read_stream")
+      .withStringParameter("key", "k")
+      .withUnsignedIntParameter("offset", 0);
+
+  kv_store_read_protocol_cmd(in_bytes, sizeof(in_bytes), &resp);
+
+  mock().checkExpectations();
+  LONGS_EQUAL(4, protocol_response_len(&resp));
+  MEMCMP_EQUAL("0123", buf, 4);
+}
+
+TEST(TestKvStoreProtocolHandlers, ReadFromOffset) {
+  const uint8_t in_bytes[] = {
+      'k', '\0',                // Key
+      0x04, 0x00, 0x00, 0x00,   // Offset (4)
+  };
+
+  mock()
+      .expectOneCall("kv_store_read_stream")
+      .withStringParameter("key", "k")
+      .withUnsignedIntParameter("offset", 4);
+
+  kv_store_read_protocol_cmd(in_bytes, sizeof(in_bytes), &s_resp);
+
+  mock().checkExpectations();
+  LONGS_EQUAL(6, protocol_response_len(&s_resp));
+  MEMCMP_EQUAL("456789", s_resp_buffer, 6);
+}
+
+TEST(TestKvStoreProtocolHandlers, WriteFailure) {
+  const uint8_t in_bytes[] = { 'k', '\0', 'v' };
+
+  mock()
+      .expectOneCall("kv_store_write")
+      .ignoreOtherParameters()
+      .andReturnValue(false);
+
+  kv_store_write_protocol_cmd(in_bytes, sizeof(in_bytes), &s_resp);
+
+  mock().checkExpectations();
+  LONGS_EQUAL(sizeof(s_nack), protocol_response_len(&s_resp));
+  MEMCMP_EQUAL(s_nack, s_resp_buffer, sizeof(s_nack));
+}
+
+//! Expects `key` to be queued under `seq` by the next async write
+static void prv_expect_queued(const char *key, const uint32_t *seq) {
+  mock().expectOneCall("kv_store_write").withStringParameter("key", key).ignoreOtherParameters();
+  mock()
+      .expectOneCall("kv_store_async_queued_seq")
+      .withStringParameter("key", key)
+      .withOutputParameterReturning("seq", seq, sizeof(*seq));
+}
+
+TEST(TestKvStoreProtocolHandlers, AsyncWrite) {
+  const uint8_t in_bytes[] = {
+      'h', 'e', 'l', 'l', 'o', '\0', // Key
+      'w', 'o', 'r', 'l', 'd'        // Value
+  };
+  sProtocolRequest req = {};
+  req.id = 7;
+  const uint32_t seq = 5;
+
+  // Handed to kv_store, which queues it, and acked once it's flushed
+  mock()
+      .expectOneCall("kv_store_write")
+      .withStringParameter("key", "hello")
+      .withMemoryBufferParameter("val", &in_bytes[6], 5)
+      .withIntParameter("len", 5);
+  mock()
+      .expectOneCall("kv_store_async_queued_seq")
+      .withStringParameter("key", "hello")
+      .withOutputParameterReturning("seq", &seq, sizeof(seq));
+  CHECK_EQUAL(kProtocolCode_Pending,
+              kv_store_write_protocol_async_cmd(&req, in_bytes, sizeof(in_bytes), &s_resp));
+  mock().checkExpectations();
+
+  // Not acked while its value is still queued
+  mock().expectOneCall("kv_store_async_process_one").ignoreOtherParameters();
+  mock()
+      .expectOneCall("kv_store_async_pending")
+      .withStringParameter("key", "hello")
+      .withUnsignedIntParameter("seq", seq)
+      .andReturnValue(true);
+  CHECK_TRUE(kv_store_protocol_process());
+  mock().checkExpectations();
+
+  mock().expectOneCall("kv_store_async_process_one").ignoreOtherParameters();
+  mock()
+      .expectOneCall("kv_store_async_pending")
+      .withStringParameter("key", "hello")
+      .withUnsignedIntParameter("seq", seq);
+  mock()
+      .expectOneCall("protocol_complete")
+      .withUnsignedIntParameter("id", 7)
+      .withIntParameter("rv", kProtocolCode_Ok)
+      .withMemoryBufferParameter("resp", s_ack, sizeof(s_ack));
+  CHECK_TRUE(kv_store_protocol_process());
+  CHECK_FALSE(kv_store_protocol_process());
+  mock().checkExpectations();
+}
+
+TEST(TestKvStoreProtocolHandlers, AsyncWriteNotQueued) {
+  const uint8_t in_bytes[] = { 'k', '\0', 'v' };
+  sProtocolRequest req = {};
+
+  // kv_store wrote it straight to flash, e.g. because the queue was full
+  mock().expectOneCall("kv_store_write").ignoreOtherParameters();
+  mock()
+      .expectOneCall("kv_store_async_queued_seq")
+      .ignoreOtherParameters()
+      .andReturnValue(false);
+  CHECK_EQUAL(kProtocolCode_Ok,
+              kv_store_write_protocol_async_cmd(&req, in_bytes, sizeof(in_bytes), &s_resp));
+  mock().checkExpectations();
+  LONGS_EQUAL(sizeof(s_ack), protocol_response_len(&s_resp));
+  MEMCMP_EQUAL(s_ack, s_resp_buffer, sizeof(s_ack));
+
+  CHECK_FALSE(kv_store_protocol_process());
+}
+
+TEST(TestKvStoreProtocolHandlers, AsyncWriteRefused) {
+  const uint8_t in_bytes[] = { 'k', '\0', 'v' };
+  sProtocolRequest req = {};
+
+  mock()
+      .expectOneCall("kv_store_write")
+      .ignoreOtherParameters()
+      .andReturnValue(false);
+  CHECK_EQUAL(kProtocolCode_Ok,
+              kv_store_write_protocol_async_cmd(&req, in_bytes, sizeof(in_bytes), &s_resp));
+  mock().checkExpectations();
+  LONGS_EQUAL(sizeof(s_nack), protocol_response_len(&s_resp));
+  MEMCMP_EQUAL(s_nack, s_resp_buffer, sizeof(s_nack));
+
+  // Nothing left to ack
+  CHECK_FALSE(kv_store_protocol_process());
+}
+
+TEST(TestKvStoreProtocolHandlers, AsyncWritesAckedSeparately) {
+  const uint8_t a_bytes[] = { 'a', '\0', '1' };
+  const uint8_t b_bytes[] = { 'b', '\0', '2' };
+  sProtocolRequest req = {};
+  const uint32_t a_seq = 1;
+  const uint32_t b_seq = 2;
+
+  prv_expect_queued("a", &a_seq);
+  req.id = 1;
+  kv_store_write_protocol_async_cmd(&req, a_bytes, sizeof(a_bytes), &s_resp);
+  prv_expect_queued("b", &b_seq);
+  req.id = 2;
+  kv_store_write_protocol_async_cmd(&req, b_bytes, sizeof(b_bytes), &s_resp);
+  mock().checkExpectations();
+
+  // Only the write whose value was flushed is acked
+  mock().expectOneCall("kv_store_async_process_one").ignoreOtherParameters();
+  mock()
+      .expectOneCall("kv_store_async_pending")
+      .withStringParameter("key", "a")
+      .withUnsignedIntParameter("seq", a_seq);
+  mock()
+      .expectOneCall("kv_store_async_pending")
+      .withStringParameter("key", "b")
+      .withUnsignedIntParameter("seq", b_seq)
+      .andReturnValue(true);
+  mock()
+      .expectOneCall("protocol_complete")
+      .withUnsignedIntParameter("id", 1)
+      .withIntParameter("rv", kProtocolCode_Ok)
+      .withMemoryBufferParameter("resp", s_ack, sizeof(s_ack));
+  CHECK_TRUE(kv_store_protocol_process());
+  mock().checkExpectations();
+
+  mock().expectOneCall("kv_store_async_process_one").ignoreOtherParameters();
+  mock()
+      .expectOneCall("kv_store_async_pending")
+      .withStringParameter("key", "b")
+      .withUnsignedIntParameter("seq", b_seq);
+  mock()
+      .expectOneCall("protocol_complete")
+      .withUnsignedIntParameter("id", 2)
+      .withIntParameter("rv", kProtocolCode_Ok)
+      .withMemoryBufferParameter("resp", s_ack, sizeof(s_ack));
+  CHECK_TRUE(kv_store_protocol_process());
+  mock().checkExpectations();
+}
+
+TEST(TestKvStoreProtocolHandlers, AsyncWriteFlushFails) {
+  const uint8_t in_bytes[] = { 'k', '\0', 'v' };
+  sProtocolRequest req = {};
+  req.id = 3;
+  const uint32_t seq = 9;
+
+  prv_expect_queued("k", &seq);
+  kv_store_write_protocol_async_cmd(&req, in_bytes, sizeof(in_bytes), &s_resp);
+
+  // kv_store keeps the value and retries it, so there's no NACK to send
+  mock()
+      .expectOneCall("kv_store_async_process_one")
+      .withOutputParameterReturning("empty", &s_false, sizeof(s_false))
+      .andReturnValue(false);
+  mock()
+      .expectOneCall("kv_store_async_pending")
+      .withStringParameter("key", "k")
+      .withUnsignedIntParameter("seq", seq)
+      .andReturnValue(true);
+  CHECK_TRUE(kv_store_protocol_process());
+  mock().checkExpectations();
+
+  // Acked once the retry gets it out
+  mock().expectOneCall("kv_store_async_process_one").ignoreOtherParameters();
+  mock().expectOneCall("kv_store_async_pending").ignoreOtherParameters();
+  mock()
+      .expectOneCall("protocol_complete")
+      .withUnsignedIntParameter("id", 3)
+      .withIntParameter("rv", kProtocolCode_Ok)
+      .withMemoryBufferParameter("resp", s_ack, sizeof(s_ack));
+  CHECK_TRUE(kv_store_protocol_process());
+  mock().checkExpectations();
+}
+
+TEST(TestKvStoreProtocolHandlers, AsyncWriteBusy) {
+  const uint8_t in_bytes[] = { 'k', '\0', 'v' };
+  sProtocolRequest req = {};
+
+  mock()
+      .expectNCalls(KV_STORE_PROTOCOL_MAX_PENDING, "kv_store_write")
+      .ignoreOtherParameters();
+  mock()
+      .expectNCalls(KV_STORE_PROTOCOL_MAX_PENDING, "kv_store_async_queued_seq")
+      .ignoreOtherParameters();
+  for (req.id = 0; req.id < KV_STORE_PROTOCOL_MAX_PENDING; req.id++) {
+    CHECK_EQUAL(kProtocolCode_Pending,
+                kv_store_write_protocol_async_cmd(&req, in_bytes, sizeof(in_bytes), &s_resp));
+  }
+
+  // Turned away without writing, rather than flushing from inside the handler
+  CHECK_EQUAL(kProtocolCode_Busy,
+              kv_store_write_protocol_async_cmd(&req, in_bytes, sizeof(in_bytes), &s_resp));
+  LONGS_EQUAL(0, protocol_response_len(&s_resp));
+  mock().checkExpectations();
+
+  mock().expectOneCall("kv_store_async_process_one").ignoreOtherParameters();
+  mock()
+      .expectNCalls(KV_STORE_PROTOCOL_MAX_PENDING, "kv_store_async_pending")
+      .ignoreOtherParameters();
+  mock()
+      .expectNCalls(KV_STORE_PROTOCOL_MAX_PENDING, "protocol_complete")
+      .ignoreOtherParameters();
+  CHECK_TRUE(kv_store_protocol_process());
+  mock().checkExpectations();
+
+  // There's room again
+  mock().expectOneCall("kv_store_write").ignoreOtherParameters();
+  mock().expectOneCall("kv_store_async_queued_seq").ignoreOtherParameters();
+  CHECK_EQUAL(kProtocolCode_Pending,
+              kv_store_write_protocol_async_cmd(&req, in_bytes, sizeof(in_bytes), &s_resp));
+  mock().expectOneCall("kv_store_async_process_one").ignoreOtherParameters();
+  mock().expectOneCall("kv_store_async_pending").ignoreOtherParameters();
+  mock().expectOneCall("protocol_complete").ignoreOtherParameters();
+  CHECK_TRUE(kv_store_protocol_process());
+  mock().checkExpectations();
+}
@@ -8,7 +8,6 @@ extern "C" {
   #include <unistd.h>
 
   #include "lfs.h"
-  #include "emubd/lfs_emubd.h"
 
   #include "defs/lfs_default_config.h"
 }
@@ -17,11 +16,11 @@ TEST_GROUP(TestFiles) {
   void setup() {
     const char *d = "blocks_test_files";
     unlink(d);
-    lfs_emubd_create(&cfg, d);
+    lfs_test_bd_create(d);
   }
 
   void teardown() {
-    lfs_emubd_destroy(&cfg);
+    lfs_test_bd_destroy();
   }
 };
 
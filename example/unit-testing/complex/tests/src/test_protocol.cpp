@@ -7,14 +7,14 @@ extern "C" {
 
   #include "protocol/protocol.h"
   #include "protocol/registry.h"
+  #include "protocol/stats.h"
 }
 
 
 static uint8_t s_resp_buffer[1024];
 static const size_t s_resp_buffer_len = sizeof(s_resp_buffer);
 
-static void prv_command_hello(const uint8_t *buffer, size_t len,
-    uint8_t *resp_buffer, size_t *resp_len) {
+static void prv_command_hello(const uint8_t *buffer, size_t len, sProtocolResponse *resp) {
 
   mock()
       .actualCall(__func__)
@@ -23,12 +23,56 @@ static void prv_command_hello(const uint8_t *buffer, size_t len,
   // Ignore resp buffer, nothing to check
 }
 
+//! Remembers where its payload was, to check the parser doesn't copy it
+static const uint8_t *s_echo_payload;
+
+//! Fake clock, which the echo command moves forward by s_echo_ticks
+static uint64_t s_now;
+static uint64_t s_echo_ticks;
+
+static uint64_t prv_fake_clock(void) {
+  return s_now;
+}
+
+static void prv_command_echo(const uint8_t *buffer, size_t len, sProtocolResponse *resp) {
+  s_echo_payload = buffer;
+  s_now += s_echo_ticks;
+  protocol_response_write(resp, buffer, len);
+}
+
+//! Mixes copied bytes with a reference to memory it doesn't own
+static void prv_command_quote(const uint8_t *buffer, size_t len, sProtocolResponse *resp) {
+  static const char s_text[] = "hello";
+  protocol_response_write(resp, "<", 1);
+  protocol_response_ref(resp, s_text, strlen(s_text));
+  protocol_response_write(resp, ">", 1);
+}
+
+//! Answers at once when called synchronously, and otherwise leaves the
+//! request in s_pending_req for the test to complete
+static sProtocolRequest s_pending_req;
+
+static void prv_command_slow(const uint8_t *buffer, size_t len, sProtocolResponse *resp) {
+  protocol_response_write(resp, "sync", 4);
+}
+
+static eProtocolCode prv_command_slow_async(const sProtocolRequest *req, const uint8_t *buffer,
+                                            size_t len, sProtocolResponse *resp) {
+  s_pending_req = *req;
+  return kProtocolCode_Pending;
+}
+
 static const sProtocolCommand s_protocol_commands[] = {
   {1234, prv_command_hello},
+  {1236, prv_command_echo},
+  {1238, prv_command_quote},
+  {1240, prv_command_slow, prv_command_slow_async},
+  {PROTOCOL_BATCH_CODE, protocol_batch_cmd},
+  {PROTOCOL_STATS_CODE, protocol_stats_cmd},
 };
 
 const sProtocolCommand *const g_protocol_commands = s_protocol_commands;
-const size_t g_num_protocol_commands = 1;
+const size_t g_num_protocol_commands = 6;
 
 
 TEST_GROUP(TestProtocolParser) {
@@ -69,6 +113,42 @@ TEST(TestProtocolParser, Hello) {
   CHECK_EQUAL(kProtocolCode_Ok, rv);
 }
 
+TEST(TestProtocolParser, FlattensReferencedResponse) {
+  const uint8_t in_bytes[] = {
+      0xD6, 0x04, 0x00, 0x00, // Code (1238)
+      0x00, 0x00, 0x00, 0x00, // Payload Size (0)
+  };
+  size_t len = s_resp_buffer_len;
+  eProtocolCode rv = protocol_handle(in_bytes, sizeof(in_bytes), s_resp_buffer, &len);
+  CHECK_EQUAL(kProtocolCode_Ok, rv);
+  LONGS_EQUAL(7, len);
+  MEMCMP_EQUAL("<hello>", s_resp_buffer, 7);
+}
+
+TEST(TestProtocolParser, PayloadSizeMismatch) {
+  const uint8_t in_bytes[] = {
+      0xD2, 0x04, 0x00, 0x00, // Code (1234)
+      0x08, 0x00, 0x00, 0x00, // Payload Size (8)
+      0xFF, 0xFF, 0xFF, 0xFF, // Only 4 bytes of payload
+  };
+  size_t len = s_resp_buffer_len;
+  eProtocolCode rv = protocol_handle(in_bytes, sizeof(in_bytes), s_resp_buffer, &len);
+  CHECK_EQUAL(kProtocolCode_MalformedMsg, rv);
+}
+
+TEST(TestProtocolParser, AsyncCommandAnswersInline) {
+  const uint8_t in_bytes[] = {
+      0xD8, 0x04, 0x00, 0x00, // Code (1240)
+      0x00, 0x00, 0x00, 0x00, // Payload Size (0)
+  };
+  // protocol_handle() can't leave a request pending, so the sync handler runs
+  size_t len = s_resp_buffer_len;
+  eProtocolCode rv = protocol_handle(in_bytes, sizeof(in_bytes), s_resp_buffer, &len);
+  CHECK_EQUAL(kProtocolCode_Ok, rv);
+  LONGS_EQUAL(4, len);
+  MEMCMP_EQUAL("sync", s_resp_buffer, 4);
+}
+
 TEST(TestProtocolParser, MessageTooShort) {
   const uint8_t stream[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
   size_t len = s_resp_buffer_len;
@@ -82,3 +162,494 @@ TEST(TestProtocolParser, NullMessageData) {
   eProtocolCode rv = protocol_handle(NULL, 0, s_resp_buffer, &len);
   CHECK_EQUAL(kProtocolCode_MalformedMsg, rv);
 }
+
+TEST(TestProtocolParser, UnknownCommand) {
+  const uint8_t in_bytes[] = {
+      0xD3, 0x04, 0x00, 0x00, // Code (1235)
+      0x00, 0x00, 0x00, 0x00, // Payload Size (0)
+  };
+  size_t len = s_resp_buffer_len;
+  eProtocolCode rv = protocol_handle(in_bytes, sizeof(in_bytes), s_resp_buffer, &len);
+  CHECK_EQUAL(kProtocolCode_CommandNotFound, rv);
+}
+
+TEST(TestProtocolParser, RegistryFind) {
+  const sProtocolCommand commands[] = {
+    {10, prv_command_hello},
+    {20, prv_command_hello},
+    {30, prv_command_hello},
+    {40, prv_command_hello},
+    {50, prv_command_hello},
+  };
+  const size_t num_commands = sizeof(commands) / sizeof(commands[0]);
+
+  for (size_t i = 0; i < num_commands; i++) {
+    POINTERS_EQUAL(&commands[i], protocol_registry_find(commands, num_commands, commands[i].code));
+  }
+
+  // Below, between and above the entries
+  POINTERS_EQUAL(NULL, protocol_registry_find(commands, num_commands, 0));
+  POINTERS_EQUAL(NULL, protocol_registry_find(commands, num_commands, 35));
+  POINTERS_EQUAL(NULL, protocol_registry_find(commands, num_commands, 0xFFFFFFFF));
+  POINTERS_EQUAL(NULL, protocol_registry_find(commands, 0, 10));
+}
+
+TEST(TestProtocolParser, RegistrySorted) {
+  const sProtocolCommand sorted[] = {
+    {10, prv_command_hello},
+    {20, prv_command_hello},
+  };
+  const sProtocolCommand unsorted[] = {
+    {20, prv_command_hello},
+    {10, prv_command_hello},
+  };
+  const sProtocolCommand duplicate[] = {
+    {10, prv_command_hello},
+    {10, prv_command_hello},
+  };
+  CHECK_TRUE(protocol_registry_sorted(sorted, 2));
+  CHECK_FALSE(protocol_registry_sorted(unsorted, 2));
+  CHECK_FALSE(protocol_registry_sorted(duplicate, 2));
+  CHECK_TRUE(protocol_registry_sorted(sorted, 0));
+
+  // This file's table, which the tests above dispatch through
+  CHECK_TRUE(protocol_registry_sorted(g_protocol_commands, g_num_protocol_commands));
+  POINTERS_EQUAL(&s_protocol_commands[1], protocol_command_find(1236));
+  POINTERS_EQUAL(NULL, protocol_command_find(1235));
+}
+
+//
+// protocol_feed()
+//
+
+typedef struct {
+  uint32_t request_ids[8];
+  uint32_t codes[8];
+  eProtocolCode rvs[8];
+  uint8_t resps[8][16];
+  size_t resp_lens[8];
+  size_t num_frames;
+} sFeedResult;
+
+static void prv_feed_cb(uint32_t request_id, uint32_t code, eProtocolCode rv,
+                        const sProtocolResponse *resp, void *ctx) {
+  sFeedResult *result = (sFeedResult *)ctx;
+  CHECK(result->num_frames < 8);
+  CHECK(protocol_response_len(resp) <= sizeof(result->resps[0]));
+  result->request_ids[result->num_frames] = request_id;
+  result->codes[result->num_frames] = code;
+  result->rvs[result->num_frames] = rv;
+  result->resp_lens[result->num_frames] =
+      protocol_response_copy(resp, result->resps[result->num_frames], sizeof(result->resps[0]));
+  result->num_frames++;
+}
+
+static const uint8_t s_echo_frames[] = {
+    0xD4, 0x04, 0x00, 0x00, // Code (1236)
+    0x03, 0x00, 0x00, 0x00, // Payload Size (3)
+    'a', 'b', 'c',
+    0xD4, 0x04, 0x00, 0x00, // Code (1236)
+    0x00, 0x00, 0x00, 0x00, // Payload Size (0)
+    0xD4, 0x04, 0x00, 0x00, // Code (1236)
+    0x05, 0x00, 0x00, 0x00, // Payload Size (5)
+    'h', 'e', 'l', 'l', 'o',
+};
+
+static void prv_check_echo_frames(const sFeedResult *result) {
+  LONGS_EQUAL(3, result->num_frames);
+  for (size_t i = 0; i < 3; i++) {
+    LONGS_EQUAL(i, result->request_ids[i]);
+    LONGS_EQUAL(1236, result->codes[i]);
+    CHECK_EQUAL(kProtocolCode_Ok, result->rvs[i]);
+  }
+  LONGS_EQUAL(3, result->resp_lens[0]);
+  MEMCMP_EQUAL("abc", result->resps[0], 3);
+  LONGS_EQUAL(0, result->resp_lens[1]);
+  LONGS_EQUAL(5, result->resp_lens[2]);
+  MEMCMP_EQUAL("hello", result->resps[2], 5);
+}
+
+static uint8_t s_frame_buf[8];
+static sFeedResult s_feed_result;
+static sProtocolParser s_parser;
+
+TEST_GROUP(TestProtocolFeed) {
+  void setup() {
+    memset(&s_feed_result, 0, sizeof(s_feed_result));
+    sProtocolParserConfig config = {};
+    config.frame_buf = s_frame_buf;
+    config.frame_buf_len = sizeof(s_frame_buf);
+    config.resp_buf = s_resp_buffer;
+    config.resp_buf_len = s_resp_buffer_len;
+    config.cb = prv_feed_cb;
+    config.ctx = &s_feed_result;
+    protocol_parser_init(&s_parser, &config);
+  }
+
+  void teardown() {
+    mock().checkExpectations();
+    mock().clear();
+  }
+};
+
+TEST(TestProtocolFeed, PipelinedFramesInOneFeed) {
+  LONGS_EQUAL(3, protocol_feed(&s_parser, s_echo_frames, sizeof(s_echo_frames)));
+  prv_check_echo_frames(&s_feed_result);
+
+  // The last payload was handed over straight from the input
+  POINTERS_EQUAL(&s_echo_frames[sizeof(s_echo_frames) - 5], s_echo_payload);
+}
+
+TEST(TestProtocolFeed, OneByteAtATime) {
+  size_t num_frames = 0;
+  for (size_t i = 0; i < sizeof(s_echo_frames); i++) {
+    num_frames += protocol_feed(&s_parser, &s_echo_frames[i], 1);
+  }
+  LONGS_EQUAL(3, num_frames);
+  prv_check_echo_frames(&s_feed_result);
+
+  // Split payloads are gathered in the frame buffer
+  POINTERS_EQUAL(s_frame_buf, s_echo_payload);
+}
+
+TEST(TestProtocolFeed, EverySplitPoint) {
+  for (size_t split = 0; split <= sizeof(s_echo_frames); split++) {
+    setup();
+    protocol_feed(&s_parser, s_echo_frames, split);
+    protocol_feed(&s_parser, &s_echo_frames[split], sizeof(s_echo_frames) - split);
+    prv_check_echo_frames(&s_feed_result);
+  }
+}
+
+TEST(TestProtocolFeed, SkipsOversizedPayload) {
+  const uint8_t stream[] = {
+      0xD4, 0x04, 0x00, 0x00, // Code (1236)
+      0x09, 0x00, 0x00, 0x00, // Payload Size (9), larger than the frame buffer
+      1, 2, 3, 4, 5, 6, 7, 8, 9,
+      0xD4, 0x04, 0x00, 0x00, // Code (1236)
+      0x02, 0x00, 0x00, 0x00, // Payload Size (2)
+      'o', 'k',
+  };
+  LONGS_EQUAL(2, protocol_feed(&s_parser, stream, sizeof(stream)));
+
+  CHECK_EQUAL(kProtocolCode_MalformedMsg, s_feed_result.rvs[0]);
+  LONGS_EQUAL(0, s_feed_result.resp_lens[0]);
+  CHECK_EQUAL(kProtocolCode_Ok, s_feed_result.rvs[1]);
+  MEMCMP_EQUAL("ok", s_feed_result.resps[1], 2);
+}
+
+TEST(TestProtocolFeed, UnknownCommand) {
+  const uint8_t stream[] = {
+      0xD3, 0x04, 0x00, 0x00, // Code (1235)
+      0x01, 0x00, 0x00, 0x00, // Payload Size (1)
+      0x00,
+  };
+  LONGS_EQUAL(1, protocol_feed(&s_parser, stream, sizeof(stream)));
+  LONGS_EQUAL(1235, s_feed_result.codes[0]);
+  CHECK_EQUAL(kProtocolCode_CommandNotFound, s_feed_result.rvs[0]);
+}
+
+static const uint8_t s_slow_then_echo_frames[] = {
+    0xD8, 0x04, 0x00, 0x00, // Code (1240)
+    0x01, 0x00, 0x00, 0x00, // Payload Size (1)
+    'x',
+    0xD4, 0x04, 0x00, 0x00, // Code (1236)
+    0x03, 0x00, 0x00, 0x00, // Payload Size (3)
+    'a', 'b', 'c',
+};
+
+TEST(TestProtocolFeed, PendingRequestCompletesOutOfOrder) {
+  LONGS_EQUAL(2, protocol_feed(&s_parser, s_slow_then_echo_frames,
+                               sizeof(s_slow_then_echo_frames)));
+
+  // The echo behind the pending request is answered straight away
+  LONGS_EQUAL(1, s_feed_result.num_frames);
+  LONGS_EQUAL(1, s_feed_result.request_ids[0]);
+  LONGS_EQUAL(1236, s_feed_result.codes[0]);
+  LONGS_EQUAL(0, s_pending_req.id);
+  LONGS_EQUAL(1240, s_pending_req.code);
+
+  uint8_t buf[8];
+  sProtocolResponse resp;
+  protocol_response_init(&resp, buf, sizeof(buf), 0);
+  protocol_response_write(&resp, "done", 4);
+  protocol_complete(&s_pending_req, kProtocolCode_Ok, &resp);
+
+  LONGS_EQUAL(2, s_feed_result.num_frames);
+  LONGS_EQUAL(0, s_feed_result.request_ids[1]);
+  LONGS_EQUAL(1240, s_feed_result.codes[1]);
+  CHECK_EQUAL(kProtocolCode_Ok, s_feed_result.rvs[1]);
+  LONGS_EQUAL(4, s_feed_result.resp_lens[1]);
+  MEMCMP_EQUAL("done", s_feed_result.resps[1], 4);
+
+  // Request IDs keep counting across feeds
+  protocol_feed(&s_parser, s_echo_frames, sizeof(s_echo_frames));
+  LONGS_EQUAL(2, s_feed_result.request_ids[2]);
+}
+
+TEST(TestProtocolFeed, CompleteWithEmptyResponse) {
+  protocol_feed(&s_parser, s_slow_then_echo_frames, sizeof(s_slow_then_echo_frames));
+  protocol_complete(&s_pending_req, kProtocolCode_MalformedMsg, NULL);
+
+  LONGS_EQUAL(2, s_feed_result.num_frames);
+  CHECK_EQUAL(kProtocolCode_MalformedMsg, s_feed_result.rvs[1]);
+  LONGS_EQUAL(0, s_feed_result.resp_lens[1]);
+}
+
+//
+// Batches
+//
+
+typedef struct {
+  uint8_t buf[128];
+  size_t len;
+} sBatchMsg;
+
+static void prv_put_u32(sBatchMsg *msg, uint32_t v) {
+  memcpy(&msg->buf[msg->len], &v, sizeof(v));
+  msg->len += sizeof(v);
+}
+
+//! Starts a batch frame. The payload size is patched in by prv_batch_end().
+static void prv_batch_begin(sBatchMsg *msg, uint32_t num_items) {
+  msg->len = 0;
+  prv_put_u32(msg, PROTOCOL_BATCH_CODE);
+  prv_put_u32(msg, 0);
+  prv_put_u32(msg, num_items);
+}
+
+static void prv_batch_add(sBatchMsg *msg, uint32_t code, const char *payload) {
+  const uint32_t len = (uint32_t)strlen(payload);
+  prv_put_u32(msg, code);
+  prv_put_u32(msg, len);
+  memcpy(&msg->buf[msg->len], payload, len);
+  msg->len += len;
+}
+
+static void prv_batch_end(sBatchMsg *msg) {
+  const uint32_t payload_size = (uint32_t)(msg->len - PROTOCOL_HEADER_LEN);
+  memcpy(&msg->buf[sizeof(uint32_t)], &payload_size, sizeof(payload_size));
+}
+
+static uint32_t prv_get_u32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+//! Checks the next item of a batch response and returns the offset past it
+static size_t prv_check_item(size_t off, eProtocolCode status, const char *resp) {
+  LONGS_EQUAL(status, prv_get_u32(&s_resp_buffer[off]));
+  LONGS_EQUAL(strlen(resp), prv_get_u32(&s_resp_buffer[off + 4]));
+  MEMCMP_EQUAL(resp, &s_resp_buffer[off + 8], strlen(resp));
+  return off + 8 + strlen(resp);
+}
+
+TEST_GROUP(TestProtocolBatch) {
+  void setup() {
+    memset(s_resp_buffer, 0, sizeof(s_resp_buffer));
+  }
+
+  void teardown() {
+    mock().checkExpectations();
+    mock().clear();
+  }
+};
+
+TEST(TestProtocolBatch, RunsItemsInOrder) {
+  sBatchMsg msg;
+  prv_batch_begin(&msg, 3);
+  prv_batch_add(&msg, 1236, "ab");
+  prv_batch_add(&msg, 1235, "x");
+  prv_batch_add(&msg, 1236, "");
+  prv_batch_end(&msg);
+
+  size_t len = s_resp_buffer_len;
+  CHECK_EQUAL(kProtocolCode_Ok, protocol_handle(msg.buf, msg.len, s_resp_buffer, &len));
+
+  LONGS_EQUAL(3, prv_get_u32(s_resp_buffer));
+  size_t off = prv_check_item(4, kProtocolCode_Ok, "ab");
+  off = prv_check_item(off, kProtocolCode_CommandNotFound, "");
+  off = prv_check_item(off, kProtocolCode_Ok, "");
+  LONGS_EQUAL(off, len);
+}
+
+TEST(TestProtocolBatch, RejectsNestedBatch) {
+  sBatchMsg msg;
+  prv_batch_begin(&msg, 2);
+  prv_batch_add(&msg, PROTOCOL_BATCH_CODE, "");
+  prv_batch_add(&msg, 1236, "ok");
+  prv_batch_end(&msg);
+
+  size_t len = s_resp_buffer_len;
+  CHECK_EQUAL(kProtocolCode_Ok, protocol_handle(msg.buf, msg.len, s_resp_buffer, &len));
+
+  LONGS_EQUAL(2, prv_get_u32(s_resp_buffer));
+  size_t off = prv_check_item(4, kProtocolCode_MalformedMsg, "");
+  prv_check_item(off, kProtocolCode_Ok, "ok");
+}
+
+TEST(TestProtocolBatch, StopsAtTruncatedItem) {
+  sBatchMsg msg;
+  prv_batch_begin(&msg, 3);
+  prv_batch_add(&msg, 1236, "ab");
+  prv_batch_add(&msg, 1236, "cd");
+  msg.len -= 1;  // Cut the second item short
+  prv_batch_end(&msg);
+
+  size_t len = s_resp_buffer_len;
+  CHECK_EQUAL(kProtocolCode_Ok, protocol_handle(msg.buf, msg.len, s_resp_buffer, &len));
+
+  LONGS_EQUAL(2, prv_get_u32(s_resp_buffer));
+  size_t off = prv_check_item(4, kProtocolCode_Ok, "ab");
+  off = prv_check_item(off, kProtocolCode_MalformedMsg, "");
+  LONGS_EQUAL(off, len);
+}
+
+TEST(TestProtocolBatch, StopsWhenResponseIsFull) {
+  sBatchMsg msg;
+  prv_batch_begin(&msg, 3);
+  prv_batch_add(&msg, 1236, "abcd");
+  prv_batch_add(&msg, 1236, "efgh");
+  prv_batch_add(&msg, 1236, "ijkl");
+  prv_batch_end(&msg);
+
+  // Room for the count and two items
+  size_t len = 4 + 2 * (8 + 4);
+  CHECK_EQUAL(kProtocolCode_Ok, protocol_handle(msg.buf, msg.len, s_resp_buffer, &len));
+
+  LONGS_EQUAL(2, prv_get_u32(s_resp_buffer));
+  size_t off = prv_check_item(4, kProtocolCode_Ok, "abcd");
+  off = prv_check_item(off, kProtocolCode_Ok, "efgh");
+  LONGS_EQUAL(off, len);
+}
+
+//
+// Stats
+//
+
+static sProtocolCommandStats s_command_stats[6];
+static sProtocolStats s_stats;
+
+static eProtocolCode prv_send_echo(const char *payload) {
+  sBatchMsg msg;
+  msg.len = 0;
+  prv_put_u32(&msg, 1236);
+  prv_put_u32(&msg, (uint32_t)strlen(payload));
+  memcpy(&msg.buf[msg.len], payload, strlen(payload));
+  msg.len += strlen(payload);
+  size_t len = s_resp_buffer_len;
+  return protocol_handle(msg.buf, msg.len, s_resp_buffer, &len);
+}
+
+TEST_GROUP(TestProtocolStats) {
+  void setup() {
+    s_now = 0;
+    s_echo_ticks = 0;
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_stats.commands = s_command_stats;
+    s_stats.num_commands = sizeof(s_command_stats) / sizeof(s_command_stats[0]);
+    s_stats.clock = prv_fake_clock;
+    protocol_stats_init(&s_stats);
+  }
+
+  void teardown() {
+    protocol_stats_init(NULL);
+    mock().checkExpectations();
+    mock().clear();
+  }
+};
+
+TEST(TestProtocolStats, LatencyHistogram) {
+  s_echo_ticks = 5;
+  for (int i = 0; i < 9; i++) {
+    CHECK_EQUAL(kProtocolCode_Ok, prv_send_echo("a"));
+  }
+  s_echo_ticks = 1000;
+  CHECK_EQUAL(kProtocolCode_Ok, prv_send_echo("a"));
+
+  const sProtocolCommandStats *stats = protocol_stats_find(1236);
+  CHECK(stats != NULL);
+  LONGS_EQUAL(10, stats->num_calls);
+  LONGS_EQUAL(9, stats->buckets[3]);   // [4, 8)
+  LONGS_EQUAL(1, stats->buckets[10]);  // [512, 1024)
+  LONGS_EQUAL(8, protocol_stats_percentile(stats, 50));
+  LONGS_EQUAL(8, protocol_stats_percentile(stats, 90));
+  LONGS_EQUAL(1024, protocol_stats_percentile(stats, 99));
+
+  // Untouched commands have nothing recorded
+  LONGS_EQUAL(0, protocol_stats_find(1238)->num_calls);
+  POINTERS_EQUAL(NULL, protocol_stats_find(1235));
+}
+
+TEST(TestProtocolStats, PendingTimeIsCounted) {
+  sProtocolParserConfig config = {};
+  config.frame_buf = s_frame_buf;
+  config.frame_buf_len = sizeof(s_frame_buf);
+  config.resp_buf = s_resp_buffer;
+  config.resp_buf_len = s_resp_buffer_len;
+  sProtocolParser parser;
+  protocol_parser_init(&parser, &config);
+
+  protocol_feed(&parser, s_slow_then_echo_frames, sizeof(s_slow_then_echo_frames));
+  const sProtocolCommandStats *stats = protocol_stats_find(1240);
+  LONGS_EQUAL(0, stats->num_calls);
+
+  s_now += 100;
+  protocol_complete(&s_pending_req, kProtocolCode_Ok, NULL);
+  LONGS_EQUAL(1, stats->num_calls);
+  LONGS_EQUAL(1, stats->buckets[7]);  // [64, 128)
+}
+
+TEST(TestProtocolStats, CountsErrors) {
+  const uint8_t short_msg[] = {0x00, 0x00, 0x00};
+  const uint8_t unknown[] = {
+      0xD3, 0x04, 0x00, 0x00, // Code (1235)
+      0x00, 0x00, 0x00, 0x00, // Payload Size (0)
+  };
+  const uint8_t bad_size[] = {
+      0xD4, 0x04, 0x00, 0x00, // Code (1236)
+      0x09, 0x00, 0x00, 0x00, // Payload Size (9), but no payload
+  };
+  size_t len = s_resp_buffer_len;
+  protocol_handle(short_msg, sizeof(short_msg), s_resp_buffer, &len);
+  protocol_handle(unknown, sizeof(unknown), s_resp_buffer, &len);
+  protocol_handle(bad_size, sizeof(bad_size), s_resp_buffer, &len);
+
+  LONGS_EQUAL(2, s_stats.num_malformed);
+  LONGS_EQUAL(1, s_stats.num_not_found);
+  const sProtocolCommandStats *stats = protocol_stats_find(1236);
+  LONGS_EQUAL(0, stats->num_calls);
+  LONGS_EQUAL(1, stats->num_malformed);
+}
+
+TEST(TestProtocolStats, DumpCommand) {
+  s_echo_ticks = 1;
+  prv_send_echo("a");
+  prv_send_echo("b");
+
+  // Dump and reset
+  const uint8_t in_bytes[] = {
+      0xD1, 0x07, 0x00, 0x00, // Code (2001)
+      0x01, 0x00, 0x00, 0x00, // Payload Size (1)
+      0x01,                   // Reset
+  };
+  size_t len = s_resp_buffer_len;
+  CHECK_EQUAL(kProtocolCode_Ok, protocol_handle(in_bytes, sizeof(in_bytes), s_resp_buffer, &len));
+
+  const size_t record_len = (3 + PROTOCOL_STATS_NUM_BUCKETS) * sizeof(uint32_t);
+  LONGS_EQUAL(4 * sizeof(uint32_t) + record_len, len);
+  LONGS_EQUAL(0, prv_get_u32(&s_resp_buffer[0]));
+  LONGS_EQUAL(0, prv_get_u32(&s_resp_buffer[4]));
+  LONGS_EQUAL(0, prv_get_u32(&s_resp_buffer[8]));
+  // The dump itself isn't recorded until it returns, so only the echo shows
+  LONGS_EQUAL(1, prv_get_u32(&s_resp_buffer[12]));
+  LONGS_EQUAL(1236, prv_get_u32(&s_resp_buffer[16]));
+  LONGS_EQUAL(2, prv_get_u32(&s_resp_buffer[20]));
+  LONGS_EQUAL(0, prv_get_u32(&s_resp_buffer[24]));
+  LONGS_EQUAL(2, prv_get_u32(&s_resp_buffer[28 + 1 * sizeof(uint32_t)]));
+
+  // Cleared by the dump; only the dump's own call has been counted since
+  LONGS_EQUAL(0, protocol_stats_find(1236)->num_calls);
+  LONGS_EQUAL(1, protocol_stats_find(PROTOCOL_STATS_CODE)->num_calls);
+}
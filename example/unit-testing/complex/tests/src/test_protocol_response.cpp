@@ -0,0 +1,115 @@
+#include "CppUTest/TestHarness.h"
+
+extern "C" {
+  #include <string.h>
+  #include <stddef.h>
+
+  #include "protocol/response.h"
+}
+
+static uint8_t s_buf[16];
+static sProtocolResponse s_resp;
+
+static void prv_check_contents(const char *expected) {
+  uint8_t out[64];
+  const size_t len = protocol_response_copy(&s_resp, out, sizeof(out));
+  LONGS_EQUAL(strlen(expected), len);
+  LONGS_EQUAL(strlen(expected), protocol_response_len(&s_resp));
+  MEMCMP_EQUAL(expected, out, len);
+}
+
+TEST_GROUP(TestProtocolResponse) {
+  void setup() {
+    memset(s_buf, 0, sizeof(s_buf));
+    protocol_response_init(&s_resp, s_buf, sizeof(s_buf), 0);
+  }
+
+  void teardown() {
+  }
+};
+
+TEST(TestProtocolResponse, WritesShareOneSegment) {
+  CHECK(protocol_response_write(&s_resp, "ab", 2));
+  CHECK(protocol_response_write(&s_resp, "cd", 2));
+  prv_check_contents("abcd");
+
+  const sProtocolIoVec *iov;
+  LONGS_EQUAL(1, protocol_response_iov(&s_resp, &iov));
+  POINTERS_EQUAL(s_buf, iov[0].base);
+}
+
+TEST(TestProtocolResponse, ReserveAndCommit) {
+  uint8_t *p = protocol_response_reserve(&s_resp, 8);
+  CHECK(p != NULL);
+  memcpy(p, "xyz", 3);
+  protocol_response_commit(&s_resp, 3);
+  prv_check_contents("xyz");
+
+  // The rest of the reservation went back
+  LONGS_EQUAL(sizeof(s_buf) - 3, protocol_response_space(&s_resp));
+  POINTERS_EQUAL(NULL, protocol_response_reserve(&s_resp, sizeof(s_buf)));
+}
+
+TEST(TestProtocolResponse, RespectsCapacity) {
+  CHECK(protocol_response_write(&s_resp, "0123456789", 10));
+  CHECK_FALSE(protocol_response_write(&s_resp, "0123456789", 10));
+  CHECK(protocol_response_write(&s_resp, "012345", 6));
+  LONGS_EQUAL(0, protocol_response_space(&s_resp));
+  CHECK_FALSE(protocol_response_ref(&s_resp, "a", 1));
+}
+
+TEST(TestProtocolResponse, RefDoesNotCopy) {
+  static const char s_big[] = "a value larger than the buffer";
+  protocol_response_init(&s_resp, s_buf, sizeof(s_buf), 48);
+
+  CHECK(protocol_response_write(&s_resp, "[", 1));
+  CHECK(protocol_response_ref(&s_resp, s_big, strlen(s_big)));
+  CHECK(protocol_response_write(&s_resp, "]", 1));
+  prv_check_contents("[a value larger than the buffer]");
+
+  const sProtocolIoVec *iov;
+  LONGS_EQUAL(3, protocol_response_iov(&s_resp, &iov));
+  POINTERS_EQUAL(s_big, iov[1].base);
+  POINTERS_EQUAL(&s_buf[1], iov[2].base);
+
+  // Only the copied bytes used the buffer, but it can't be flattened
+  LONGS_EQUAL(sizeof(s_buf) - 2, s_resp.capacity - s_resp.used);
+  CHECK_FALSE(protocol_response_flatten(&s_resp));
+
+  // max_len counts referenced bytes too
+  CHECK_FALSE(protocol_response_ref(&s_resp, s_big, strlen(s_big)));
+}
+
+TEST(TestProtocolResponse, RefFallsBackToCopy) {
+  char text[PROTOCOL_RESPONSE_MAX_SEGMENTS + 1];
+  for (size_t i = 0; i < PROTOCOL_RESPONSE_MAX_SEGMENTS; i++) {
+    text[i] = (char)('a' + i);
+  }
+  text[PROTOCOL_RESPONSE_MAX_SEGMENTS] = '\0';
+
+  for (size_t i = 0; i < PROTOCOL_RESPONSE_MAX_SEGMENTS; i++) {
+    CHECK(protocol_response_ref(&s_resp, &text[i], 1));
+  }
+  CHECK(protocol_response_write(&s_resp, "!", 1));
+  prv_check_contents("abcdefgh!");
+
+  const sProtocolIoVec *iov;
+  LONGS_EQUAL(PROTOCOL_RESPONSE_MAX_SEGMENTS, protocol_response_iov(&s_resp, &iov));
+}
+
+TEST(TestProtocolResponse, FlattenInPlace) {
+  static const char s_mid[] = "MID";
+  CHECK(protocol_response_write(&s_resp, "ab", 2));
+  CHECK(protocol_response_ref(&s_resp, s_mid, 3));
+  CHECK(protocol_response_write(&s_resp, "cd", 2));
+  CHECK(protocol_response_ref(&s_resp, s_mid, 3));
+  CHECK(protocol_response_write(&s_resp, "e", 1));
+
+  CHECK(protocol_response_flatten(&s_resp));
+  LONGS_EQUAL(11, protocol_response_len(&s_resp));
+  MEMCMP_EQUAL("abMIDcdMIDe", s_buf, 11);
+
+  const sProtocolIoVec *iov;
+  LONGS_EQUAL(1, protocol_response_iov(&s_resp, &iov));
+  prv_check_contents("abMIDcdMIDe");
+}
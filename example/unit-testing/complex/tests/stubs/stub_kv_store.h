@@ -3,7 +3,7 @@
 #include "lfs.h"
 #include <stdio.h>
 
-void kv_store_init(lfs_t *lfs) {
+void kv_store_init(lfs_t *lfs, const sKvStoreConfig *config) {
 }
 
 bool kv_store_write(const char *key, const void *val, uint32_t len) {
@@ -17,3 +17,7 @@ uint32_t kv_store_read(const char *key, void *buf, uint32_t buf_len) {
 bool kv_store_delete(const char *key) {
   return true;
 }
+
+bool kv_store_flush(void) {
+  return true;
+}
@@ -11,3 +11,35 @@ void mutex_lock(Mutex *mutex) {
 void mutex_unlock(Mutex *mutex) {
   return;
 }
+
+RwLock *rwlock_create(void) {
+  return NULL;
+}
+
+void rwlock_read_lock(RwLock *rwlock) {
+  return;
+}
+
+void rwlock_read_unlock(RwLock *rwlock) {
+  return;
+}
+
+void rwlock_write_lock(RwLock *rwlock) {
+  return;
+}
+
+void rwlock_write_unlock(RwLock *rwlock) {
+  return;
+}
+
+Semaphore *semaphore_create(void) {
+  return NULL;
+}
+
+void semaphore_give(Semaphore *semaphore) {
+  return;
+}
+
+void semaphore_take(Semaphore *semaphore) {
+  return;
+}